@@ -0,0 +1,307 @@
+/*
+* This file is part of libmeegomtp package
+*
+* Copyright (c) 2010 Nokia Corporation. All rights reserved.
+* Copyright (c) 2013 - 2020 Jolla Ltd.
+* Copyright (c) 2020 Open Mobile Platform LLC.
+*
+* Contact: Deepak Kodihalli <deepak.kodihalli@nokia.com>
+*
+* Redistribution and use in source and binary forms, with or without modification,
+* are permitted provided that the following conditions are met:
+*
+* Redistributions of source code must retain the above copyright notice, this list
+* of conditions and the following disclaimer. Redistributions in binary form must
+* reproduce the above copyright notice, this list of conditions and the following
+* disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of Nokia Corporation nor the names of its contributors may be
+* used to endorse or promote products derived from this software without specific
+* prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+* IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+* INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+* BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+* DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+* LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+* OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+* OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*/
+
+#include "fsdatawriter.h"
+#include "trace.h"
+
+#include <QMutexLocker>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+using namespace meegomtp1dot0;
+
+/* Data is written in pieces this large. Big enough for the file system
+ * to allocate and write out efficiently, yet small enough for the USB
+ * reader to keep receiving while a piece is being written. */
+static const quint32 WRITE_BUFFER_SIZE = 512 * 1024;
+static const int WRITE_BUFFER_ALIGN = 4096;
+
+/* Number of full buffers waiting for the writer thread before write()
+ * starts blocking. */
+static const int MAX_WRITE_BUFFERS_QUEUED = 4;
+
+/**************************************************
+ * FSDataWriter::FSDataWriter
+ *************************************************/
+FSDataWriter::FSDataWriter(QObject *parent)
+    : QThread(parent)
+    , m_writing(false)
+    , m_error(0)
+    , m_shouldExit(false)
+    , m_fd(-1)
+    , m_offset(0)
+{
+    m_current.data = 0;
+    m_current.len = 0;
+    m_current.offset = 0;
+}
+
+/**************************************************
+ * FSDataWriter::~FSDataWriter
+ *************************************************/
+FSDataWriter::~FSDataWriter()
+{
+    discard();
+
+    m_lock.lock();
+    m_shouldExit = true;
+    m_wait.wakeAll();
+    m_lock.unlock();
+    wait();
+}
+
+/**************************************************
+ * void FSDataWriter::begin
+ *************************************************/
+void FSDataWriter::begin(int fd)
+{
+    // Leftovers of an abandoned transfer must not end up in this file
+    discard();
+
+    QMutexLocker locker(&m_lock);
+    m_fd = fd;
+    m_error = 0;
+    m_offset = 0;
+
+    if (!isRunning())
+        start();
+}
+
+/**************************************************
+ * bool FSDataWriter::write
+ *************************************************/
+bool FSDataWriter::write(const char *data, quint32 len)
+{
+    while (len > 0) {
+        if (!m_current.data) {
+            if (posix_memalign((void **) &m_current.data, WRITE_BUFFER_ALIGN, WRITE_BUFFER_SIZE)) {
+                MTP_LOG_CRITICAL("Couldn't allocate write buffer");
+                m_current.data = 0;
+                QMutexLocker locker(&m_lock);
+                if (!m_error)
+                    m_error = ENOMEM;
+                return false;
+            }
+            m_current.len = 0;
+            m_current.offset = m_offset;
+        }
+
+        quint32 copyLen = qMin(len, WRITE_BUFFER_SIZE - m_current.len);
+        memcpy(m_current.data + m_current.len, data, copyLen);
+        m_current.len += copyLen;
+        m_offset += copyLen;
+        data += copyLen;
+        len -= copyLen;
+
+        if (m_current.len == WRITE_BUFFER_SIZE && !queueCurrent())
+            return false;
+    }
+
+    return error() == 0;
+}
+
+/**************************************************
+ * int FSDataWriter::finish
+ *************************************************/
+int FSDataWriter::finish()
+{
+    flush();
+
+    QMutexLocker locker(&m_lock);
+    int result = m_error;
+    m_error = 0;
+    m_fd = -1;
+    return result;
+}
+
+/**************************************************
+ * void FSDataWriter::discard
+ *************************************************/
+void FSDataWriter::discard()
+{
+    free(m_current.data);
+    m_current.data = 0;
+    m_current.len = 0;
+    m_offset = 0;
+
+    QMutexLocker locker(&m_lock);
+    releaseQueue_locked();
+    while (m_writing)
+        m_done.wait(&m_lock);
+}
+
+/**************************************************
+ * void FSDataWriter::seek
+ *************************************************/
+void FSDataWriter::seek(quint64 offset)
+{
+    flush();
+    m_offset = offset;
+}
+
+/**************************************************
+ * int FSDataWriter::error
+ *************************************************/
+int FSDataWriter::error()
+{
+    QMutexLocker locker(&m_lock);
+    return m_error;
+}
+
+/**************************************************
+ * quint64 FSDataWriter::offset
+ *************************************************/
+quint64 FSDataWriter::offset() const
+{
+    return m_offset;
+}
+
+/**************************************************
+ * bool FSDataWriter::queueCurrent
+ *************************************************/
+bool FSDataWriter::queueCurrent()
+{
+    QMutexLocker locker(&m_lock);
+
+    /* Expectation: Waiting is needed only when the file system can't
+     * keep up with the transfer -> log in verbose mode. */
+    if (!m_error && m_queue.count() >= MAX_WRITE_BUFFERS_QUEUED) {
+        MTP_LOG_INFO("waiting for writer ...");
+        while (!m_error && m_queue.count() >= MAX_WRITE_BUFFERS_QUEUED)
+            m_done.wait(&m_lock);
+    }
+
+    if (m_error) {
+        free(m_current.data);
+    } else {
+        m_queue.append(m_current);
+        m_wait.wakeAll();
+    }
+    m_current.data = 0;
+    m_current.len = 0;
+
+    return m_error == 0;
+}
+
+/**************************************************
+ * void FSDataWriter::flush
+ *************************************************/
+void FSDataWriter::flush()
+{
+    if (m_current.len)
+        queueCurrent();
+    free(m_current.data);
+    m_current.data = 0;
+    m_current.len = 0;
+
+    QMutexLocker locker(&m_lock);
+    while (!m_queue.isEmpty() || m_writing)
+        m_done.wait(&m_lock);
+}
+
+/**************************************************
+ * void FSDataWriter::releaseQueue_locked
+ *************************************************/
+void FSDataWriter::releaseQueue_locked()
+{
+    while (!m_queue.isEmpty())
+        free(m_queue.takeFirst().data);
+}
+
+/**************************************************
+ * int FSDataWriter::writeBuffer
+ *************************************************/
+int FSDataWriter::writeBuffer(int fd, const Buffer &buffer)
+{
+    const char *data = buffer.data;
+    quint32 len = buffer.len;
+    off_t offset = buffer.offset;
+
+    while (len > 0) {
+        ssize_t rc = pwrite(fd, data, len, offset);
+        if (rc == -1) {
+            if (errno == EINTR)
+                continue;
+            return errno;
+        }
+        if (rc == 0)
+            return EIO;
+        data += rc;
+        len -= rc;
+        offset += rc;
+    }
+    return 0;
+}
+
+/**************************************************
+ * void FSDataWriter::run
+ *************************************************/
+void FSDataWriter::run()
+{
+    /* Lock on entry */
+    m_lock.lock();
+
+    while (!m_shouldExit) {
+        if (m_queue.isEmpty()) {
+            m_wait.wait(&m_lock);
+            continue;
+        }
+
+        Buffer buffer = m_queue.takeFirst();
+        int fd = m_fd;
+        m_writing = true;
+
+        /* Do IO in unlocked state */
+        m_lock.unlock();
+        int err = writeBuffer(fd, buffer);
+        free(buffer.data);
+        m_lock.lock();
+
+        m_writing = false;
+        if (err && !m_error) {
+            MTP_LOG_WARNING("write at offset" << buffer.offset << "failed:" << strerror(err));
+            /* The rest of the file is useless, drop it */
+            m_error = err;
+            releaseQueue_locked();
+        }
+
+        /* Wake up callers waiting for queue space / completion */
+        m_done.wakeAll();
+    }
+
+    /* Unlock before leaving */
+    m_lock.unlock();
+}
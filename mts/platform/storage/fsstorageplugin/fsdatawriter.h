@@ -0,0 +1,123 @@
+/*
+* This file is part of libmeegomtp package
+*
+* Copyright (c) 2010 Nokia Corporation. All rights reserved.
+* Copyright (c) 2013 - 2020 Jolla Ltd.
+* Copyright (c) 2020 Open Mobile Platform LLC.
+*
+* Contact: Deepak Kodihalli <deepak.kodihalli@nokia.com>
+*
+* Redistribution and use in source and binary forms, with or without modification,
+* are permitted provided that the following conditions are met:
+*
+* Redistributions of source code must retain the above copyright notice, this list
+* of conditions and the following disclaimer. Redistributions in binary form must
+* reproduce the above copyright notice, this list of conditions and the following
+* disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of Nokia Corporation nor the names of its contributors may be
+* used to endorse or promote products derived from this software without specific
+* prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+* IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+* INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+* BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+* DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+* LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+* OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+* OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*/
+
+#ifndef FSDATAWRITER_H
+#define FSDATAWRITER_H
+
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QList>
+
+namespace meegomtp1dot0 {
+/// FSDataWriter writes object data received from the initiator to a file
+/// in a thread of its own, so that receiving more data does not have to
+/// wait for the file system.
+///
+/// Data passed to write() is collected into large page aligned buffers,
+/// which are written out by the thread. Only a few buffers are queued at
+/// a time; once the queue is full write() blocks until the thread has
+/// caught up. Write errors are sticky and get reported by the following
+/// write() and by finish().
+class FSDataWriter : public QThread
+{
+public:
+    /// Constructor.
+    explicit FSDataWriter(QObject *parent = 0);
+
+    /// Destructor.
+    ~FSDataWriter();
+
+    /// Starts writing a file from offset zero.
+    /// \param fd [in] descriptor of the file; it stays owned by the caller
+    ///           and must be kept open until finish() returns.
+    void begin(int fd);
+
+    /// Appends data to the file.
+    /// \param data [in] the data, copied before returning.
+    /// \param len [in] the length of the data in bytes.
+    /// \return false if this or an earlier write has failed, see error().
+    bool write(const char *data, quint32 len);
+
+    /// Writes out everything appended so far and waits for it to complete.
+    /// \return 0 on success, else the errno of the first failed write.
+    int finish();
+
+    /// Drops data that has not been written yet, e.g. when a transfer is
+    /// abandoned, and waits for the ongoing write to complete. The offset
+    /// starts over from zero.
+    void discard();
+
+    /// Writes out everything appended so far and makes data appended from
+    /// now on go to the given offset, e.g. the size the file gets
+    /// truncated to. Write errors stay to be reported by finish().
+    /// \param offset [in] the file offset.
+    void seek(quint64 offset);
+
+    /// The errno of the first failed write, 0 if there is none.
+    int error();
+
+    /// Offset right after the data appended so far.
+    quint64 offset() const;
+
+protected:
+    void run();
+
+private:
+    struct Buffer
+    {
+        char *data;
+        quint32 len;
+        quint64 offset;
+    };
+
+    bool queueCurrent();
+    void flush();
+    void releaseQueue_locked();
+    static int writeBuffer(int fd, const Buffer &buffer);
+
+    QMutex m_lock;
+    QWaitCondition m_wait; ///< the thread waits here for buffers to write
+    QWaitCondition m_done; ///< callers wait here for the thread to make progress
+    QList<Buffer> m_queue; ///< protected by m_lock
+    bool m_writing;        ///< protected by m_lock
+    int m_error;           ///< protected by m_lock
+    bool m_shouldExit;     ///< protected by m_lock
+    int m_fd;              ///< protected by m_lock
+
+    Buffer m_current; ///< the buffer being filled, only used by the caller
+    quint64 m_offset; ///< only used by the caller
+};
+}
+
+#endif
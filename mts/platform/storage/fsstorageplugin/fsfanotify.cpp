@@ -0,0 +1,321 @@
+/*
+* This file is part of libmeegomtp package
+*
+* Copyright (c) 2010 Nokia Corporation. All rights reserved.
+* Copyright (c) 2013 - 2020 Jolla Ltd.
+* Copyright (c) 2020 Open Mobile Platform LLC.
+*
+* Contact: Deepak Kodihalli <deepak.kodihalli@nokia.com>
+*
+* Redistribution and use in source and binary forms, with or without modification,
+* are permitted provided that the following conditions are met:
+*
+* Redistributions of source code must retain the above copyright notice, this list
+* of conditions and the following disclaimer. Redistributions in binary form must
+* reproduce the above copyright notice, this list of conditions and the following
+* disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of Nokia Corporation nor the names of its contributors may be
+* used to endorse or promote products derived from this software without specific
+* prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+* IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+* INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+* BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+* DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+* LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+* OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+* OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*/
+
+#include "fsfanotify.h"
+#include "trace.h"
+
+#include <QSocketNotifier>
+
+#include <sys/fanotify.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+using namespace meegomtp1dot0;
+
+/**************************************************
+ * FSFanotify::FSFanotify
+ *************************************************/
+FSFanotify::FSFanotify(const QString &path)
+    : m_fd(-1)
+    , m_readSocket(0)
+    , m_lastWd(0)
+    , m_lastCookie(0)
+{
+#ifdef FAN_RENAME
+    int fd = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK | FAN_REPORT_DFID_NAME, O_RDONLY);
+    if (fd == -1) {
+        MTP_LOG_INFO("fanotify not available:" << strerror(errno));
+        return;
+    }
+    // Dirent events can not be reported for mount marks, only for
+    // the whole file system. Events outside the storage are ignored.
+    QByteArray fsPath = path.toUtf8();
+    uint64_t mask = FAN_CREATE | FAN_DELETE | FAN_RENAME | FAN_ONDIR;
+    if (fanotify_mark(fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, mask, AT_FDCWD, fsPath.constData()) == -1) {
+        MTP_LOG_INFO("fanotify can not monitor" << path << strerror(errno));
+        close(fd);
+        return;
+    }
+    /* Writes are far more frequent than directory changes. Take them
+     * from the mount of the storage only, so that writes elsewhere on
+     * the file system do not wake us up when it is mounted separately. */
+    if (fanotify_mark(fd, FAN_MARK_ADD | FAN_MARK_MOUNT, FAN_CLOSE_WRITE, AT_FDCWD, fsPath.constData()) == -1
+        && fanotify_mark(fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, FAN_CLOSE_WRITE, AT_FDCWD, fsPath.constData())
+               == -1) {
+        MTP_LOG_INFO("fanotify can not monitor writes in" << path << strerror(errno));
+        close(fd);
+        return;
+    }
+    m_fd = fd;
+    m_readSocket = new QSocketNotifier(m_fd, QSocketNotifier::Read);
+    QObject::connect(m_readSocket, SIGNAL(activated(int)), this, SLOT(fanotifyEventSlot(int)));
+    MTP_LOG_INFO("fanotify monitors the file system of" << path);
+#else
+    Q_UNUSED(path);
+#endif
+}
+
+/**************************************************
+ * FSFanotify::~FSFanotify
+ *************************************************/
+FSFanotify::~FSFanotify()
+{
+    delete m_readSocket;
+    if (m_fd != -1) {
+        close(m_fd);
+    }
+}
+
+/**************************************************
+ * bool FSFanotify::isValid
+ *************************************************/
+bool FSFanotify::isValid() const
+{
+    return m_fd != -1;
+}
+
+/**************************************************
+ * int FSFanotify::addWatch
+ *************************************************/
+int FSFanotify::addWatch(const QString &pathName)
+{
+    if (m_fd == -1) {
+        return -1;
+    }
+
+    QByteArray path = pathName.toUtf8();
+    struct statfs fs;
+    if (statfs(path.constData(), &fs) == -1) {
+        return -1;
+    }
+
+    // The key has the layout the events have: file system id followed
+    // by the file handle
+    QByteArray key(sizeof fs.f_fsid + sizeof(struct file_handle) + MAX_HANDLE_SZ, '\0');
+    memcpy(key.data(), &fs.f_fsid, sizeof fs.f_fsid);
+    struct file_handle *handle = reinterpret_cast<struct file_handle *>(key.data() + sizeof fs.f_fsid);
+    handle->handle_bytes = MAX_HANDLE_SZ;
+    int mountId;
+    if (name_to_handle_at(AT_FDCWD, path.constData(), handle, &mountId, 0) == -1) {
+        return -1;
+    }
+    key.resize(sizeof fs.f_fsid + sizeof *handle + handle->handle_bytes);
+
+    // Like inotify, give the same descriptor for the same directory
+    int wd = m_watches.value(key, -1);
+    if (wd == -1) {
+        wd = ++m_lastWd;
+        m_watches.insert(key, wd);
+        m_handles.insert(wd, key);
+    }
+    m_paths.insert(wd, pathName);
+    return wd;
+}
+
+/**************************************************
+ * int FSFanotify::removeWatch
+ *************************************************/
+int FSFanotify::removeWatch(const int &wd)
+{
+    if (!m_handles.contains(wd)) {
+        return -1;
+    }
+    m_watches.remove(m_handles.take(wd));
+    m_paths.remove(wd);
+    return 0;
+}
+
+/**************************************************
+ * void FSFanotify::fanotifyEventSlot
+ *************************************************/
+void FSFanotify::fanotifyEventSlot(int)
+{
+    m_buffer.resize(EVENT_BUFFER_SIZE);
+
+    ssize_t bytes_read;
+    do {
+        bytes_read = read(m_fd, m_buffer.data(), m_buffer.size());
+    } while (-1 == bytes_read && EINTR == errno);
+
+    if (bytes_read <= 0) {
+        return;
+    }
+
+    m_events.clear();
+    const struct fanotify_event_metadata *event = reinterpret_cast<const struct fanotify_event_metadata *>(
+        m_buffer.constData());
+    while (FAN_EVENT_OK(event, bytes_read)) {
+        if (event->vers != FANOTIFY_METADATA_VERSION) {
+            MTP_LOG_WARNING("unexpected fanotify metadata version" << event->vers);
+            break;
+        }
+        if (event->mask & FAN_Q_OVERFLOW) {
+            // Reported like inotify does, the receiver has to look at everything again
+            MTP_LOG_WARNING("fanotify event queue overflow");
+            appendEvent(-1, IN_Q_OVERFLOW, 0, "");
+        } else {
+            translateEvent(event);
+        }
+        event = FAN_EVENT_NEXT(event, bytes_read);
+    }
+
+    if (!m_events.isEmpty()) {
+        // The receivers are looking at m_events, see inotifyEventsSignal()
+        m_readSocket->setEnabled(false);
+        emit inotifyEventsSignal(m_events);
+        m_readSocket->setEnabled(true);
+    }
+}
+
+/**************************************************
+ * void FSFanotify::translateEvent
+ *************************************************/
+void FSFanotify::translateEvent(const struct fanotify_event_metadata *event)
+{
+#ifdef FAN_RENAME
+    int wd = -1, fromWd = -1, toWd = -1;
+    const char *name = 0, *fromName = 0, *toName = 0;
+
+    const char *info = reinterpret_cast<const char *>(event) + event->metadata_len;
+    const char *end = reinterpret_cast<const char *>(event) + event->event_len;
+    while (info + sizeof(struct fanotify_event_info_header) <= end) {
+        const struct fanotify_event_info_header *header
+            = reinterpret_cast<const struct fanotify_event_info_header *>(info);
+        if (header->len < sizeof *header || info + header->len > end) {
+            break;
+        }
+        switch (header->info_type) {
+        case FAN_EVENT_INFO_TYPE_DFID_NAME:
+            wd = resolveWatch(info, &name);
+            break;
+        case FAN_EVENT_INFO_TYPE_OLD_DFID_NAME:
+            fromWd = resolveWatch(info, &fromName);
+            break;
+        case FAN_EVENT_INFO_TYPE_NEW_DFID_NAME:
+            toWd = resolveWatch(info, &toName);
+            break;
+        }
+        info += header->len;
+    }
+
+    quint32 isDir = (event->mask & FAN_ONDIR) ? IN_ISDIR : 0;
+
+    if (event->mask & FAN_RENAME) {
+        // One event for both ends of a rename, the storage pairs the
+        // inotify events by their cookie
+        if (++m_lastCookie == 0) {
+            ++m_lastCookie;
+        }
+        if (fromWd != -1) {
+            appendEvent(fromWd, IN_MOVED_FROM | isDir, m_lastCookie, fromName);
+        }
+        if (toWd != -1) {
+            appendEvent(toWd, IN_MOVED_TO | isDir, m_lastCookie, toName);
+        }
+        return;
+    }
+
+    if (wd == -1 || !name || !strcmp(name, ".")) {
+        return;
+    }
+
+    // Events on the same name are merged by the kernel, so the mask does
+    // not tell in what order they happened. Whether the name still exists
+    // tells if it was deleted last.
+    bool created = event->mask & FAN_CREATE;
+    bool deleted = event->mask & FAN_DELETE;
+    bool exists = true;
+    if (deleted && created) {
+        QByteArray path = (m_paths.value(wd) + '/').toUtf8() + name;
+        struct stat st;
+        exists = lstat(path.constData(), &st) == 0;
+    }
+
+    if (deleted && exists) {
+        appendEvent(wd, IN_DELETE | isDir, 0, name);
+    }
+    if (created) {
+        appendEvent(wd, IN_CREATE | isDir, 0, name);
+    }
+    if (event->mask & FAN_CLOSE_WRITE) {
+        appendEvent(wd, IN_CLOSE_WRITE, 0, name);
+    }
+    if (deleted && !exists) {
+        appendEvent(wd, IN_DELETE | isDir, 0, name);
+    }
+#else
+    Q_UNUSED(event);
+#endif
+}
+
+/**************************************************
+ * int FSFanotify::resolveWatch
+ *************************************************/
+int FSFanotify::resolveWatch(const char *info, const char **name) const
+{
+#ifdef FAN_RENAME
+    const struct fanotify_event_info_fid *fid = reinterpret_cast<const struct fanotify_event_info_fid *>(info);
+    const struct file_handle *handle = reinterpret_cast<const struct file_handle *>(fid->handle);
+    *name = reinterpret_cast<const char *>(handle->f_handle + handle->handle_bytes);
+
+    QByteArray key = QByteArray::fromRawData(
+        reinterpret_cast<const char *>(&fid->fsid), sizeof fid->fsid + sizeof *handle + handle->handle_bytes);
+    return m_watches.value(key, -1);
+#else
+    Q_UNUSED(info);
+    *name = 0;
+    return -1;
+#endif
+}
+
+/**************************************************
+ * void FSFanotify::appendEvent
+ *************************************************/
+void FSFanotify::appendEvent(int wd, quint32 mask, quint32 cookie, const char *name)
+{
+    size_t nameLength = strlen(name);
+    struct inotify_event event;
+    event.wd = wd;
+    event.mask = mask;
+    event.cookie = cookie;
+    // Null terminated and padded like the names inotify reports
+    event.len = nameLength ? (nameLength + 4) & ~3 : 0;
+    m_events.append(reinterpret_cast<const char *>(&event), sizeof event);
+    m_events.append(name, nameLength);
+    m_events.append(QByteArray(event.len - nameLength, '\0'));
+}
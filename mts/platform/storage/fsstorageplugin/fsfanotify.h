@@ -0,0 +1,100 @@
+/*
+* This file is part of libmeegomtp package
+*
+* Copyright (c) 2010 Nokia Corporation. All rights reserved.
+* Copyright (c) 2013 - 2020 Jolla Ltd.
+* Copyright (c) 2020 Open Mobile Platform LLC.
+*
+* Contact: Deepak Kodihalli <deepak.kodihalli@nokia.com>
+*
+* Redistribution and use in source and binary forms, with or without modification,
+* are permitted provided that the following conditions are met:
+*
+* Redistributions of source code must retain the above copyright notice, this list
+* of conditions and the following disclaimer. Redistributions in binary form must
+* reproduce the above copyright notice, this list of conditions and the following
+* disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of Nokia Corporation nor the names of its contributors may be
+* used to endorse or promote products derived from this software without specific
+* prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+* IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+* INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+* BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+* DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+* LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+* OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+* OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*/
+
+#ifndef FSFANOTIFY_H
+#define FSFANOTIFY_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QString>
+#include "fswatcher.h"
+class QSocketNotifier;
+struct fanotify_event_metadata;
+
+namespace meegomtp1dot0 {
+/// FSFanotify monitors a whole file system with fanotify.
+///
+/// Unlike inotify, fanotify needs no watch per directory in the kernel, so
+/// large storages do not run into the max_user_watches limit. Events name
+/// their directory by a file handle, addWatch() only records the handle of
+/// a directory in order to resolve its events to a watch descriptor.
+/// Reporting file handles of the whole file system requires CAP_SYS_ADMIN
+/// and Linux 5.17 for FAN_RENAME, isValid() tells if fanotify can be used.
+class FSFanotify : public FSWatcher
+{
+    Q_OBJECT
+
+public:
+    /// Constructor.
+    /// \param path [in] a path on the file system to monitor.
+    FSFanotify(const QString &path);
+
+    /// Destructor.
+    ~FSFanotify();
+
+    /// \return true if the file system is being monitored.
+    bool isValid() const;
+
+    int addWatch(const QString &pathName);
+    int removeWatch(const int &wd);
+
+public slots:
+    /// This slot is for reading the fanotify events, when some are generated.
+    void fanotifyEventSlot(int);
+
+private:
+    /// Translates a fanotify event into inotify events in m_events.
+    void translateEvent(const struct fanotify_event_metadata *event);
+
+    /// Appends an inotify event to m_events.
+    void appendEvent(int wd, quint32 mask, quint32 cookie, const char *name);
+
+    /// Finds the directory of a directory file handle and name record.
+    /// \param info [in] the fanotify_event_info_fid record.
+    /// \param name [out] the name that follows the file handle.
+    /// \return watch descriptor of the directory, -1 if it is not watched.
+    int resolveWatch(const char *info, const char **name) const;
+
+    int m_fd;                      ///< the fanotify descriptor, -1 if not available
+    QSocketNotifier *m_readSocket; ///< notifies when events can be read from m_fd
+    QHash<QByteArray, int> m_watches; ///< file system id and file handle of directories to their watches
+    QHash<int, QByteArray> m_handles; ///< watch descriptors to the keys of m_watches
+    QHash<int, QString> m_paths;      ///< watch descriptors to directory paths
+    int m_lastWd;                  ///< the last watch descriptor given out
+    quint32 m_lastCookie;          ///< pairs the inotify events made of a rename
+    QByteArray m_buffer;           ///< events are read here, reused between reads
+    QByteArray m_events;           ///< the translated batch of events
+};
+}
+
+#endif
@@ -29,6 +29,7 @@
 *
 */
 
+#include <errno.h>
 #include <unistd.h>
 #include "fsinotify.h"
 #include <QSocketNotifier>
@@ -58,7 +59,7 @@ FSInotify::~FSInotify()
 /**************************************************
  * int FSInotify::addWatch
  *************************************************/
-int FSInotify::addWatch(const QString &pathName) const
+int FSInotify::addWatch(const QString &pathName)
 {
     if (!m_readSocket) {
         return -1;
@@ -70,7 +71,7 @@ int FSInotify::addWatch(const QString &pathName) const
 /**************************************************
  * int FSInotify::removeWatch
  *************************************************/
-int FSInotify::removeWatch(const int &wd) const
+int FSInotify::removeWatch(const int &wd)
 {
     if (!m_readSocket) {
         return -1;
@@ -83,20 +84,23 @@ int FSInotify::removeWatch(const int &wd) const
  *************************************************/
 void FSInotify::inotifyEventSlot(int)
 {
-    char tmp[512], *ptr;
-    int bytes_read = -1;
+    // Keeps the capacity, the buffer is only detached if a receiver
+    // held on to the previous batch
+    m_buffer.resize(EVENT_BUFFER_SIZE);
 
-    bytes_read = read(m_readSocket->socket(), tmp, sizeof(tmp));
+    ssize_t bytes_read;
+    do {
+        bytes_read = read(m_readSocket->socket(), m_buffer.data(), m_buffer.size());
+    } while (-1 == bytes_read && EINTR == errno);
 
-    if (-1 == bytes_read) {
+    if (bytes_read <= 0) {
         return;
     }
 
-    ptr = tmp;
-    while (ptr < tmp + bytes_read) {
-        struct inotify_event *event = (struct inotify_event *) ptr;
-        // FIXME: would it be better to pass all events or one at a time?
-        emit inotifyEventSignal(event);
-        ptr += sizeof *event + event->len;
-    }
+    m_buffer.resize(bytes_read);
+
+    // The receivers are looking at m_buffer, see inotifyEventsSignal()
+    m_readSocket->setEnabled(false);
+    emit inotifyEventsSignal(m_buffer);
+    m_readSocket->setEnabled(true);
 }
@@ -32,8 +32,9 @@
 #ifndef FSINOTIFY_H
 #define FSINOTIFY_H
 
-#include <QObject>
+#include <QByteArray>
 #include "sys/inotify.h"
+#include "fswatcher.h"
 class QSocketNotifier;
 
 /// FSInotify is a wrapper class for the inotify library.
@@ -41,7 +42,7 @@ class QSocketNotifier;
 /// FSInotify notifies the filesystem storage plug-in about changes in the file system
 /// so that the storage can take appropriate action.
 namespace meegomtp1dot0 {
-class FSInotify : public QObject
+class FSInotify : public FSWatcher
 {
     Q_OBJECT
 
@@ -56,25 +57,21 @@ public:
     /// Adds a new watch to the file whose pathname is provided.
     /// \param pathName [in] the file's pathname.
     /// \return watch descriptor on success, -1 on failure.
-    int addWatch(const QString &pathName) const;
+    int addWatch(const QString &pathName);
 
     /// Removes an added watch.
     /// \param wd [in] the watch to be removed.
     /// \return 0 on success -1 on failure.
-    int removeWatch(const int &wd) const;
+    int removeWatch(const int &wd);
 
 public slots:
-    /// This slot is for reading the inotify event, when one is generated.
+    /// This slot is for reading the inotify events, when some are generated.
     void inotifyEventSlot(int);
 
-signals:
-    /// This signal is emitted corresponding to an inotify event.
-    /// \param event [in] the structure holding inotify event details.
-    void inotifyEventSignal(struct inotify_event *event);
-
 private:
     uint32_t m_mask; ///< indicates what to watch for on a file.
     QSocketNotifier *m_readSocket; ///< inotify events will be written to this socket.
+    QByteArray m_buffer; ///< events are read here, reused between reads once the previous batch is handled.
 };
 }
 
@@ -0,0 +1,371 @@
+/*
+* This file is part of libmeegomtp package
+*
+* Copyright (c) 2010 Nokia Corporation. All rights reserved.
+* Copyright (c) 2013 - 2020 Jolla Ltd.
+* Copyright (c) 2020 Open Mobile Platform LLC.
+*
+* Contact: Deepak Kodihalli <deepak.kodihalli@nokia.com>
+*
+* Redistribution and use in source and binary forms, with or without modification,
+* are permitted provided that the following conditions are met:
+*
+* Redistributions of source code must retain the above copyright notice, this list
+* of conditions and the following disclaimer. Redistributions in binary form must
+* reproduce the above copyright notice, this list of conditions and the following
+* disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of Nokia Corporation nor the names of its contributors may be
+* used to endorse or promote products derived from this software without specific
+* prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+* IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+* INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+* BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+* DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+* LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+* OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+* OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*/
+
+#include "fsscanner.h"
+#include "fsstorageplugin.h"
+#include "trace.h"
+
+#include <QMutexLocker>
+#include <QRunnable>
+#include <QThread>
+
+#include <algorithm>
+
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+using namespace meegomtp1dot0;
+
+/* Directory reads are mostly waiting for the storage, so a few threads
+ * in parallel help even on devices with fewer cores. */
+static const int MAX_SCAN_THREADS = 4;
+
+/* Keep the order QDir used to list entries in, so that objects get
+ * their handles in a predictable order. */
+static bool entryLessThan(const FSScanner::Entry &a, const FSScanner::Entry &b)
+{
+    return a.path.compare(b.path, Qt::CaseInsensitive) < 0;
+}
+
+static qint64 statMtimeNs(const struct stat &st)
+{
+    return qint64(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+}
+
+static bool fillEntry(const struct stat &st, FSScanner::Entry &entry)
+{
+    // Like QDir::Files | QDir::Dirs, leave out devices, fifos and sockets
+    if (S_ISDIR(st.st_mode)) {
+        entry.isDir = true;
+        entry.size = 0;
+    } else if (S_ISREG(st.st_mode)) {
+        entry.isDir = false;
+        entry.size = st.st_size;
+    } else {
+        return false;
+    }
+    entry.mtime = st.st_mtime;
+    return true;
+}
+
+/* Stats a directory entry without following symlinks the policy does
+ * not allow, entry.path must already be set. */
+static FSScanner::Lookup statEntryAt(
+    int dirFd, const char *name, const QString &storagePath, FSScanner::Entry &entry)
+{
+    struct stat st;
+    if (fstatat(dirFd, name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+        return FSScanner::NotFound;
+    }
+    if (S_ISLNK(st.st_mode)) {
+        QString targetPath;
+        char *target = realpath(entry.path.toUtf8().constData(), 0);
+        if (target) {
+            targetPath = QString::fromUtf8(target);
+            free(target);
+        }
+        if (!FSStoragePlugin::symLinkAllowed(storagePath, entry.path, targetPath)) {
+            return FSScanner::Denied;
+        }
+        if (fstatat(dirFd, name, &st, 0) == -1) {
+            return FSScanner::NotFound;
+        }
+    }
+    return fillEntry(st, entry) ? FSScanner::Found : FSScanner::NotFound;
+}
+
+class FSScanner::Task : public QRunnable
+{
+public:
+    Task(FSScanner *scanner, const QString &path)
+        : m_scanner(scanner)
+        , m_path(path)
+    {}
+
+    void run() { m_scanner->scanDirectory(m_path); }
+
+private:
+    FSScanner *m_scanner;
+    QString m_path;
+};
+
+/************************************************************
+ * FSScanner::FSScanner
+ ***********************************************************/
+FSScanner::FSScanner(const QString &storagePath, const QStringList &excludePaths, QObject *parent)
+    : QObject(parent)
+    , m_storagePath(storagePath)
+    , m_excludePaths(excludePaths)
+    , m_pending(0)
+    , m_notified(false)
+    , m_cancelled(false)
+{
+    m_pool.setMaxThreadCount(qBound(2, QThread::idealThreadCount(), MAX_SCAN_THREADS));
+}
+
+/************************************************************
+ * FSScanner::~FSScanner
+ ***********************************************************/
+FSScanner::~FSScanner()
+{
+    m_lock.lock();
+    m_cancelled = true;
+    m_lock.unlock();
+
+    m_pool.clear();
+    m_pool.waitForDone();
+}
+
+/************************************************************
+ * void FSScanner::setKnownDirectories
+ ***********************************************************/
+void FSScanner::setKnownDirectories(const QHash<QString, qint64> &mtimes)
+{
+    m_knownDirs = mtimes;
+}
+
+/************************************************************
+ * void FSScanner::start
+ ***********************************************************/
+void FSScanner::start(const QString &path)
+{
+    m_lock.lock();
+    ++m_pending;
+    m_lock.unlock();
+
+    m_pool.start(new Task(this, path));
+}
+
+/************************************************************
+ * QList<FSScanner::Directory> FSScanner::takeResults
+ ***********************************************************/
+QList<FSScanner::Directory> FSScanner::takeResults()
+{
+    QMutexLocker locker(&m_lock);
+    QList<Directory> results;
+    results.swap(m_results);
+    m_notified = false;
+    return results;
+}
+
+/************************************************************
+ * bool FSScanner::isFinished
+ ***********************************************************/
+bool FSScanner::isFinished()
+{
+    QMutexLocker locker(&m_lock);
+    return m_pending == 0;
+}
+
+/************************************************************
+ * bool FSScanner::statEntry
+ ***********************************************************/
+bool FSScanner::statEntry(const QString &path, Entry &entry)
+{
+    struct stat st;
+    if (stat(path.toUtf8().constData(), &st) == -1) {
+        return false;
+    }
+    entry.path = path;
+    return fillEntry(st, entry);
+}
+
+/************************************************************
+ * FSScanner::Lookup FSScanner::lookupEntry
+ ***********************************************************/
+FSScanner::Lookup FSScanner::lookupEntry(const QString &storagePath, const QString &path, Entry &entry)
+{
+    entry.path = path;
+    return statEntryAt(AT_FDCWD, path.toUtf8().constData(), storagePath, entry);
+}
+
+/************************************************************
+ * qint64 FSScanner::mtimeNs
+ ***********************************************************/
+qint64 FSScanner::mtimeNs(const QString &path)
+{
+    struct stat st;
+    if (stat(path.toUtf8().constData(), &st) == -1) {
+        return -1;
+    }
+    return statMtimeNs(st);
+}
+
+/************************************************************
+ * qint64 FSScanner::nowNs
+ ***********************************************************/
+qint64 FSScanner::nowNs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return qint64(now.tv_sec) * 1000000000 + now.tv_nsec;
+}
+
+/************************************************************
+ * void FSScanner::waitForFinished
+ ***********************************************************/
+void FSScanner::waitForFinished()
+{
+    m_pool.waitForDone();
+}
+
+/************************************************************
+ * void FSScanner::listDirectory
+ ***********************************************************/
+void FSScanner::listDirectory(const QString &path, Directory &result)
+{
+    listDirectory(m_storagePath, m_excludePaths, path, result);
+}
+
+/************************************************************
+ * void FSScanner::listDirectory
+ ***********************************************************/
+void FSScanner::listDirectory(
+    const QString &storagePath, const QStringList &excludePaths, const QString &path, Directory &result)
+{
+    QStringList subDirs;
+    result.path = path;
+    readDirectory(storagePath, excludePaths, 0, path, result, subDirs);
+}
+
+/************************************************************
+ * bool FSScanner::readDirectory
+ ***********************************************************/
+bool FSScanner::readDirectory(
+    const QString &storagePath,
+    const QStringList &excludePaths,
+    const QHash<QString, qint64> *knownDirs,
+    const QString &path,
+    Directory &result,
+    QStringList &subDirs)
+{
+    result.mtime = -1;
+    result.listedAt = nowNs();
+    int dirFd = open(path.toUtf8().constData(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *dir = dirFd == -1 ? 0 : fdopendir(dirFd);
+    if (!dir) {
+        MTP_LOG_WARNING("could not read directory:" << path);
+        if (dirFd != -1) {
+            close(dirFd);
+        }
+        return false;
+    }
+
+    /* If nothing has been added, removed or renamed here since the
+     * contents were known, only look for the subdirectories. */
+    struct stat dirSt;
+    if (fstat(dirFd, &dirSt) == 0) {
+        result.mtime = statMtimeNs(dirSt);
+    }
+    bool known = knownDirs && result.mtime != -1 && knownDirs->value(path, -1) == result.mtime;
+
+    struct dirent *de;
+    while ((de = readdir(dir))) {
+        const char *name = de->d_name;
+        if (name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0))) {
+            continue;
+        }
+        if (known && de->d_type == DT_REG) {
+            continue;
+        }
+
+        Entry entry;
+        entry.path = path + '/' + QString::fromUtf8(name);
+        if (excludePaths.contains(entry.path)) {
+            continue;
+        }
+        if (statEntryAt(dirFd, name, storagePath, entry) != Found) {
+            continue;
+        }
+
+        if (entry.isDir) {
+            subDirs.append(entry.path);
+        }
+        if (!known) {
+            result.entries.append(entry);
+        }
+    }
+    closedir(dir);
+    std::sort(result.entries.begin(), result.entries.end(), entryLessThan);
+    return known;
+}
+
+/************************************************************
+ * void FSScanner::scanDirectory
+ ***********************************************************/
+void FSScanner::scanDirectory(const QString &path)
+{
+    Directory result;
+    result.path = path;
+    QStringList subDirs;
+    bool unchanged = false;
+
+    m_lock.lock();
+    bool cancelled = m_cancelled;
+    m_lock.unlock();
+
+    if (!cancelled) {
+        unchanged = readDirectory(m_storagePath, m_excludePaths, &m_knownDirs, path, result, subDirs);
+    }
+
+    /* Publish the listing before queueing the subdirectories, so that it
+     * gets taken before the listings of the subdirectories. */
+    m_lock.lock();
+    if (!unchanged) {
+        m_results.append(result);
+    }
+    // Subdirectories are pending only if they actually get queued
+    cancelled = m_cancelled;
+    if (!cancelled) {
+        m_pending += subDirs.size();
+    }
+    --m_pending;
+    bool notify = !m_notified && (!unchanged || m_pending == 0);
+    if (notify) {
+        m_notified = true;
+    }
+    m_lock.unlock();
+
+    if (!cancelled) {
+        foreach (const QString &subDir, subDirs) {
+            m_pool.start(new Task(this, subDir));
+        }
+    }
+
+    if (notify) {
+        emit resultsAvailable();
+    }
+}
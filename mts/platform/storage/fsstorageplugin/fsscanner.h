@@ -0,0 +1,179 @@
+/*
+* This file is part of libmeegomtp package
+*
+* Copyright (c) 2010 Nokia Corporation. All rights reserved.
+* Copyright (c) 2013 - 2020 Jolla Ltd.
+* Copyright (c) 2020 Open Mobile Platform LLC.
+*
+* Contact: Deepak Kodihalli <deepak.kodihalli@nokia.com>
+*
+* Redistribution and use in source and binary forms, with or without modification,
+* are permitted provided that the following conditions are met:
+*
+* Redistributions of source code must retain the above copyright notice, this list
+* of conditions and the following disclaimer. Redistributions in binary form must
+* reproduce the above copyright notice, this list of conditions and the following
+* disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of Nokia Corporation nor the names of its contributors may be
+* used to endorse or promote products derived from this software without specific
+* prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+* IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+* INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+* BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+* DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+* LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+* OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+* OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*/
+
+#ifndef FSSCANNER_H
+#define FSSCANNER_H
+
+#include <QObject>
+#include <QMutex>
+#include <QThreadPool>
+#include <QList>
+#include <QVector>
+#include <QStringList>
+#include <QHash>
+#include <time.h>
+
+namespace meegomtp1dot0 {
+/// FSScanner lists the contents of a directory tree using a pool of threads.
+///
+/// Every directory is read by a task of its own, which stats the entries
+/// and queues subdirectories for the other threads. Listings are collected
+/// in an order where a directory always comes before its subdirectories,
+/// so that the owner can build its object tree from them incrementally.
+/// The owner is notified with resultsAvailable() and picks up the listings
+/// with takeResults() in its own thread.
+///
+/// Directories whose contents are already known can be passed in with
+/// setKnownDirectories(). They are not listed again unless their mtime
+/// has changed, only their subdirectories are scanned.
+class FSScanner : public QObject
+{
+    Q_OBJECT
+
+public:
+    /// A file or a directory found by the scan.
+    struct Entry
+    {
+        QString path;
+        bool isDir;
+        quint64 size;
+        time_t mtime;
+    };
+
+    /// Contents of one directory.
+    struct Directory
+    {
+        QString path;
+        QVector<Entry> entries;
+        qint64 mtime;    ///< mtime of the directory in nanoseconds before it was read, -1 if unknown
+        qint64 listedAt; ///< wall clock time in nanoseconds when reading started
+    };
+
+    /// Outcome of lookupEntry().
+    enum Lookup
+    {
+        Found,
+        NotFound, ///< does not exist or is not a file or a directory
+        Denied    ///< a symlink excluded by the symlink policy
+    };
+
+    /// Constructor.
+    /// \param storagePath [in] canonical path of the storage, for symlink checks.
+    /// \param excludePaths [in] paths that are left out of the scan.
+    /// \param parent [in] the parent object.
+    FSScanner(const QString &storagePath, const QStringList &excludePaths, QObject *parent = 0);
+
+    /// Destructor, stops the scan and waits for ongoing tasks to complete.
+    ~FSScanner();
+
+    /// Sets directories whose contents the owner already knows.
+    /// \param mtimes [in] directory paths with their mtime in nanoseconds,
+    ///               see mtimeNs(), at the time their contents were known.
+    void setKnownDirectories(const QHash<QString, qint64> &mtimes);
+
+    /// Starts scanning the directory tree under path.
+    void start(const QString &path);
+
+    /// Takes the directory listings collected so far.
+    QList<Directory> takeResults();
+
+    /// True when all directories have been scanned. Results may still be
+    /// waiting to be taken.
+    bool isFinished();
+
+    /// Blocks until all directories have been scanned.
+    void waitForFinished();
+
+    /// Lists a single directory right away in the calling thread, e.g.
+    /// when its contents are needed before the scan gets to it.
+    /// \param path [in] the directory.
+    /// \param result [out] the contents of the directory.
+    void listDirectory(const QString &path, Directory &result);
+
+    /// Lists a single directory without a scanner, e.g. a directory tree
+    /// that appears in the storage after the scan.
+    /// \param storagePath [in] canonical path of the storage, for symlink checks.
+    /// \param excludePaths [in] paths that are left out of the listing.
+    /// \param path [in] the directory.
+    /// \param result [out] the contents of the directory.
+    static void listDirectory(
+        const QString &storagePath, const QStringList &excludePaths, const QString &path, Directory &result);
+
+    /// Stats a single path the same way as listed entries, applying the
+    /// symlink policy to it.
+    /// \param storagePath [in] canonical path of the storage, for symlink checks.
+    /// \param path [in] the path to look up.
+    /// \param entry [out] the attributes of path when found.
+    static Lookup lookupEntry(const QString &storagePath, const QString &path, Entry &entry);
+
+    /// Stats a single path the same way as scanned entries.
+    /// \return false if path does not exist or is not a file or a directory.
+    static bool statEntry(const QString &path, Entry &entry);
+
+    /// Gets the mtime of a path in nanoseconds, -1 if it can not be read.
+    static qint64 mtimeNs(const QString &path);
+
+    /// Gets the wall clock time in nanoseconds, comparable to mtimeNs().
+    static qint64 nowNs();
+
+signals:
+    /// Emitted when results become available after a takeResults() call,
+    /// and when the scan has finished.
+    void resultsAvailable();
+
+private:
+    class Task;
+
+    void scanDirectory(const QString &path);
+    static bool readDirectory(
+        const QString &storagePath,
+        const QStringList &excludePaths,
+        const QHash<QString, qint64> *knownDirs,
+        const QString &path,
+        Directory &result,
+        QStringList &subDirs);
+
+    QThreadPool m_pool;
+    QString m_storagePath;
+    QStringList m_excludePaths;
+    QHash<QString, qint64> m_knownDirs; ///< only read once the scan is started
+
+    QMutex m_lock;
+    QList<Directory> m_results; ///< protected by m_lock
+    int m_pending;              ///< directories queued or being read, protected by m_lock
+    bool m_notified;            ///< resultsAvailable() sent and not acted on, protected by m_lock
+    bool m_cancelled;           ///< protected by m_lock
+};
+}
+
+#endif
@@ -33,19 +33,25 @@
 
 #include "fsstorageplugin.h"
 #include "fsinotify.h"
+#include "fsfanotify.h"
 #include "storageitem.h"
 #include "thumbnailer.h"
 #include "trace.h"
 #include "../../../protocol/mtpresponder.h"
 
+#include <sys/ioctl.h>
 #include <sys/statvfs.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <linux/fs.h>
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 
 #include <QCoreApplication>
+#include <QCryptographicHash>
+#include <QDataStream>
 #include <QDebug>
 #include <QFile>
 #include <QDir>
@@ -54,6 +60,11 @@
 #include <QDateTime>
 #include <QMetaObject>
 #include <QLocale>
+#include <QSaveFile>
+#include <QSet>
+#include <QPair>
+
+#include <algorithm>
 
 #ifndef UT_ON
 #include <blkid.h>
@@ -70,6 +81,81 @@ const quint32 THUMB_HEIGHT = 100;
 static quint32 fourcc_wmv3 = 0x574D5633;
 static const QString FILENAMES_FILTER_REGEX("[<>:\\\"\\/\\\\\\|\\?\\*\\x0000-\\x001F]");
 
+/* How many scanned entries to add to the storage before returning to the
+ * event loop during enumeration. */
+static const int SCAN_MERGE_BATCH = 256;
+
+/* A directory mtime this close to the time the directory was listed does
+ * not tell whether it changed after the listing. FAT stores mtimes with a
+ * two second granularity. */
+static const qint64 MTIME_GRANULARITY_NS = 2000000000LL;
+
+/* The mtime a directory had when it was listed, for the index snapshot.
+ * Too recent an mtime can not prove that the listing is still complete,
+ * -1 makes the next run list the directory again. */
+static qint64 listedMtime(const FSScanner::Directory &dir)
+{
+    return dir.mtime < dir.listedAt - MTIME_GRANULARITY_NS ? dir.mtime : -1;
+}
+
+/* How many directory levels have to be scanned before a storage reports
+ * ready, deeper directories are scanned in the background or on demand. */
+static int readyDepth()
+{
+    static int depth = -1;
+    if (depth < 0) {
+        depth = 1;
+        QByteArray envData = qgetenv("BUTEO_MTP_READY_DEPTH");
+        QString envValue = QString::fromUtf8(envData.data()).toLower();
+        bool ok = false;
+        int value = envValue.toInt(&ok);
+        if (envValue == "all")
+            depth = INT_MAX;
+        else if (ok && value > 0)
+            depth = value;
+        else if (!envValue.isEmpty())
+            MTP_LOG_WARNING("unknown ready depth:" << envValue);
+    }
+    return depth;
+}
+
+/* Index snapshot file header */
+static const quint32 INDEX_SNAPSHOT_MAGIC = 0x4d545049; // "MTPI"
+static const quint32 INDEX_SNAPSHOT_VERSION = 1;
+
+/* Only one transaction is active at a time, but e.g. copying between
+ * objects can have more than one object open for reading. */
+static const int MAX_CACHED_READ_FDS = 4;
+
+/* How much data to keep requested ahead of a sequential reader. Pages
+ * are dropped from the page cache once they are this far behind it,
+ * as the transport may still be sending data queued just before. */
+static const quint64 READ_AHEAD_WINDOW = 4 * 1024 * 1024;
+
+/* Amount of data copied within the kernel between checks for
+ * cancellation of CopyObject. */
+static const quint64 COPY_CHUNK_SIZE = 8 * 1024 * 1024;
+
+/* How many getObjectHandles() results are kept up to date, each
+ * association and format filter asked for takes one. */
+static const int MAX_HANDLE_LISTS = 32;
+
+static quint64 handleListKey(quint32 associationHandle, MTPObjFormatCode formatCode)
+{
+    return (quint64(associationHandle) << 16) | formatCode;
+}
+
+/* Whether getObjectHandles() lists an object of the given format. Listings
+ * of the whole storage can filter by undefined format, those of an
+ * association cannot. */
+static bool handleListMatches(MTPObjFormatCode formatCode, quint16 format, bool wholeStorage)
+{
+    if (!formatCode) {
+        return true;
+    }
+    return formatCode == format && (wholeStorage || MTP_OBF_FORMAT_Undefined != formatCode);
+}
+
 /* ========================================================================= *
  * Timestamp helpers
  * ========================================================================= */
@@ -389,10 +475,22 @@ FSStoragePlugin::FSStoragePlugin(
     , m_storagePath(QDir(storagePath).canonicalPath())
     , m_root(0)
     , m_writeObjectHandle(0)
-    , m_largestPuoid(0)
     , m_reportedFreeSpace(0)
+    , m_inotifyBatchDepth(0)
+    , m_storageInfoChangePending(false)
     , m_dataFile(0)
+    , m_storeFullReported(false)
+    , m_scanner(0)
+    , m_scanPosition(0)
+    , m_validatingIndex(false)
+    , m_rescanPending(false)
+    , m_unscannedReadyDirs(0)
+    , m_readyReported(false)
 {
+    m_readAhead.handle = 0;
+    m_readAhead.advised = 0;
+    m_readAhead.dropped = 0;
+
     m_storageInfo.storageType = storageType;
     m_storageInfo.accessCapability = MTP_STORAGE_ACCESS_ReadWrite;
     m_storageInfo.filesystemType = MTP_FILE_SYSTEM_TYPE_GenHier;
@@ -419,10 +517,14 @@ FSStoragePlugin::FSStoragePlugin(
         dir.mkpath(m_mtpPersistentDBPath);
     }
 
+    QString dbSuffix = '-' + volumeLabel + '-' + filesystemUuid();
+
     m_puoidsDbPath = m_mtpPersistentDBPath + "/mtppuoids";
     // Remove legacy PUOID database if it exists.
     QFile::remove(m_puoidsDbPath);
-    m_puoidsDbPath += '-' + volumeLabel + '-' + filesystemUuid();
+    m_puoidsDbPath += dbSuffix;
+
+    m_indexSnapshotPath = m_mtpPersistentDBPath + "/mtpindex" + dbSuffix;
 
     m_objectReferencesDbPath = m_mtpPersistentDBPath + "/mtpreferences";
 
@@ -435,12 +537,20 @@ FSStoragePlugin::FSStoragePlugin(
     QObject::connect(
         m_thumbnailer, SIGNAL(thumbnailReady(const QString &)), this, SLOT(receiveThumbnail(const QString &)));
     clearCachedInotifyEvent(); // initialize
-    m_inotify = new FSInotify(IN_MOVE | IN_CREATE | IN_DELETE | IN_CLOSE_WRITE);
+    // fanotify needs no watches per directory, but is only available to
+    // privileged processes
+    FSFanotify *fanotify = new FSFanotify(m_storagePath);
+    if (fanotify->isValid()) {
+        m_watcher = fanotify;
+    } else {
+        delete fanotify;
+        m_watcher = new FSInotify(IN_MOVE | IN_CREATE | IN_DELETE | IN_CLOSE_WRITE);
+    }
     QObject::connect(
-        m_inotify,
-        SIGNAL(inotifyEventSignal(struct inotify_event *)),
+        m_watcher,
+        SIGNAL(inotifyEventsSignal(const QByteArray &)),
         this,
-        SLOT(inotifyEventSlot(struct inotify_event *)));
+        SLOT(inotifyEventsSlot(const QByteArray &)));
 
     MTP_LOG_INFO(storagePath << "exported as FS storage" << volumeLabel << '(' << storageDescription << ')');
 
@@ -466,30 +576,341 @@ bool FSStoragePlugin::enumerateStorage()
 void FSStoragePlugin::enumerateStorage_worker()
 {
     // Add the root folder to storage
-    addToStorage(m_storagePath, &m_root);
+    FSScanner::Entry rootEntry;
+    if (!FSScanner::statEntry(m_storagePath, rootEntry) || !rootEntry.isDir) {
+        addToStorage(m_storagePath, &m_root);
+        finishEnumeration();
+        return;
+    }
+
+    /* With a snapshot from the previous run the storage can be used right
+     * away. The scan then only needs to look into directories that have
+     * changed since the snapshot was written. Puoids and references of
+     * objects added since then are dealt with once the scan has found them. */
+    QHash<QString, qint64> knownDirs;
+    if (loadIndexSnapshot(knownDirs)) {
+        m_validatingIndex = true;
+        reportReady();
+    } else {
+        m_root = addScannedItem(rootEntry, 0);
+        setDirectoryUnscanned(m_root, 0);
+    }
+
+    startScan(knownDirs);
+}
+
+/************************************************************
+ * void FSStoragePlugin::startScan
+ ***********************************************************/
+void FSStoragePlugin::startScan(const QHash<QString, qint64> &knownDirs)
+{
+    /* The tree is listed by worker threads and added from the listings
+     * in batches, keeping the event loop responsive. The symlink policy
+     * gets evaluated here, before the threads need it. */
+    symLinkPolicy();
+    m_scanner = new FSScanner(m_storagePath, m_excludePaths, this);
+    m_scanner->setKnownDirectories(knownDirs);
+    QObject::connect(m_scanner, &FSScanner::resultsAvailable, this, &FSStoragePlugin::mergeScanResults);
+    m_scanPosition = 0;
+    m_scanner->start(m_storagePath);
+}
+
+/************************************************************
+ * void FSStoragePlugin::rescanStorage
+ ***********************************************************/
+void FSStoragePlugin::rescanStorage()
+{
+    // Directories already merged by an ongoing scan may have missed changes too
+    if (m_scanner) {
+        m_rescanPending = true;
+        return;
+    }
+
+    /* Events were lost, so no directory can be assumed unchanged. The
+     * tree is checked against the file system like an index snapshot. */
+    MTP_LOG_WARNING("storage" << m_storageId << "lost file system events, scanning it again");
+    m_validatingIndex = true;
+    startScan(QHash<QString, qint64>());
+}
+
+/************************************************************
+ * void FSStoragePlugin::mergeScanResults
+ ***********************************************************/
+void FSStoragePlugin::mergeScanResults()
+{
+    if (!m_scanner) {
+        return;
+    }
+
+    bool finished = m_scanner->isFinished();
+    m_scanResults.append(m_scanner->takeResults());
+
+    int work = 0;
+    while (!m_scanResults.isEmpty() && work < SCAN_MERGE_BATCH) {
+        FSScanner::Directory &dir = m_scanResults.first();
+        /* The directory may have been deleted or excluded by now,
+         * in which case its contents are of no interest either. */
+        StorageItem *parentItem = findStorageItemByPath(dir.path);
+        if (parentItem && m_scanPosition == 0 && relistIfStale(dir, parentItem)) {
+            // New subdirectories are being scanned
+            finished = false;
+        }
+        if (parentItem && m_validatingIndex && m_scanPosition == 0) {
+            removeVanishedItems(dir, parentItem);
+        }
+        while (parentItem && m_scanPosition < dir.entries.size() && work++ < SCAN_MERGE_BATCH) {
+            if (m_validatingIndex) {
+                updateScannedItem(dir.entries.at(m_scanPosition++), parentItem);
+            } else {
+                addScannedChild(dir.entries.at(m_scanPosition++), parentItem);
+            }
+        }
+        if (!parentItem || m_scanPosition == dir.entries.size()) {
+            if (parentItem) {
+                setDirectoryScanned(parentItem->m_handle);
+                m_listedMtimes.insert(parentItem->m_handle, listedMtime(dir));
+            }
+            m_scanResults.removeFirst();
+            m_scanPosition = 0;
+        }
+    }
+
+    if (!m_readyReported && !m_unscannedReadyDirs) {
+        reportReady();
+    }
+
+    if (!m_scanResults.isEmpty()) {
+        QMetaObject::invokeMethod(this, "mergeScanResults", Qt::QueuedConnection);
+    } else if (finished) {
+        delete m_scanner;
+        m_scanner = 0;
+        m_watchedAt.clear();
+        if (m_validatingIndex) {
+            m_validatingIndex = false;
+            MTP_LOG_INFO("storage" << m_storageId << "index snapshot validated");
+        }
+        finishEnumeration();
+        storeIndexSnapshot();
+        if (m_rescanPending) {
+            m_rescanPending = false;
+            rescanStorage();
+        }
+    }
+    // Otherwise called again when the scanner has more results
+}
+
+/************************************************************
+ * bool FSStoragePlugin::relistIfStale
+ ***********************************************************/
+bool FSStoragePlugin::relistIfStale(FSScanner::Directory &dir, StorageItem *item)
+{
+    /* Inotify only reports changes made after the watch was added. If the
+     * directory was listed before that, anything added or removed in
+     * between would be missed, unless its mtime shows it did not change. */
+    qint64 watchedAt = m_watchedAt.take(item->m_handle);
+    if (!watchedAt || dir.listedAt >= watchedAt) {
+        return false;
+    }
+    if (dir.mtime != -1 && dir.mtime < dir.listedAt - MTIME_GRANULARITY_NS
+        && dir.mtime == FSScanner::mtimeNs(dir.path)) {
+        return false;
+    }
 
+    FSScanner::Directory current;
+    m_scanner->listDirectory(dir.path, current);
+
+    // The scanner only queued the subdirectories it saw
+    QSet<QString> listedDirs;
+    foreach (const FSScanner::Entry &entry, dir.entries) {
+        if (entry.isDir) {
+            listedDirs.insert(entry.path);
+        }
+    }
+    bool scanning = false;
+    foreach (const FSScanner::Entry &entry, current.entries) {
+        if (entry.isDir && !listedDirs.contains(entry.path)) {
+            m_scanner->start(entry.path);
+            scanning = true;
+        }
+    }
+    dir = current;
+    return scanning;
+}
+
+/************************************************************
+ * void FSStoragePlugin::finishEnumeration
+ ***********************************************************/
+void FSStoragePlugin::finishEnumeration()
+{
+    // Everything the scan did not find is gone
+    m_unscannedDirs.clear();
+    m_unscannedReadyDirs = 0;
     removeUnusedPuoids();
 
     // Populate object references stored persistently and add them to the storage.
     populateObjectReferences();
 
+    if (!m_readyReported) {
+        reportReady();
+    }
+}
+
+/************************************************************
+ * void FSStoragePlugin::reportReady
+ ***********************************************************/
+void FSStoragePlugin::reportReady()
+{
+    m_readyReported = true;
+
     /* Delay from waiting for "storage ready" is known cause
      * of issues. To ease debugging log when it is finished. */
-    MTP_LOG_WARNING("storage" << m_storageId << "is ready");
+    MTP_LOG_WARNING("storage" << m_storageId << "is ready" << (m_scanner ? "while scanning" : ""));
 
     emit storagePluginReady(m_storageId);
 
-    // enable thumbnailer after fs scan is finished
+    /* Enable thumbnailer once the storage is ready. The rest of the tree
+     * may still be being scanned, thumbnails are requested as objects
+     * are looked at rather than by walking the tree. */
     m_thumbnailer->enableThumbnailing();
 }
 
+/************************************************************
+ * void FSStoragePlugin::setDirectoryUnscanned
+ ***********************************************************/
+void FSStoragePlugin::setDirectoryUnscanned(StorageItem *item, int depth)
+{
+    m_unscannedDirs.insert(item->m_handle, depth);
+    if (depth < readyDepth()) {
+        ++m_unscannedReadyDirs;
+    }
+}
+
+/************************************************************
+ * void FSStoragePlugin::setDirectoryScanned
+ ***********************************************************/
+void FSStoragePlugin::setDirectoryScanned(ObjHandle handle)
+{
+    QHash<ObjHandle, int>::iterator i = m_unscannedDirs.find(handle);
+    if (i != m_unscannedDirs.end()) {
+        if (i.value() < readyDepth()) {
+            --m_unscannedReadyDirs;
+        }
+        m_unscannedDirs.erase(i);
+    }
+}
+
+/************************************************************
+ * void FSStoragePlugin::addScannedChild
+ ***********************************************************/
+void FSStoragePlugin::addScannedChild(const FSScanner::Entry &entry, StorageItem *parentItem)
+{
+    // An on-demand scan or an inotify event may have added it already
+    if (parentItem->m_children.contains(entry.path.mid(entry.path.lastIndexOf('/') + 1))) {
+        return;
+    }
+    StorageItem *item = addScannedItem(entry, parentItem);
+    if (entry.isDir) {
+        setDirectoryUnscanned(item, m_unscannedDirs.value(parentItem->m_handle) + 1);
+    }
+}
+
+/************************************************************
+ * void FSStoragePlugin::ensureDirectoryScanned
+ ***********************************************************/
+void FSStoragePlugin::ensureDirectoryScanned(StorageItem *item)
+{
+    if (!m_unscannedDirs.contains(item->m_handle)) {
+        return;
+    }
+
+    // The initiator is waiting for this one, do not wait for the scanner
+    FSScanner::Directory dir;
+    m_scanner->listDirectory(item->path(), dir);
+    foreach (const FSScanner::Entry &entry, dir.entries) {
+        addScannedChild(entry, item);
+    }
+    setDirectoryScanned(item->m_handle);
+    m_listedMtimes.insert(item->m_handle, listedMtime(dir));
+}
+
+/************************************************************
+ * void FSStoragePlugin::rescanMovedDirectory
+ ***********************************************************/
+void FSStoragePlugin::rescanMovedDirectory(StorageItem *item)
+{
+    /* The scanner lists directories by path, and what it lists under the
+     * old path of a moved directory gets dropped. Whatever of the subtree
+     * has not been added yet is scanned again under the new path. */
+    if (m_scanner && hasUnscannedDirectory(item)) {
+        m_scanner->start(item->path());
+    }
+}
+
+/************************************************************
+ * bool FSStoragePlugin::hasUnscannedDirectory
+ ***********************************************************/
+bool FSStoragePlugin::hasUnscannedDirectory(StorageItem *item) const
+{
+    if (MTP_OBF_FORMAT_Association != item->m_format) {
+        return false;
+    }
+    if (m_unscannedDirs.contains(item->m_handle)) {
+        return true;
+    }
+    for (StorageItem *child = item->m_firstChild; child; child = child->m_nextSibling) {
+        if (hasUnscannedDirectory(child)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/************************************************************
+ * void FSStoragePlugin::completeEnumeration
+ ***********************************************************/
+void FSStoragePlugin::completeEnumeration()
+{
+    // Validating the index snapshot leaves nothing unscanned, but may still find changes
+    if (!m_scanner) {
+        return;
+    }
+
+    /* Add the listings as they come in rather than after the whole scan,
+     * and keep handling events meanwhile, like addToStorage() does. */
+    MTP_LOG_INFO("waiting for storage" << m_storageId << "scan to finish");
+    while (m_scanner) {
+        mergeScanResults();
+        if (m_scanner && m_scanResults.isEmpty()) {
+            QCoreApplication::processEvents(QEventLoop::WaitForMoreEvents);
+        }
+    }
+}
+
 /************************************************************
  * FSStoragePlugin::~FSStoragePlugin
  ***********************************************************/
 FSStoragePlugin::~FSStoragePlugin()
 {
+    /* A snapshot written in the middle of a scan would claim directories
+     * not yet scanned to be up to date, keep the previous one then. The
+     * same goes for references, which get loaded once the scan is done. */
+    bool scanned = !m_scanner;
+    if (m_scanner) {
+        delete m_scanner;
+        m_scanner = 0;
+    } else {
+        storeIndexSnapshot();
+    }
+
     storePuoids();
-    storeObjectReferences();
+    if (scanned) {
+        storeObjectReferences();
+    }
+
+    foreach (int fd, m_readFds) {
+        close(fd);
+    }
+    m_readFds.clear();
 
     for (QHash<ObjHandle, StorageItem *>::iterator i = m_objectHandlesMap.begin(); i != m_objectHandlesMap.end(); ++i) {
         if (i.value()) {
@@ -499,8 +920,8 @@ FSStoragePlugin::~FSStoragePlugin()
 
     delete m_thumbnailer;
     m_thumbnailer = 0;
-    delete m_inotify;
-    m_inotify = 0;
+    delete m_watcher;
+    m_watcher = 0;
 }
 
 void FSStoragePlugin::disableObjectEvents()
@@ -512,76 +933,64 @@ void FSStoragePlugin::disableObjectEvents()
     }
 }
 
+void FSStoragePlugin::sessionClosed()
+{
+    // SendObject will not come for objects created in the session
+    releaseReservedSpace();
+}
+
 /************************************************************
  * void FSStoragePlugin::populatePuoids
  ***********************************************************/
 void FSStoragePlugin::populatePuoids()
 {
-    QFile file(m_puoidsDbPath);
-    if (!file.open(QIODevice::ReadOnly) || !file.size()) {
-        return;
-    }
-
-    qint32 bytesRead = 0;
-    char *name = 0;
-    quint32 noOfPuoids = 0, pathnameLen = 0;
-    MtpInt128 puoid;
-
-    // Read the last used puoid
-    bytesRead = file.read(reinterpret_cast<char *>(&m_largestPuoid), sizeof(MtpInt128));
-    if (0 >= bytesRead) {
-        return;
-    }
-
-    // Read the no. of puoids
-    bytesRead = file.read(reinterpret_cast<char *>(&noOfPuoids), sizeof(quint32));
-    if (0 >= bytesRead) {
-        return;
-    }
+    m_puoids.open(m_puoidsDbPath);
+}
 
-    for (quint32 i = 0; i < noOfPuoids; ++i) {
-        // read pathname len
-        bytesRead = file.read(reinterpret_cast<char *>(&pathnameLen), sizeof(quint32));
-        if (0 >= bytesRead) {
-            return;
+/* Paths in the puoid db come mostly sorted, so consecutive ones tend to
+ * share their directory. It is looked up once, then only the names in it. */
+class FSStoragePlugin::UsedPathFilter : public PuoidDb::PathFilter
+{
+public:
+    UsedPathFilter(FSStoragePlugin *storage)
+        : m_storage(storage)
+        , m_rootPath(storage->m_storagePath.toUtf8())
+        , m_dirItem(0)
+    {}
+
+    bool keep(const char *path, int length)
+    {
+        // Only the root has its directory outside of the storage
+        if (length == m_rootPath.size() && !memcmp(path, m_rootPath.constData(), length)) {
+            return m_storage->m_root != 0;
         }
 
-        // read the pathname
-        name = new char[pathnameLen + 1];
-        bytesRead = file.read(name, pathnameLen);
-        if (0 >= bytesRead) {
-            delete[] name;
-            return;
+        const char *separator = static_cast<const char *>(memrchr(path, '/', length));
+        if (!separator) {
+            return false;
         }
-        name[pathnameLen] = '\0';
-
-        // read the puoid
-        bytesRead = file.read(reinterpret_cast<char *>(&puoid), sizeof(MtpInt128));
-        if (0 >= bytesRead) {
-            delete[] name;
-            return;
+        int dirLength = separator - path;
+        if (dirLength != m_dirPath.size() || memcmp(path, m_dirPath.constData(), dirLength)) {
+            m_dirPath = QByteArray(path, dirLength);
+            m_dirItem = m_storage->findStorageItemByPath(QString::fromUtf8(m_dirPath));
         }
-
-        // Store this in puoids map
-        m_puoidsMap[name] = puoid;
-
-        delete[] name;
+        return m_dirItem && m_dirItem->m_children.contains(QString::fromUtf8(separator + 1, length - dirLength - 1));
     }
-}
+
+private:
+    FSStoragePlugin *m_storage;
+    QByteArray m_rootPath;
+    QByteArray m_dirPath;   ///< directory of the previous path
+    StorageItem *m_dirItem; ///< m_dirPath in the tree, if it is there
+};
 
 /************************************************************
  * void FSStoragePlugin::removeUnusedPuoids
  ***********************************************************/
 void FSStoragePlugin::removeUnusedPuoids()
 {
-    QHash<QString, MtpInt128>::iterator i = m_puoidsMap.begin();
-    while (i != m_puoidsMap.end()) {
-        if (!m_pathNamesMap.contains(i.key())) {
-            i = m_puoidsMap.erase(i);
-        } else {
-            ++i;
-        }
-    }
+    UsedPathFilter filter(this);
+    m_puoids.removeUnused(filter);
 }
 
 /************************************************************
@@ -589,69 +998,137 @@ void FSStoragePlugin::removeUnusedPuoids()
  ***********************************************************/
 void FSStoragePlugin::storePuoids()
 {
-    // Store in the following order
-    // Last used PUOID (128 bits)
-    // No. Of puoids ( 4 bytes )
-    // length of object's pathname : pathname : puoid ( for each puoid )
-    qint32 bytesWritten = -1;
-    QFile file(m_puoidsDbPath);
-    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
-        return;
+    m_puoids.compact();
+}
+
+/************************************************************
+ * bool FSStoragePlugin::loadIndexSnapshot
+ ***********************************************************/
+bool FSStoragePlugin::loadIndexSnapshot(QHash<QString, qint64> &knownDirs)
+{
+    QFile file(m_indexSnapshotPath);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return false;
     }
 
-    // Write the last used puoid.
-    bytesWritten = file.write(reinterpret_cast<const char *>(&m_largestPuoid), sizeof(MtpInt128));
-    if (-1 == bytesWritten) {
-        MTP_LOG_WARNING("ERROR writing last used puoid to db!!");
-        file.resize(0);
-        file.close();
-        return;
+    quint32 magic = 0;
+    quint32 version = 0;
+    QByteArray payload;
+    QByteArray digest;
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_5_0);
+    stream >> magic >> version >> payload >> digest;
+    if (stream.status() != QDataStream::Ok || magic != INDEX_SNAPSHOT_MAGIC || version != INDEX_SNAPSHOT_VERSION
+        || digest != QCryptographicHash::hash(payload, QCryptographicHash::Md5)) {
+        MTP_LOG_WARNING("ignoring invalid index snapshot" << m_indexSnapshotPath);
+        return false;
     }
 
-    // Write the no of puoids
-    quint32 noOfPuoids = m_puoidsMap.size();
-    bytesWritten = file.write(reinterpret_cast<const char *>(&noOfPuoids), sizeof(quint32));
-    if (-1 == bytesWritten) {
-        MTP_LOG_WARNING("ERROR writing no of puoids to db!!");
-        file.resize(0);
-        file.close();
-        return;
+    QDataStream in(payload);
+    in.setVersion(QDataStream::Qt_5_0);
+    QString storagePath;
+    in >> storagePath;
+    if (storagePath != m_storagePath) {
+        return false;
     }
 
-    // Write info for each puoid
-    for (QHash<QString, MtpInt128>::const_iterator i = m_puoidsMap.constBegin(); i != m_puoidsMap.constEnd(); ++i) {
-        quint32 pathnameLen = i.key().size();
-        QString pathname = i.key();
-        MtpInt128 puoid = i.value();
+    // Items refer to their parent by index, parents come first
+    QVector<StorageItem *> items;
+    while (!in.atEnd()) {
+        qint32 parent = -1;
+        QString name;
+        qint64 mtime = -1;
+        MtpInt128 puoid;
+        FSScanner::Entry entry;
+        in >> parent >> name >> entry.isDir >> entry.size >> mtime;
+        in.readRawData(puoid.val, sizeof puoid.val);
+        if (in.status() != QDataStream::Ok || parent >= items.size() || (parent < 0) != items.isEmpty()) {
+            // Whatever could not be loaded gets added by the scan
+            MTP_LOG_WARNING("index snapshot" << m_indexSnapshotPath << "is truncated");
+            break;
+        }
 
-        // Write length of path name
-        bytesWritten = file.write(reinterpret_cast<const char *>(&pathnameLen), sizeof(quint32));
-        if (-1 == bytesWritten) {
-            MTP_LOG_WARNING("ERROR writing pathname len to db!!");
-            file.resize(0);
-            file.close();
-            return;
+        StorageItem *parentItem = parent < 0 ? 0 : items.at(parent);
+        entry.path = parentItem ? parentItem->path() + '/' + name : m_storagePath;
+        if (entry.isDir) {
+            knownDirs.insert(entry.path, mtime);
+            entry.mtime = mtime / 1000000000;
+        } else {
+            entry.mtime = mtime;
+        }
+        // Never reuse a puoid that might have been given out again since
+        if (!(puoid > m_puoids.largestPuoid()) && !m_puoids.contains(entry.path)) {
+            m_puoids.insert(entry.path, puoid);
+        }
+        StorageItem *item = addScannedItem(entry, parentItem);
+        if (entry.isDir) {
+            m_listedMtimes.insert(item->m_handle, mtime);
+        } else {
+            // A file rewritten in place does not change the directory mtime
+            item->m_attributesUnverified = true;
         }
+        items.append(item);
+    }
 
-        // Write path name
-        QByteArray ba = pathname.toUtf8();
-        bytesWritten = file.write(reinterpret_cast<const char *>(ba.constData()), pathnameLen);
-        if (-1 == bytesWritten) {
-            MTP_LOG_WARNING("ERROR writing pathname to db!!");
-            file.resize(0);
-            file.close();
-            return;
+    m_root = items.value(0);
+    if (m_root) {
+        MTP_LOG_INFO("storage" << m_storageId << "loaded" << items.size() << "objects from index snapshot");
+    }
+    return m_root != 0;
+}
+
+/************************************************************
+ * void FSStoragePlugin::storeIndexSnapshot
+ ***********************************************************/
+void FSStoragePlugin::storeIndexSnapshot()
+{
+    if (!m_root) {
+        return;
+    }
+
+    QByteArray payload;
+    QDataStream out(&payload, QIODevice::WriteOnly);
+    out.setVersion(QDataStream::Qt_5_0);
+    out << m_storagePath;
+
+    /* Breadth first, so that parents are written before their children.
+     * Directories get the mtime they had when they were listed. Inotify
+     * events still queued would not be covered by the current mtime,
+     * changes made after the listing make the next run list them again. */
+    QHash<StorageItem *, qint32> indices;
+    QList<StorageItem *> pending;
+    pending.append(m_root);
+    while (!pending.isEmpty()) {
+        StorageItem *item = pending.takeFirst();
+        bool isDir = item->m_format == MTP_OBF_FORMAT_Association;
+        MTPObjectInfo *info = item->m_objectInfo;
+        quint64 size = info ? info->mtpObjectCompressedSize : item->m_size;
+        qint64 mtime = info ? datetime_to_time_t(info->mtpModificationDate) : item->m_mtime;
+        if (isDir) {
+            size = 0;
+            mtime = m_listedMtimes.value(item->m_handle, -1);
         }
+        out << (item->m_parent ? indices.value(item->m_parent) : qint32(-1)) << item->m_name << isDir << size << mtime;
+        out.writeRawData(item->m_puoid.val, sizeof item->m_puoid.val);
 
-        // Write puoid
-        bytesWritten = file.write(reinterpret_cast<const char *>(&puoid), sizeof(MtpInt128));
-        if (-1 == bytesWritten) {
-            MTP_LOG_WARNING("ERROR writing puoid to db!!");
-            file.resize(0);
-            file.close();
-            return;
+        indices.insert(item, indices.size());
+        for (StorageItem *child = item->m_firstChild; child; child = child->m_nextSibling) {
+            pending.append(child);
         }
     }
+
+    QSaveFile file(m_indexSnapshotPath);
+    if (!file.open(QIODevice::WriteOnly)) {
+        MTP_LOG_WARNING("ERROR opening index snapshot" << m_indexSnapshotPath);
+        return;
+    }
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_5_0);
+    stream << INDEX_SNAPSHOT_MAGIC << INDEX_SNAPSHOT_VERSION << payload
+           << QCryptographicHash::hash(payload, QCryptographicHash::Md5);
+    if (!file.commit()) {
+        MTP_LOG_WARNING("ERROR writing index snapshot" << m_indexSnapshotPath);
+    }
 }
 
 /************************************************************
@@ -662,7 +1139,7 @@ void FSStoragePlugin::buildSupportedFormatsList()
     /* The m_formatByExtTable lookup table is used for determining
      * mtp object format of files present in the device file system
      * and is accessed only from:
-     *   FSStoragePlugin::getObjectFormatByExtension()
+     *   FSStoragePlugin::setObjectAttributes()
      *
      * Files with extensions not defined here will be handled as
      * MTP_OBF_FORMAT_Undefined - which should allow pc side software
@@ -779,16 +1256,18 @@ quint32 FSStoragePlugin::requestNewObjectHandle()
 void FSStoragePlugin::requestNewPuoid(MtpInt128 &newPuoid)
 {
     emit puoid(newPuoid);
-    m_largestPuoid = newPuoid;
+    m_puoids.setLargestPuoid(newPuoid);
 }
 
 void FSStoragePlugin::getLargestPuoid(MtpInt128 &puoid)
 {
-    puoid = m_largestPuoid;
+    puoid = m_puoids.largestPuoid();
 }
 
-MTPResponseCode FSStoragePlugin::createFile(const QString &path, MTPObjectInfo *info)
+MTPResponseCode FSStoragePlugin::createFile(const QString &path, MTPObjectInfo *info, bool &preallocated)
 {
+    preallocated = false;
+
     // Create the file in the file system.
     QFile file(path);
 
@@ -817,7 +1296,17 @@ MTPResponseCode FSStoragePlugin::createFile(const QString &path, MTPObjectInfo *
 
     if (size > 0) {
         if (fallocate(file.handle(), 0, 0, size) == -1) {
-            MTP_LOG_WARNING("failed to set file:" << path << " to size:" << size << " err:" << strerror(errno));
+            int err = errno;
+            MTP_LOG_WARNING("failed to set file:" << path << " to size:" << size << " err:" << strerror(err));
+            /* Let the initiator know now rather than after it has
+             * sent all the data that does not fit. */
+            if (err == ENOSPC || err == EDQUOT) {
+                if (!already_exists)
+                    file.remove();
+                return MTP_RESP_StoreFull;
+            }
+        } else {
+            preallocated = true;
         }
     } else {
         if (ftruncate(file.handle(), 0) == -1) {
@@ -863,6 +1352,7 @@ void FSStoragePlugin::linkChildStorageItem(StorageItem *childStorageItem, Storag
         return;
     }
     childStorageItem->m_parent = parentStorageItem;
+    parentStorageItem->m_children.insert(childStorageItem->m_name, childStorageItem);
 
     // Parent has no children
     if (!parentStorageItem->m_firstChild) {
@@ -886,6 +1376,11 @@ void FSStoragePlugin::unlinkChildStorageItem(StorageItem *childStorageItem)
         return;
     }
 
+    QHash<QString, StorageItem *>::iterator i = childStorageItem->m_parent->m_children.find(childStorageItem->m_name);
+    if (i != childStorageItem->m_parent->m_children.end() && i.value() == childStorageItem) {
+        childStorageItem->m_parent->m_children.erase(i);
+    }
+
     // If this is the first child.
     if (childStorageItem->m_parent->m_firstChild == childStorageItem) {
         childStorageItem->m_parent->m_firstChild = childStorageItem->m_nextSibling;
@@ -908,11 +1403,27 @@ void FSStoragePlugin::unlinkChildStorageItem(StorageItem *childStorageItem)
  ***********************************************************/
 StorageItem *FSStoragePlugin::findStorageItemByPath(const QString &path)
 {
-    StorageItem *storageItem = 0;
-    ObjHandle handle;
-    if (m_pathNamesMap.contains(path)) {
-        handle = m_pathNamesMap.value(path);
-        storageItem = m_objectHandlesMap.value(handle);
+    if (!m_root) {
+        return 0;
+    }
+    if (path == m_root->m_name) {
+        return m_root;
+    }
+
+    int length = m_root->m_name.size();
+    if (!path.startsWith(m_root->m_name) || path.size() <= length + 1 || path.at(length) != '/') {
+        return 0;
+    }
+
+    // Walk down the tree one path segment at a time
+    StorageItem *storageItem = m_root;
+    for (int from = length + 1; storageItem && from <= path.size(); ++from) {
+        int to = path.indexOf('/', from);
+        if (to < 0) {
+            to = path.size();
+        }
+        storageItem = storageItem->m_children.value(path.mid(from, to - from));
+        from = to;
     }
     return storageItem;
 }
@@ -953,6 +1464,35 @@ void FSStoragePlugin::setSymLinkPolicy(FSStoragePlugin::SymLinkPolicy policy)
     }
 }
 
+/************************************************************
+ * bool FSStoragePlugin::symLinkAllowed
+ ***********************************************************/
+bool FSStoragePlugin::symLinkAllowed(const QString &storagePath, const QString &path, const QString &targetPath)
+{
+    if (targetPath.isEmpty()) {
+        MTP_LOG_WARNING("excluded broken symlink:" << path);
+        return false;
+    }
+    switch (symLinkPolicy()) {
+    case SymLinkPolicy::AllowAll:
+        break;
+    case SymLinkPolicy::AllowWithinStorage: {
+        // NB: storagePath is in canonical form
+        int prefixLen = storagePath.length();
+        if (targetPath.length() <= prefixLen || targetPath[prefixLen] != '/' || !targetPath.startsWith(storagePath)) {
+            MTP_LOG_INFO("excluded out-of-storage symlink:" << path);
+            return false;
+        }
+    }
+    break;
+    default:
+    case SymLinkPolicy::DenyAll:
+        MTP_LOG_INFO("excluded symlink:" << path);
+        return false;
+    }
+    return true;
+}
+
 /************************************************************
  * MTPrespCode FSStoragePlugin::addToStorage
  ***********************************************************/
@@ -962,60 +1502,56 @@ MTPResponseCode FSStoragePlugin::addToStorage(
     MTPObjectInfo *info,
     bool sendEvent,
     bool createIfNotExist,
-    ObjHandle handle)
+    ObjHandle handle,
+    const FSScanner::Entry *entry)
 {
     if (m_excludePaths.contains(path)) {
         return MTP_RESP_AccessDenied;
     }
 
-    // Handle symbolic link policy
-    QFileInfo pathInfo(path);
-    if (pathInfo.isSymLink()) {
-        QString targetPath(pathInfo.canonicalFilePath());
-        if (targetPath.isEmpty()) {
-            MTP_LOG_WARNING("excluded broken symlink:" << path);
+    // Entries listed from the parent directory have been checked already,
+    // otherwise stat the path once, applying the symbolic link policy.
+    FSScanner::Entry lookedUp;
+    if (!entry) {
+        switch (FSScanner::lookupEntry(m_storagePath, path, lookedUp)) {
+        case FSScanner::Denied:
             return MTP_RESP_AccessDenied;
-        }
-        switch (symLinkPolicy()) {
-        case SymLinkPolicy::AllowAll:
+        case FSScanner::NotFound:
+            lookedUp.isDir = false;
+            lookedUp.size = 0;
+            lookedUp.mtime = 0;
+            break;
+        case FSScanner::Found:
             break;
-        case SymLinkPolicy::AllowWithinStorage: {
-            // NB: m_storagePath is in canonical form
-            int prefixLen = m_storagePath.length();
-            if (targetPath.length() <= prefixLen || targetPath[prefixLen] != '/'
-                || !targetPath.startsWith(m_storagePath)) {
-                MTP_LOG_INFO("excluded out-of-storage symlink:" << path);
-                return MTP_RESP_AccessDenied;
-            }
-        }
-        break;
-        default:
-        case SymLinkPolicy::DenyAll:
-            MTP_LOG_INFO("excluded symlink:" << path);
-            return MTP_RESP_AccessDenied;
         }
+        entry = &lookedUp;
     }
 
     // If we already have StorageItem for given path...
-    if (m_pathNamesMap.contains(path)) {
+    StorageItem *existingItem = findStorageItemByPath(path);
+    if (existingItem) {
         if (storageItem) {
-            *storageItem = findStorageItemByPath(path);
+            *storageItem = existingItem;
         }
         return MTP_RESP_OK;
     }
 
     QScopedPointer<StorageItem> item(new StorageItem);
-    item->m_path = path;
-
-    QString parentPath(item->m_path.left(item->m_path.lastIndexOf('/')));
-    StorageItem *parentItem = findStorageItemByPath(parentPath);
-    linkChildStorageItem(item.data(), parentItem ? parentItem : m_root);
+    int separator = path.lastIndexOf('/');
+    if (path == m_storagePath) {
+        item->m_name = path;
+    } else {
+        item->m_name = path.mid(separator + 1);
+        StorageItem *parentItem = findStorageItemByPath(path.left(separator));
+        linkChildStorageItem(item.data(), parentItem ? parentItem : m_root);
+    }
 
     if (info) {
         item->m_objectInfo = new MTPObjectInfo(*info);
         item->m_objectInfo->mtpStorageId = storageId();
+        item->m_format = info->mtpObjectFormat;
     } else {
-        populateObjectInfo(item.data());
+        setObjectAttributes(item.data(), *entry);
     }
 
     // Root of the storage should have handle of 0.
@@ -1029,11 +1565,11 @@ MTPResponseCode FSStoragePlugin::addToStorage(
 
     MTPResponseCode result;
     // Create file or directory
-    switch (item->m_objectInfo->mtpObjectFormat) {
+    switch (item->m_format) {
     // Directory.
     case MTP_OBF_FORMAT_Association: {
         if (createIfNotExist) {
-            result = createDirectory(item->m_path);
+            result = createDirectory(item->path());
             if (result != MTP_RESP_OK) {
                 unlinkChildStorageItem(item.data());
                 return result;
@@ -1044,28 +1580,42 @@ MTPResponseCode FSStoragePlugin::addToStorage(
 
         addItemToMaps(item.data());
 
-        // Recursively add StorageItems for the contents of the directory.
-        QDir dir(item->m_path);
-        dir.setFilter(QDir::Files | QDir::Dirs | QDir::NoDotAndDotDot | QDir::Hidden);
-        QFileInfoList dirContents = dir.entryInfoList();
+        // Children find their parent by path, which starts from the root
+        if (path == m_storagePath) {
+            m_root = item.data();
+        }
+
+        // Recursively add StorageItems for the contents of the directory,
+        // reusing the attributes read while listing it.
+        FSScanner::Directory dir;
+        FSScanner::listDirectory(m_storagePath, m_excludePaths, path, dir);
+        m_listedMtimes.insert(item->m_handle, listedMtime(dir));
         int work = 0;
-        foreach (const QFileInfo &info, dirContents) {
+        foreach (const FSScanner::Entry &child, dir.entries) {
             if (work++ % 16 == 0) {
                 QCoreApplication::sendPostedEvents();
                 QCoreApplication::processEvents();
             }
-            addToStorage(info.absoluteFilePath(), 0, 0, sendEvent, createIfNotExist);
+            addToStorage(child.path, 0, 0, sendEvent, createIfNotExist, 0, &child);
         }
         break;
     }
     // File.
     default:
         if (createIfNotExist) {
-            result = createFile(item->m_path, info);
+            bool preallocated = false;
+            result = createFile(item->path(), info, preallocated);
             if (result != MTP_RESP_OK) {
                 unlinkChildStorageItem(item.data());
                 return result;
             }
+            // Without preallocation the file system does not know
+            // how much space the upload is going to take
+            if (!preallocated && info && info->mtpObjectCompressedSize) {
+                // Only one object at a time can wait for its data
+                releaseReservedSpace();
+                m_reservedSpace.insert(item->m_handle, info->mtpObjectCompressedSize);
+            }
         }
 
         addItemToMaps(item.data());
@@ -1080,9 +1630,11 @@ MTPResponseCode FSStoragePlugin::addToStorage(
         emit eventGenerated(MTP_EV_ObjectAdded, eventParams);
     }
 
-    // Dates from our device
-    item->m_objectInfo->mtpCaptureDate = getCreatedDate(item.data());
-    item->m_objectInfo->mtpModificationDate = getModifiedDate(item.data());
+    // Dates from our device, see getCreatedDate()
+    if (item->m_objectInfo) {
+        item->m_objectInfo->mtpModificationDate = getModifiedDate(item.data());
+        item->m_objectInfo->mtpCaptureDate = item->m_objectInfo->mtpModificationDate;
+    }
 
     if (storageItem) {
         *storageItem = item.take();
@@ -1095,20 +1647,103 @@ MTPResponseCode FSStoragePlugin::addToStorage(
 
 void FSStoragePlugin::addItemToMaps(StorageItem *item)
 {
-    // Path names map.
-    m_pathNamesMap[item->m_path] = item->m_handle;
-
     // Object handles map.
     m_objectHandlesMap[item->m_handle] = item;
+    updateHandleLists(item, true);
 
-    if (!m_puoidsMap.contains(item->m_path)) {
+    // The tree itself indexes the path names, the puoids are kept by path to persist them.
+    // Use the persistent puoid if there is one.
+    QString path = item->path();
+    if (!m_puoids.find(path, item->m_puoid)) {
         // Assign a new puoid
         requestNewPuoid(item->m_puoid);
-        // Add the puoid to the map.
-        m_puoidsMap[item->m_path] = item->m_puoid;
+        m_puoids.insert(path, item->m_puoid);
+    }
+}
+
+/************************************************************
+ * StorageItem* FSStoragePlugin::addScannedItem
+ ***********************************************************/
+StorageItem *FSStoragePlugin::addScannedItem(const FSScanner::Entry &entry, StorageItem *parentItem)
+{
+    // Inotify events may have added it already
+    StorageItem *item = findStorageItemByPath(entry.path);
+    if (item) {
+        return item;
+    }
+
+    item = new StorageItem;
+    item->m_name = parentItem ? entry.path.mid(entry.path.lastIndexOf('/') + 1) : entry.path;
+    linkChildStorageItem(item, parentItem);
+
+    setObjectAttributes(item, entry);
+
+    // Root of the storage should have handle of 0.
+    item->m_handle = parentItem ? requestNewObjectHandle() : 0;
+
+    if (entry.isDir) {
+        addWatchDescriptor(item);
+        addItemToMaps(item);
     } else {
-        // Use the persistent puoid.
-        item->m_puoid = m_puoidsMap[item->m_path];
+        addItemToMaps(item);
+        // Add this PUOID to the PUOID->Object Handles map
+        m_puoidToHandleMap[item->m_puoid] = item->m_handle;
+    }
+
+    return item;
+}
+
+/************************************************************
+ * void FSStoragePlugin::updateScannedItem
+ ***********************************************************/
+void FSStoragePlugin::updateScannedItem(const FSScanner::Entry &entry, StorageItem *parentItem)
+{
+    StorageItem *item = findStorageItemByPath(entry.path);
+    if (item && entry.isDir != (item->m_format == MTP_OBF_FORMAT_Association)) {
+        // Replaced by an object of the other kind
+        deleteItemHelper(item->m_handle, false, true);
+        item = 0;
+    }
+
+    QVector<quint32> eventParams;
+    if (!item) {
+        item = addScannedItem(entry, parentItem);
+        eventParams.append(item->m_handle);
+        emit eventGenerated(MTP_EV_ObjectAdded, eventParams);
+    } else if (!entry.isDir && item->m_handle != m_writeObjectHandle) {
+        MTPObjectInfo *info = item->m_objectInfo;
+        quint64 size = info ? info->mtpObjectCompressedSize : item->m_size;
+        time_t mtime = info ? datetime_to_time_t(info->mtpModificationDate) : item->m_mtime;
+        if (size != entry.size || mtime != entry.mtime) {
+            closeCachedObjectFd(item->m_handle);
+            setObjectAttributes(item, entry);
+            eventParams.append(item->m_handle);
+            emit eventGenerated(MTP_EV_ObjectInfoChanged, eventParams);
+        }
+    }
+}
+
+/************************************************************
+ * void FSStoragePlugin::removeVanishedItems
+ ***********************************************************/
+void FSStoragePlugin::removeVanishedItems(const FSScanner::Directory &dir, StorageItem *parentItem)
+{
+    QSet<QString> paths;
+    foreach (const FSScanner::Entry &entry, dir.entries) {
+        paths.insert(entry.path);
+    }
+
+    /* Items added after the directory was listed are not in the listing,
+     * make sure the rest are really gone before removing them. */
+    QVector<ObjHandle> vanished;
+    for (StorageItem *child = parentItem->m_firstChild; child; child = child->m_nextSibling) {
+        QString childPath = child->path();
+        if (!paths.contains(childPath) && !QFileInfo::exists(childPath)) {
+            vanished.append(child->m_handle);
+        }
+    }
+    foreach (ObjHandle handle, vanished) {
+        deleteItemHelper(handle, false, true);
     }
 }
 
@@ -1134,7 +1769,24 @@ MTPResponseCode FSStoragePlugin::addItem(ObjHandle &parentHandle, ObjHandle &han
         return MTP_RESP_InvalidParentObject;
     }
 
-    QString path = m_objectHandlesMap[info->mtpParentObject]->m_path + "/" + info->mtpFileName;
+    QString path = m_objectHandlesMap[info->mtpParentObject]->path() + "/" + info->mtpFileName;
+
+    // Refuse objects that can't fit before creating anything
+    if (MTP_OBF_FORMAT_Association != info->mtpObjectFormat && info->mtpObjectCompressedSize) {
+        // An existing file gets overwritten, its space is reused
+        quint64 replacedSize = 0;
+        StorageItem *existingItem = findStorageItemByPath(path);
+        if (existingItem && MTP_OBF_FORMAT_Association != existingItem->m_format) {
+            replacedSize = existingItem->m_objectInfo ? existingItem->m_objectInfo->mtpObjectCompressedSize
+                                                      : existingItem->m_size;
+        }
+        MTPStorageInfo spaceInfo;
+        if (storageInfo(spaceInfo) == MTP_RESP_OK
+            && spaceInfo.freeSpace + replacedSize < info->mtpObjectCompressedSize) {
+            MTP_LOG_WARNING("no space for" << path << "size:" << info->mtpObjectCompressedSize);
+            return MTP_RESP_StoreFull;
+        }
+    }
 
     // Add the object ( file/dir ) to the filesystem storage.
     response = addToStorage(path, &storageItem, info, false, true);
@@ -1170,7 +1822,7 @@ MTPResponseCode FSStoragePlugin::copyHandle(StoragePlugin *sourceStorage, ObjHan
     MTPObjectInfo newInfo(*info);
     newInfo.mtpParentObject = parent;
 
-    QString path = m_objectHandlesMap[newInfo.mtpParentObject]->m_path + "/" + newInfo.mtpFileName;
+    QString path = m_objectHandlesMap[newInfo.mtpParentObject]->path() + "/" + newInfo.mtpFileName;
 
     result = addToStorage(path, 0, &newInfo, false, true, source);
     if (result != MTP_RESP_OK) {
@@ -1192,6 +1844,9 @@ MTPResponseCode FSStoragePlugin::copyHandle(StoragePlugin *sourceStorage, ObjHan
     } else {
         // Source and destination handles are the same, though each
         // in a different storage.
+        FSStoragePlugin *sourceFsStorage = dynamic_cast<FSStoragePlugin *>(sourceStorage);
+        if (sourceFsStorage)
+            return sourceFsStorage->copyFileData(source, this, source);
         return copyData(sourceStorage, source, this, source);
     }
 }
@@ -1202,24 +1857,30 @@ MTPResponseCode FSStoragePlugin::copyHandle(StoragePlugin *sourceStorage, ObjHan
 MTPResponseCode FSStoragePlugin::deleteItem(const ObjHandle &handle, const MTPObjFormatCode &formatCode)
 {
     // If handle == 0xFFFFFFFF, that means delete all objects that can be deleted ( this could be filered by fmtCode )
+    completeEnumeration();
     bool deletedSome = false;
     bool failedSome = false;
     StorageItem *storageItem = 0;
     MTPResponseCode response = MTP_RESP_GeneralError;
 
     if (0xFFFFFFFF == handle) {
-        // deleteItemHelper modifies m_objectHandlesMap so loop over a copy
-        QHash<ObjHandle, StorageItem *> objectHandles = m_objectHandlesMap;
-        for (QHash<ObjHandle, StorageItem *>::const_iterator i = objectHandles.constBegin();
-             i != objectHandles.constEnd();
+        // deleteItemHelper modifies m_objectHandlesMap so loop over the handles
+        QVector<ObjHandle> objectHandles;
+        objectHandles.reserve(m_objectHandlesMap.size());
+        for (QHash<ObjHandle, StorageItem *>::const_iterator i = m_objectHandlesMap.constBegin();
+             i != m_objectHandlesMap.constEnd();
              ++i) {
+            objectHandles.append(i.key());
+        }
+        foreach (ObjHandle objectHandle, objectHandles) {
             if (formatCode && MTP_OBF_FORMAT_Undefined != formatCode) {
-                storageItem = i.value();
-                if (storageItem->m_objectInfo && storageItem->m_objectInfo->mtpObjectFormat == formatCode) {
-                    response = deleteItemHelper(i.key());
+                // Deleted along with a folder earlier in the loop
+                storageItem = m_objectHandlesMap.value(objectHandle);
+                if (storageItem && storageItem->m_format == formatCode) {
+                    response = deleteItemHelper(objectHandle);
                 }
             } else {
-                response = deleteItemHelper(i.key());
+                response = deleteItemHelper(objectHandle);
             }
             if (MTP_RESP_OK == response) {
                 deletedSome = true;
@@ -1271,14 +1932,14 @@ MTPResponseCode FSStoragePlugin::deleteItemHelper(ObjHandle handle, bool removeP
 
     // If this is a file or an empty dir, just delete this item.
     if (!storageItem->m_firstChild) {
-        if (removePhysically && MTP_OBF_FORMAT_Association == storageItem->m_objectInfo->mtpObjectFormat
+        if (removePhysically && MTP_OBF_FORMAT_Association == storageItem->m_format
             && 0 != storageItem->m_handle) {
-            QDir dir(storageItem->m_parent->m_path);
-            if (!dir.rmdir(storageItem->m_path)) {
+            QDir dir(storageItem->m_parent->path());
+            if (!dir.rmdir(storageItem->path())) {
                 return MTP_RESP_GeneralError;
             }
         } else if (removePhysically) {
-            QFile file(storageItem->m_path);
+            QFile file(storageItem->path());
             if (!file.remove()) {
                 return MTP_RESP_GeneralError;
             }
@@ -1322,10 +1983,24 @@ MTPResponseCode FSStoragePlugin::removeFromStorage(ObjHandle handle, bool sendEv
             // Remove watch on the path and then remove the wd from the map
             removeWatchDescriptor(storageItem);
         }
+        closeCachedObjectFd(handle);
+        m_reservedSpace.remove(handle);
+        setDirectoryScanned(handle);
+        m_listedMtimes.remove(handle);
         m_objectHandlesMap.remove(handle);
-        m_pathNamesMap.remove(storageItem->m_path);
+        updateHandleLists(storageItem, false);
         unlinkChildStorageItem(storageItem);
         delete storageItem;
+
+        // Listings of the children go with the association
+        QHash<quint64, QVector<ObjHandle> >::iterator list = m_handleLists.begin();
+        while (list != m_handleLists.end()) {
+            if (list.key() >> 16 == handle) {
+                list = m_handleLists.erase(list);
+            } else {
+                ++list;
+            }
+        }
     }
 
     if (sendEvent) {
@@ -1343,30 +2018,33 @@ MTPResponseCode FSStoragePlugin::removeFromStorage(ObjHandle handle, bool sendEv
 MTPResponseCode FSStoragePlugin::getObjectHandles(
     const MTPObjFormatCode &formatCode, const quint32 &associationHandle, QVector<ObjHandle> &objectHandles) const
 {
+    /* Scanning what is asked for does not change the storage contents,
+     * they just have not been looked at yet. */
+    FSStoragePlugin *self = const_cast<FSStoragePlugin *>(this);
+
+    // Initiators tend to ask again after every event, answer from the list kept up to date
+    quint64 key = handleListKey(associationHandle, formatCode);
+    QHash<quint64, QVector<ObjHandle> >::const_iterator cached = m_handleLists.constFind(key);
+    if (cached != m_handleLists.constEnd()) {
+        appendHandles(objectHandles, cached.value());
+        return MTP_RESP_OK;
+    }
+
+    QVector<ObjHandle> handles;
     switch (associationHandle) {
     // Count of all objects in this storage.
     case 0x00000000:
-        if (!formatCode) {
-            for (QHash<ObjHandle, StorageItem *>::const_iterator i = m_objectHandlesMap.constBegin();
-                 i != m_objectHandlesMap.constEnd();
-                 ++i) {
-                // Don't enumerate the root.
-                if (0 == i.key()) {
-                    continue;
-                }
-                objectHandles.append(i.key());
+        self->completeEnumeration();
+        handles.reserve(m_objectHandlesMap.size());
+        for (QHash<ObjHandle, StorageItem *>::const_iterator i = m_objectHandlesMap.constBegin();
+             i != m_objectHandlesMap.constEnd();
+             ++i) {
+            // Don't enumerate the root.
+            if (0 == i.key()) {
+                continue;
             }
-        } else {
-            for (QHash<ObjHandle, StorageItem *>::const_iterator i = m_objectHandlesMap.constBegin();
-                 i != m_objectHandlesMap.constEnd();
-                 ++i) {
-                // Don't enumerate the root.
-                if (0 == i.key()) {
-                    continue;
-                }
-                if (i.value()->m_objectInfo && formatCode == i.value()->m_objectInfo->mtpObjectFormat) {
-                    objectHandles.append(i.key());
-                }
+            if (handleListMatches(formatCode, i.value()->m_format, true)) {
+                handles.append(i.key());
             }
         }
         break;
@@ -1374,12 +2052,11 @@ MTPResponseCode FSStoragePlugin::getObjectHandles(
     // Count of all objects present in the root storage.
     case 0xFFFFFFFF:
         if (m_root) {
+            self->ensureDirectoryScanned(m_root);
             StorageItem *storageItem = m_root->m_firstChild;
             while (storageItem) {
-                if (!formatCode
-                    || (MTP_OBF_FORMAT_Undefined != formatCode && storageItem->m_objectInfo
-                        && formatCode == storageItem->m_objectInfo->mtpObjectFormat)) {
-                    objectHandles.append(storageItem->m_handle);
+                if (handleListMatches(formatCode, storageItem->m_format, false)) {
+                    handles.append(storageItem->m_handle);
                 }
                 storageItem = storageItem->m_nextSibling;
             }
@@ -1397,24 +2074,69 @@ MTPResponseCode FSStoragePlugin::getObjectHandles(
         StorageItem *parentItem = m_objectHandlesMap[associationHandle];
         if (parentItem) {
             //Check if this is an association
-            if (!parentItem->m_objectInfo || MTP_OBF_FORMAT_Association != parentItem->m_objectInfo->mtpObjectFormat) {
+            if (MTP_OBF_FORMAT_Association != parentItem->m_format) {
                 return MTP_RESP_InvalidParentObject;
             }
+            self->ensureDirectoryScanned(parentItem);
             StorageItem *storageItem = parentItem->m_firstChild;
             while (storageItem) {
-                if ((!formatCode)
-                    || (MTP_OBF_FORMAT_Undefined != formatCode && storageItem->m_objectInfo
-                        && formatCode == storageItem->m_objectInfo->mtpObjectFormat)) {
-                    objectHandles.append(storageItem->m_handle);
+                if (handleListMatches(formatCode, storageItem->m_format, false)) {
+                    handles.append(storageItem->m_handle);
                 }
                 storageItem = storageItem->m_nextSibling;
             }
         } else {
             return MTP_RESP_InvalidParentObject;
         }
-        break;
+        break;
+    }
+
+    // Kept sorted from here on by updateHandleLists()
+    std::sort(handles.begin(), handles.end());
+    if (m_handleLists.size() >= MAX_HANDLE_LISTS) {
+        self->m_handleLists.erase(self->m_handleLists.begin());
+    }
+    self->m_handleLists.insert(key, handles);
+
+    appendHandles(objectHandles, handles);
+    return MTP_RESP_OK;
+}
+
+void FSStoragePlugin::appendHandles(QVector<ObjHandle> &objectHandles, const QVector<ObjHandle> &handles)
+{
+    // An empty collection can share the list instead of copying it
+    if (objectHandles.isEmpty()) {
+        objectHandles = handles;
+    } else {
+        objectHandles += handles;
+    }
+}
+
+void FSStoragePlugin::updateHandleLists(const StorageItem *item, bool insert)
+{
+    if (m_handleLists.isEmpty() || !item->m_parent) {
+        return;
+    }
+
+    quint32 associationHandle = item->m_parent == m_root ? 0xFFFFFFFF : item->m_parent->m_handle;
+    QHash<quint64, QVector<ObjHandle> >::iterator list;
+    for (list = m_handleLists.begin(); list != m_handleLists.end(); ++list) {
+        quint32 listAssociation = list.key() >> 16;
+        MTPObjFormatCode listFormat = list.key() & 0xFFFF;
+        if ((listAssociation && listAssociation != associationHandle)
+            || !handleListMatches(listFormat, item->m_format, !listAssociation)) {
+            continue;
+        }
+
+        QVector<ObjHandle> &handles = list.value();
+        QVector<ObjHandle>::iterator position = std::lower_bound(handles.begin(), handles.end(), item->m_handle);
+        bool listed = position != handles.end() && *position == item->m_handle;
+        if (insert && !listed) {
+            handles.insert(position, item->m_handle);
+        } else if (!insert && listed) {
+            handles.erase(position);
+        }
     }
-    return MTP_RESP_OK;
 }
 
 /************************************************************
@@ -1440,11 +2162,53 @@ MTPResponseCode FSStoragePlugin::storageInfo(MTPStorageInfo &info)
         responseCode = MTP_RESP_GeneralError;
     } else {
         info.maxCapacity = m_storageInfo.maxCapacity = (quint64) stat.f_blocks * stat.f_bsize;
-        info.freeSpace = m_storageInfo.freeSpace = (quint64) stat.f_bavail * stat.f_bsize;
+        quint64 freeSpace = (quint64) stat.f_bavail * stat.f_bsize;
+        quint64 reserved = reservedSpace();
+        info.freeSpace = m_storageInfo.freeSpace = freeSpace > reserved ? freeSpace - reserved : 0;
     }
     return responseCode;
 }
 
+/************************************************************
+ * void FSStoragePlugin::releaseReservedSpace
+ ***********************************************************/
+void FSStoragePlugin::releaseReservedSpace()
+{
+    // The upload in progress keeps its reservation until it finishes
+    QHash<ObjHandle, quint64>::iterator i = m_reservedSpace.begin();
+    while (i != m_reservedSpace.end()) {
+        if (i.key() == m_writeObjectHandle && m_dataFile) {
+            ++i;
+        } else {
+            i = m_reservedSpace.erase(i);
+        }
+    }
+}
+
+void FSStoragePlugin::releaseReservedSpace(ObjHandle handle)
+{
+    m_reservedSpace.remove(handle);
+}
+
+/************************************************************
+ * quint64 FSStoragePlugin::reservedSpace
+ ***********************************************************/
+quint64 FSStoragePlugin::reservedSpace() const
+{
+    quint64 reserved = 0;
+    for (QHash<ObjHandle, quint64>::const_iterator i = m_reservedSpace.constBegin(); i != m_reservedSpace.constEnd();
+         ++i) {
+        quint64 size = i.value();
+        // Data of the ongoing upload already shows in the file system
+        if (i.key() == m_writeObjectHandle && m_dataFile) {
+            quint64 written = m_dataWriter.offset();
+            size = written < size ? size - written : 0;
+        }
+        reserved += size;
+    }
+    return reserved;
+}
+
 /************************************************************
  * MTPResponseCode FSStoragePlugin::copyObject
  ***********************************************************/
@@ -1455,6 +2219,9 @@ MTPResponseCode FSStoragePlugin::copyObject(
     ObjHandle &copiedObjectHandle,
     quint32 recursionCounter /*= 0*/)
 {
+    // Before looking anything up, events are handled while waiting
+    completeEnumeration();
+
     if (!checkHandle(handle)) {
         return MTP_RESP_InvalidObjectHandle;
     }
@@ -1468,12 +2235,10 @@ MTPResponseCode FSStoragePlugin::copyObject(
     if (!storageItem) {
         return MTP_RESP_GeneralError;
     }
-    if (!m_objectHandlesMap[handle]->m_objectInfo) {
-        return MTP_RESP_InvalidObjectHandle;
-    }
 
     // Get the source object's objectinfo dataset.
-    MTPObjectInfo objectInfo = *m_objectHandlesMap[handle]->m_objectInfo;
+    populateObjectInfo(storageItem);
+    MTPObjectInfo objectInfo = *storageItem->m_objectInfo;
 
     MTPStorageInfo storageInfo;
     if (destinationStorage->storageInfo(storageInfo) != MTP_RESP_OK) {
@@ -1546,7 +2311,10 @@ MTPResponseCode FSStoragePlugin::copyObject(
     }
     // this is a file, copy the data
     else {
-        response = copyData(this, handle, destinationStorage, copiedObjectHandle);
+        if (destinationFsStorage)
+            response = copyFileData(handle, destinationFsStorage, copiedObjectHandle);
+        else
+            response = copyData(this, handle, destinationStorage, copiedObjectHandle);
         if (response != MTP_RESP_OK) {
             return response;
         }
@@ -1560,23 +2328,114 @@ MTPResponseCode FSStoragePlugin::copyObject(
 }
 
 /************************************************************
- * void FSStoragePlugin::adjustMovedItemsPath
+ * MTPResponseCode FSStoragePlugin::copyFileData
  ***********************************************************/
-void FSStoragePlugin::adjustMovedItemsPath(QString newAncestorPath, StorageItem *movedItem)
+MTPResponseCode FSStoragePlugin::copyFileData(
+    ObjHandle source, FSStoragePlugin *destinationStorage, ObjHandle destination)
 {
-    if (!movedItem) {
-        return;
+    StorageItem *sourceItem = m_objectHandlesMap.value(source);
+    StorageItem *destinationItem = destinationStorage->m_objectHandlesMap.value(destination);
+    if (!sourceItem || !destinationItem) {
+        return MTP_RESP_InvalidObjectHandle;
+    }
+
+    QByteArray sourcePath = sourceItem->path().toUtf8();
+    QByteArray destinationPath = destinationItem->path().toUtf8();
+    int in = open(sourcePath.constData(), O_RDONLY | O_CLOEXEC);
+    int out = open(destinationPath.constData(), O_WRONLY | O_CLOEXEC);
+    struct stat st;
+
+    if (in == -1 || out == -1 || fstat(in, &st) == -1) {
+        MTP_LOG_WARNING("can't copy" << sourceItem->path() << "to" << destinationItem->path() << strerror(errno));
+        if (in != -1)
+            close(in);
+        if (out != -1)
+            close(out);
+        return copyData(this, source, destinationStorage, destination);
+    }
+
+    MTPResponseCode result = MTP_RESP_OK;
+    bool fallback = false;
+    quint64 copied = 0;
+    destinationStorage->resetStoreFullReport();
+
+#ifdef FICLONE
+    // Reflinking shares the data blocks and takes no time at all
+    if (ioctl(out, FICLONE, in) == 0) {
+        copied = st.st_size;
+    } else
+#endif
+    {
+        loff_t inOffset = 0;
+        loff_t outOffset = 0;
+        bool txCancelled = false;
+
+        while (copied < quint64(st.st_size)) {
+            quint64 len = qMin(quint64(st.st_size) - copied, COPY_CHUNK_SIZE);
+            ssize_t rc = copy_file_range(in, &inOffset, out, &outOffset, len, 0);
+            if (rc == -1) {
+                int err = errno;
+                if (err == EINTR)
+                    continue;
+                // Not supported between these files, copy via user space
+                if (!copied && (err == EXDEV || err == EINVAL || err == ENOSYS || err == EOPNOTSUPP)) {
+                    fallback = true;
+                } else {
+                    MTP_LOG_WARNING("copy to" << destinationItem->path() << "failed:" << strerror(err));
+                    result = destinationStorage->writeErrorResponse(err);
+                }
+                break;
+            }
+            if (rc == 0) {
+                // The source got truncated under us, don't leave a partial copy
+                MTP_LOG_WARNING("copy to" << destinationItem->path() << "ended early at" << copied);
+                close(in);
+                close(out);
+                destinationStorage->deleteItem(destination, MTP_OBF_FORMAT_Undefined);
+                return MTP_RESP_GeneralError;
+            }
+            copied += rc;
+
+            emit checkTransportEvents(txCancelled);
+            if (txCancelled) {
+                MTP_LOG_WARNING("CopyObject cancelled, aborting file copy...");
+                close(in);
+                close(out);
+                destinationStorage->deleteItem(destination, MTP_OBF_FORMAT_Undefined);
+                return MTP_RESP_GeneralError;
+            }
+        }
+    }
+
+    // The destination was preallocated for the expected size
+    if (result == MTP_RESP_OK && !fallback && ftruncate(out, copied) == -1) {
+        MTP_LOG_WARNING("failed to truncate file:" << destinationItem->path() << " err:" << strerror(errno));
     }
 
-    m_pathNamesMap.remove(movedItem->m_path);
-    QString destinationPath = newAncestorPath + "/" + movedItem->m_objectInfo->mtpFileName;
-    movedItem->m_path = destinationPath;
-    m_pathNamesMap[movedItem->m_path] = movedItem->m_handle;
-    StorageItem *itr = movedItem->m_firstChild;
-    while (itr) {
-        adjustMovedItemsPath(movedItem->m_path, itr);
-        itr = itr->m_nextSibling;
+    close(in);
+    close(out);
+
+    if (fallback) {
+        return copyData(this, source, destinationStorage, destination);
+    }
+    if (result != MTP_RESP_OK) {
+        // Don't leave a partial copy registered either
+        destinationStorage->deleteItem(destination, MTP_OBF_FORMAT_Undefined);
+        return result;
     }
+
+    /* Writing changed the modify time -> put it back to the
+     * cached/expected value, like after writeData(). */
+    destinationStorage->populateObjectInfo(destinationItem);
+    MTPObjectInfo *info = destinationItem->m_objectInfo;
+    time_t t = datetime_to_time_t(info->mtpModificationDate);
+    file_set_mtime(destinationItem->path(), t);
+    info->mtpObjectCompressedSize = copied;
+    info->mtpModificationDate = destinationStorage->getModifiedDate(destinationItem);
+    info->mtpCaptureDate = info->mtpModificationDate;
+    destinationStorage->releaseReservedSpace(destination);
+
+    return result;
 }
 
 /************************************************************
@@ -1585,6 +2444,13 @@ void FSStoragePlugin::adjustMovedItemsPath(QString newAncestorPath, StorageItem
 MTPResponseCode FSStoragePlugin::moveObject(
     const ObjHandle &handle, const ObjHandle &parentHandle, StoragePlugin *destinationStorage, bool movePhysically)
 {
+    /* Items under a folder moved here must be known before its path
+     * changes. One moved on the file system has a new path already, see
+     * rescanMovedDirectory(). */
+    if (movePhysically || destinationStorage != this) {
+        completeEnumeration();
+    }
+
     if (!checkHandle(handle)) {
         return MTP_RESP_InvalidObjectHandle;
     }
@@ -1607,46 +2473,40 @@ MTPResponseCode FSStoragePlugin::moveObject(
         return MTP_RESP_GeneralError;
     }
 
-    QString destinationPath = parentItem->m_path + "/" + storageItem->m_objectInfo->mtpFileName;
+    QString destinationPath = parentItem->path() + "/" + storageItem->m_name;
 
     // If this is a directory already exists, don't overwrite it.
-    if (MTP_OBF_FORMAT_Association == storageItem->m_objectInfo->mtpObjectFormat) {
-        if (m_pathNamesMap.contains(destinationPath)) {
+    if (MTP_OBF_FORMAT_Association == storageItem->m_format) {
+        if (parentItem->m_children.contains(storageItem->m_name)) {
             return MTP_RESP_InvalidParentObject;
         }
     }
 
     // Invalidate the watch descriptor for this item and it's children, as their paths will change.
     removeWatchDescriptorRecursively(storageItem);
+    closeCachedObjectFd(handle);
 
     // Do the move.
     if (movePhysically) {
         QDir dir;
-        if (!dir.rename(storageItem->m_path, destinationPath)) {
+        if (!dir.rename(storageItem->path(), destinationPath)) {
             // Move failed; restore original watch descriptors.
             addWatchDescriptorRecursively(storageItem);
             return MTP_RESP_InvalidParentObject;
         }
     }
-    m_pathNamesMap.remove(storageItem->m_path);
-    m_pathNamesMap[destinationPath] = handle;
 
-    // Unlink this item from its current parent.
+    /* Paths are composed from the parent links, relinking the item moves
+     * its whole subtree along with it. */
+    updateHandleLists(storageItem, false);
     unlinkChildStorageItem(storageItem);
-
-    StorageItem *itr = storageItem->m_firstChild;
-    while (itr) {
-        adjustMovedItemsPath(destinationPath, itr);
-        itr = itr->m_nextSibling;
-    }
-
-    // link it to the new parent
     linkChildStorageItem(storageItem, parentItem);
-    //storageItem->m_nextSibling = 0;
+    updateHandleLists(storageItem, true);
 
-    // update it's path and parent object.
-    storageItem->m_path = destinationPath;
-    storageItem->m_objectInfo->mtpParentObject = parentHandle;
+    // update it's parent object.
+    if (storageItem->m_objectInfo) {
+        storageItem->m_objectInfo->mtpParentObject = parentHandle;
+    }
     // create new watch descriptors for the moved item.
     addWatchDescriptorRecursively(storageItem);
     return MTP_RESP_OK;
@@ -1665,6 +2525,15 @@ MTPResponseCode FSStoragePlugin::getObjectInfo(const ObjHandle &handle, const MT
         return MTP_RESP_GeneralError;
     }
 
+    objectInfo = objectInfoForInitiator(storageItem);
+    return MTP_RESP_OK;
+}
+
+/************************************************************
+ * const MTPObjectInfo *FSStoragePlugin::objectInfoForInitiator
+ ***********************************************************/
+const MTPObjectInfo *FSStoragePlugin::objectInfoForInitiator(StorageItem *storageItem)
+{
     /* Assumption: All mtp queries that the host can use to
      * "show interest in object" lead to getObjectInfo()
      * method call -> Flag the object so that any future
@@ -1672,9 +2541,11 @@ MTPResponseCode FSStoragePlugin::getObjectInfo(const ObjHandle &handle, const MT
      * appropriate notification event. */
     storageItem->setEventsEnabled(true);
 
+    // Listing the folder usually comes next
+    ensureDirectoryScanned(storageItem);
+
     populateObjectInfo(storageItem);
-    objectInfo = storageItem->m_objectInfo;
-    return MTP_RESP_OK;
+    return storageItem->m_objectInfo;
 }
 
 /************************************************************
@@ -1690,21 +2561,28 @@ void FSStoragePlugin::populateObjectInfo(StorageItem *storageItem)
         return;
     }
 
+    // Attributes from the index snapshot are checked when first needed
+    if (storageItem->m_attributesUnverified) {
+        readObjectAttributes(storageItem);
+    }
+
     // Populate object info for this item.
     storageItem->m_objectInfo = new MTPObjectInfo;
 
     // storage id.
     storageItem->m_objectInfo->mtpStorageId = m_storageId;
     // file name
-    QString name = storageItem->m_path;
-    name = name.remove(0, storageItem->m_path.lastIndexOf("/") + 1);
+    QString name = storageItem->m_name;
+    if (!storageItem->m_parent) {
+        name.remove(0, name.lastIndexOf('/') + 1);
+    }
     storageItem->m_objectInfo->mtpFileName = name;
     // object format.
-    storageItem->m_objectInfo->mtpObjectFormat = getObjectFormatByExtension(storageItem);
+    storageItem->m_objectInfo->mtpObjectFormat = storageItem->m_format;
     // protection status.
     storageItem->m_objectInfo->mtpProtectionStatus = getMTPProtectionStatus(storageItem);
     // object size.
-    storageItem->m_objectInfo->mtpObjectCompressedSize = getObjectSize(storageItem);
+    storageItem->m_objectInfo->mtpObjectCompressedSize = storageItem->m_size;
     // thumb size
     storageItem->m_objectInfo->mtpThumbCompressedSize = getThumbCompressedSize(storageItem);
     // thumb format
@@ -1727,33 +2605,57 @@ void FSStoragePlugin::populateObjectInfo(StorageItem *storageItem)
     storageItem->m_objectInfo->mtpAssociationDescription = getAssociationDescription(storageItem);
     // sequence number
     storageItem->m_objectInfo->mtpSequenceNumber = getSequenceNumber(storageItem);
-    // date created
-    storageItem->m_objectInfo->mtpCaptureDate = getCreatedDate(storageItem);
     // date modified
-    storageItem->m_objectInfo->mtpModificationDate = getModifiedDate(storageItem);
+    storageItem->m_objectInfo->mtpModificationDate = datetime_from_time_t(storageItem->m_mtime);
+    // date created, see getCreatedDate()
+    storageItem->m_objectInfo->mtpCaptureDate = storageItem->m_objectInfo->mtpModificationDate;
 
     // keywords.
     storageItem->m_objectInfo->mtpKeywords = getKeywords(storageItem);
 }
 
 /************************************************************
- * quint16 FSStoragePlugin::getObjectFormatByExtension
+ * void FSStoragePlugin::setObjectAttributes
  ***********************************************************/
-quint16 FSStoragePlugin::getObjectFormatByExtension(StorageItem *storageItem)
+void FSStoragePlugin::setObjectAttributes(StorageItem *storageItem, const FSScanner::Entry &entry)
 {
-    // TODO Fetch from tracker or determine from the file.
-    quint16 format = MTP_OBF_FORMAT_Undefined;
+    quint16 format = MTP_OBF_FORMAT_Association;
+    if (!entry.isDir) {
+        QString ext = storageItem->m_name.section('.', -1).toLower();
+        format = m_formatByExtTable.value(ext, MTP_OBF_FORMAT_Undefined);
+    }
 
-    QFileInfo item(storageItem->m_path);
-    if (item.isDir()) {
-        format = MTP_OBF_FORMAT_Association;
-    } else { //file
-        QString ext = storageItem->m_path.section('.', -1).toLower();
-        if (m_formatByExtTable.contains(ext)) {
-            format = m_formatByExtTable[ext];
-        }
+    // The format decides which filtered handle lists the object is in
+    bool relist = format != storageItem->m_format
+        && m_objectHandlesMap.value(storageItem->m_handle) == storageItem;
+    if (relist) {
+        updateHandleLists(storageItem, false);
     }
-    return format;
+    storageItem->m_format = format;
+    if (relist) {
+        updateHandleLists(storageItem, true);
+    }
+    storageItem->m_size = entry.isDir ? 0 : entry.size;
+    storageItem->m_mtime = entry.mtime;
+    storageItem->m_attributesUnverified = false;
+
+    // Built again from the new attributes when asked for
+    delete storageItem->m_objectInfo;
+    storageItem->m_objectInfo = 0;
+}
+
+/************************************************************
+ * void FSStoragePlugin::readObjectAttributes
+ ***********************************************************/
+void FSStoragePlugin::readObjectAttributes(StorageItem *storageItem)
+{
+    FSScanner::Entry entry;
+    if (!FSScanner::statEntry(storageItem->path(), entry)) {
+        entry.isDir = false;
+        entry.size = 0;
+        entry.mtime = 0;
+    }
+    setObjectAttributes(storageItem, entry);
 }
 
 /************************************************************
@@ -1773,7 +2675,7 @@ quint64 FSStoragePlugin::getObjectSize(StorageItem *storageItem)
     if (!storageItem) {
         return 0;
     }
-    QFileInfo item(storageItem->m_path);
+    QFileInfo item(storageItem->path());
     if (item.isFile()) {
         return item.size();
     }
@@ -1801,7 +2703,7 @@ bool FSStoragePlugin::isThumbnailableImage(StorageItem *storageItem)
 
     if (storageItem) {
         for (size_t i = 0; extension[i]; ++i) {
-            if (storageItem->m_path.endsWith(extension[i]))
+            if (storageItem->m_name.endsWith(extension[i]))
                 return true;
         }
     }
@@ -1853,7 +2755,7 @@ quint32 FSStoragePlugin::getThumbCompressedSize(StorageItem *storageItem)
     quint32 size = 0;
     if (isThumbnailableImage(storageItem)) {
         QString thumbPath = m_thumbnailer->requestThumbnail(
-            storageItem->m_path, m_imageMimeTable.value(storageItem->m_objectInfo->mtpObjectFormat));
+            storageItem->path(), m_imageMimeTable.value(storageItem->m_format));
         if (!thumbPath.isEmpty()) {
             size = QFileInfo(thumbPath).size();
         }
@@ -1884,8 +2786,7 @@ quint32 FSStoragePlugin::getImagePixelHeight(StorageItem * /*storageItem*/)
  ***********************************************************/
 quint16 FSStoragePlugin::getAssociationType(StorageItem *storageItem)
 {
-    QFileInfo item(storageItem->m_path);
-    if (item.isDir()) {
+    if (storageItem->m_format == MTP_OBF_FORMAT_Association) {
         // GenFolder is the only type used in MTP.
         // The others may be used for PTP compatibility but are not required.
         return MTP_ASSOCIATION_TYPE_GenFolder;
@@ -1940,7 +2841,7 @@ QString FSStoragePlugin::getCreatedDate(StorageItem *storageItem)
  ***********************************************************/
 QString FSStoragePlugin::getModifiedDate(StorageItem *storageItem)
 {
-    time_t t = file_get_mtime(storageItem->m_path);
+    time_t t = file_get_mtime(storageItem->path());
     return datetime_from_time_t(t);
 }
 
@@ -1963,46 +2864,143 @@ MTPResponseCode FSStoragePlugin::readData(
 
     MTPResponseCode resp = MTP_RESP_OK;
     StorageItem *storageItem = nullptr;
+    int fd = -1;
 
     if (!readBuffer) {
         resp = MTP_RESP_GeneralError;
     } else if (!(storageItem = m_objectHandlesMap.value(handle))) {
         resp = MTP_RESP_InvalidObjectHandle;
-    } else {
-        QFile file(storageItem->m_path);
-        if (!file.open(QIODevice::ReadOnly)) {
-            MTP_LOG_WARNING("failed to open:" << file.fileName());
-            resp = MTP_RESP_AccessDenied;
-        } else if (quint64(file.size()) < (readOffset + readBufferLen)) {
-            MTP_LOG_WARNING("file is too small:" << file.fileName());
-            resp = MTP_RESP_GeneralError;
-        } else if (!file.seek(readOffset)) {
-            MTP_LOG_WARNING("failed to seek:" << file.fileName());
-            resp = MTP_RESP_GeneralError;
-        } else
-            while (resp == MTP_RESP_OK && readBufferLen > 0) {
-                qint64 rc = file.read(readBuffer, readBufferLen);
-                if (rc == -1) {
-                    MTP_LOG_WARNING("failed to read:" << file.fileName());
-                    resp = MTP_RESP_GeneralError;
-                } else if (rc == 0) {
-                    MTP_LOG_WARNING("unexpected eof:" << file.fileName());
-                    resp = MTP_RESP_GeneralError;
-                } else {
-                    readBuffer += rc;
-                    readBufferLen -= quint32(rc);
-                }
+    } else if ((fd = cachedObjectFd(storageItem)) == -1) {
+        resp = MTP_RESP_AccessDenied;
+    } else
+        while (resp == MTP_RESP_OK && readBufferLen > 0) {
+            ssize_t rc = pread(fd, readBuffer, readBufferLen, readOffset);
+            if (rc == -1) {
+                if (errno == EINTR)
+                    continue;
+                MTP_LOG_WARNING("failed to read:" << storageItem->path() << strerror(errno));
+                resp = MTP_RESP_GeneralError;
+            } else if (rc == 0) {
+                MTP_LOG_WARNING("unexpected eof:" << storageItem->path());
+                resp = MTP_RESP_GeneralError;
+            } else {
+                readBuffer += rc;
+                readBufferLen -= quint32(rc);
+                readOffset += rc;
             }
-    }
-
-    // FIXME: Repeated opening and closing of the file will happen when we do segmented reads.
-    // This must be avoided
+        }
 
     if (resp != MTP_RESP_OK)
         MTP_LOG_WARNING("read from handle:" << handle << "failed:" << mtp_code_repr(resp));
     return resp;
 }
 
+/************************************************************
+ * int FSStoragePlugin::cachedObjectFd
+ ***********************************************************/
+int FSStoragePlugin::cachedObjectFd(StorageItem *storageItem)
+{
+    int fd = m_readFds.value(storageItem->m_handle, -1);
+    if (fd != -1)
+        return fd;
+
+    if (storageItem->m_format == MTP_OBF_FORMAT_Association)
+        return -1;
+
+    QByteArray utf8 = storageItem->path().toUtf8();
+    fd = open(utf8.constData(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        MTP_LOG_WARNING("failed to open:" << storageItem->path() << strerror(errno));
+        return -1;
+    }
+
+    // Entries are normally released at the end of a transaction, so
+    // anything still cached here is left over and any of it can go
+    if (m_readFds.count() >= MAX_CACHED_READ_FDS) {
+        QHash<ObjHandle, int>::iterator stale = m_readFds.begin();
+        close(stale.value());
+        m_readFds.erase(stale);
+    }
+    m_readFds.insert(storageItem->m_handle, fd);
+    return fd;
+}
+
+/************************************************************
+ * void FSStoragePlugin::closeCachedObjectFd
+ ***********************************************************/
+void FSStoragePlugin::closeCachedObjectFd(ObjHandle handle)
+{
+    if (m_readFds.contains(handle))
+        close(m_readFds.take(handle));
+    if (m_readAhead.handle == handle)
+        m_readAhead.handle = 0;
+}
+
+/************************************************************
+ * void FSStoragePlugin::releaseObjectData
+ ***********************************************************/
+void FSStoragePlugin::releaseObjectData(const ObjHandle &handle)
+{
+    closeCachedObjectFd(handle);
+}
+
+/************************************************************
+ * void FSStoragePlugin::adviseSequentialRead
+ ***********************************************************/
+void FSStoragePlugin::adviseSequentialRead(const ObjHandle &handle, quint64 offsetNow, quint64 offsetEnd)
+{
+    StorageItem *storageItem = m_objectHandlesMap.value(handle);
+    int fd = -1;
+
+    if (!storageItem || offsetNow >= offsetEnd || (fd = cachedObjectFd(storageItem)) == -1)
+        return;
+
+    if (m_readAhead.handle != handle || offsetNow < m_readAhead.dropped || offsetNow > m_readAhead.advised) {
+        // New transfer, or the reader jumped elsewhere in the object
+        posix_fadvise(fd, offsetNow, offsetEnd - offsetNow, POSIX_FADV_SEQUENTIAL);
+        m_readAhead.handle = handle;
+        m_readAhead.advised = offsetNow;
+        m_readAhead.dropped = offsetNow;
+    }
+
+    // Top up the read-ahead once half of the window has been consumed
+    if (m_readAhead.advised < offsetEnd && m_readAhead.advised - offsetNow < READ_AHEAD_WINDOW / 2) {
+        quint64 end = qMin(offsetNow + READ_AHEAD_WINDOW, offsetEnd);
+        posix_fadvise(fd, m_readAhead.advised, end - m_readAhead.advised, POSIX_FADV_WILLNEED);
+        m_readAhead.advised = end;
+    }
+
+    // Do not let a large transfer push everything else out of the page cache
+    if (offsetNow >= m_readAhead.dropped + 2 * READ_AHEAD_WINDOW) {
+        quint64 end = offsetNow - READ_AHEAD_WINDOW;
+        posix_fadvise(fd, m_readAhead.dropped, end - m_readAhead.dropped, POSIX_FADV_DONTNEED);
+        m_readAhead.dropped = end;
+    }
+}
+
+/************************************************************
+ * MTPResponseCode FSStoragePlugin::openObjectFd
+ ***********************************************************/
+MTPResponseCode FSStoragePlugin::openObjectFd(const ObjHandle &handle, int &fd)
+{
+    MTPResponseCode resp = MTP_RESP_OK;
+    StorageItem *storageItem = m_objectHandlesMap.value(handle);
+
+    fd = -1;
+    if (!storageItem) {
+        resp = MTP_RESP_InvalidObjectHandle;
+    } else if (storageItem->m_format == MTP_OBF_FORMAT_Association) {
+        resp = MTP_RESP_InvalidObjectHandle;
+    } else {
+        /* Share the open file with readData(), but give the caller
+         * a descriptor of its own to close. */
+        int cached = cachedObjectFd(storageItem);
+        if (cached == -1 || (fd = fcntl(cached, F_DUPFD_CLOEXEC, 0)) == -1)
+            resp = MTP_RESP_AccessDenied;
+    }
+    return resp;
+}
+
 /************************************************************
  * MTPResponseCode FSStoragePlugin::truncateItem
  ***********************************************************/
@@ -2014,16 +3012,24 @@ MTPResponseCode FSStoragePlugin::truncateItem(const ObjHandle &handle, const qui
 
     // Get the corresponding storage item.
     StorageItem *storageItem = m_objectHandlesMap[handle];
-    if (!storageItem || !storageItem->m_objectInfo
-        || MTP_OBF_FORMAT_Association == storageItem->m_objectInfo->mtpObjectFormat) {
+    if (!storageItem || MTP_OBF_FORMAT_Association == storageItem->m_format) {
         return MTP_RESP_GeneralError;
     }
 
-    QFile file(storageItem->m_path);
+    // Data still on its way to the file would undo the truncation,
+    // whatever comes next is appended to the truncated file
+    if (handle == m_writeObjectHandle && m_dataFile)
+        m_dataWriter.seek(size);
+
+    QFile file(storageItem->path());
     if (!file.resize(size)) {
         return MTP_RESP_GeneralError;
     }
-    storageItem->m_objectInfo->mtpObjectCompressedSize = size;
+    if (storageItem->m_objectInfo) {
+        storageItem->m_objectInfo->mtpObjectCompressedSize = size;
+    } else {
+        storageItem->m_size = size;
+    }
     return MTP_RESP_OK;
 }
 
@@ -2043,12 +3049,21 @@ MTPResponseCode FSStoragePlugin::writeData(
         return MTP_RESP_GeneralError;
     }
 
+    MTPResponseCode code = MTP_RESP_OK;
+
     if (isLastSegment && !writeBuffer) {
         m_writeObjectHandle = 0;
+        m_reservedSpace.remove(handle);
         if (m_dataFile) {
+            /* Wait for the data written in background */
+            int err = m_dataWriter.finish();
+            if (err) {
+                MTP_LOG_WARNING("ERROR writing data to" << storageItem->path() << strerror(err));
+                code = writeErrorResponse(err);
+            }
+
             /* Truncate at current write offset */
-            m_dataFile->flush();
-            m_dataFile->resize(m_dataFile->pos());
+            m_dataFile->resize(m_dataWriter.offset());
 
             /* Close the file */
             m_dataFile->close();
@@ -2058,9 +3073,10 @@ MTPResponseCode FSStoragePlugin::writeData(
             /* Preceeding writes and/or close might have changed
              * the modify time -> put it back to cached/expected
              * value. */
+            populateObjectInfo(storageItem);
             MTPObjectInfo *info = storageItem->m_objectInfo;
             time_t t = datetime_to_time_t(info->mtpModificationDate);
-            file_set_mtime(storageItem->m_path, t);
+            file_set_mtime(storageItem->path(), t);
 
             /* In any case update the cached values according to
              * what is actually used by thefilesystem. */
@@ -2069,11 +3085,16 @@ MTPResponseCode FSStoragePlugin::writeData(
         }
     } else {
         m_writeObjectHandle = handle;
-        qint32 bytesRemaining = bufferLen;
         // Resize file to zero, if first segment
         if (isFirstSegment) {
+            // An earlier transfer may have been abandoned
+            if (m_dataFile) {
+                m_dataWriter.discard();
+                delete m_dataFile;
+            }
+
             // Open the file and write to it.
-            m_dataFile = new QFile(storageItem->m_path);
+            m_dataFile = new QFile(storageItem->path());
 
             bool already_exists = m_dataFile->exists();
 
@@ -2087,45 +3108,33 @@ MTPResponseCode FSStoragePlugin::writeData(
                 /* When creating new files, prefer using the real gid
                  * (= "nemo") over the effective gid (= "privileged"). */
                 if (fchown(m_dataFile->handle(), getuid(), getgid()) == -1) {
-                    MTP_LOG_WARNING("failed to set file:" << storageItem->m_path << " ownership");
+                    MTP_LOG_WARNING("failed to set file:" << storageItem->path() << " ownership");
                 }
             }
 
             /* In all likelihood we've already created the file
              * via createFile() method and it should  have correct
              * target size -> start overwriting from offset zero. */
-            m_dataFile->seek(0);
+            m_dataWriter.begin(m_dataFile->handle());
+            resetStoreFullReport();
 
             /* Opening the file changes modify time, put it back
              * to expected/cached value */
+            populateObjectInfo(storageItem);
             MTPObjectInfo *info = storageItem->m_objectInfo;
             time_t t = datetime_to_time_t(info->mtpModificationDate);
-            file_set_mtime(storageItem->m_path, t);
+            file_set_mtime(storageItem->path(), t);
         }
 
-        while (bytesRemaining && m_dataFile) {
-            qint32 bytesWritten = m_dataFile->write(writeBuffer, bytesRemaining);
-            if (-1 == bytesWritten) {
-                MTP_LOG_WARNING("ERROR writing data to" << storageItem->m_path);
-                //Send a store full event if there's no space.
-                /*MTPResponseCode resp;
-                MTPObjectInfo objectInfo;
-                resp = getObjectInfo( handle, &objectInfo );
-                quint64 freeSpaceRemaining = 0;
-                resp = freeSpace( freeSpaceRemaining );
-                if( freeSpaceRemaining < objectInfo.mtpObjectCompressedSize )
-                {
-                    QVector<quint32> params;
-                    params.append(m_storageId);
-                    emit eventGenerated(MTP_EV_StoreFull, params, QString());
-                }*///TODO Fixme eventGenerated not working.
-                return MTP_RESP_GeneralError;
-            }
-            bytesRemaining -= bytesWritten;
-            writeBuffer += bytesWritten;
+        /* The data is written in background, errors of previous
+         * writes get reported here or at the end of the transfer. */
+        if (bufferLen && m_dataFile && !m_dataWriter.write(writeBuffer, bufferLen)) {
+            int err = m_dataWriter.error();
+            MTP_LOG_WARNING("ERROR writing data to" << storageItem->path() << strerror(err));
+            code = writeErrorResponse(err);
         }
     }
-    return MTP_RESP_OK;
+    return code;
 }
 
 /************************************************************
@@ -2151,19 +3160,21 @@ MTPResponseCode FSStoragePlugin::writePartialData(
 
     /* Open file when dealing with the first segment */
     if (code == MTP_RESP_OK && isFirstSegment) {
-        MTP_LOG_INFO("open for writing:" << storageItem->m_path);
+        MTP_LOG_INFO("open for writing:" << storageItem->path());
 
         /* Start ignoring inotify events about this handle */
         m_writeObjectHandle = handle;
 
-        if (m_dataFile)
+        if (m_dataFile) {
+            m_dataWriter.discard();
             delete m_dataFile;
-        m_dataFile = new QFile(storageItem->m_path);
+        }
+        m_dataFile = new QFile(storageItem->path());
 
         bool already_exists = m_dataFile->exists();
 
         if (!m_dataFile->open(QIODevice::ReadWrite)) {
-            MTP_LOG_WARNING("failed to open file" << storageItem->m_path << " for writing");
+            MTP_LOG_WARNING("failed to open file" << storageItem->path() << " for writing");
             delete m_dataFile;
             m_dataFile = nullptr;
             code = MTP_RESP_GeneralError;
@@ -2171,25 +3182,25 @@ MTPResponseCode FSStoragePlugin::writePartialData(
             /* When creating new files, prefer using the real gid
              * (= "nemo") over the effective gid (= "privileged"). */
             if (fchown(m_dataFile->handle(), getuid(), getgid()) == -1)
-                MTP_LOG_WARNING("failed to set file" << storageItem->m_path << " ownership");
+                MTP_LOG_WARNING("failed to set file" << storageItem->path() << " ownership");
         }
     }
 
     /* Write data when applicable */
     if (code == MTP_RESP_OK && m_dataFile && dataContent) {
-        MTP_LOG_INFO("set read position:" << storageItem->m_path << "at offset:" << offset);
+        MTP_LOG_INFO("set read position:" << storageItem->path() << "at offset:" << offset);
 
         if (m_writeObjectHandle != handle)
             code = MTP_RESP_GeneralError;
 
         if (code == MTP_RESP_OK && !m_dataFile->seek(offset)) {
-            MTP_LOG_WARNING("ERROR setting write position in" << storageItem->m_path);
+            MTP_LOG_WARNING("ERROR setting write position in" << storageItem->path());
             code = MTP_RESP_GeneralError;
         }
         while (code == MTP_RESP_OK && dataLength > 0) {
             qint32 bytesWritten = m_dataFile->write(reinterpret_cast<const char *>(dataContent), dataLength);
             if (bytesWritten == -1) {
-                MTP_LOG_WARNING("ERROR writing data to" << storageItem->m_path);
+                MTP_LOG_WARNING("ERROR writing data to" << storageItem->path());
                 code = MTP_RESP_GeneralError;
             } else {
                 dataLength -= bytesWritten;
@@ -2201,7 +3212,7 @@ MTPResponseCode FSStoragePlugin::writePartialData(
     /* Close file when dealing with failures / the last segment */
     if (code != MTP_RESP_OK || isLastSegment) {
         if (m_dataFile) {
-            MTP_LOG_INFO("close file:" << storageItem->m_path);
+            MTP_LOG_INFO("close file:" << storageItem->path());
             m_dataFile->flush();
             m_dataFile->close();
             delete m_dataFile;
@@ -2210,9 +3221,10 @@ MTPResponseCode FSStoragePlugin::writePartialData(
             /* Preceeding writes and/or close might have changed
              * the modify time -> put it back to cached/expected
              * value. */
+            populateObjectInfo(storageItem);
             MTPObjectInfo *info = storageItem->m_objectInfo;
             time_t t = datetime_to_time_t(info->mtpModificationDate);
-            file_set_mtime(storageItem->m_path, t);
+            file_set_mtime(storageItem->path(), t);
 
             /* In any case update the cached values according to
              * what is actually used by thefilesystem. */
@@ -2234,6 +3246,32 @@ MTPResponseCode FSStoragePlugin::writePartialData(
     return code;
 }
 
+/************************************************************
+ * void FSStoragePlugin::resetStoreFullReport
+ ***********************************************************/
+void FSStoragePlugin::resetStoreFullReport()
+{
+    m_storeFullReported = false;
+}
+
+/************************************************************
+ * MTPResponseCode FSStoragePlugin::writeErrorResponse
+ ***********************************************************/
+MTPResponseCode FSStoragePlugin::writeErrorResponse(int err)
+{
+    if (err != ENOSPC && err != EDQUOT)
+        return MTP_RESP_GeneralError;
+
+    // The error shows up again when the file gets closed
+    if (!m_storeFullReported) {
+        m_storeFullReported = true;
+        QVector<quint32> eventParams;
+        eventParams.append(m_storageId);
+        emit eventGenerated(MTP_EV_StoreFull, eventParams);
+    }
+    return MTP_RESP_StoreFull;
+}
+
 /************************************************************
  * MTPResponseCode FSStoragePlugin::getPath
  ***********************************************************/
@@ -2248,7 +3286,7 @@ MTPResponseCode FSStoragePlugin::getPath(const quint32 &handle, QString &path) c
         return MTP_RESP_GeneralError;
     }
 
-    path = storageItem->m_path;
+    path = storageItem->path();
     return MTP_RESP_OK;
 }
 
@@ -2290,9 +3328,9 @@ void FSStoragePlugin::dumpStorageItem(StorageItem *storageItem, bool recurse)
     }
 
     ObjHandle parentHandle = storageItem->m_parent ? storageItem->m_parent->m_handle : 0;
-    QString parentPath = storageItem->m_parent ? storageItem->m_parent->m_path : "";
+    QString parentPath = storageItem->m_parent ? storageItem->m_parent->path() : "";
     MTP_LOG_INFO(
-        "\n<" << storageItem->m_handle << "," << storageItem->m_path << "," << parentHandle << "," << parentPath << ">");
+        "\n<" << storageItem->m_handle << "," << storageItem->path() << "," << parentHandle << "," << parentPath << ">");
 
     if (recurse) {
         StorageItem *itr = storageItem->m_firstChild;
@@ -2304,9 +3342,90 @@ void FSStoragePlugin::dumpStorageItem(StorageItem *storageItem, bool recurse)
 }
 
 /************************************************************
- * void FSStoragePlugin::inotifyEventSlot
+ * void FSStoragePlugin::inotifyEventsSlot
+ ***********************************************************/
+void FSStoragePlugin::inotifyEventsSlot(const QByteArray &events)
+{
+    typedef QPair<int, QByteArray> EventKey;
+
+    QVector<const struct inotify_event *> batch;
+    // Index of the last IN_CREATE or IN_CLOSE_WRITE in the batch that
+    // would become redundant if the object was deleted later in the batch
+    QHash<EventKey, int> droppable;
+    // Objects whose attributes will be read by an event in the batch. The
+    // handlers run after the whole batch was read, so they see the final state.
+    QSet<EventKey> refreshed;
+    bool overflow = false;
+
+    const char *ptr = events.constData();
+    const char *end = ptr + events.size();
+    while (ptr + sizeof(struct inotify_event) <= end) {
+        const struct inotify_event *event = reinterpret_cast<const struct inotify_event *>(ptr);
+        ptr += sizeof *event + event->len;
+        if (ptr > end) {
+            break;
+        }
+        if (event->mask & IN_Q_OVERFLOW) {
+            overflow = true;
+            continue;
+        }
+        if (!event->len) {
+            continue;
+        }
+
+        EventKey key(event->wd, QByteArray::fromRawData(event->name, qstrlen(event->name)));
+        if (event->mask & IN_CREATE) {
+            droppable.insert(key, batch.size());
+            // A name already in the tree is not added again, so its
+            // IN_CLOSE_WRITE is still needed to read its attributes
+            StorageItem *parentNode = m_objectHandlesMap.value(m_watchDescriptorMap.value(event->wd));
+            if (!parentNode || !parentNode->m_children.contains(QString::fromUtf8(key.second))) {
+                refreshed.insert(key);
+            }
+        } else if (event->mask & IN_CLOSE_WRITE) {
+            if (refreshed.contains(key)) {
+                continue;
+            }
+            droppable.insert(key, batch.size());
+            refreshed.insert(key);
+        } else if (event->mask & IN_DELETE) {
+            if (droppable.contains(key)) {
+                batch[droppable.take(key)] = 0;
+            }
+            refreshed.remove(key);
+        } else if (event->mask & IN_MOVED_FROM) {
+            // Must stay paired with its IN_MOVED_TO, nothing before it is dropped
+            droppable.remove(key);
+            refreshed.remove(key);
+        } else if (event->mask & IN_MOVED_TO) {
+            droppable.remove(key);
+            refreshed.insert(key);
+        }
+        batch.append(event);
+    }
+
+    ++m_inotifyBatchDepth;
+    foreach (const struct inotify_event *event, batch) {
+        if (event) {
+            handleInotifyEvent(event);
+        }
+    }
+    --m_inotifyBatchDepth;
+
+    if (!m_inotifyBatchDepth && m_storageInfoChangePending) {
+        m_storageInfoChangePending = false;
+        sendStorageInfoChanged();
+    }
+
+    if (overflow) {
+        rescanStorage();
+    }
+}
+
+/************************************************************
+ * void FSStoragePlugin::handleInotifyEvent
  ***********************************************************/
-void FSStoragePlugin::inotifyEventSlot(struct inotify_event *event)
+void FSStoragePlugin::handleInotifyEvent(const struct inotify_event *event)
 {
     const struct inotify_event *fromEvent = 0;
     QString fromNameString;
@@ -2405,20 +3524,20 @@ MTPResponseCode FSStoragePlugin::setReferences(const ObjHandle &handle, const QV
 {
     StorageItem *playlist = m_objectHandlesMap.value(handle);
 
-    if (!playlist || !playlist->m_objectInfo) {
+    if (!playlist) {
         return MTP_RESP_InvalidObjectHandle;
     }
 
-    bool savePlaylist = (MTP_OBF_FORMAT_Abstract_Audio_Video_Playlist == playlist->m_objectInfo->mtpObjectFormat);
+    bool savePlaylist = (MTP_OBF_FORMAT_Abstract_Audio_Video_Playlist == playlist->m_format);
     QStringList entries;
     for (int i = 0; i < references.size(); ++i) {
         StorageItem *reference = m_objectHandlesMap.value(references[i]);
-        if (!reference || !reference->m_objectInfo) {
+        if (!reference) {
             return MTP_RESP_Invalid_ObjectReference;
         }
         if (savePlaylist) {
             // Append the path to the entries list
-            entries.append(reference->m_path);
+            entries.append(reference->path());
         }
     }
     m_objectReferencesMap[handle] = references;
@@ -2482,7 +3601,7 @@ void FSStoragePlugin::storeObjectReferences()
         // Get the object PUOID from the object handle (we need to store PUOIDs
         // in the ref DB as it is persistent, not object handles)
         StorageItem *item = m_objectHandlesMap.value(handle);
-        if (!item || (MTP_OBF_FORMAT_Abstract_Audio_Video_Playlist == item->m_objectInfo->mtpObjectFormat)) {
+        if (!item || (MTP_OBF_FORMAT_Abstract_Audio_Video_Playlist == item->m_format)) {
             // Possibly, the handle was removed from the objectHandles map, but
             // still lingers in the object references map (It is cleared lazily
             // in getObjectReferences). Ignore this handle.
@@ -2596,8 +3715,10 @@ void FSStoragePlugin::populateObjectReferences()
                 references.append(m_puoidToHandleMap[referencePuoid]);
             }
         }
-        if (m_puoidToHandleMap.contains(objPuoid)) {
-            m_objectReferencesMap[m_puoidToHandleMap[objPuoid]] = references;
+        // References set during the scan are newer than the stored ones
+        ObjHandle objHandle = m_puoidToHandleMap.value(objPuoid);
+        if (objHandle && !m_objectReferencesMap.contains(objHandle)) {
+            m_objectReferencesMap[objHandle] = references;
         }
     }
 }
@@ -2611,6 +3732,17 @@ MTPResponseCode FSStoragePlugin::getObjectPropertyValueFromStorage(
     if (MTP_RESP_OK != code) {
         return code;
     }
+    return getItemPropertyValue(m_objectHandlesMap.value(handle), objectInfo, propCode, value, dataType);
+}
+
+MTPResponseCode FSStoragePlugin::getItemPropertyValue(
+    StorageItem *storageItem,
+    const MTPObjectInfo *objectInfo,
+    MTPObjPropertyCode propCode,
+    QVariant &value,
+    MTPDataType dataType)
+{
+    MTPResponseCode code = MTP_RESP_OK;
     switch (propCode) {
     case MTP_OBJ_PROP_Association_Desc: {
         value = QVariant::fromValue(0);
@@ -2702,7 +3834,6 @@ MTPResponseCode FSStoragePlugin::getObjectPropertyValueFromStorage(
     }
     break;
     case MTP_OBJ_PROP_Persistent_Unique_ObjId: {
-        StorageItem *storageItem = m_objectHandlesMap.value(handle);
         value = QVariant::fromValue(storageItem->m_puoid);
     }
     break;
@@ -2715,12 +3846,6 @@ MTPResponseCode FSStoragePlugin::getObjectPropertyValueFromStorage(
         /* Default to returning empty octet set */
         value = QVariant::fromValue(QVector<quint8>());
 
-        StorageItem *storageItem = m_objectHandlesMap.value(handle);
-        if (!storageItem) {
-            MTP_LOG_WARNING("ObjectHandle" << handle << "does not exist");
-            break;
-        }
-
         /* Check if the file is an image that the thumbnailer can process */
         if (!isThumbnailableImage(storageItem)) {
             MTP_LOG_WARNING(storageItem->path() << "is not thumbnailable image");
@@ -2729,7 +3854,7 @@ MTPResponseCode FSStoragePlugin::getObjectPropertyValueFromStorage(
 
         /* Check if thumbnail already exists / request it to be generated */
         QString thumbPath
-            = m_thumbnailer->requestThumbnail(storageItem->m_path, m_imageMimeTable.value(objectInfo->mtpObjectFormat));
+            = m_thumbnailer->requestThumbnail(storageItem->path(), m_imageMimeTable.value(objectInfo->mtpObjectFormat));
         if (thumbPath.isEmpty()) {
             MTP_LOG_WARNING(storageItem->path() << "has no thumbnail yet");
             break;
@@ -2761,7 +3886,7 @@ MTPResponseCode FSStoragePlugin::getObjectPropertyValueFromStorage(
         break;
     }
     MTP_LOG_INFO(
-        "object:" << handle << "prop:" << mtp_code_repr(propCode) << "type:" << mtp_data_type_repr(dataType)
+        "object:" << storageItem->m_handle << "prop:" << mtp_code_repr(propCode) << "type:" << mtp_data_type_repr(dataType)
                   << "data:" << value << "result:" << mtp_code_repr(code));
     return code;
 }
@@ -2769,15 +3894,16 @@ MTPResponseCode FSStoragePlugin::getObjectPropertyValueFromStorage(
 MTPResponseCode FSStoragePlugin::getObjectPropertyValue(const ObjHandle &handle, QList<MTPObjPropDescVal> &propValList)
 {
     StorageItem *storageItem = m_objectHandlesMap.value(handle);
-    if (!storageItem || storageItem->m_path.isEmpty()) {
+    if (!storageItem || storageItem->m_name.isEmpty()) {
         return MTP_RESP_GeneralError;
     } else {
         // First, fill in the property values that are in the object info data
         // set or statically defined.
+        const MTPObjectInfo *objectInfo = objectInfoForInitiator(storageItem);
         QList<MTPObjPropDescVal>::iterator i;
         for (i = propValList.begin(); i != propValList.end(); ++i) {
-            MTPResponseCode response
-                = getObjectPropertyValueFromStorage(handle, i->propDesc->uPropCode, i->propVal, i->propDesc->uDataType);
+            MTPResponseCode response = getItemPropertyValue(
+                storageItem, objectInfo, i->propDesc->uPropCode, i->propVal, i->propDesc->uDataType);
             if (response != MTP_RESP_OK && response != MTP_RESP_ObjectProp_Not_Supported) {
                 // Ignore ObjectProp_Not_Supported since the value may still be
                 // available in Tracker.
@@ -2796,7 +3922,7 @@ MTPResponseCode FSStoragePlugin::getChildPropertyValues(
     }
 
     StorageItem *item = m_objectHandlesMap[handle];
-    if (item->m_objectInfo->mtpObjectFormat != MTP_OBF_FORMAT_Association) {
+    if (item->m_format != MTP_OBF_FORMAT_Association) {
         // Not an association.
         return MTP_RESP_InvalidObjectHandle;
     }
@@ -2804,9 +3930,43 @@ MTPResponseCode FSStoragePlugin::getChildPropertyValues(
     StorageItem *child = item->m_firstChild;
     for (; child; child = child->m_nextSibling) {
         QList<QVariant> &childValues = values.insert(child->m_handle, QList<QVariant>()).value();
+        // Reading all children doesn't show interest in any one of them
+        populateObjectInfo(child);
+        const MTPObjectInfo *objectInfo = child->m_objectInfo;
         foreach (const MtpObjPropDesc *desc, properties) {
             childValues.append(QVariant());
-            getObjectPropertyValueFromStorage(child->m_handle, desc->uPropCode, childValues.last(), desc->uDataType);
+            getItemPropertyValue(child, objectInfo, desc->uPropCode, childValues.last(), desc->uDataType);
+        }
+    }
+
+    return MTP_RESP_OK;
+}
+
+MTPResponseCode FSStoragePlugin::getObjectPropertyValues(
+    const QVector<ObjHandle> &handles,
+    const QList<const MtpObjPropDesc *> &properties,
+    QVector<QList<QVariant>> &values)
+{
+    values.resize(handles.size());
+    for (int i = 0; i < handles.size(); ++i) {
+        StorageItem *storageItem = m_objectHandlesMap.value(handles[i]);
+        if (!storageItem || storageItem->m_name.isEmpty()) {
+            return MTP_RESP_GeneralError;
+        }
+
+        // One lookup and one object info per object, however many properties.
+        // Batches may be prefetched, so no directory is scanned for them.
+        populateObjectInfo(storageItem);
+        const MTPObjectInfo *objectInfo = storageItem->m_objectInfo;
+        QList<QVariant> &objectValues = values[i];
+        objectValues.clear();
+        foreach (const MtpObjPropDesc *desc, properties) {
+            objectValues.append(QVariant());
+            MTPResponseCode response
+                = getItemPropertyValue(storageItem, objectInfo, desc->uPropCode, objectValues.last(), desc->uDataType);
+            if (response != MTP_RESP_OK && response != MTP_RESP_ObjectProp_Not_Supported) {
+                return response;
+            }
         }
     }
 
@@ -2829,7 +3989,8 @@ MTPResponseCode FSStoragePlugin::setObjectPropertyValue(
         // Handle filename on our own
         if (MTP_OBJ_PROP_Obj_File_Name == propDesc->uPropCode) {
             QDir dir;
-            QString path = storageItem->m_path;
+            QString oldPath = storageItem->path();
+            QString path = oldPath;
             path.truncate(path.lastIndexOf("/") + 1);
             QString newName = QString(value.value<QString>());
             // Check if the file name is valid
@@ -2839,21 +4000,20 @@ MTPResponseCode FSStoragePlugin::setObjectPropertyValue(
                 return MTP_RESP_Invalid_ObjectProp_Value;
             }
             path += newName;
-            if (dir.rename(storageItem->m_path, path)) {
-                m_pathNamesMap.remove(storageItem->m_path);
-                m_puoidsMap.remove(storageItem->m_path);
-
-                storageItem->m_path = path;
-                storageItem->m_objectInfo->mtpFileName = newName;
-                m_pathNamesMap[storageItem->m_path] = handle;
-                m_puoidsMap[storageItem->m_path] = storageItem->m_puoid;
+            if (dir.rename(oldPath, path)) {
+                closeCachedObjectFd(handle);
+                m_puoids.remove(oldPath);
+
+                StorageItem *parentItem = storageItem->m_parent;
+                unlinkChildStorageItem(storageItem);
+                storageItem->m_name = newName;
+                linkChildStorageItem(storageItem, parentItem);
+                if (storageItem->m_objectInfo) {
+                    storageItem->m_objectInfo->mtpFileName = newName;
+                }
+                m_puoids.insert(path, storageItem->m_puoid);
                 removeWatchDescriptorRecursively(storageItem);
                 addWatchDescriptorRecursively(storageItem);
-                StorageItem *itr = storageItem->m_firstChild;
-                while (itr) {
-                    adjustMovedItemsPath(path, itr);
-                    itr = itr->m_nextSibling;
-                }
                 code = MTP_RESP_OK;
             }
         }
@@ -2865,10 +4025,12 @@ MTPResponseCode FSStoragePlugin::setObjectPropertyValue(
 void FSStoragePlugin::receiveThumbnail(const QString &path)
 {
     // Thumbnail for the file "path" is ready
-    ObjHandle handle = m_pathNamesMap.value(path);
-    if (0 != handle) {
-        StorageItem *storageItem = m_objectHandlesMap[handle];
-        storageItem->m_objectInfo->mtpThumbCompressedSize = getThumbCompressedSize(storageItem);
+    StorageItem *storageItem = findStorageItemByPath(path);
+    if (storageItem && 0 != storageItem->m_handle) {
+        ObjHandle handle = storageItem->m_handle;
+        if (storageItem->m_objectInfo) {
+            storageItem->m_objectInfo->mtpThumbCompressedSize = getThumbCompressedSize(storageItem);
+        }
 
         QVector<quint32> params;
         params.append(handle);
@@ -2889,11 +4051,10 @@ void FSStoragePlugin::handleFSDelete(const struct inotify_event *event, const ch
             StorageItem *parentNode = m_objectHandlesMap[parentHandle];
 
             if (0 != parentNode) {
-                QString fullPath = parentNode->m_path + QString("/") + QString(name);
-                if (m_pathNamesMap.contains(fullPath)) {
+                StorageItem *toBeDeleted = parentNode->m_children.value(QString(name));
+                if (toBeDeleted) {
                     MTP_LOG_INFO("Handle FS Delete, deleting file::" << name);
-                    ObjHandle toBeDeleted = m_pathNamesMap[fullPath];
-                    deleteItemHelper(toBeDeleted, false, true);
+                    deleteItemHelper(toBeDeleted->m_handle, false, true);
                 }
                 // Emit storageinfo changed events, free space may be different from before now
                 sendStorageInfoChanged();
@@ -2911,8 +4072,8 @@ void FSStoragePlugin::handleFSCreate(const struct inotify_event *event, const ch
 
         // The above QHash::value() may return a default constructed value of 0... so we double check the wd's here
         if (parentNode && (parentNode->m_wd == event->wd)) {
-            QString addedPath = parentNode->m_path + QString("/") + QString(name);
-            if (!m_pathNamesMap.contains(addedPath)) {
+            if (!parentNode->m_children.contains(QString(name))) {
+                QString addedPath = parentNode->path() + QString("/") + QString(name);
                 MTP_LOG_INFO("Handle FS create, adding file::" << name);
                 addToStorage(addedPath, 0, 0, true);
 
@@ -2939,56 +4100,45 @@ void FSStoragePlugin::handleFSMove(
         }
         if ((0 != fromNode) && (0 != toNode) && (fromNode->m_wd == fromEvent->wd) && (toNode->m_wd == toEvent->wd)) {
             MTP_LOG_INFO("Handle FS Move, moving file::" << fromName << toName);
-            QString oldPath = fromNode->m_path + QString("/") + QString(fromName);
-            ObjHandle movedHandle = m_pathNamesMap.value(oldPath);
+            StorageItem *movedNode = fromNode->m_children.value(QString(fromName));
 
-            if (0 == movedHandle) {
+            if (!movedNode) {
                 // Already handled
                 return;
             }
-            StorageItem *movedNode = m_objectHandlesMap.value(movedHandle);
-            if (movedNode) {
-                QString newPath = toNode->m_path + QString("/") + toName;
-                if (m_pathNamesMap.contains(newPath)) { // Already Handled
-                    // As the destination path is already present in our tree,
-                    // we only need to delete the fromNode
-                    MTP_LOG_INFO("The path to rename to is already present in our tree, hence, delete the moved node "
-                                 "from our tree");
-                    deleteItemHelper(m_pathNamesMap[oldPath], false, true);
-                    return;
-                }
-                MTP_LOG_INFO("Handle FS Move, moving file, found!");
-                if (fromHandle == toHandle) { // Rename
-                    MTP_LOG_INFO("Handle FS Move, renaming file::" << fromName << toName);
-                    // Remove the old path from the path names map
-                    m_pathNamesMap.remove(oldPath);
-                    movedNode->m_path = newPath;
-                    movedNode->m_objectInfo->mtpFileName = QString(toName);
-                    m_pathNamesMap[movedNode->m_path] = movedHandle;
-                    StorageItem *itr = movedNode->m_firstChild;
-                    while (itr) {
-                        adjustMovedItemsPath(movedNode->m_path, itr);
-                        itr = itr->m_nextSibling;
-                    }
-                    removeWatchDescriptorRecursively(movedNode);
-                    addWatchDescriptorRecursively(movedNode);
-                } else {
-                    moveObject(movedHandle, toHandle, this, false);
-                }
+            ObjHandle movedHandle = movedNode->m_handle;
+            if (toNode->m_children.contains(QString(toName))) { // Already Handled
+                // As the destination path is already present in our tree,
+                // we only need to delete the fromNode
+                MTP_LOG_INFO("The path to rename to is already present in our tree, hence, delete the moved node "
+                             "from our tree");
+                deleteItemHelper(movedHandle, false, true);
+                return;
+            }
+            MTP_LOG_INFO("Handle FS Move, moving file, found!");
+            if (fromHandle == toHandle) { // Rename
+                MTP_LOG_INFO("Handle FS Move, renaming file::" << fromName << toName);
+                closeCachedObjectFd(movedHandle);
+                unlinkChildStorageItem(movedNode);
+                movedNode->m_name = QString(toName);
+                linkChildStorageItem(movedNode, fromNode);
+                removeWatchDescriptorRecursively(movedNode);
+                addWatchDescriptorRecursively(movedNode);
+            } else {
+                moveObject(movedHandle, toHandle, this, false);
+            }
+            rescanMovedDirectory(movedNode);
 
-                // object info would need to be computed again
-                delete movedNode->m_objectInfo;
-                movedNode->m_objectInfo = 0;
-                populateObjectInfo(movedNode);
+            // object info would need to be computed again
+            readObjectAttributes(movedNode);
 
-                if (fromNode->eventsAreEnabled())
-                    toNode->setEventsEnabled(true);
+            if (fromNode->eventsAreEnabled())
+                toNode->setEventsEnabled(true);
 
-                // Emit an object info changed signal
-                QVector<quint32> evtParams;
-                evtParams.append(movedHandle);
-                emit eventGenerated(MTP_EV_ObjectInfoChanged, evtParams);
-            }
+            // Emit an object info changed signal
+            QVector<quint32> evtParams;
+            evtParams.append(movedHandle);
+            emit eventGenerated(MTP_EV_ObjectInfoChanged, evtParams);
         }
     }
 }
@@ -3025,6 +4175,12 @@ static QString inotifyEventMaskRepr(int mask)
 
 void FSStoragePlugin::sendStorageInfoChanged()
 {
+    // One statvfs() for a whole batch of inotify events is enough
+    if (m_inotifyBatchDepth) {
+        m_storageInfoChangePending = true;
+        return;
+    }
+
     MTPStorageInfo info;
     storageInfo(info);
 
@@ -3053,17 +4209,24 @@ void FSStoragePlugin::handleFSModify(const struct inotify_event *event, const ch
         StorageItem *parentNode = m_objectHandlesMap.value(parent);
         //MTP_LOG_INFO("Handle FS Modify::" << name);
         if (parentNode && (parentNode->m_wd == event->wd)) {
-            QString changedPath = parentNode->m_path + QString("/") + QString(name);
-            ObjHandle changedHandle = m_pathNamesMap.value(changedPath);
+            StorageItem *changedNode = parentNode->m_children.value(QString(name));
+            ObjHandle changedHandle = changedNode ? changedNode->m_handle : 0;
             // Don't fire the change signal in the case when there is a transfer to the device ongoing
             if ((0 != changedHandle) && (changedHandle != m_writeObjectHandle)) {
                 StorageItem *item = m_objectHandlesMap.value(changedHandle);
+                // Reads must not be served from a descriptor opened before the change
+                closeCachedObjectFd(changedHandle);
                 // object info would need to be computed again
                 MTPObjectInfo *prev = item->m_objectInfo;
                 item->m_objectInfo = 0;
-                populateObjectInfo(item);
-                bool changed = !prev || prev->differsFrom(item->m_objectInfo);
-                delete prev;
+                readObjectAttributes(item);
+                // Without a dataset built there is nothing to compare to
+                bool changed = true;
+                if (prev) {
+                    populateObjectInfo(item);
+                    changed = prev->differsFrom(item->m_objectInfo);
+                    delete prev;
+                }
                 MTP_LOG_INFO(
                     "Handle FS Modify, file::" << name << "handle:" << changedHandle
                                                << "writing:" << m_writeObjectHandle << "changed:" << changed);
@@ -3106,7 +4269,7 @@ void FSStoragePlugin::clearCachedInotifyEvent()
 void FSStoragePlugin::removeWatchDescriptorRecursively(StorageItem *item)
 {
     StorageItem *itr;
-    if (item && item->m_objectInfo && MTP_OBF_FORMAT_Association == item->m_objectInfo->mtpObjectFormat) {
+    if (item && MTP_OBF_FORMAT_Association == item->m_format) {
         removeWatchDescriptor(item);
         for (itr = item->m_firstChild; itr; itr = itr->m_nextSibling) {
             removeWatchDescriptorRecursively(itr);
@@ -3116,8 +4279,8 @@ void FSStoragePlugin::removeWatchDescriptorRecursively(StorageItem *item)
 
 void FSStoragePlugin::removeWatchDescriptor(StorageItem *item)
 {
-    if (item && item->m_objectInfo && MTP_OBF_FORMAT_Association == item->m_objectInfo->mtpObjectFormat) {
-        m_inotify->removeWatch(item->m_wd);
+    if (item && MTP_OBF_FORMAT_Association == item->m_format) {
+        m_watcher->removeWatch(item->m_wd);
         m_watchDescriptorMap.remove(item->m_wd);
     }
 }
@@ -3125,7 +4288,7 @@ void FSStoragePlugin::removeWatchDescriptor(StorageItem *item)
 void FSStoragePlugin::addWatchDescriptorRecursively(StorageItem *item)
 {
     StorageItem *itr;
-    if (item && item->m_objectInfo && MTP_OBF_FORMAT_Association == item->m_objectInfo->mtpObjectFormat) {
+    if (item && MTP_OBF_FORMAT_Association == item->m_format) {
         addWatchDescriptor(item);
         for (itr = item->m_firstChild; itr; itr = itr->m_nextSibling) {
             addWatchDescriptorRecursively(itr);
@@ -3135,11 +4298,15 @@ void FSStoragePlugin::addWatchDescriptorRecursively(StorageItem *item)
 
 void FSStoragePlugin::addWatchDescriptor(StorageItem *item)
 {
-    if (item && item->m_objectInfo && MTP_OBF_FORMAT_Association == item->m_objectInfo->mtpObjectFormat) {
-        item->m_wd = m_inotify->addWatch(item->m_path);
+    if (item && MTP_OBF_FORMAT_Association == item->m_format) {
+        item->m_wd = m_watcher->addWatch(item->path());
         if (-1 != item->m_wd) {
             m_watchDescriptorMap[item->m_wd] = item->m_handle;
         }
+        if (m_scanner) {
+            // A listing taken before this point may be out of date
+            m_watchedAt.insert(item->m_handle, FSScanner::nowNs());
+        }
     }
 }
 
@@ -3151,7 +4318,7 @@ bool FSStoragePlugin::isFileNameValid(const QString &fileName, const StorageItem
         // Illegal characters, or all .'s
         return false;
     }
-    if (m_pathNamesMap.contains(parent->m_path + "/" + fileName)) {
+    if (parent->m_children.contains(fileName)) {
         // Already present
         return false;
     }
@@ -36,6 +36,9 @@
 
 #include <sys/inotify.h>
 #include "storageplugin.h"
+#include "fsdatawriter.h"
+#include "fsscanner.h"
+#include "puoiddb.h"
 #include <QVector>
 #include <QList>
 #include <QStringList>
@@ -44,7 +47,7 @@ class QFile;
 class QDir;
 
 namespace meegomtp1dot0 {
-class FSInotify;
+class FSWatcher;
 class Thumbnailer;
 class StorageItem;
 }
@@ -66,6 +69,15 @@ public:
     static SymLinkPolicy symLinkPolicy();
     static void setSymLinkPolicy(SymLinkPolicy policy);
 
+    /// Checks whether a symbolic link should be exported according to the
+    /// symlink policy.
+    /// \param storagePath [in] canonical path of the storage root.
+    /// \param path [in] path of the link.
+    /// \param targetPath [in] canonical path of the link target, empty if
+    ///                   the link is broken.
+    /// \return true if the link can be added to the storage.
+    static bool symLinkAllowed(const QString &storagePath, const QString &path, const QString &targetPath);
+
     /// Constructor.
     FSStoragePlugin(
         quint32 storageId = 0,
@@ -78,6 +90,7 @@ public:
     ~FSStoragePlugin();
 
     void disableObjectEvents();
+    void sessionClosed();
     bool enumerateStorage();
 
     MTPResponseCode addItem(ObjHandle &parentHandle, ObjHandle &handle, MTPObjectInfo *info);
@@ -114,30 +127,53 @@ public:
         bool isFirstSegment,
         bool isLastSegment);
     MTPResponseCode readData(const ObjHandle &handle, char *readBuffer, quint32 readBufferLen, quint64 readOffset);
+    MTPResponseCode openObjectFd(const ObjHandle &handle, int &fd);
+    void releaseObjectData(const ObjHandle &handle);
+    void adviseSequentialRead(const ObjHandle &handle, quint64 offsetNow, quint64 offsetEnd);
     MTPResponseCode truncateItem(const ObjHandle &handle, const quint64 &size);
     MTPResponseCode getObjectPropertyValue(const ObjHandle &handle, QList<MTPObjPropDescVal> &propValList);
     MTPResponseCode setObjectPropertyValue(
         const ObjHandle &handle, QList<MTPObjPropDescVal> &propValList, bool sendObjectPropList = false);
     MTPResponseCode getChildPropertyValues(
         ObjHandle handle, const QList<const MtpObjPropDesc *> &properties, QMap<ObjHandle, QList<QVariant>> &values);
+    MTPResponseCode getObjectPropertyValues(
+        const QVector<ObjHandle> &handles,
+        const QList<const MtpObjPropDesc *> &properties,
+        QVector<QList<QVariant>> &values);
     void excludePath(const QString &path);
 
 public slots:
-    /// This slot gets notified when an inotify event is received, and takes appropriate action.
-    void inotifyEventSlot(struct inotify_event *);
+    /// This slot gets notified when inotify events are received, and takes appropriate action.
+    /// Events that a later one in the same batch makes redundant are dropped, e.g. the
+    /// IN_CLOSE_WRITE of a file created in the batch, and storage info is checked once.
+    /// \param events [in] inotify_event structures, each followed by its name.
+    void inotifyEventsSlot(const QByteArray &events);
     void receiveThumbnail(const QString &path);
     void getLargestPuoid(MtpInt128 &puoid);
 
 private:
-    /// Reads puoids from the puoids db, so that are preserved across MTP sessions.
+    /// Opens the puoids db, so that puoids are preserved across MTP sessions.
     void populatePuoids();
 
-    /// Writes puoids to a db, so that are preserved across MTP sessions.
+    /// Merges the changes to puoids into the db, so that the next session starts
+    /// without a journal to replay.
     void storePuoids();
 
     /// After reading puoids the db, this gets rid of any puoids that are no longer valid ( the corresponding object doesn't exist ).
     void removeUnusedPuoids();
 
+    /// Keeps the puoids of the paths that are in the storage tree.
+    class UsedPathFilter;
+
+    /// Builds the object tree from the index snapshot written by a previous run.
+    /// \param knownDirs [out] directories in the snapshot with their mtimes.
+    /// \return false if there is no usable snapshot.
+    bool loadIndexSnapshot(QHash<QString, qint64> &knownDirs);
+
+    /// Writes the object tree to the index snapshot, so that the next run
+    /// does not have to scan the whole storage before it is ready.
+    void storeIndexSnapshot();
+
     /// Creates a directory in the file system.
     ///
     /// \param path [in] filesystem path of the directory to create.
@@ -147,8 +183,37 @@ private:
     /// Creates a file in the file system.
     ///
     /// \param path [in] filesystem path of the file to create.
+    /// \param preallocated [out] true if the space for the announced
+    ///                     object size could be allocated up front.
+    /// \return MTP response; MTP_RESP_StoreFull if there is not enough
+    ///         space for the announced object size.
+    MTPResponseCode createFile(const QString &path, MTPObjectInfo *info, bool &preallocated);
+
+    /// Copies the content of a file object to a file object in another (or
+    /// the same) file system storage. The data is cloned or copied within
+    /// the kernel when the file systems allow, falling back to copyData().
+    /// \param source [in] handle of the object to copy data from.
+    /// \param destinationStorage [in] the storage of the destination object.
+    /// \param destination [in] handle of the object to be filled with data.
     /// \return MTP response.
-    MTPResponseCode createFile(const QString &path, MTPObjectInfo *info);
+    MTPResponseCode copyFileData(ObjHandle source, FSStoragePlugin *destinationStorage, ObjHandle destination);
+
+    /// Maps the errno of a failed object data write to an MTP response,
+    /// sending a StoreFull event if the storage ran out of space.
+    MTPResponseCode writeErrorResponse(int err);
+
+    /// Starts a new transfer into this storage, which reports StoreFull again.
+    void resetStoreFullReport();
+
+    /// Space promised to objects being uploaded that is not yet in use
+    /// as far as the file system is concerned.
+    quint64 reservedSpace() const;
+
+    /// Drops the space reserved for objects whose data is not being written.
+    void releaseReservedSpace();
+
+    /// Drops the space reserved for an object once its data is in place.
+    void releaseReservedSpace(ObjHandle handle);
 
     /// Gets a new object handle that can be assigned to an item.
     /// \return the object handle
@@ -199,6 +264,8 @@ private:
     ///                         created if it doesn't exist yet.
     /// \param handle [in] when nonzero, assigns the specific object handle to
     ///               the newly created StorageItem.
+    /// \param entry [in] attributes of \c path when the caller has already
+    ///              read them, otherwise \c path is looked up.
     /// \return MTP response code.
     ///
     /// This method will call processEvents() regularly when adding
@@ -209,31 +276,82 @@ private:
         MTPObjectInfo *info = 0,
         bool sendEvent = false,
         bool createIfNotExist = false,
-        ObjHandle handle = 0);
+        ObjHandle handle = 0,
+        const FSScanner::Entry *entry = 0);
 
     /// Inserts a storage item into internal data structures for faster search.
     ///
     /// \param item [in] a storage item.
     void addItemToMaps(StorageItem *item);
 
+    /// Adds an object to, or removes it from, the kept getObjectHandles()
+    /// results it belongs in, see m_handleLists.
+    ///
+    /// \param item [in] a storage item linked to its parent.
+    /// \param insert [in] true to add the object's handle, false to remove it.
+    void updateHandleLists(const StorageItem *item, bool insert);
+
+    /// Appends handles to a collection, sharing the list if the collection is empty.
+    static void appendHandles(QVector<ObjHandle> &objectHandles, const QVector<ObjHandle> &handles);
+
+    /// Creates a StorageItem for an entry found by the storage scan. Unlike
+    /// addToStorage() this does not descend into directories, their contents
+    /// are added from the listings of the scanner.
+    ///
+    /// \param entry [in] the scanned file or directory.
+    /// \param parentItem [in] the item of the parent directory, null for the root.
+    /// \return the new storage item, or the existing one for entry.path.
+    StorageItem *addScannedItem(const FSScanner::Entry &entry, StorageItem *parentItem);
+
+    /// Brings a storage item loaded from the index snapshot up to date with
+    /// an entry found by the scan, adding the item if it does not exist.
+    ///
+    /// \param entry [in] the scanned file or directory.
+    /// \param parentItem [in] the item of the parent directory.
+    void updateScannedItem(const FSScanner::Entry &entry, StorageItem *parentItem);
+
+    /// Removes the children of parentItem that no longer exist according
+    /// to the scanned directory listing.
+    void removeVanishedItems(const FSScanner::Directory &dir, StorageItem *parentItem);
+
     /// Removes a storage item.
     /// \param handle [in] the handle of the object that needs to be removed.
     /// \sendEvent [in] indicates whether to send an ObjectRemoved event to the inititiator.
     MTPResponseCode removeFromStorage(ObjHandle handle, bool sendEvent = false);
 
-    /// Populates the object info for a storage item if that's not done by the initiator.
+    /// Gets a descriptor for reading the content of a storage item. The
+    /// descriptor stays open so that segmented reads of the same object do
+    /// not have to reopen the file every time.
+    /// \param storageItem [in] the storage item.
+    /// \return a descriptor owned by the plugin, or -1 on failure.
+    int cachedObjectFd(StorageItem *storageItem);
+
+    /// Closes the cached read descriptor of an object, if there is one.
+    /// \param handle [in] the object handle.
+    void closeCachedObjectFd(ObjHandle handle);
+
+    /// Populates the object info for a storage item from its recorded file
+    /// attributes, if that's not done by the initiator or already earlier.
     /// \param storageItem [in] the item's whose object info needs to be populated.
     void populateObjectInfo(StorageItem *storageItem);
 
-    /// This method helps recursively modify the "path" field of a StorageItem ther has been moved.
-    /// \param newAncestorPath [in] the new ancestor for the moved item and it's children.
-    /// \movedItem [in] the moved item.
-    void adjustMovedItemsPath(QString newAncestorPath, StorageItem *movedItem);
+    /// Returns the populated object info of a single storage item the
+    /// initiator is asking about, flagging the item for change events and
+    /// scanning it if it is a directory. Batch reads use populateObjectInfo().
+    /// \param storageItem [in] the item.
+    const MTPObjectInfo *objectInfoForInitiator(StorageItem *storageItem);
 
-    /// Gets the object format of a storage item.
+    /// Records the file attributes the object info of a storage item is
+    /// populated from once asked for. Object info populated from earlier
+    /// attributes is dropped.
     /// \param storageItem [in] the storage item.
-    /// \return object format code.
-    quint16 getObjectFormatByExtension(StorageItem *storageItem);
+    /// \param entry [in] the attributes as found by the scanner.
+    void setObjectAttributes(StorageItem *storageItem, const FSScanner::Entry &entry);
+
+    /// Looks up and records the file attributes of a storage item, see
+    /// setObjectAttributes().
+    /// \param storageItem [in] the storage item.
+    void readObjectAttributes(StorageItem *storageItem);
 
     /// Gets the protection status of a storage item.
     /// \param storageItem [in] the storage item.
@@ -324,6 +442,9 @@ private:
     /// This method removes invalid object handles and invalid references from the references map.
     void removeInvalidObjectReferences(const ObjHandle &handle);
 
+    /// Takes appropriate action on a single inotify event.
+    void handleInotifyEvent(const struct inotify_event *event);
+
     /// This handles IN_DELETE/IN_MOVED_FROM iNotify events
     void handleFSDelete(const struct inotify_event *event, const char *name);
 
@@ -355,6 +476,15 @@ private:
     MTPResponseCode getObjectPropertyValueFromStorage(
         const ObjHandle &handle, MTPObjPropertyCode propCode, QVariant &value, MTPDataType type);
 
+    /// Gets a property value of a storage item whose object info is already
+    /// at hand, see getObjectPropertyValueFromStorage().
+    MTPResponseCode getItemPropertyValue(
+        StorageItem *storageItem,
+        const MTPObjectInfo *objectInfo,
+        MTPObjPropertyCode propCode,
+        QVariant &value,
+        MTPDataType type);
+
     /// Is storage item an image file that the thumbnailer can process
     bool isThumbnailableImage(StorageItem *);
 
@@ -372,37 +502,93 @@ private:
 
 private slots:
     void enumerateStorage_worker();
+    void mergeScanResults();
 
 private:
+    void finishEnumeration();
+    void reportReady();
+
+    /// Starts the scanner on the whole storage.
+    /// \param knownDirs [in] directories not to list again unless their mtime changed.
+    void startScan(const QHash<QString, qint64> &knownDirs);
+
+    /// Checks the whole tree against the file system after file system
+    /// events were lost, or once the ongoing scan is done.
+    void rescanStorage();
+
+    /// Lists a scanned directory again if it may have changed before its
+    /// watch was added, and scans any new subdirectories.
+    /// \param dir [in,out] the listing from the scanner.
+    /// \param item [in] the directory in the storage.
+    /// \return true if new subdirectories were queued to the scanner.
+    bool relistIfStale(FSScanner::Directory &dir, StorageItem *item);
+
+    /// Adds a scanned entry unless it is there already. Directories are
+    /// marked unscanned until their own listing has been added.
+    void addScannedChild(const FSScanner::Entry &entry, StorageItem *parentItem);
+    void setDirectoryUnscanned(StorageItem *item, int depth);
+    void setDirectoryScanned(ObjHandle handle);
+
+    /// Adds the contents of a directory right away if the scan has not
+    /// got to it yet.
+    void ensureDirectoryScanned(StorageItem *item);
+
+    /// Scans a directory moved on the file system again under its new
+    /// path, if the ongoing scan has not added all of it yet.
+    void rescanMovedDirectory(StorageItem *item);
+    bool hasUnscannedDirectory(StorageItem *item) const;
+
+    /// Waits for the scan to finish and adds everything it found, for
+    /// operations that need the whole storage or a whole subtree. Events
+    /// are handled while waiting, so items looked up before may be gone.
+    void completeEnumeration();
     MTPResponseCode deleteItemHelper(ObjHandle handle, bool removePhysically = true, bool sendEvent = false);
     bool isFileNameValid(const QString &fileName, const StorageItem *parent);
     QString filesystemUuid() const;
 
     QString m_storagePath;
     QHash<int, ObjHandle> m_watchDescriptorMap; ///< map from an inotify watch on an object to it's object handle.
-    QHash<QString, ObjHandle> m_pathNamesMap;
-    QHash<QString, MtpInt128> m_puoidsMap;
+    PuoidDb m_puoids; ///< puoids of objects by path, also of ones not currently in the storage
     QHash<MtpInt128, ObjHandle> m_puoidToHandleMap; ///< Maps the PUOID to the corresponding object handle
     StorageItem *m_root;                            ///< the root folder
     QString m_puoidsDbPath;                         ///< path where puoids will be stored persistently.
     QString m_objectReferencesDbPath;               ///< path where references will be stored persistently.
+    QString m_indexSnapshotPath;                    ///< path where the object tree is stored between runs.
     ObjHandle
         m_writeObjectHandle; ///< The obj handle for which a write operation is currently is progress. 0 means invalid handle, NOT root node!!
     Thumbnailer *m_thumbnailer; ///< pointer to the thumbnailer object
-    FSInotify *m_inotify;       ///< pointer to the inotify wrapper
+    FSWatcher *m_watcher;       ///< pointer to the file system monitor
     QHash<QString, quint16> m_formatByExtTable;
     QHash<MTPObjFormatCode, QString>
         m_imageMimeTable; ///< Maps the MTP object format code (for image types only) to MIME type string
     QString m_mtpPersistentDBPath;
-    MtpInt128 m_largestPuoid;
 
     QHash<ObjHandle, StorageItem *>
         m_objectHandlesMap; ///< each storage has a map of all it's object's handles to corresponding storage item.
+    /// Sorted getObjectHandles() results by association and format filter, updated as objects come and go
+    QHash<quint64, QVector<ObjHandle> > m_handleLists;
     quint64 m_reportedFreeSpace;
+    int m_inotifyBatchDepth;          ///< Nonzero while a batch of inotify events is being handled
+    bool m_storageInfoChangePending;  ///< Free space is to be checked once the batch is handled
     QFile *m_dataFile;
+    FSDataWriter m_dataWriter; ///< Writes object data to m_dataFile in the background
+    bool m_storeFullReported;  ///< StoreFull event sent for the ongoing upload
+    QHash<ObjHandle, quint64> m_reservedSpace; ///< Sizes of uploads that could not be preallocated
+    QHash<ObjHandle, int> m_readFds; ///< Read descriptors kept open during segmented reads
 
     QStringList m_excludePaths; ///< Paths that should not be indexed
 
+    FSScanner *m_scanner;                      ///< Scans the storage during enumeration, null after it
+    QList<FSScanner::Directory> m_scanResults; ///< Scanned directories waiting to be added
+    int m_scanPosition;                        ///< Entries of the first m_scanResults directory already added
+    bool m_validatingIndex;                    ///< The scan is checking a tree loaded from the index snapshot
+    bool m_rescanPending;                      ///< Events were lost during the scan, scan again after it
+    QHash<ObjHandle, int> m_unscannedDirs;     ///< Directories whose contents are not added yet, with their depth
+    QHash<ObjHandle, qint64> m_watchedAt;      ///< Directories watched during the scan, with the time the watch was added
+    QHash<ObjHandle, qint64> m_listedMtimes;   ///< Directory mtimes in nanoseconds when listed, for the index snapshot
+    int m_unscannedReadyDirs;                  ///< Unscanned directories shallow enough to delay storage ready
+    bool m_readyReported;                      ///< storagePluginReady() has been emitted
+
 #ifdef UT_ON
     ObjHandle m_testHandleProvider;
     friend class FSStoragePlugin_test;
@@ -415,6 +601,13 @@ private:
         QString fromName;
         struct inotify_event fromEvent;
     } m_iNotifyCache; ///< A cache for iNotify events
+
+    struct ReadAhead
+    {
+        ObjHandle handle; ///< the object being read sequentially, 0 if none
+        quint64 advised;  ///< end of the range already requested from the kernel
+        quint64 dropped;  ///< end of the range already dropped from the page cache
+    } m_readAhead;        ///< Access hint state of the ongoing sequential read
 };
 }
 
@@ -29,13 +29,22 @@ INCLUDEPATH += . \
 HEADERS += fsstorageplugin.h \
            ../storageplugin.h \
            thumbnailer.h \
+           fswatcher.h \
            fsinotify.h \
+           fsfanotify.h \
+           fsdatawriter.h \
+           fsscanner.h \
+           puoiddb.h \
            storageitem.h
 
 SOURCES += fsstorageplugin.cpp \
            fsstoragepluginfactory.cpp \
            thumbnailer.cpp \
            fsinotify.cpp \
+           fsfanotify.cpp \
+           fsdatawriter.cpp \
+           fsscanner.cpp \
+           puoiddb.cpp \
            storageitem.cpp
 
 LIBPATH += ../../..
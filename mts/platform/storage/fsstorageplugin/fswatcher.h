@@ -0,0 +1,77 @@
+/*
+* This file is part of libmeegomtp package
+*
+* Copyright (c) 2010 Nokia Corporation. All rights reserved.
+* Copyright (c) 2013 - 2020 Jolla Ltd.
+* Copyright (c) 2020 Open Mobile Platform LLC.
+*
+* Contact: Deepak Kodihalli <deepak.kodihalli@nokia.com>
+*
+* Redistribution and use in source and binary forms, with or without modification,
+* are permitted provided that the following conditions are met:
+*
+* Redistributions of source code must retain the above copyright notice, this list
+* of conditions and the following disclaimer. Redistributions in binary form must
+* reproduce the above copyright notice, this list of conditions and the following
+* disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of Nokia Corporation nor the names of its contributors may be
+* used to endorse or promote products derived from this software without specific
+* prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+* IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+* INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+* BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+* DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+* LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+* OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+* OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*/
+
+#ifndef FSWATCHER_H
+#define FSWATCHER_H
+
+#include <QObject>
+#include <QByteArray>
+#include <QString>
+
+namespace meegomtp1dot0 {
+/// FSWatcher is the interface of the file system monitoring backends.
+///
+/// Directories are registered with addWatch(), which returns a watch
+/// descriptor for them. Changes are delivered in batches as inotify_event
+/// structures, whatever the backend, with the watch descriptor of the
+/// directory the change happened in.
+class FSWatcher : public QObject
+{
+    Q_OBJECT
+
+public:
+    /// Size of the buffer events are read into at a time. Big enough for a
+    /// burst of file creations, e.g. a camera or an archive extraction, to
+    /// be handled as one batch.
+    static const int EVENT_BUFFER_SIZE = 64 * 1024;
+
+    /// Adds a new watch to the directory whose pathname is provided.
+    /// \param pathName [in] the directory's pathname.
+    /// \return watch descriptor on success, -1 on failure.
+    virtual int addWatch(const QString &pathName) = 0;
+
+    /// Removes an added watch.
+    /// \param wd [in] the watch to be removed.
+    /// \return 0 on success -1 on failure.
+    virtual int removeWatch(const int &wd) = 0;
+
+signals:
+    /// This signal is emitted once for all the events read at a time.
+    /// Receivers may process events while handling the batch, so no more
+    /// events are read until the signal returns.
+    /// \param events [in] inotify_event structures, each followed by its name.
+    void inotifyEventsSignal(const QByteArray &events);
+};
+}
+
+#endif
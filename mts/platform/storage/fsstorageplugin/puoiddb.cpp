@@ -0,0 +1,709 @@
+/*
+* This file is part of libmeegomtp package
+*
+* Copyright (c) 2010 Nokia Corporation. All rights reserved.
+* Copyright (c) 2013 - 2020 Jolla Ltd.
+* Copyright (c) 2020 Open Mobile Platform LLC.
+*
+* Contact: Deepak Kodihalli <deepak.kodihalli@nokia.com>
+*
+* Redistribution and use in source and binary forms, with or without modification,
+* are permitted provided that the following conditions are met:
+*
+* Redistributions of source code must retain the above copyright notice, this list
+* of conditions and the following disclaimer. Redistributions in binary form must
+* reproduce the above copyright notice, this list of conditions and the following
+* disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of Nokia Corporation nor the names of its contributors may be
+* used to endorse or promote products derived from this software without specific
+* prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+* IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+* INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+* BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+* DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+* LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+* OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+* OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*/
+
+#include "puoiddb.h"
+#include "trace.h"
+
+#include <QCoreApplication>
+#include <QRunnable>
+#include <QSaveFile>
+#include <QScopedPointer>
+#include <QVector>
+#include <QPair>
+#include <QSet>
+
+#include <algorithm>
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+using namespace meegomtp1dot0;
+
+static const quint32 PUOID_DB_MAGIC = 0x4d545050; // "MTPP"
+static const quint32 PUOID_DB_VERSION = 1;
+
+/* Journal records are an operation, the length of the path, the path and
+ * for JOURNAL_SET the puoid. */
+static const char JOURNAL_SET = 'S';
+static const char JOURNAL_REMOVE = 'R';
+
+/* Merging rewrites the whole file, so let the journal grow relative to
+ * the size of the database before doing it. */
+static const int MIN_COMPACTION_CHANGES = 1024;
+
+struct PuoidDb::Header
+{
+    quint32 magic;
+    quint32 version;
+    quint32 count; ///< number of records, the path table follows them
+    quint32 reserved;
+    MtpInt128 largestPuoid;
+};
+
+struct PuoidDb::Record
+{
+    quint32 offset; ///< of the path from the start of the path table
+    quint32 length; ///< of the path in bytes
+    MtpInt128 puoid;
+};
+
+/* Orders paths by their UTF-8 bytes, which is the order of the records. */
+static int comparePaths(const char *a, quint32 aLength, const char *b, quint32 bLength)
+{
+    int result = memcmp(a, b, qMin(aLength, bLength));
+    if (result == 0 && aLength != bLength) {
+        result = aLength < bLength ? -1 : 1;
+    }
+    return result;
+}
+
+/************************************************************
+ * PuoidDb::CompactTask
+ ***********************************************************/
+class PuoidDb::CompactTask : public QRunnable
+{
+public:
+    CompactTask(PuoidDb *db)
+        : m_db(db)
+        , m_base(db->m_base)
+        , m_baseCount(db->m_baseCount)
+        , m_changes(db->m_compacting)
+        , m_largestPuoid(db->m_largestPuoid)
+        , m_path(db->m_path)
+    {
+    }
+
+    void run()
+    {
+        bool ok = write();
+        if (ok) {
+            // Everything in it is in the database file now
+            QFile::remove(m_path + ".journal.old");
+        }
+        QMetaObject::invokeMethod(m_db, "compactionFinished", Qt::QueuedConnection, Q_ARG(bool, ok));
+    }
+
+private:
+    typedef QPair<QByteArray, Change> SortedChange;
+
+    static bool changeLessThan(const SortedChange &a, const SortedChange &b)
+    {
+        return comparePaths(a.first.constData(), a.first.size(), b.first.constData(), b.first.size()) < 0;
+    }
+
+    void append(const char *path, quint32 length, const MtpInt128 &puoid)
+    {
+        Record record;
+        record.offset = m_strings.size();
+        record.length = length;
+        record.puoid = puoid;
+        m_records.append(record);
+        m_strings.append(path, length);
+    }
+
+    bool write()
+    {
+        QVector<SortedChange> changes;
+        changes.reserve(m_changes.size());
+        for (Changes::const_iterator i = m_changes.constBegin(); i != m_changes.constEnd(); ++i) {
+            changes.append(qMakePair(i.key().toUtf8(), i.value()));
+        }
+        std::sort(changes.begin(), changes.end(), changeLessThan);
+
+        const Record *records = m_base ? reinterpret_cast<const Record *>(m_base + sizeof(Header)) : 0;
+        const char *strings = reinterpret_cast<const char *>(records + m_baseCount);
+        m_records.reserve(m_baseCount + changes.size());
+
+        // Both are sorted, merge them with the changes taking precedence
+        quint32 i = 0;
+        int j = 0;
+        while (i < m_baseCount || j < changes.size()) {
+            int order;
+            if (i == m_baseCount) {
+                order = 1;
+            } else if (j == changes.size()) {
+                order = -1;
+            } else {
+                const QByteArray &path = changes.at(j).first;
+                order = comparePaths(
+                    strings + records[i].offset, records[i].length, path.constData(), path.size());
+            }
+
+            if (order < 0) {
+                append(strings + records[i].offset, records[i].length, records[i].puoid);
+                ++i;
+                continue;
+            }
+            if (order == 0) {
+                ++i;
+            }
+            const SortedChange &change = changes.at(j++);
+            if (!change.second.removed) {
+                append(change.first.constData(), change.first.size(), change.second.puoid);
+            }
+        }
+
+        Header header;
+        header.magic = PUOID_DB_MAGIC;
+        header.version = PUOID_DB_VERSION;
+        header.count = m_records.size();
+        header.reserved = 0;
+        header.largestPuoid = m_largestPuoid;
+
+        QSaveFile file(m_path);
+        if (!file.open(QIODevice::WriteOnly)) {
+            return false;
+        }
+        file.write(reinterpret_cast<const char *>(&header), sizeof header);
+        file.write(reinterpret_cast<const char *>(m_records.constData()), m_records.size() * sizeof(Record));
+        file.write(m_strings);
+        return file.commit();
+    }
+
+    PuoidDb *m_db;
+    const uchar *m_base;
+    quint32 m_baseCount;
+    Changes m_changes;
+    MtpInt128 m_largestPuoid;
+    QString m_path;
+
+    QVector<Record> m_records;
+    QByteArray m_strings;
+};
+
+/************************************************************
+ * PuoidDb::PuoidDb
+ ***********************************************************/
+PuoidDb::PuoidDb(QObject *parent)
+    : QObject(parent)
+    , m_baseFile(0)
+    , m_base(0)
+    , m_baseCount(0)
+    , m_journaled(0)
+    , m_flushPending(false)
+    , m_compactionRunning(false)
+{
+    m_pool.setMaxThreadCount(1);
+}
+
+/************************************************************
+ * PuoidDb::~PuoidDb
+ ***********************************************************/
+PuoidDb::~PuoidDb()
+{
+    // The files are consistent whether or not the compaction has been
+    // taken into use, only the mapping must stay valid until it is done
+    m_pool.waitForDone();
+    m_journal.close();
+    delete m_baseFile;
+}
+
+/************************************************************
+ * void PuoidDb::open
+ ***********************************************************/
+void PuoidDb::open(const QString &path)
+{
+    m_path = path;
+
+    bool imported = false;
+    if (!mapBase() && QFile::exists(m_path)) {
+        importLegacy();
+        imported = true;
+    }
+
+    // A compaction may have been interrupted before its journal got merged
+    QString oldJournalPath = m_path + ".journal.old";
+    replayJournal(oldJournalPath, false);
+    replayJournal(m_path + ".journal", true);
+
+    m_journal.setFileName(m_path + ".journal");
+    if (!m_journal.open(QIODevice::WriteOnly | QIODevice::Append)) {
+        MTP_LOG_WARNING("cannot open puoid journal" << m_journal.fileName());
+    }
+    if (QFile::exists(oldJournalPath)) {
+        rewriteJournal();
+    }
+
+    if (imported || m_journaled >= qMax<int>(MIN_COMPACTION_CHANGES, m_baseCount / 4)) {
+        startCompaction();
+    }
+}
+
+/************************************************************
+ * bool PuoidDb::mapBase
+ ***********************************************************/
+bool PuoidDb::mapBase()
+{
+    // The previous mapping is kept unless the file is valid
+    QScopedPointer<QFile> file(new QFile(m_path));
+    if (!file->open(QIODevice::ReadOnly) || file->size() < qint64(sizeof(Header))) {
+        return false;
+    }
+
+    qint64 size = file->size();
+    const uchar *data = file->map(0, size);
+    if (!data) {
+        return false;
+    }
+
+    const Header *header = reinterpret_cast<const Header *>(data);
+    if (header->magic != PUOID_DB_MAGIC) {
+        return false;
+    }
+    qint64 stringsOffset = sizeof(Header) + qint64(header->count) * sizeof(Record);
+    if (header->version != PUOID_DB_VERSION || stringsOffset > size) {
+        MTP_LOG_WARNING("ignoring invalid puoid db" << m_path);
+        return false;
+    }
+    const Record *records = reinterpret_cast<const Record *>(data + sizeof(Header));
+    for (quint32 i = 0; i < header->count; ++i) {
+        if (qint64(records[i].offset) + records[i].length > size - stringsOffset) {
+            MTP_LOG_WARNING("ignoring invalid puoid db" << m_path);
+            return false;
+        }
+    }
+
+    delete m_baseFile;
+    m_baseFile = file.take();
+    m_base = data;
+    m_baseCount = header->count;
+    if (header->largestPuoid > m_largestPuoid) {
+        m_largestPuoid = header->largestPuoid;
+    }
+    return true;
+}
+
+/************************************************************
+ * void PuoidDb::importLegacy
+ ***********************************************************/
+void PuoidDb::importLegacy()
+{
+    // Last used puoid, number of puoids, then length of the path, path
+    // and puoid for each. The length was that of the path in UTF-16 while
+    // the path was written in UTF-8, so paths with other than ASCII in
+    // them got truncated and are left out.
+    QFile file(m_path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return;
+    }
+    MtpInt128 largestPuoid;
+    quint32 noOfPuoids = 0;
+    if (file.read(largestPuoid.val, sizeof largestPuoid.val) != sizeof largestPuoid.val
+        || file.read(reinterpret_cast<char *>(&noOfPuoids), sizeof noOfPuoids) != sizeof noOfPuoids) {
+        return;
+    }
+    // A damaged database of the current format, not worth importing
+    quint32 magic;
+    memcpy(&magic, largestPuoid.val, sizeof magic);
+    if (magic == PUOID_DB_MAGIC) {
+        return;
+    }
+    if (largestPuoid > m_largestPuoid) {
+        m_largestPuoid = largestPuoid;
+    }
+
+    for (quint32 i = 0; i < noOfPuoids; ++i) {
+        quint32 pathnameLen = 0;
+        if (file.read(reinterpret_cast<char *>(&pathnameLen), sizeof pathnameLen) != sizeof pathnameLen) {
+            break;
+        }
+        QByteArray name = file.read(pathnameLen);
+        Change change;
+        change.removed = false;
+        if (name.size() != int(pathnameLen)
+            || file.read(change.puoid.val, sizeof change.puoid.val) != sizeof change.puoid.val) {
+            break;
+        }
+        QString path = QString::fromUtf8(name);
+        if (path.size() == name.size()) {
+            m_changes.insert(path, change);
+        }
+    }
+    MTP_LOG_INFO("imported" << m_changes.size() << "puoids from" << m_path);
+}
+
+/************************************************************
+ * void PuoidDb::replayJournal
+ ***********************************************************/
+void PuoidDb::replayJournal(const QString &path, bool truncateTorn)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return;
+    }
+    QByteArray data = file.readAll();
+    file.close();
+
+    const int headerSize = 1 + sizeof(quint32);
+    int pos = 0;
+    while (pos + headerSize <= data.size()) {
+        char op = data.at(pos);
+        quint32 length;
+        memcpy(&length, data.constData() + pos + 1, sizeof length);
+        qint64 recordSize = headerSize + qint64(length) + (op == JOURNAL_SET ? sizeof(MtpInt128) : 0);
+        if ((op != JOURNAL_SET && op != JOURNAL_REMOVE) || pos + recordSize > data.size()) {
+            break;
+        }
+
+        Change change;
+        change.removed = op == JOURNAL_REMOVE;
+        if (!change.removed) {
+            memcpy(change.puoid.val, data.constData() + pos + headerSize + length, sizeof change.puoid.val);
+            if (change.puoid > m_largestPuoid) {
+                m_largestPuoid = change.puoid;
+            }
+        }
+        m_changes.insert(QString::fromUtf8(data.constData() + pos + headerSize, length), change);
+        ++m_journaled;
+        pos += recordSize;
+    }
+
+    // The last record may have been cut short by a crash
+    if (pos < data.size()) {
+        MTP_LOG_WARNING("puoid journal" << path << "is truncated at" << pos);
+        if (truncateTorn) {
+            QFile::resize(path, pos);
+        }
+    }
+}
+
+/************************************************************
+ * void PuoidDb::appendJournal
+ ***********************************************************/
+void PuoidDb::appendJournal(char op, const QString &path, const MtpInt128 &puoid)
+{
+    QByteArray name = path.toUtf8();
+    quint32 length = name.size();
+    QByteArray record;
+    record.reserve(1 + sizeof length + length + sizeof puoid.val);
+    record.append(op);
+    record.append(reinterpret_cast<const char *>(&length), sizeof length);
+    record.append(name);
+    if (op == JOURNAL_SET) {
+        record.append(puoid.val, sizeof puoid.val);
+    }
+    if (m_journal.write(record) != record.size()) {
+        MTP_LOG_WARNING("cannot write puoid journal" << m_journal.fileName());
+    }
+
+    // Changes made while handling one event are written out together
+    if (!m_flushPending) {
+        m_flushPending = true;
+        QMetaObject::invokeMethod(this, "flushJournal", Qt::QueuedConnection);
+    }
+
+    if (++m_journaled >= qMax<int>(MIN_COMPACTION_CHANGES, m_baseCount / 4)) {
+        startCompaction();
+    }
+}
+
+/************************************************************
+ * void PuoidDb::flushJournal
+ ***********************************************************/
+void PuoidDb::flushJournal()
+{
+    m_flushPending = false;
+    m_journal.flush();
+}
+
+/************************************************************
+ * void PuoidDb::rewriteJournal
+ ***********************************************************/
+void PuoidDb::rewriteJournal()
+{
+    // m_changes has everything since the database file was written
+    m_journal.close();
+    QSaveFile file(m_journal.fileName());
+    if (file.open(QIODevice::WriteOnly)) {
+        for (Changes::const_iterator i = m_changes.constBegin(); i != m_changes.constEnd(); ++i) {
+            QByteArray name = i.key().toUtf8();
+            quint32 length = name.size();
+            file.putChar(i.value().removed ? JOURNAL_REMOVE : JOURNAL_SET);
+            file.write(reinterpret_cast<const char *>(&length), sizeof length);
+            file.write(name);
+            if (!i.value().removed) {
+                file.write(i.value().puoid.val, sizeof i.value().puoid.val);
+            }
+        }
+        if (file.commit()) {
+            QFile::remove(m_path + ".journal.old");
+        }
+    }
+    m_journal.open(QIODevice::WriteOnly | QIODevice::Append);
+    m_journaled = m_changes.size();
+}
+
+/************************************************************
+ * void PuoidDb::startCompaction
+ ***********************************************************/
+void PuoidDb::startCompaction()
+{
+    if (m_compactionRunning || m_path.isEmpty()) {
+        return;
+    }
+
+    // Changes made from now on go to a new journal, the old one is removed
+    // once the database file with its changes has been written
+    m_journal.close();
+    m_flushPending = false;
+    if (rename(QFile::encodeName(m_journal.fileName()).constData(),
+               QFile::encodeName(m_path + ".journal.old").constData())
+        == -1) {
+        m_journal.open(QIODevice::WriteOnly | QIODevice::Append);
+        return;
+    }
+    m_journal.open(QIODevice::WriteOnly | QIODevice::Append);
+    m_journaled = 0;
+
+    m_compacting = m_changes;
+    m_compactionRunning = true;
+    m_pool.start(new CompactTask(this));
+}
+
+/************************************************************
+ * void PuoidDb::compactionFinished
+ ***********************************************************/
+void PuoidDb::compactionFinished(bool ok)
+{
+    m_compactionRunning = false;
+
+    if (ok && mapBase()) {
+        // Changes made during the compaction stay until the next one
+        for (Changes::const_iterator i = m_compacting.constBegin(); i != m_compacting.constEnd(); ++i) {
+            Changes::iterator change = m_changes.find(i.key());
+            if (change != m_changes.end() && change->removed == i->removed && change->puoid == i->puoid) {
+                m_changes.erase(change);
+            }
+        }
+        MTP_LOG_INFO("puoid db" << m_path << "compacted to" << m_baseCount << "puoids");
+    } else {
+        MTP_LOG_WARNING("cannot write puoid db" << m_path);
+        rewriteJournal();
+    }
+    m_compacting.clear();
+}
+
+/************************************************************
+ * void PuoidDb::compact
+ ***********************************************************/
+void PuoidDb::compact()
+{
+    // Let a running compaction finish first, the changes made during it
+    // are still to be written
+    m_pool.waitForDone();
+    QCoreApplication::sendPostedEvents(this, QEvent::MetaCall);
+
+    if (!m_changes.isEmpty()) {
+        startCompaction();
+        m_pool.waitForDone();
+        QCoreApplication::sendPostedEvents(this, QEvent::MetaCall);
+    }
+
+    // Changes that could not be compacted must not be lost in a power cut
+    m_flushPending = false;
+    if (m_journal.isOpen() && (!m_journal.flush() || fdatasync(m_journal.handle()) == -1)) {
+        MTP_LOG_WARNING("cannot sync puoid journal" << m_journal.fileName());
+    }
+}
+
+/************************************************************
+ * const PuoidDb::Record *PuoidDb::findRecord
+ ***********************************************************/
+const PuoidDb::Record *PuoidDb::findRecord(const QByteArray &path) const
+{
+    if (!m_base) {
+        return 0;
+    }
+    const Record *records = reinterpret_cast<const Record *>(m_base + sizeof(Header));
+    const char *strings = reinterpret_cast<const char *>(records + m_baseCount);
+
+    quint32 low = 0, high = m_baseCount;
+    while (low < high) {
+        quint32 middle = low + (high - low) / 2;
+        const Record &record = records[middle];
+        int order = comparePaths(strings + record.offset, record.length, path.constData(), path.size());
+        if (order == 0) {
+            return &record;
+        } else if (order < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return 0;
+}
+
+/************************************************************
+ * bool PuoidDb::find
+ ***********************************************************/
+bool PuoidDb::find(const QString &path, MtpInt128 &puoid) const
+{
+    Changes::const_iterator change = m_changes.constFind(path);
+    if (change != m_changes.constEnd()) {
+        if (change->removed) {
+            return false;
+        }
+        puoid = change->puoid;
+        return true;
+    }
+
+    const Record *record = findRecord(path.toUtf8());
+    if (!record) {
+        return false;
+    }
+    puoid = record->puoid;
+    return true;
+}
+
+/************************************************************
+ * bool PuoidDb::contains
+ ***********************************************************/
+bool PuoidDb::contains(const QString &path) const
+{
+    MtpInt128 puoid;
+    return find(path, puoid);
+}
+
+/************************************************************
+ * void PuoidDb::insert
+ ***********************************************************/
+void PuoidDb::insert(const QString &path, const MtpInt128 &puoid)
+{
+    MtpInt128 current;
+    if (find(path, current) && current == puoid) {
+        return;
+    }
+
+    Change change;
+    change.puoid = puoid;
+    change.removed = false;
+    m_changes.insert(path, change);
+    if (puoid > m_largestPuoid) {
+        m_largestPuoid = puoid;
+    }
+    appendJournal(JOURNAL_SET, path, puoid);
+}
+
+/************************************************************
+ * void PuoidDb::remove
+ ***********************************************************/
+void PuoidDb::remove(const QString &path)
+{
+    if (!contains(path)) {
+        return;
+    }
+
+    Change change;
+    change.removed = true;
+    m_changes.insert(path, change);
+    appendJournal(JOURNAL_REMOVE, path, change.puoid);
+}
+
+/************************************************************
+ * QStringList PuoidDb::paths
+ ***********************************************************/
+QStringList PuoidDb::paths() const
+{
+    QStringList result;
+    if (m_base) {
+        const Record *records = reinterpret_cast<const Record *>(m_base + sizeof(Header));
+        const char *strings = reinterpret_cast<const char *>(records + m_baseCount);
+        result.reserve(m_baseCount + m_changes.size());
+        for (quint32 i = 0; i < m_baseCount; ++i) {
+            QString path = QString::fromUtf8(strings + records[i].offset, records[i].length);
+            if (!m_changes.contains(path)) {
+                result.append(path);
+            }
+        }
+    }
+    for (Changes::const_iterator i = m_changes.constBegin(); i != m_changes.constEnd(); ++i) {
+        if (!i->removed) {
+            result.append(i.key());
+        }
+    }
+    return result;
+}
+
+/************************************************************
+ * void PuoidDb::removeUnused
+ ***********************************************************/
+void PuoidDb::removeUnused(PathFilter &filter)
+{
+    // Only the paths that are removed get converted
+    QStringList unused;
+    QSet<QByteArray> changed;
+    changed.reserve(m_changes.size());
+    for (Changes::const_iterator i = m_changes.constBegin(); i != m_changes.constEnd(); ++i) {
+        QByteArray path = i.key().toUtf8();
+        if (!i->removed && !filter.keep(path.constData(), path.size())) {
+            unused.append(i.key());
+        }
+        changed.insert(path);
+    }
+
+    if (m_base) {
+        const Record *records = reinterpret_cast<const Record *>(m_base + sizeof(Header));
+        const char *strings = reinterpret_cast<const char *>(records + m_baseCount);
+        for (quint32 i = 0; i < m_baseCount; ++i) {
+            const char *path = strings + records[i].offset;
+            int length = records[i].length;
+            if (!changed.isEmpty() && changed.contains(QByteArray::fromRawData(path, length))) {
+                continue;
+            }
+            if (!filter.keep(path, length)) {
+                unused.append(QString::fromUtf8(path, length));
+            }
+        }
+    }
+
+    foreach (const QString &path, unused) {
+        remove(path);
+    }
+}
+
+/************************************************************
+ * const MtpInt128 &PuoidDb::largestPuoid
+ ***********************************************************/
+const MtpInt128 &PuoidDb::largestPuoid() const
+{
+    return m_largestPuoid;
+}
+
+/************************************************************
+ * void PuoidDb::setLargestPuoid
+ ***********************************************************/
+void PuoidDb::setLargestPuoid(const MtpInt128 &puoid)
+{
+    m_largestPuoid = puoid;
+}
@@ -0,0 +1,161 @@
+/*
+* This file is part of libmeegomtp package
+*
+* Copyright (c) 2010 Nokia Corporation. All rights reserved.
+* Copyright (c) 2013 - 2020 Jolla Ltd.
+* Copyright (c) 2020 Open Mobile Platform LLC.
+*
+* Contact: Deepak Kodihalli <deepak.kodihalli@nokia.com>
+*
+* Redistribution and use in source and binary forms, with or without modification,
+* are permitted provided that the following conditions are met:
+*
+* Redistributions of source code must retain the above copyright notice, this list
+* of conditions and the following disclaimer. Redistributions in binary form must
+* reproduce the above copyright notice, this list of conditions and the following
+* disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of Nokia Corporation nor the names of its contributors may be
+* used to endorse or promote products derived from this software without specific
+* prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+* IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+* INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+* BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+* DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+* LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+* OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+* OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*/
+
+#ifndef PUOIDDB_H
+#define PUOIDDB_H
+
+#include <QObject>
+#include <QFile>
+#include <QHash>
+#include <QString>
+#include <QStringList>
+#include <QThreadPool>
+#include "mtptypes.h"
+
+namespace meegomtp1dot0 {
+/// PuoidDb keeps the persistent unique object identifiers of a storage
+/// by object path across MTP sessions.
+///
+/// The database is a file of records sorted by path, followed by a table
+/// of the paths in UTF-8. It is mapped to memory and looked up with a
+/// binary search, so nothing needs to be parsed at startup. Changes are
+/// kept in memory and appended to a journal next to the file, which is
+/// replayed when the database is opened again, so a crash does not lose
+/// them. Once enough changes have been journaled they are merged into a
+/// new file in the background.
+class PuoidDb : public QObject
+{
+    Q_OBJECT
+
+public:
+    /// Constructor.
+    explicit PuoidDb(QObject *parent = 0);
+
+    /// Destructor, waits for an ongoing compaction. Changes that have
+    /// not been compacted stay in the journal.
+    ~PuoidDb();
+
+    /// Opens the database and replays its journal. A database in the
+    /// format of earlier versions is imported.
+    /// \param path [in] path of the database file.
+    void open(const QString &path);
+
+    /// Looks up the puoid of a path.
+    /// \param path [in] the object path.
+    /// \param puoid [out] the puoid of the path, if it has one.
+    /// \return true if the path has a puoid.
+    bool find(const QString &path, MtpInt128 &puoid) const;
+
+    /// \return true if the path has a puoid.
+    bool contains(const QString &path) const;
+
+    /// Gives a path a puoid.
+    void insert(const QString &path, const MtpInt128 &puoid);
+
+    /// Removes the puoid of a path.
+    void remove(const QString &path);
+
+    /// \return all the paths that have a puoid.
+    QStringList paths() const;
+
+    /// Decides which puoids removeUnused() keeps.
+    class PathFilter
+    {
+    public:
+        virtual ~PathFilter() {}
+
+        /// \param path [in] a path that has a puoid, in UTF-8 and not null terminated.
+        /// \param length [in] length of the path in bytes.
+        /// \return true if the puoid of the path is to be kept.
+        virtual bool keep(const char *path, int length) = 0;
+    };
+
+    /// Removes the puoids of the paths that filter does not keep. Paths are
+    /// passed as stored, without a string being built for each, and those in
+    /// the database file in sorted order.
+    void removeUnused(PathFilter &filter);
+
+    /// The largest puoid given out so far, also to objects that are gone.
+    const MtpInt128 &largestPuoid() const;
+    void setLargestPuoid(const MtpInt128 &puoid);
+
+    /// Merges all changes into the database file and empties the journal,
+    /// waiting for it to complete. Whatever is left in the journal is
+    /// synced to the storage.
+    void compact();
+
+private slots:
+    /// Writes out the journal, so that changes survive a crash.
+    void flushJournal();
+
+    /// Takes the new database file into use after a compaction.
+    /// \param ok [in] false if the file could not be written.
+    void compactionFinished(bool ok);
+
+private:
+    struct Header;
+    struct Record;
+    class CompactTask;
+
+    /// A change not in the database file yet.
+    struct Change
+    {
+        MtpInt128 puoid;
+        bool removed;
+    };
+    typedef QHash<QString, Change> Changes;
+
+    bool mapBase();
+    void importLegacy();
+    void replayJournal(const QString &path, bool truncateTorn);
+    void appendJournal(char op, const QString &path, const MtpInt128 &puoid);
+    void rewriteJournal();
+    void startCompaction();
+    const Record *findRecord(const QByteArray &path) const;
+
+    QString m_path;           ///< the database file
+    QFile *m_baseFile;        ///< m_path, mapped to memory
+    const uchar *m_base;      ///< the mapped database, 0 if there is none
+    quint32 m_baseCount;      ///< number of records in m_base
+    Changes m_changes;        ///< changes since the database file was written
+    QFile m_journal;          ///< m_changes are appended here
+    int m_journaled;          ///< records appended to the journal since the last compaction
+    bool m_flushPending;      ///< flushJournal() is queued
+    MtpInt128 m_largestPuoid;
+    QThreadPool m_pool;       ///< runs the compaction
+    Changes m_compacting;     ///< the changes being merged by the ongoing compaction
+    bool m_compactionRunning;
+};
+}
+
+#endif
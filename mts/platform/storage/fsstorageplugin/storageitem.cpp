@@ -34,18 +34,99 @@
 #include "storageitem.h"
 #include "trace.h"
 
+#include <QVarLengthArray>
+
+#include <new>
+#include <stdlib.h>
+
 using namespace meegomtp1dot0;
 
+/* Items are allocated one chunk at a time and recycled through a free
+ * list per chunk, so that a tree of tens of thousands of objects neither
+ * pays the heap's per-allocation overhead nor ends up scattered across the
+ * heap. Chunks are aligned to their size, which finds the chunk of an item
+ * from its address. The chunk an item was last deleted from is used first.
+ * Once all items of a chunk are gone it is given back, except for one
+ * chunk kept around for reuse. Items are only ever created and destroyed
+ * on the main thread. */
+static const size_t CHUNK_SIZE = 32 * 1024;
+
+union alignas(StorageItem) StorageItemSlot
+{
+    StorageItemSlot *next;
+    char item[sizeof(StorageItem)];
+};
+
+struct StorageItemChunkHeader
+{
+    StorageItemChunkHeader *prev; ///< previous chunk with free slots
+    StorageItemChunkHeader *next; ///< next chunk with free slots
+    StorageItemSlot *freeSlots;
+    int used;
+};
+
+static const int ITEMS_PER_CHUNK = (CHUNK_SIZE - sizeof(StorageItemChunkHeader)) / sizeof(StorageItemSlot);
+
+struct StorageItemChunk : StorageItemChunkHeader
+{
+    StorageItemSlot slots[ITEMS_PER_CHUNK];
+};
+Q_STATIC_ASSERT(sizeof(StorageItemChunk) <= CHUNK_SIZE);
+
+static StorageItemChunkHeader *partialChunks = 0; ///< chunks with free slots
+static StorageItemChunkHeader *spareChunk = 0;    ///< the empty chunk among them, if any
+
+static void linkChunk(StorageItemChunkHeader *chunk)
+{
+    chunk->prev = 0;
+    chunk->next = partialChunks;
+    if (partialChunks) {
+        partialChunks->prev = chunk;
+    }
+    partialChunks = chunk;
+}
+
+static void unlinkChunk(StorageItemChunkHeader *chunk)
+{
+    if (chunk->prev) {
+        chunk->prev->next = chunk->next;
+    } else {
+        partialChunks = chunk->next;
+    }
+    if (chunk->next) {
+        chunk->next->prev = chunk->prev;
+    }
+}
+
+static StorageItemChunk *newChunk()
+{
+    void *memory = 0;
+    if (posix_memalign(&memory, CHUNK_SIZE, sizeof(StorageItemChunk))) {
+        throw std::bad_alloc();
+    }
+    StorageItemChunk *chunk = static_cast<StorageItemChunk *>(memory);
+    chunk->freeSlots = 0;
+    chunk->used = 0;
+    for (int i = ITEMS_PER_CHUNK - 1; i >= 0; --i) {
+        chunk->slots[i].next = chunk->freeSlots;
+        chunk->freeSlots = &chunk->slots[i];
+    }
+    return chunk;
+}
+
 StorageItem::StorageItem()
     : m_handle(0)
-    , m_path("")
     , m_wd(-1)
-    , m_objectInfo(0)
     , m_parent(0)
     , m_firstChild(0)
     , m_nextSibling(0)
+    , m_objectInfo(0)
+    , m_size(0)
+    , m_mtime(0)
     , m_puoid(MtpInt128(0))
+    , m_format(MTP_OBF_FORMAT_Undefined)
     , m_eventsEnabled(false)
+    , m_attributesUnverified(false)
 {}
 
 StorageItem::~StorageItem()
@@ -54,15 +135,91 @@ StorageItem::~StorageItem()
     m_objectInfo = nullptr;
 }
 
+void *StorageItem::operator new(size_t size)
+{
+    if (size != sizeof(StorageItem)) {
+        return ::operator new(size);
+    }
+
+    if (!partialChunks) {
+        linkChunk(newChunk());
+    }
+
+    StorageItemChunkHeader *chunk = partialChunks;
+    if (chunk == spareChunk) {
+        spareChunk = 0;
+    }
+    StorageItemSlot *slot = chunk->freeSlots;
+    chunk->freeSlots = slot->next;
+    if (++chunk->used == ITEMS_PER_CHUNK) {
+        unlinkChunk(chunk);
+    }
+    return slot;
+}
+
+void StorageItem::operator delete(void *item, size_t size)
+{
+    if (!item) {
+        return;
+    }
+    if (size != sizeof(StorageItem)) {
+        ::operator delete(item);
+        return;
+    }
+
+    StorageItemChunkHeader *chunk
+        = reinterpret_cast<StorageItemChunkHeader *>(quintptr(item) & ~quintptr(CHUNK_SIZE - 1));
+    StorageItemSlot *slot = static_cast<StorageItemSlot *>(item);
+    slot->next = chunk->freeSlots;
+    chunk->freeSlots = slot;
+    if (chunk->used-- != ITEMS_PER_CHUNK) {
+        unlinkChunk(chunk);
+    }
+    linkChunk(chunk);
+
+    if (!chunk->used) {
+        if (spareChunk) {
+            unlinkChunk(spareChunk);
+            free(spareChunk);
+        }
+        spareChunk = chunk;
+    }
+}
+
 void StorageItem::setEventsEnabled(bool enabled)
 {
     if (m_eventsEnabled != enabled) {
         m_eventsEnabled = enabled;
         if (m_eventsEnabled)
-            MTP_LOG_INFO("events enabled for:" << m_path);
+            MTP_LOG_INFO("events enabled for:" << path());
         else
-            MTP_LOG_INFO("events disabled for:" << m_path);
+            MTP_LOG_INFO("events disabled for:" << path());
+    }
+}
+
+QString StorageItem::path() const
+{
+    if (!m_parent) {
+        return m_name;
+    }
+
+    // Collect the names from the root down, then join them in one allocation
+    int length = 0;
+    QVarLengthArray<const StorageItem *, 16> chain;
+    for (const StorageItem *item = this; item; item = item->m_parent) {
+        chain.append(item);
+        length += item->m_name.size() + 1;
+    }
+
+    QString result;
+    result.reserve(length);
+    for (int i = chain.size() - 1; i >= 0; --i) {
+        if (i != chain.size() - 1) {
+            result += QLatin1Char('/');
+        }
+        result += chain[i]->m_name;
     }
+    return result;
 }
 
 bool StorageItem::eventsAreEnabled() const
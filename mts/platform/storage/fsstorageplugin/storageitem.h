@@ -33,7 +33,9 @@
 #define STORAGEITEM_H
 
 #include "mtptypes.h"
+#include <QHash>
 #include <QString>
+#include <time.h>
 
 namespace meegomtp1dot0 {
 class StorageItem
@@ -50,28 +52,44 @@ public:
     /// Constructor
     ~StorageItem();
 
+    /// Storage items are carved out of chunks shared by all storages
+    static void *operator new(size_t size);
+
+    /// Returns the item's slot for reuse by the next allocation
+    static void operator delete(void *item, size_t size);
+
     /// Allow/deny sending object change notifications
     void setEventsEnabled(bool enabled);
 
     /// Is sending of object changed notifications allowed
     bool eventsAreEnabled() const;
 
-    // Allow read access to item path
-    const QString &path() const
+    /// Full pathname of the item, composed from the names of its ancestors
+    QString path() const;
+
+    /// Name of the item within its parent directory
+    const QString &name() const
     {
-        return m_path;
+        return m_name;
     }
 
 private:
+    // Fields used when walking the tree come first, the rest is seldom touched
     ObjHandle m_handle; ///< the item's handle
-    QString m_path; ///< the pathname by which this item is identified in the storage.
     int m_wd; ///< The item's iNotify watch descriptor. This will be -1 for non-directories
-    MTPObjectInfo *m_objectInfo; ///< the objectinfo dataset for this item.
     StorageItem *m_parent; ///< this item's parent.
     StorageItem *m_firstChild; ///< this item's first child.
     StorageItem *m_nextSibling; ///< this item's first sibling.
+    MTPObjectInfo *m_objectInfo; ///< the objectinfo dataset for this item, populated when first needed.
+    quint64 m_size; ///< file size the objectinfo dataset is populated from.
+    time_t m_mtime; ///< modification time the objectinfo dataset is populated from.
+    QString m_name; ///< the item's name in its parent; the storage root holds the full storage path.
+    QHash<QString, StorageItem *> m_children; ///< this item's children indexed by name.
     MtpInt128 m_puoid;
+    // The small fields share the tail of the item
+    quint16 m_format; ///< the item's object format.
     bool m_eventsEnabled;
+    bool m_attributesUnverified; ///< m_size and m_mtime come from the index snapshot and may be out of date
 };
 }
 
@@ -29,15 +29,21 @@
 *
 */
 
+#include <sys/stat.h>
 #include <unistd.h>
 #include "fsstorageplugin_test.h"
 #include "fsstorageplugin.h"
 #include "storageitem.h"
+#include "fsfanotify.h"
+#include "puoiddb.h"
+#include <QFileInfo>
 #include <QImage>
 #include <QPainter>
 #include <QRadialGradient>
 #include <QSignalSpy>
 
+#include <algorithm>
+
 /* Path to root of primary test storage area */
 #define STORAGE1 "/tmp/mtptests/storage1"
 
@@ -70,6 +76,39 @@ static bool makeTestFile_(const char *path, const char *data, size_t size)
 }
 #define makeTestFile(path, data) makeTestFile_(path, data, sizeof data - 1)
 
+static void appendInotifyEvent(QByteArray &batch, int wd, uint32_t mask, const char *name)
+{
+    struct inotify_event event;
+    memset(&event, 0, sizeof event);
+    event.wd = wd;
+    event.mask = mask;
+    // The name is null terminated and padded, like the kernel does
+    event.len = (strlen(name) + 4) & ~3;
+    batch.append(reinterpret_cast<const char *>(&event), sizeof event);
+    QByteArray paddedName(event.len, '\0');
+    memcpy(paddedName.data(), name, strlen(name));
+    batch.append(paddedName);
+}
+
+/* Keeps the puoids of the paths in a list. */
+class ListedPathFilter : public PuoidDb::PathFilter
+{
+public:
+    ListedPathFilter(const QStringList &paths)
+        : m_paths(paths)
+        , m_checked(0)
+    {}
+
+    bool keep(const char *path, int length)
+    {
+        ++m_checked;
+        return m_paths.contains(QString::fromUtf8(path, length));
+    }
+
+    QStringList m_paths;
+    int m_checked;
+};
+
 static bool runCommand(const char *command)
 {
     int status = system(command);
@@ -142,15 +181,222 @@ void FSStoragePlugin_test::testStorageCreation()
     QVERIFY(m_storage->m_root->m_parent == 0);
     QVERIFY(m_storage->m_root->m_firstChild != 0);
     QVERIFY(m_storage->m_root->m_nextSibling == 0);
-    QCOMPARE(m_storage->m_root->m_path, QString(STORAGE1));
+    QCOMPARE(m_storage->m_root->path(), QString(STORAGE1));
 
     // Check whether child items are correctly linked to their parents.
     StorageItem *parentItem = m_storage->findStorageItemByPath(STORAGE1 "/subdir1");
     StorageItem *childItem = m_storage->findStorageItemByPath(STORAGE1 "/subdir1/file1");
     QVERIFY(parentItem && childItem);
+    m_storage->populateObjectInfo(childItem);
     QCOMPARE(childItem->m_objectInfo->mtpParentObject, parentItem->m_handle);
 }
 
+void FSStoragePlugin_test::testScannedObjectInfo()
+{
+    // Items added from the scan must match what the file system says.
+    QHash<ObjHandle, StorageItem *>::const_iterator i;
+    for (i = m_storage->m_objectHandlesMap.constBegin(); i != m_storage->m_objectHandlesMap.constEnd(); ++i) {
+        StorageItem *item = i.value();
+        if (item == m_storage->m_root)
+            continue;
+        QFileInfo info(item->path());
+        m_storage->populateObjectInfo(item);
+        QCOMPARE(item->m_handle, i.key());
+        QCOMPARE(item->m_parent->path(), info.absolutePath());
+        QCOMPARE(item->m_objectInfo->mtpParentObject, item->m_parent->m_handle);
+        QCOMPARE(item->m_objectInfo->mtpFileName, info.fileName());
+        QCOMPARE(item->m_objectInfo->mtpObjectCompressedSize, info.isDir() ? 0 : quint64(info.size()));
+        quint16 format = info.isDir()
+            ? MTP_OBF_FORMAT_Association
+            : m_storage->m_formatByExtTable.value(info.fileName().section('.', -1).toLower(), MTP_OBF_FORMAT_Undefined);
+        QCOMPARE(item->m_objectInfo->mtpObjectFormat, format);
+        QCOMPARE(item->m_objectInfo->mtpModificationDate, m_storage->getModifiedDate(item));
+        QCOMPARE(m_storage->m_puoidToHandleMap.contains(item->m_puoid), !info.isDir());
+    }
+}
+
+void FSStoragePlugin_test::testIndexSnapshot()
+{
+    int count = m_storage->m_objectHandlesMap.size();
+    delete m_storage;
+    m_storage = nullptr;
+
+    // The tree comes back from the snapshot without scanning
+    FSStoragePlugin *storage = new FSStoragePlugin(1, MTP_STORAGE_TYPE_FixedRAM, STORAGE1, "media", "Phone Memory");
+    QHash<QString, qint64> knownDirs;
+    QVERIFY(storage->loadIndexSnapshot(knownDirs));
+    QCOMPARE(storage->m_objectHandlesMap.size(), count);
+    QCOMPARE(knownDirs.size(), 5);
+    QVERIFY(knownDirs.contains(STORAGE1 "/subdir1/subdir3"));
+    StorageItem *item = storage->findStorageItemByPath(STORAGE1 "/subdir2/fileC");
+    QVERIFY(item);
+    QVERIFY(!item->m_objectInfo);
+    storage->populateObjectInfo(item);
+    QCOMPARE(item->m_objectInfo->mtpObjectCompressedSize, quint64(sizeof content_size_100 - 1));
+    QCOMPARE(item->m_objectInfo->mtpParentObject, item->m_parent->m_handle);
+
+    // A file rewritten in place leaves the directory mtime alone
+    QVERIFY(makeTestFile(STORAGE1 "/subdir2/fileB", content_size_100));
+    item = storage->findStorageItemByPath(STORAGE1 "/subdir2/fileB");
+    QVERIFY(item);
+    storage->populateObjectInfo(item);
+    QCOMPARE(item->m_objectInfo->mtpObjectCompressedSize, quint64(sizeof content_size_100 - 1));
+    QVERIFY(makeTestFile(STORAGE1 "/subdir2/fileB", content_size_6));
+    delete storage;
+
+    // Changes made in the meantime are picked up after ready
+    QVERIFY(makeTestFile(STORAGE1 "/subdir2/fileD", content_size_6));
+    m_storage = new FSStoragePlugin(1, MTP_STORAGE_TYPE_FixedRAM, STORAGE1, "media", "Phone Memory");
+    setupPlugin(m_storage);
+    QVERIFY(m_storage->findStorageItemByPath(STORAGE1 "/subdir2/fileD"));
+    QCOMPARE(m_storage->m_objectHandlesMap.size(), count + 1);
+
+    delete m_storage;
+    QVERIFY(QFile::remove(STORAGE1 "/subdir2/fileD"));
+    m_storage = new FSStoragePlugin(1, MTP_STORAGE_TYPE_FixedRAM, STORAGE1, "media", "Phone Memory");
+    setupPlugin(m_storage);
+    QVERIFY(!m_storage->findStorageItemByPath(STORAGE1 "/subdir2/fileD"));
+    QCOMPARE(m_storage->m_objectHandlesMap.size(), count);
+
+    // Asking for all objects waits for the validation scan to finish
+    delete m_storage;
+    QVERIFY(makeTestFile(STORAGE1 "/subdir2/fileD", content_size_6));
+    m_storage = new FSStoragePlugin(1, MTP_STORAGE_TYPE_FixedRAM, STORAGE1, "media", "Phone Memory");
+    m_storage->enumerateStorage_worker();
+    QVERIFY(m_storage->m_validatingIndex);
+    QVERIFY(m_storage->m_unscannedDirs.isEmpty());
+    QVector<ObjHandle> handles;
+    QCOMPARE(m_storage->getObjectHandles(0, 0, handles), (MTPResponseCode) MTP_RESP_OK);
+    QVERIFY(!m_storage->m_scanner);
+    QVERIFY(handles.contains(handleForPath(STORAGE1 "/subdir2/fileD", m_storage)));
+
+    delete m_storage;
+    QVERIFY(QFile::remove(STORAGE1 "/subdir2/fileD"));
+    m_storage = new FSStoragePlugin(1, MTP_STORAGE_TYPE_FixedRAM, STORAGE1, "media", "Phone Memory");
+    setupPlugin(m_storage);
+}
+
+void FSStoragePlugin_test::testScanOnDemand()
+{
+    FSStoragePlugin *storage = new FSStoragePlugin(2, MTP_STORAGE_TYPE_FixedRAM, STORAGE1, "media", "Phone Memory");
+
+    // Pretend the background scan has not got anywhere yet
+    FSScanner::Entry rootEntry;
+    QVERIFY(FSScanner::statEntry(storage->m_storagePath, rootEntry));
+    storage->m_root = storage->addScannedItem(rootEntry, 0);
+    storage->setDirectoryUnscanned(storage->m_root, 0);
+    storage->m_scanner = new FSScanner(storage->m_storagePath, QStringList(), storage);
+
+    QVector<ObjHandle> handles;
+    QCOMPARE(storage->getObjectHandles(0, 0xFFFFFFFF, handles), (MTPResponseCode) MTP_RESP_OK);
+    QCOMPARE(handles.size(), 6);
+
+    ObjHandle subdir1 = handleForPath(STORAGE1 "/subdir1", storage);
+    QVERIFY(subdir1);
+    QVERIFY(storage->m_unscannedDirs.contains(subdir1));
+    QCOMPARE(storage->m_unscannedDirs.value(subdir1), 1);
+
+    // Batch reads of the listed directories don't scan them
+    MtpObjPropDesc nameDesc;
+    nameDesc.uPropCode = MTP_OBJ_PROP_Obj_File_Name;
+    nameDesc.uDataType = MTP_DATA_TYPE_STR;
+    QList<const MtpObjPropDesc *> properties;
+    properties << &nameDesc;
+    QMap<ObjHandle, QList<QVariant>> childValues;
+    QCOMPARE(storage->getChildPropertyValues(storage->m_root->m_handle, properties, childValues),
+             (MTPResponseCode) MTP_RESP_OK);
+    QVector<QList<QVariant>> values;
+    QCOMPARE(storage->getObjectPropertyValues(QVector<ObjHandle>() << subdir1, properties, values),
+             (MTPResponseCode) MTP_RESP_OK);
+    QCOMPARE(values[0][0].toString(), QString("subdir1"));
+    QVERIFY(storage->m_unscannedDirs.contains(subdir1));
+    QVERIFY(!storage->m_objectHandlesMap.value(subdir1)->m_eventsEnabled);
+
+    // Asking for the object info of one of them does
+    const MTPObjectInfo *objectInfo = 0;
+    QCOMPARE(storage->getObjectInfo(subdir1, objectInfo), (MTPResponseCode) MTP_RESP_OK);
+    QVERIFY(!storage->m_unscannedDirs.contains(subdir1));
+    QVERIFY(storage->m_objectHandlesMap.value(subdir1)->m_eventsEnabled);
+
+    // file1, file2, file3 and subdir3
+    handles.clear();
+    QCOMPARE(storage->getObjectHandles(0, subdir1, handles), (MTPResponseCode) MTP_RESP_OK);
+    QCOMPARE(handles.size(), 4);
+    QVERIFY(!storage->m_unscannedDirs.contains(subdir1));
+    QVERIFY(storage->m_unscannedDirs.contains(handleForPath(STORAGE1 "/subdir1/subdir3", storage)));
+
+    delete storage;
+}
+
+void FSStoragePlugin_test::testRelistBeforeWatch()
+{
+    FSStoragePlugin *storage = new FSStoragePlugin(2, MTP_STORAGE_TYPE_FixedRAM, STORAGE1, "media", "Phone Memory");
+    FSScanner::Entry rootEntry;
+    QVERIFY(FSScanner::statEntry(storage->m_storagePath, rootEntry));
+    storage->m_root = storage->addScannedItem(rootEntry, 0);
+    storage->setDirectoryUnscanned(storage->m_root, 0);
+    storage->m_scanner = new FSScanner(storage->m_storagePath, QStringList(), storage);
+
+    // A worker lists subdir2 before its watch gets added
+    FSScanner::Directory dir;
+    storage->m_scanner->listDirectory(STORAGE1 "/subdir2", dir);
+    QCOMPARE(dir.entries.size(), 3);
+    QVERIFY(makeTestFile(STORAGE1 "/subdir2/fileE", content_size_1));
+    storage->ensureDirectoryScanned(storage->m_root);
+    StorageItem *subdir2 = storage->findStorageItemByPath(STORAGE1 "/subdir2");
+    QVERIFY(subdir2);
+
+    // The file created in between is not lost
+    QVERIFY(!storage->relistIfStale(dir, subdir2));
+    QCOMPARE(dir.entries.size(), 4);
+    QCOMPARE(dir.entries.last().path, QString(STORAGE1 "/subdir2/fileE"));
+
+    // Checked only once for each watch
+    QVERIFY(!storage->m_watchedAt.contains(subdir2->m_handle));
+
+    delete storage;
+    QVERIFY(QFile::remove(STORAGE1 "/subdir2/fileE"));
+}
+
+void FSStoragePlugin_test::testRenameWhileScanning()
+{
+    FSStoragePlugin *storage = new FSStoragePlugin(2, MTP_STORAGE_TYPE_FixedRAM, STORAGE1, "media", "Phone Memory");
+    FSScanner::Entry rootEntry;
+    QVERIFY(FSScanner::statEntry(storage->m_storagePath, rootEntry));
+    storage->m_root = storage->addScannedItem(rootEntry, 0);
+    storage->setDirectoryUnscanned(storage->m_root, 0);
+    storage->m_scanner = new FSScanner(storage->m_storagePath, QStringList(), storage);
+    storage->ensureDirectoryScanned(storage->m_root);
+    ObjHandle subdir1 = handleForPath(STORAGE1 "/subdir1", storage);
+    QVERIFY(storage->m_unscannedDirs.contains(subdir1));
+
+    // subdir1 gets renamed before the scan has listed it
+    QVERIFY(QDir().rename(STORAGE1 "/subdir1", STORAGE1 "/subdir1renamed"));
+    struct inotify_event fromEvent;
+    memset(&fromEvent, 0, sizeof fromEvent);
+    fromEvent.wd = storage->m_root->m_wd;
+    fromEvent.mask = IN_MOVED_FROM | IN_ISDIR;
+    fromEvent.cookie = 1;
+    struct inotify_event toEvent = fromEvent;
+    toEvent.mask = IN_MOVED_TO | IN_ISDIR;
+    storage->handleFSMove(&fromEvent, "subdir1", &toEvent, "subdir1renamed");
+    QCOMPARE(handleForPath(STORAGE1 "/subdir1renamed", storage), subdir1);
+
+    // It is listed again under the new path
+    QTRY_VERIFY(storage->m_scanner->isFinished());
+    bool listed = false;
+    foreach (const FSScanner::Directory &dir, storage->m_scanner->takeResults()) {
+        if (dir.path == STORAGE1 "/subdir1renamed") {
+            QCOMPARE(dir.entries.size(), 4);
+            listed = true;
+        }
+    }
+    QVERIFY(listed);
+
+    delete storage;
+    QVERIFY(QDir().rename(STORAGE1 "/subdir1renamed", STORAGE1 "/subdir1"));
+}
+
 void FSStoragePlugin_test::testDeleteAll()
 {
     MTPResponseCode response = MTP_RESP_GeneralError;
@@ -161,7 +407,7 @@ void FSStoragePlugin_test::testDeleteAll()
     QCOMPARE(response, (MTPResponseCode) MTP_RESP_PartialDeletion);
 
     QCOMPARE(m_storage->m_objectHandlesMap.size(), 1);
-    QCOMPARE(m_storage->m_objectHandlesMap.size(), m_storage->m_pathNamesMap.size());
+    QCOMPARE(m_storage->m_objectHandlesMap.size(), itemCount(m_storage->m_root));
 
     delete m_storage;
     m_storage = nullptr;
@@ -175,7 +421,7 @@ void FSStoragePlugin_test::testDeleteAll()
 
 void FSStoragePlugin_test::testObjectHandlesCountAfterCreation()
 {
-    QCOMPARE(m_storage->m_objectHandlesMap.size(), m_storage->m_pathNamesMap.size());
+    QCOMPARE(m_storage->m_objectHandlesMap.size(), itemCount(m_storage->m_root));
     //QCOMPARE( m_storage->m_objectHandlesMap.size(), totalCount );
     totalCount = m_storage->m_objectHandlesMap.size();
     QVector<ObjHandle> objectHandles;
@@ -199,19 +445,19 @@ void FSStoragePlugin_test::testObjectHandlesCountAfterCreation()
 
     objectHandles.clear();
     response
-        = m_storage->getObjectHandles(0x0000, m_storage->m_pathNamesMap[QString(STORAGE1 "/subdir1")], objectHandles);
+        = m_storage->getObjectHandles(0x0000, handleForPath(STORAGE1 "/subdir1"), objectHandles);
     QCOMPARE(response, (MTPResponseCode) MTP_RESP_OK);
     QCOMPARE(objectHandles.size(), static_cast<qint32>(4));
 
     objectHandles.clear();
     response
-        = m_storage->getObjectHandles(0x0000, m_storage->m_pathNamesMap[QString(STORAGE1 "/subdir2")], objectHandles);
+        = m_storage->getObjectHandles(0x0000, handleForPath(STORAGE1 "/subdir2"), objectHandles);
     QCOMPARE(response, (MTPResponseCode) MTP_RESP_OK);
     QCOMPARE(objectHandles.size(), static_cast<qint32>(3));
 
     objectHandles.clear();
     response = m_storage->getObjectHandles(
-        0x0000, m_storage->m_pathNamesMap[QString(STORAGE1 "/subdir1/subdir3")], objectHandles);
+        0x0000, handleForPath(STORAGE1 "/subdir1/subdir3"), objectHandles);
     QCOMPARE(response, (MTPResponseCode) MTP_RESP_OK);
     QCOMPARE(objectHandles.size(), static_cast<qint32>(3));
 }
@@ -229,13 +475,13 @@ void FSStoragePlugin_test::testObjectHandlesAfterCreation()
 
     objectHandles.clear();
     response = m_storage->getObjectHandles(
-        0x0000, m_storage->m_pathNamesMap[QString(STORAGE1 "/subdir1/subdir3")], objectHandles);
+        0x0000, handleForPath(STORAGE1 "/subdir1/subdir3"), objectHandles);
     QCOMPARE(response, (MTPResponseCode) MTP_RESP_OK);
     QCOMPARE(objectHandles.size(), 3);
 
     objectHandles.clear();
     response
-        = m_storage->getObjectHandles(0x0000, m_storage->m_pathNamesMap[QString(STORAGE1 "/subdir1")], objectHandles);
+        = m_storage->getObjectHandles(0x0000, handleForPath(STORAGE1 "/subdir1"), objectHandles);
     QCOMPARE(response, (MTPResponseCode) MTP_RESP_OK);
     QCOMPARE(objectHandles.size(), 4);
 
@@ -257,7 +503,7 @@ void FSStoragePlugin_test::testInvalidGetObjectHandle()
     objectHandles.clear();
     response
         = m_storage
-              ->getObjectHandles(0x0000, m_storage->m_pathNamesMap[QString(STORAGE1 "/subdir1/file1")], objectHandles);
+              ->getObjectHandles(0x0000, handleForPath(STORAGE1 "/subdir1/file1"), objectHandles);
     QCOMPARE(response, (MTPResponseCode) MTP_RESP_InvalidParentObject);
     QCOMPARE(objectHandles.size(), static_cast<qint32>(0));
 }
@@ -280,35 +526,35 @@ void FSStoragePlugin_test::testObjectInfoAfterCreation()
 {
     const MTPObjectInfo *objectInfo = 0;
 
-    MTPResponseCode response = m_storage->getObjectInfo(m_storage->m_pathNamesMap[QString(STORAGE1)], objectInfo);
+    MTPResponseCode response = m_storage->getObjectInfo(handleForPath(STORAGE1), objectInfo);
     QCOMPARE(response, (MTPResponseCode) MTP_RESP_OK);
     QCOMPARE(objectInfo->mtpFileName, QString("storage1"));
 
-    response = m_storage->getObjectInfo(m_storage->m_pathNamesMap[QString(STORAGE1 "/subdir1")], objectInfo);
+    response = m_storage->getObjectInfo(handleForPath(STORAGE1 "/subdir1"), objectInfo);
     QCOMPARE(response, (MTPResponseCode) MTP_RESP_OK);
     QCOMPARE(objectInfo->mtpFileName, QString("subdir1"));
 
-    response = m_storage->getObjectInfo(m_storage->m_pathNamesMap[QString(STORAGE1 "/subdir2")], objectInfo);
+    response = m_storage->getObjectInfo(handleForPath(STORAGE1 "/subdir2"), objectInfo);
     QCOMPARE(response, (MTPResponseCode) MTP_RESP_OK);
     QCOMPARE(objectInfo->mtpFileName, QString("subdir2"));
 
-    response = m_storage->getObjectInfo(m_storage->m_pathNamesMap[QString(STORAGE1 "/subdir1/file1")], objectInfo);
+    response = m_storage->getObjectInfo(handleForPath(STORAGE1 "/subdir1/file1"), objectInfo);
     QCOMPARE(response, (MTPResponseCode) MTP_RESP_OK);
     QCOMPARE(objectInfo->mtpFileName, QString("file1"));
     QCOMPARE(objectInfo->mtpObjectCompressedSize, static_cast<quint64>(1));
 
-    response = m_storage->getObjectInfo(m_storage->m_pathNamesMap[QString(STORAGE1 "/subdir2/fileB")], objectInfo);
+    response = m_storage->getObjectInfo(handleForPath(STORAGE1 "/subdir2/fileB"), objectInfo);
     QCOMPARE(response, (MTPResponseCode) MTP_RESP_OK);
     QCOMPARE(objectInfo->mtpFileName, QString("fileB"));
     QCOMPARE(objectInfo->mtpObjectCompressedSize, static_cast<quint64>(6));
 
-    response = m_storage->getObjectInfo(m_storage->m_pathNamesMap[QString(STORAGE1 "/subdir1/subdir3")], objectInfo);
+    response = m_storage->getObjectInfo(handleForPath(STORAGE1 "/subdir1/subdir3"), objectInfo);
     QCOMPARE(response, (MTPResponseCode) MTP_RESP_OK);
     QCOMPARE(objectInfo->mtpFileName, QString("subdir3"));
     QCOMPARE(objectInfo->mtpObjectCompressedSize, static_cast<quint64>(0));
 
     response
-        = m_storage->getObjectInfo(m_storage->m_pathNamesMap[QString(STORAGE1 "/subdir1/subdir3/file3")], objectInfo);
+        = m_storage->getObjectInfo(handleForPath(STORAGE1 "/subdir1/subdir3/file3"), objectInfo);
     QCOMPARE(response, (MTPResponseCode) MTP_RESP_OK);
     QCOMPARE(objectInfo->mtpFileName, QString("file3"));
     QCOMPARE(objectInfo->mtpObjectCompressedSize, static_cast<quint64>(100));
@@ -323,21 +569,35 @@ void FSStoragePlugin_test::testFindByPath()
 
     storageItem = static_cast<StorageItem *>(m_storage->findStorageItemByPath(STORAGE1));
     QCOMPARE(storageItem != 0, true);
-    QCOMPARE(storageItem->m_path, QString(STORAGE1));
+    QCOMPARE(storageItem->path(), QString(STORAGE1));
     QCOMPARE(storageItem->m_handle, static_cast<quint32>(0));
 
     storageItem = static_cast<StorageItem *>(m_storage->findStorageItemByPath(STORAGE1 "/subdir1/subdir3"));
     QCOMPARE(storageItem != 0, true);
-    QCOMPARE(storageItem->m_path, QString(STORAGE1 "/subdir1/subdir3"));
+    QCOMPARE(storageItem->path(), QString(STORAGE1 "/subdir1/subdir3"));
 
     storageItem = static_cast<StorageItem *>(m_storage->findStorageItemByPath(STORAGE1 "/subdir2/fileC"));
     QCOMPARE(storageItem != 0, true);
-    QCOMPARE(storageItem->m_path, QString(STORAGE1 "/subdir2/fileC"));
+    QCOMPARE(storageItem->path(), QString(STORAGE1 "/subdir2/fileC"));
 
     storageItem = static_cast<StorageItem *>(m_storage->findStorageItemByPath("/tmp/NOmtptests/subdir2/fileC"));
     QCOMPARE(storageItem == 0, true);
 }
 
+void FSStoragePlugin_test::testStorageItemReuse()
+{
+    // A deleted item's slot is handed out again before a new chunk is taken
+    StorageItem *item = new StorageItem;
+    quintptr slot = reinterpret_cast<quintptr>(item);
+    delete item;
+
+    item = new StorageItem;
+    QCOMPARE(reinterpret_cast<quintptr>(item), slot);
+    QCOMPARE(item->m_wd, -1);
+    QVERIFY(!item->m_parent && !item->m_firstChild && !item->m_objectInfo);
+    delete item;
+}
+
 void FSStoragePlugin_test::testObjectHandle()
 {
     QCOMPARE(m_storage->checkHandle(0), static_cast<bool>(true));
@@ -366,11 +626,11 @@ void FSStoragePlugin_test::testWriteData()
 {
     MTPResponseCode response;
 
-    response = m_storage->writeData(m_storage->m_pathNamesMap[STORAGE1 "/file2"], "bbb", 3, true, false);
+    response = m_storage->writeData(handleForPath(STORAGE1 "/file2"), "bbb", 3, true, false);
     QCOMPARE(response, (MTPResponseCode) MTP_RESP_OK);
 
-    response = m_storage->writeData(m_storage->m_pathNamesMap[STORAGE1 "/file2"], "bbb", 3, false, true);
-    m_storage->writeData(m_storage->m_pathNamesMap[STORAGE1 "/file2"], 0, 0, false, true);
+    response = m_storage->writeData(handleForPath(STORAGE1 "/file2"), "bbb", 3, false, true);
+    m_storage->writeData(handleForPath(STORAGE1 "/file2"), 0, 0, false, true);
     QFile file(STORAGE1 "/file2");
     file.open(QIODevice::ReadOnly);
     QCOMPARE(response, (MTPResponseCode) MTP_RESP_OK);
@@ -383,6 +643,22 @@ void FSStoragePlugin_test::testWriteData()
     QCOMPARE(readBuf2, "bbbbbb\0");
     file.close();
 
+    // Data spanning several background write buffers
+    QByteArray chunk(64 * 1024, 'c');
+    for (int i = 0; i < 24; ++i) {
+        chunk[0] = char('a' + i);
+        response = m_storage->writeData(handleForPath(STORAGE1 "/file2"), chunk.constData(),
+                                        chunk.size(), i == 0, i == 23);
+        QCOMPARE(response, (MTPResponseCode) MTP_RESP_OK);
+    }
+    response = m_storage->writeData(handleForPath(STORAGE1 "/file2"), 0, 0, false, true);
+    QCOMPARE(response, (MTPResponseCode) MTP_RESP_OK);
+    file.open(QIODevice::ReadOnly);
+    QCOMPARE(file.size(), static_cast<long long>(24 * chunk.size()));
+    QVERIFY(file.seek(23 * chunk.size()));
+    QCOMPARE(file.read(1), QByteArray("x"));
+    file.close();
+
     response = m_storage->writeData(100, "bbb", 3, true, true);
     m_storage->writeData(100, 0, 0, false, true);
     QCOMPARE(response, (MTPResponseCode) MTP_RESP_InvalidObjectHandle);
@@ -395,7 +671,7 @@ void FSStoragePlugin_test::testReadData()
     MTPResponseCode response;
 
     readBuf = (char *) malloc(readBufLen);
-    response = m_storage->readData(m_storage->m_pathNamesMap[STORAGE1 "/subdir1/subdir3/file1"], readBuf, readBufLen, 0);
+    response = m_storage->readData(handleForPath(STORAGE1 "/subdir1/subdir3/file1"), readBuf, readBufLen, 0);
     QCOMPARE(response, (MTPResponseCode) MTP_RESP_OK);
     QCOMPARE(readBuf != 0, static_cast<bool>(true));
     QCOMPARE(readBufLen, 1);
@@ -405,13 +681,25 @@ void FSStoragePlugin_test::testReadData()
 
     readBufLen = 100;
     readBuf = (char *) malloc(readBufLen);
-    response = m_storage->readData(m_storage->m_pathNamesMap[STORAGE1 "/subdir1/subdir3/file3"], readBuf, readBufLen, 0);
+    response = m_storage->readData(handleForPath(STORAGE1 "/subdir1/subdir3/file3"), readBuf, readBufLen, 0);
     QCOMPARE(response, (MTPResponseCode) MTP_RESP_OK);
     QCOMPARE(readBuf != 0, static_cast<bool>(true));
     QCOMPARE(readBufLen, 100);
     QCOMPARE(readBuf[0], 'a');
     QCOMPARE(readBuf[99], 'a');
 
+    // The file stays open until the object is released
+    ObjHandle handle = handleForPath(STORAGE1 "/subdir1/subdir3/file3");
+    QVERIFY(m_storage->m_readFds.contains(handle));
+    m_storage->adviseSequentialRead(handle, 90, 100);
+    QCOMPARE(m_storage->m_readAhead.handle, handle);
+    QCOMPARE(m_storage->m_readAhead.advised, static_cast<quint64>(100));
+    response = m_storage->readData(handle, readBuf, 10, 90);
+    QCOMPARE(response, (MTPResponseCode) MTP_RESP_OK);
+    m_storage->releaseObjectData(handle);
+    QVERIFY(!m_storage->m_readFds.contains(handle));
+    QCOMPARE(m_storage->m_readAhead.handle, static_cast<ObjHandle>(0));
+
     quint32 invalidHandle = 0xdeadbeef;
     response = m_storage->readData(invalidHandle, readBuf, readBufLen, 0);
     QCOMPARE(response, (MTPResponseCode) MTP_RESP_InvalidObjectHandle);
@@ -420,6 +708,29 @@ void FSStoragePlugin_test::testReadData()
     readBuf = 0;
 }
 
+void FSStoragePlugin_test::testOpenObjectFd()
+{
+    MTPResponseCode response;
+    int fd = -1;
+    char readBuf[2] = {0, 0};
+
+    response = m_storage->openObjectFd(handleForPath(STORAGE1 "/subdir1/subdir3/file3"), fd);
+    QCOMPARE(response, (MTPResponseCode) MTP_RESP_OK);
+    QVERIFY(fd != -1);
+    QCOMPARE(pread(fd, readBuf, 1, 99), static_cast<ssize_t>(1));
+    QCOMPARE(readBuf[0], 'a');
+    close(fd);
+
+    response = m_storage->openObjectFd(handleForPath(STORAGE1 "/subdir1"), fd);
+    QCOMPARE(response, (MTPResponseCode) MTP_RESP_InvalidObjectHandle);
+    QCOMPARE(fd, -1);
+
+    quint32 invalidHandle = 0xdeadbeef;
+    response = m_storage->openObjectFd(invalidHandle, fd);
+    QCOMPARE(response, (MTPResponseCode) MTP_RESP_InvalidObjectHandle);
+    QCOMPARE(fd, -1);
+}
+
 void FSStoragePlugin_test::testAddFile()
 {
     MTPResponseCode response;
@@ -435,6 +746,19 @@ void FSStoragePlugin_test::testAddFile()
     response = m_storage->addItem(parentHandle, handle, &objectInfo);
     QCOMPARE(response, (MTPResponseCode) MTP_RESP_InvalidParentObject);
 
+    {
+        // Objects larger than the free space are refused up front
+        MTPStorageInfo storageInfo;
+        QCOMPARE(m_storage->storageInfo(storageInfo), (MTPResponseCode) MTP_RESP_OK);
+        objectInfo.mtpParentObject = 0xFFFFFFFF;
+        objectInfo.mtpFileName = "toobig";
+        objectInfo.mtpObjectCompressedSize = storageInfo.freeSpace + 1;
+        response = m_storage->addItem(parentHandle, handle, &objectInfo);
+        QCOMPARE(response, (MTPResponseCode) MTP_RESP_StoreFull);
+        QVERIFY(!QFile::exists(STORAGE1 "/toobig"));
+        QVERIFY(!m_storage->findStorageItemByPath(STORAGE1 "/toobig"));
+    }
+
     {
         // Add a file to root
         objectInfo.mtpParentObject = 0xFFFFFFFF;
@@ -446,7 +770,7 @@ void FSStoragePlugin_test::testAddFile()
         QCOMPARE(parentHandle, static_cast<quint32>(0));
         QCOMPARE(objectInfo.mtpParentObject, static_cast<quint32>(0));
         QCOMPARE(objectInfo.mtpFileName, QString("addfile"));
-        QCOMPARE(m_storage->m_pathNamesMap[STORAGE1 "/addfile"], static_cast<quint32>(handle));
+        QCOMPARE(handleForPath(STORAGE1 "/addfile"), static_cast<quint32>(handle));
         QCOMPARE(m_storage->m_objectHandlesMap[handle] != 0, true);
         QCOMPARE(m_storage->m_objectHandlesMap[handle]->m_parent->m_handle, static_cast<quint32>(0));
         response = m_storage->writeData(handle, "xxx", 3, true, true);
@@ -473,7 +797,7 @@ void FSStoragePlugin_test::testAddFile()
         QCOMPARE(parentHandle, static_cast<quint32>(0));
         QCOMPARE(objectInfo.mtpParentObject, static_cast<quint32>(0));
         QCOMPARE(objectInfo.mtpFileName, QString("addfile2"));
-        QCOMPARE(m_storage->m_pathNamesMap[STORAGE1 "/addfile2"], static_cast<quint32>(handle));
+        QCOMPARE(handleForPath(STORAGE1 "/addfile2"), static_cast<quint32>(handle));
         QCOMPARE(m_storage->m_objectHandlesMap[handle] != 0, true);
         QCOMPARE(m_storage->m_objectHandlesMap[handle]->m_parent->m_handle, static_cast<quint32>(0));
         response = m_storage->writeData(handle, "xxx", 3, true, true);
@@ -492,18 +816,18 @@ void FSStoragePlugin_test::testAddFile()
 
     {
         // Add a file to subdir1
-        objectInfo.mtpParentObject = m_storage->m_pathNamesMap[STORAGE1 "/subdir1"];
+        objectInfo.mtpParentObject = handleForPath(STORAGE1 "/subdir1");
         objectInfo.mtpFileName = "addfile";
         objectInfo.mtpObjectCompressedSize = 3;
         response = m_storage->addItem(parentHandle, handle, &objectInfo);
         QCOMPARE(response, (MTPResponseCode) MTP_RESP_OK);
         QCOMPARE(handle, static_cast<quint32>(++totalCount));
-        QCOMPARE(parentHandle, static_cast<quint32>(m_storage->m_pathNamesMap[STORAGE1 "/subdir1"]));
+        QCOMPARE(parentHandle, static_cast<quint32>(handleForPath(STORAGE1 "/subdir1")));
         QCOMPARE(objectInfo.mtpFileName, QString("addfile"));
-        QCOMPARE(m_storage->m_pathNamesMap[STORAGE1 "/subdir1/addfile"], static_cast<quint32>(handle));
+        QCOMPARE(handleForPath(STORAGE1 "/subdir1/addfile"), static_cast<quint32>(handle));
         QCOMPARE(m_storage->m_objectHandlesMap[handle] != 0, true);
         QCOMPARE(
-            m_storage->m_objectHandlesMap[handle]->m_parent->m_handle, m_storage->m_pathNamesMap[STORAGE1 "/subdir1"]);
+            m_storage->m_objectHandlesMap[handle]->m_parent->m_handle, handleForPath(STORAGE1 "/subdir1"));
         response = m_storage->writeData(handle, "xxx", 3, true, true);
         m_storage->writeData(handle, 0, 0, false, true);
         QCOMPARE(response, (MTPResponseCode) MTP_RESP_OK);
@@ -520,17 +844,17 @@ void FSStoragePlugin_test::testAddFile()
 
     {
         // Add a file to subdir3
-        objectInfo.mtpParentObject = m_storage->m_pathNamesMap[STORAGE1 "/subdir1/subdir3"];
+        objectInfo.mtpParentObject = handleForPath(STORAGE1 "/subdir1/subdir3");
         response = m_storage->addItem(parentHandle, handle, &objectInfo);
         QCOMPARE(response, (MTPResponseCode) MTP_RESP_OK);
         QCOMPARE(handle, static_cast<quint32>(++totalCount));
-        QCOMPARE(parentHandle, static_cast<quint32>(m_storage->m_pathNamesMap[STORAGE1 "/subdir1/subdir3"]));
+        QCOMPARE(parentHandle, static_cast<quint32>(handleForPath(STORAGE1 "/subdir1/subdir3")));
         QCOMPARE(objectInfo.mtpFileName, QString("addfile"));
-        QCOMPARE(m_storage->m_pathNamesMap[STORAGE1 "/subdir1/subdir3/addfile"], static_cast<quint32>(handle));
+        QCOMPARE(handleForPath(STORAGE1 "/subdir1/subdir3/addfile"), static_cast<quint32>(handle));
         QCOMPARE(m_storage->m_objectHandlesMap[handle] != 0, true);
         QCOMPARE(
             m_storage->m_objectHandlesMap[handle]->m_parent->m_handle,
-            m_storage->m_pathNamesMap[STORAGE1 "/subdir1/subdir3"]);
+            handleForPath(STORAGE1 "/subdir1/subdir3"));
         response = m_storage->writeData(handle, "xxx", 3, true, true);
         m_storage->writeData(handle, 0, 0, false, true);
         QCOMPARE(response, (MTPResponseCode) MTP_RESP_OK);
@@ -546,6 +870,17 @@ void FSStoragePlugin_test::testAddFile()
     }
 }
 
+void FSStoragePlugin_test::testReleaseReservedSpace()
+{
+    // An object still waiting for its data when the session closes
+    m_storage->m_reservedSpace.insert(0x7FFFFFFF, 1024);
+    QCOMPARE(m_storage->reservedSpace(), quint64(1024));
+
+    m_storage->sessionClosed();
+    QVERIFY(m_storage->m_reservedSpace.isEmpty());
+    QCOMPARE(m_storage->reservedSpace(), quint64(0));
+}
+
 void FSStoragePlugin_test::testAddDir()
 {
     MTPResponseCode response;
@@ -555,20 +890,20 @@ void FSStoragePlugin_test::testAddDir()
     //memset(&objectInfo, 0 , sizeof(MTPObjectInfo));
 
     //add a nested dir to subdir2 : D1, D1->D2, D1->D2->f
-    objectInfo.mtpParentObject = m_storage->m_pathNamesMap[STORAGE1 "/subdir2"];
+    objectInfo.mtpParentObject = handleForPath(STORAGE1 "/subdir2");
     objectInfo.mtpFileName = "D1";
     objectInfo.mtpObjectCompressedSize = 0;
     objectInfo.mtpObjectFormat = MTP_OBF_FORMAT_Association;
     response = m_storage->addItem(parentHandle, handle, &objectInfo);
     QCOMPARE(response, (MTPResponseCode) MTP_RESP_OK);
     QCOMPARE(handle, static_cast<quint32>(++totalCount));
-    QCOMPARE(parentHandle, static_cast<quint32>(m_storage->m_pathNamesMap[STORAGE1 "/subdir2"]));
+    QCOMPARE(parentHandle, static_cast<quint32>(handleForPath(STORAGE1 "/subdir2")));
     QCOMPARE(objectInfo.mtpFileName, QString("D1"));
-    QCOMPARE(m_storage->m_pathNamesMap[STORAGE1 "/subdir2/D1"], static_cast<quint32>(handle));
+    QCOMPARE(handleForPath(STORAGE1 "/subdir2/D1"), static_cast<quint32>(handle));
     QCOMPARE(m_storage->m_objectHandlesMap[handle] != 0, true);
     QCOMPARE(
         m_storage->m_objectHandlesMap[handle]->m_parent->m_handle,
-        static_cast<quint32>(m_storage->m_pathNamesMap[STORAGE1 "/subdir2"]));
+        static_cast<quint32>(handleForPath(STORAGE1 "/subdir2")));
 
     objectInfo.mtpParentObject = handle;
     objectInfo.mtpFileName = "D2";
@@ -577,7 +912,7 @@ void FSStoragePlugin_test::testAddDir()
     QCOMPARE(handle, static_cast<quint32>(++totalCount));
     QCOMPARE(objectInfo.mtpParentObject, static_cast<quint32>(parentHandle));
     QCOMPARE(objectInfo.mtpFileName, QString("D2"));
-    QCOMPARE(m_storage->m_pathNamesMap[STORAGE1 "/subdir2/D1/D2"], static_cast<quint32>(handle));
+    QCOMPARE(handleForPath(STORAGE1 "/subdir2/D1/D2"), static_cast<quint32>(handle));
     QCOMPARE(m_storage->m_objectHandlesMap[handle] != 0, true);
     QCOMPARE(m_storage->m_objectHandlesMap[handle]->m_parent->m_handle, static_cast<quint32>(parentHandle));
     QCOMPARE(m_storage->m_objectHandlesMap[parentHandle]->m_firstChild->m_handle, static_cast<quint32>(handle));
@@ -590,7 +925,7 @@ void FSStoragePlugin_test::testAddDir()
     QCOMPARE(handle, static_cast<quint32>(++totalCount));
     QCOMPARE(objectInfo.mtpParentObject, static_cast<quint32>(parentHandle));
     QCOMPARE(objectInfo.mtpFileName, QString("f1"));
-    QCOMPARE(m_storage->m_pathNamesMap[STORAGE1 "/subdir2/D1/D2/f1"], static_cast<quint32>(handle));
+    QCOMPARE(handleForPath(STORAGE1 "/subdir2/D1/D2/f1"), static_cast<quint32>(handle));
     QCOMPARE(m_storage->m_objectHandlesMap[handle] != 0, true);
     QCOMPARE(m_storage->m_objectHandlesMap[handle]->m_parent->m_handle, static_cast<quint32>(parentHandle));
     QCOMPARE(m_storage->m_objectHandlesMap[parentHandle]->m_firstChild->m_handle, static_cast<quint32>(handle));
@@ -610,7 +945,7 @@ void FSStoragePlugin_test::testAddDir()
 
 void FSStoragePlugin_test::testObjectHandlesCountAfterAddition()
 {
-    QCOMPARE(m_storage->m_objectHandlesMap.size(), m_storage->m_pathNamesMap.size());
+    QCOMPARE(m_storage->m_objectHandlesMap.size(), itemCount(m_storage->m_root));
     QCOMPARE(m_storage->m_objectHandlesMap.size(), totalCount + 1);
     QVector<ObjHandle> objectHandles;
 
@@ -635,19 +970,19 @@ void FSStoragePlugin_test::testObjectHandlesCountAfterAddition()
 
     objectHandles.clear();
     response
-        = m_storage->getObjectHandles(0x0000, m_storage->m_pathNamesMap[QString(STORAGE1 "/subdir1")], objectHandles);
+        = m_storage->getObjectHandles(0x0000, handleForPath(STORAGE1 "/subdir1"), objectHandles);
     QCOMPARE(response, (MTPResponseCode) MTP_RESP_OK);
     QCOMPARE(objectHandles.size(), static_cast<qint32>(5));
 
     objectHandles.clear();
     response
-        = m_storage->getObjectHandles(0x0000, m_storage->m_pathNamesMap[QString(STORAGE1 "/subdir2")], objectHandles);
+        = m_storage->getObjectHandles(0x0000, handleForPath(STORAGE1 "/subdir2"), objectHandles);
     QCOMPARE(response, (MTPResponseCode) MTP_RESP_OK);
     QCOMPARE(objectHandles.size(), static_cast<qint32>(4));
 
     objectHandles.clear();
     response = m_storage->getObjectHandles(
-        0x0000, m_storage->m_pathNamesMap[QString(STORAGE1 "/subdir1/subdir3")], objectHandles);
+        0x0000, handleForPath(STORAGE1 "/subdir1/subdir3"), objectHandles);
     QCOMPARE(response, (MTPResponseCode) MTP_RESP_OK);
     QCOMPARE(objectHandles.size(), static_cast<qint32>(4));
 
@@ -670,13 +1005,13 @@ void FSStoragePlugin_test::testObjectHandlesAfterAddition()
 
     objectHandles.clear();
     response = m_storage->getObjectHandles(
-        0x0000, m_storage->m_pathNamesMap[QString(STORAGE1 "/subdir1/subdir3")], objectHandles);
+        0x0000, handleForPath(STORAGE1 "/subdir1/subdir3"), objectHandles);
     QCOMPARE(response, (MTPResponseCode) MTP_RESP_OK);
     QCOMPARE(objectHandles.size(), 4);
 
     objectHandles.clear();
     response
-        = m_storage->getObjectHandles(0x0000, m_storage->m_pathNamesMap[QString(STORAGE1 "/subdir1")], objectHandles);
+        = m_storage->getObjectHandles(0x0000, handleForPath(STORAGE1 "/subdir1"), objectHandles);
     QCOMPARE(response, (MTPResponseCode) MTP_RESP_OK);
     QCOMPARE(objectHandles.size(), 5);
 
@@ -690,19 +1025,19 @@ void FSStoragePlugin_test::testObjectInfoAfterAddition()
 {
     const MTPObjectInfo *objectInfo;
 
-    MTPResponseCode response = m_storage->getObjectInfo(m_storage->m_pathNamesMap[QString(STORAGE1)], objectInfo);
+    MTPResponseCode response = m_storage->getObjectInfo(handleForPath(STORAGE1), objectInfo);
     QCOMPARE(response, (MTPResponseCode) MTP_RESP_OK);
     QCOMPARE(objectInfo->mtpFileName, QString("storage1"));
 
-    response = m_storage->getObjectInfo(m_storage->m_pathNamesMap[QString(STORAGE1 "/subdir1")], objectInfo);
+    response = m_storage->getObjectInfo(handleForPath(STORAGE1 "/subdir1"), objectInfo);
     QCOMPARE(response, (MTPResponseCode) MTP_RESP_OK);
     QCOMPARE(objectInfo->mtpFileName, QString("subdir1"));
 
-    response = m_storage->getObjectInfo(m_storage->m_pathNamesMap[QString(STORAGE1 "/subdir1/addfile")], objectInfo);
+    response = m_storage->getObjectInfo(handleForPath(STORAGE1 "/subdir1/addfile"), objectInfo);
     QCOMPARE(response, (MTPResponseCode) MTP_RESP_OK);
     QCOMPARE(objectInfo->mtpFileName, QString("addfile"));
 
-    response = m_storage->getObjectInfo(m_storage->m_pathNamesMap[QString(STORAGE1 "/subdir2/D1/D2/f1")], objectInfo);
+    response = m_storage->getObjectInfo(handleForPath(STORAGE1 "/subdir2/D1/D2/f1"), objectInfo);
     QCOMPARE(response, (MTPResponseCode) MTP_RESP_OK);
     QCOMPARE(objectInfo->mtpFileName, QString("f1"));
 
@@ -710,7 +1045,7 @@ void FSStoragePlugin_test::testObjectInfoAfterAddition()
 
     storageItem = static_cast<StorageItem *>(m_storage->findStorageItemByPath(STORAGE1 "/subdir2/D1/D2/f1"));
     QCOMPARE(storageItem != 0, true);
-    QCOMPARE(storageItem->m_path, QString(STORAGE1 "/subdir2/D1/D2/f1"));
+    QCOMPARE(storageItem->path(), QString(STORAGE1 "/subdir2/D1/D2/f1"));
 
     response = m_storage->getObjectInfo(100, objectInfo);
     QCOMPARE(response, (MTPResponseCode) MTP_RESP_InvalidObjectHandle);
@@ -817,6 +1152,67 @@ void FSStoragePlugin_test::testGetChildPropertyValues()
     m_storage->deleteItem(directoryHandle, MTP_OBF_FORMAT_Undefined);
 }
 
+void FSStoragePlugin_test::testGetObjectPropertyValues()
+{
+    MTPObjectInfo info;
+    info.mtpFileName = "batchDirectory";
+    info.mtpObjectFormat = MTP_OBF_FORMAT_Association;
+
+    ObjHandle unused;
+    ObjHandle directoryHandle;
+    QCOMPARE(m_storage->addItem(unused, directoryHandle, &info), (MTPResponseCode) MTP_RESP_OK);
+
+    info.mtpObjectFormat = MTP_OBF_FORMAT_Text;
+    info.mtpParentObject = directoryHandle;
+
+    ObjHandle file1Handle;
+    info.mtpFileName = "batchFile1";
+    QCOMPARE(m_storage->addItem(unused, file1Handle, &info), (MTPResponseCode) MTP_RESP_OK);
+
+    ObjHandle file2Handle;
+    info.mtpFileName = "batchFile2";
+    QCOMPARE(m_storage->addItem(unused, file2Handle, &info), (MTPResponseCode) MTP_RESP_OK);
+
+    MtpObjPropDesc nameDesc;
+    nameDesc.uPropCode = MTP_OBJ_PROP_Obj_File_Name;
+    nameDesc.uDataType = MTP_DATA_TYPE_STR;
+
+    MtpObjPropDesc parentDesc;
+    parentDesc.uPropCode = MTP_OBJ_PROP_Parent_Obj;
+    parentDesc.uDataType = MTP_DATA_TYPE_UINT32;
+
+    // Not known to the storage, left unset
+    MtpObjPropDesc genreDesc;
+    genreDesc.uPropCode = MTP_OBJ_PROP_Genre;
+    genreDesc.uDataType = MTP_DATA_TYPE_STR;
+
+    QList<const MtpObjPropDesc *> properties;
+    properties << &nameDesc << &genreDesc << &parentDesc;
+
+    // Results follow the order of the handles, not that of the storage
+    QVector<ObjHandle> handles;
+    handles << file2Handle << directoryHandle << file1Handle;
+
+    QVector<QList<QVariant>> values;
+    QCOMPARE(m_storage->getObjectPropertyValues(handles, properties, values), (MTPResponseCode) MTP_RESP_OK);
+    QCOMPARE(values.size(), 3);
+    for (int i = 0; i < values.size(); ++i) {
+        QCOMPARE(values[i].size(), 3);
+        QVERIFY(!values[i][1].isValid());
+    }
+    QCOMPARE(values[0][0].toString(), QString("batchFile2"));
+    QCOMPARE(values[0][2].value<quint32>(), directoryHandle);
+    QCOMPARE(values[1][0].toString(), QString("batchDirectory"));
+    QCOMPARE(values[2][0].toString(), QString("batchFile1"));
+    QCOMPARE(values[2][2].value<quint32>(), directoryHandle);
+
+    // An unknown handle fails the whole query
+    handles << 0xdeadbeef;
+    QCOMPARE(m_storage->getObjectPropertyValues(handles, properties, values), (MTPResponseCode) MTP_RESP_GeneralError);
+
+    m_storage->deleteItem(directoryHandle, MTP_OBF_FORMAT_Undefined);
+}
+
 void FSStoragePlugin_test::testSetReferences()
 {
     MTPResponseCode response;
@@ -829,7 +1225,7 @@ void FSStoragePlugin_test::testSetReferences()
     response = m_storage->setReferences(100, references);
     QCOMPARE(response, (MTPResponseCode) MTP_RESP_InvalidObjectHandle);
 
-    response = m_storage->setReferences(m_storage->m_pathNamesMap[STORAGE1 "/subdir2/fileA"], references);
+    response = m_storage->setReferences(handleForPath(STORAGE1 "/subdir2/fileA"), references);
     QCOMPARE(response, (MTPResponseCode) MTP_RESP_OK);
 }
 
@@ -841,7 +1237,7 @@ void FSStoragePlugin_test::testGetReferences()
     response = m_storage->getReferences(100, references);
     QCOMPARE(response, (MTPResponseCode) MTP_RESP_InvalidObjectHandle);
 
-    response = m_storage->getReferences(m_storage->m_pathNamesMap[STORAGE1 "/subdir2/fileA"], references);
+    response = m_storage->getReferences(handleForPath(STORAGE1 "/subdir2/fileA"), references);
     QCOMPARE(response, (MTPResponseCode) MTP_RESP_OK);
     QCOMPARE(references.size(), 3);
     QCOMPARE(references[0], static_cast<unsigned int>(1));
@@ -853,13 +1249,13 @@ void FSStoragePlugin_test::testDeleteFile()
 {
     MTPResponseCode response;
 
-    response = m_storage->deleteItem(m_storage->m_pathNamesMap[STORAGE1 "/subdir1/file1"], MTP_OBF_FORMAT_Undefined);
+    response = m_storage->deleteItem(handleForPath(STORAGE1 "/subdir1/file1"), MTP_OBF_FORMAT_Undefined);
     QCOMPARE(response, (MTPResponseCode) MTP_RESP_OK);
 
-    response = m_storage->deleteItem(m_storage->m_pathNamesMap[STORAGE1 "/subdir1/file2"], MTP_OBF_FORMAT_Undefined);
+    response = m_storage->deleteItem(handleForPath(STORAGE1 "/subdir1/file2"), MTP_OBF_FORMAT_Undefined);
     QCOMPARE(response, (MTPResponseCode) MTP_RESP_OK);
 
-    response = m_storage->deleteItem(m_storage->m_pathNamesMap[STORAGE1 "/subdir1/file3"], MTP_OBF_FORMAT_Undefined);
+    response = m_storage->deleteItem(handleForPath(STORAGE1 "/subdir1/file3"), MTP_OBF_FORMAT_Undefined);
     QCOMPARE(response, (MTPResponseCode) MTP_RESP_OK);
 }
 
@@ -867,10 +1263,10 @@ void FSStoragePlugin_test::testDeleteDir()
 {
     MTPResponseCode response;
 
-    response = m_storage->deleteItem(m_storage->m_pathNamesMap[STORAGE1 "/subdir1/subdir3"], MTP_OBF_FORMAT_Undefined);
+    response = m_storage->deleteItem(handleForPath(STORAGE1 "/subdir1/subdir3"), MTP_OBF_FORMAT_Undefined);
     QCOMPARE(response, (MTPResponseCode) MTP_RESP_OK);
 
-    response = m_storage->deleteItem(m_storage->m_pathNamesMap[STORAGE1 "/subdir1"], MTP_OBF_FORMAT_Undefined);
+    response = m_storage->deleteItem(handleForPath(STORAGE1 "/subdir1"), MTP_OBF_FORMAT_Undefined);
     QCOMPARE(response, (MTPResponseCode) MTP_RESP_OK);
 
     totalCount -= 9;
@@ -878,7 +1274,7 @@ void FSStoragePlugin_test::testDeleteDir()
 
 void FSStoragePlugin_test::testObjectHandlesCountAfterDeletion()
 {
-    QCOMPARE(m_storage->m_objectHandlesMap.size(), m_storage->m_pathNamesMap.size());
+    QCOMPARE(m_storage->m_objectHandlesMap.size(), itemCount(m_storage->m_root));
     QCOMPARE(m_storage->m_objectHandlesMap.size(), totalCount);
     QVector<ObjHandle> objectHandles;
 
@@ -902,7 +1298,7 @@ void FSStoragePlugin_test::testObjectHandlesCountAfterDeletion()
 
     objectHandles.clear();
     response
-        = m_storage->getObjectHandles(0x0000, m_storage->m_pathNamesMap[QString(STORAGE1 "/subdir2")], objectHandles);
+        = m_storage->getObjectHandles(0x0000, handleForPath(STORAGE1 "/subdir2"), objectHandles);
     QCOMPARE(response, (MTPResponseCode) MTP_RESP_OK);
     QCOMPARE(objectHandles.size(), static_cast<qint32>(4));
 
@@ -923,19 +1319,142 @@ void FSStoragePlugin_test::testObjectHandlesAfterDeletion()
     QCOMPARE(objectHandles.contains(1), static_cast<bool>(true));
 }
 
+void FSStoragePlugin_test::testHandleLists()
+{
+    QEventLoop loop;
+
+    QDir dir;
+    dir.mkpath(STORAGE1 "/listdir");
+
+    while (loop.processEvents())
+        ;
+
+    ObjHandle dirHandle = handleForPath(STORAGE1 "/listdir");
+    QVERIFY(dirHandle);
+
+    QVector<ObjHandle> children;
+    QCOMPARE(m_storage->getObjectHandles(0x0000, dirHandle, children), (MTPResponseCode) MTP_RESP_OK);
+    QVERIFY(children.isEmpty());
+    QVERIFY(m_storage->m_handleLists.contains(quint64(dirHandle) << 16));
+
+    foreach (const QString &name, QStringList() << "f1" << "f2") {
+        QFile file(STORAGE1 "/listdir/" + name);
+        QVERIFY(file.open(QFile::WriteOnly));
+    }
+
+    while (loop.processEvents())
+        ;
+
+    ObjHandle f1 = handleForPath(STORAGE1 "/listdir/f1");
+    ObjHandle f2 = handleForPath(STORAGE1 "/listdir/f2");
+    QVERIFY(f1 && f2);
+
+    // Kept lists follow the added objects and stay sorted
+    QCOMPARE(m_storage->getObjectHandles(0x0000, dirHandle, children), (MTPResponseCode) MTP_RESP_OK);
+    QCOMPARE(children, QVector<ObjHandle>() << qMin(f1, f2) << qMax(f1, f2));
+
+    QVector<ObjHandle> expected = m_storage->m_objectHandlesMap.keys().toVector();
+    expected.removeOne(0);
+    std::sort(expected.begin(), expected.end());
+    QVector<ObjHandle> objectHandles;
+    QCOMPARE(m_storage->getObjectHandles(0x0000, 0x00000000, objectHandles), (MTPResponseCode) MTP_RESP_OK);
+    QCOMPARE(objectHandles, expected);
+
+    // Also the ones asked for again, and the ones filtered by format
+    objectHandles.clear();
+    QCOMPARE(m_storage->getObjectHandles(0x0000, 0x00000000, objectHandles), (MTPResponseCode) MTP_RESP_OK);
+    QCOMPARE(objectHandles, expected);
+    QVector<ObjHandle> associations;
+    QCOMPARE(
+        m_storage->getObjectHandles(MTP_OBF_FORMAT_Association, 0x00000000, associations),
+        (MTPResponseCode) MTP_RESP_OK);
+    QVERIFY(associations.contains(dirHandle));
+
+    QCOMPARE(m_storage->deleteItem(f1, MTP_OBF_FORMAT_Undefined), (MTPResponseCode) MTP_RESP_OK);
+    children.clear();
+    QCOMPARE(m_storage->getObjectHandles(0x0000, dirHandle, children), (MTPResponseCode) MTP_RESP_OK);
+    QCOMPARE(children, QVector<ObjHandle>() << f2);
+
+    // Removing the association drops its list
+    QCOMPARE(m_storage->deleteItem(dirHandle, MTP_OBF_FORMAT_Undefined), (MTPResponseCode) MTP_RESP_OK);
+    QVERIFY(!m_storage->m_handleLists.contains(quint64(dirHandle) << 16));
+    objectHandles.clear();
+    QCOMPARE(m_storage->getObjectHandles(0x0000, 0x00000000, objectHandles), (MTPResponseCode) MTP_RESP_OK);
+    QVERIFY(!objectHandles.contains(dirHandle));
+    QVERIFY(!objectHandles.contains(f2));
+    associations.clear();
+    QCOMPARE(
+        m_storage->getObjectHandles(MTP_OBF_FORMAT_Association, 0x00000000, associations),
+        (MTPResponseCode) MTP_RESP_OK);
+    QVERIFY(!associations.contains(dirHandle));
+
+    while (loop.processEvents())
+        ;
+}
+
 void FSStoragePlugin_test::testFileCopy()
 {
     MTPResponseCode response;
     ObjHandle newHandle;
     QVector<ObjHandle> objectHandles;
 
-    response = m_storage->copyObject(1, m_storage->m_pathNamesMap[STORAGE1 "/subdir2"], 0, newHandle);
+    response = m_storage->copyObject(1, handleForPath(STORAGE1 "/subdir2"), 0, newHandle);
     QCOMPARE(response, (MTPResponseCode) MTP_RESP_OK);
 
-    response = m_storage->copyObject(3, m_storage->m_pathNamesMap[STORAGE1 "/subdir2"], 0, newHandle);
+    response = m_storage->copyObject(3, handleForPath(STORAGE1 "/subdir2"), 0, newHandle);
     QCOMPARE(response, (MTPResponseCode) MTP_RESP_OK);
 }
 
+void FSStoragePlugin_test::testFileCopyData()
+{
+    MTPResponseCode response;
+    ObjHandle parentHandle;
+    ObjHandle handle;
+    ObjHandle newHandle;
+    MTPObjectInfo objectInfo;
+    const MTPObjectInfo *copiedInfo;
+
+    // A copy made by reflinking or with copy_file_range() matches its source
+    QByteArray content(3 * 4096 + 17, 'c');
+    objectInfo.mtpParentObject = handleForPath(STORAGE1 "/subdir2");
+    objectInfo.mtpFileName = "copysource";
+    objectInfo.mtpObjectCompressedSize = content.size();
+    response = m_storage->addItem(parentHandle, handle, &objectInfo);
+    QCOMPARE(response, (MTPResponseCode) MTP_RESP_OK);
+    response = m_storage->writeData(handle, content.constData(), content.size(), true, true);
+    m_storage->writeData(handle, 0, 0, false, true);
+    QCOMPARE(response, (MTPResponseCode) MTP_RESP_OK);
+
+    response = m_storage->copyObject(handle, handleForPath(STORAGE1), 0, newHandle);
+    QCOMPARE(response, (MTPResponseCode) MTP_RESP_OK);
+    QFile copy(STORAGE1 "/copysource");
+    QVERIFY(copy.open(QIODevice::ReadOnly));
+    QCOMPARE(copy.readAll(), content);
+    copy.close();
+    QCOMPARE(m_storage->getObjectInfo(newHandle, copiedInfo), (MTPResponseCode) MTP_RESP_OK);
+    QCOMPARE(copiedInfo->mtpObjectCompressedSize, quint64(content.size()));
+    QCOMPARE(m_storage->deleteItem(handle, MTP_OBF_FORMAT_Undefined), (MTPResponseCode) MTP_RESP_OK);
+    QCOMPARE(m_storage->deleteItem(newHandle, MTP_OBF_FORMAT_Undefined), (MTPResponseCode) MTP_RESP_OK);
+
+    // A copy that fails half way is not left behind. Copying from a
+    // directory fails with EISDIR, which has no fallback.
+    struct stat st;
+    QCOMPARE(stat(STORAGE1 "/subdir2", &st), 0);
+    if (!st.st_size) {
+        QSKIP("the file system reports empty directory sizes");
+    }
+    objectInfo.mtpParentObject = handleForPath(STORAGE1);
+    objectInfo.mtpFileName = "copyfailed";
+    objectInfo.mtpObjectCompressedSize = st.st_size;
+    response = m_storage->addItem(parentHandle, handle, &objectInfo);
+    QCOMPARE(response, (MTPResponseCode) MTP_RESP_OK);
+    response = m_storage->copyFileData(handleForPath(STORAGE1 "/subdir2"), m_storage, handle);
+    QVERIFY(response != MTP_RESP_OK);
+    QVERIFY(!m_storage->checkHandle(handle));
+    QVERIFY(!m_storage->findStorageItemByPath(STORAGE1 "/copyfailed"));
+    QVERIFY(!QFile::exists(STORAGE1 "/copyfailed"));
+}
+
 void FSStoragePlugin_test::testDirCopy()
 {
     MTPResponseCode response;
@@ -946,7 +1465,7 @@ void FSStoragePlugin_test::testDirCopy()
     //memset(&objectInfo, 0 , sizeof(MTPObjectInfo));
 
     //add a nested dir to subdir2 : D1, D1->D2, D1->D2->f
-    objectInfo.mtpParentObject = m_storage->m_pathNamesMap[STORAGE1 "/subdir2"];
+    objectInfo.mtpParentObject = handleForPath(STORAGE1 "/subdir2");
     objectInfo.mtpFileName = "D1";
     objectInfo.mtpObjectCompressedSize = 0;
     objectInfo.mtpObjectFormat = MTP_OBF_FORMAT_Association;
@@ -968,7 +1487,7 @@ void FSStoragePlugin_test::testDirCopy()
 
     // Copy dir D1 from subdir2 to mtptests
     response = m_storage->copyObject(
-        m_storage->m_pathNamesMap[STORAGE1 "/subdir2/D1"], m_storage->m_pathNamesMap[STORAGE1], 0, newHandle);
+        handleForPath(STORAGE1 "/subdir2/D1"), handleForPath(STORAGE1), 0, newHandle);
     QCOMPARE(response, (MTPResponseCode) MTP_RESP_OK);
 }
 
@@ -977,7 +1496,7 @@ void FSStoragePlugin_test::testFileMove()
     MTPResponseCode response;
 
     response = m_storage->moveObject(
-        m_storage->m_pathNamesMap[STORAGE1 "/subdir2/fileA"], m_storage->m_pathNamesMap[STORAGE1], m_storage);
+        handleForPath(STORAGE1 "/subdir2/fileA"), handleForPath(STORAGE1), m_storage);
     QCOMPARE(response, (MTPResponseCode) MTP_RESP_OK);
 }
 
@@ -1011,10 +1530,11 @@ void FSStoragePlugin_test::testFileMoveAcrossStorage()
     StorageItem *item = m_storage->findStorageItemByPath(STORAGE1 "/fileToMove");
 
     ObjHandle originalHandle = item->m_handle;
+    m_storage->populateObjectInfo(item);
     MTPObjectInfo originalInfo = *item->m_objectInfo;
 
     QCOMPARE(
-        m_storage->moveObject(originalHandle, secondStorage.m_pathNamesMap[STORAGE2 "/dir1"], &secondStorage),
+        m_storage->moveObject(originalHandle, handleForPath(STORAGE2 "/dir1", &secondStorage), &secondStorage),
         (MTPResponseCode) MTP_RESP_OK);
 
     QVERIFY(!m_storage->checkHandle(originalHandle));
@@ -1042,8 +1562,15 @@ void FSStoragePlugin_test::testDirMove()
     MTPResponseCode response;
 
     response = m_storage->moveObject(
-        m_storage->m_pathNamesMap[STORAGE1 "/subdir2/D1"], m_storage->m_pathNamesMap[STORAGE1 "/D1"], m_storage);
+        handleForPath(STORAGE1 "/subdir2/D1"), handleForPath(STORAGE1 "/D1"), m_storage);
     QCOMPARE(response, (MTPResponseCode) MTP_RESP_OK);
+
+    // Descendants follow the moved directory
+    QCOMPARE(handleForPath(STORAGE1 "/subdir2/D1/D2/f1"), ObjHandle(0));
+    StorageItem *storageItem = m_storage->findStorageItemByPath(STORAGE1 "/D1/D1/D2/f1");
+    QVERIFY(storageItem);
+    QCOMPARE(storageItem->path(), QString(STORAGE1 "/D1/D1/D2/f1"));
+    QCOMPARE(storageItem->name(), QString("f1"));
 }
 
 void FSStoragePlugin_test::testDirMoveAcrossStorage()
@@ -1068,17 +1595,20 @@ void FSStoragePlugin_test::testDirMoveAcrossStorage()
 
     item = m_storage->findStorageItemByPath(STORAGE1 "/d1");
     ObjHandle hOrigD1 = item->m_handle;
+    m_storage->populateObjectInfo(item);
     MTPObjectInfo iOrigD1 = *item->m_objectInfo;
 
     item = m_storage->findStorageItemByPath(STORAGE1 "/d1/d2");
     ObjHandle hOrigD2 = item->m_handle;
+    m_storage->populateObjectInfo(item);
     MTPObjectInfo iOrigD2 = *item->m_objectInfo;
 
     item = m_storage->findStorageItemByPath(STORAGE1 "/d1/d2/f1");
     ObjHandle hOrigF1 = item->m_handle;
+    m_storage->populateObjectInfo(item);
     MTPObjectInfo iOrigF1 = *item->m_objectInfo;
 
-    quint32 parentHandle = secondStorage.m_pathNamesMap[STORAGE2 "/dir"];
+    quint32 parentHandle = handleForPath(STORAGE2 "/dir", &secondStorage);
     QVERIFY(parentHandle != 0);
 
     QCOMPARE(m_storage->moveObject(hOrigD1, parentHandle, &secondStorage), (MTPResponseCode) MTP_RESP_OK);
@@ -1108,10 +1638,115 @@ void FSStoragePlugin_test::testGetLargestPuoid()
     QVERIFY(puoid == zero);
 }
 
+void FSStoragePlugin_test::testPuoidDb()
+{
+    const QString path = QDir::homePath() + "/.local/mtp/testpuoids";
+    const QString nonAscii = QString::fromUtf8(STORAGE1 "/p\xc3\xa4th");
+    MtpInt128 puoid;
+
+    {
+        PuoidDb db;
+        db.open(path);
+        db.insert(STORAGE1 "/a", MtpInt128(1));
+        db.insert(nonAscii, MtpInt128(2));
+        db.insert(STORAGE1 "/b", MtpInt128(3));
+        db.remove(STORAGE1 "/b");
+    }
+
+    // Without compacting, changes are replayed from the journal
+    {
+        PuoidDb db;
+        db.open(path);
+        QVERIFY(db.find(nonAscii, puoid));
+        QVERIFY(puoid == MtpInt128(2));
+        QVERIFY(!db.contains(STORAGE1 "/b"));
+        QVERIFY(db.largestPuoid() == MtpInt128(3));
+        db.compact();
+        QCOMPARE(QFileInfo(path + ".journal").size(), static_cast<qint64>(0));
+        QVERIFY(!QFile::exists(path + ".journal.old"));
+        db.insert(STORAGE1 "/c", MtpInt128(4));
+    }
+
+    // A record cut short by a crash is dropped from the journal
+    qint64 journalSize = QFileInfo(path + ".journal").size();
+    QVERIFY(journalSize > 0);
+    QFile journal(path + ".journal");
+    QVERIFY(journal.open(QIODevice::Append));
+    journal.write("S\x10", 2);
+    journal.close();
+    {
+        PuoidDb db;
+        db.open(path);
+        QVERIFY(db.find(STORAGE1 "/a", puoid));
+        QVERIFY(puoid == MtpInt128(1));
+        QVERIFY(db.find(STORAGE1 "/c", puoid));
+        QVERIFY(puoid == MtpInt128(4));
+        QStringList paths = db.paths();
+        paths.sort();
+        QCOMPARE(paths, QStringList() << STORAGE1 "/a" << STORAGE1 "/c" << nonAscii);
+        QCOMPARE(QFileInfo(path + ".journal").size(), journalSize);
+
+        // Only what the filter keeps is left, each path is looked at once
+        ListedPathFilter filter(QStringList() << STORAGE1 "/c" << nonAscii);
+        db.removeUnused(filter);
+        QCOMPARE(filter.m_checked, 3);
+        QVERIFY(!db.contains(STORAGE1 "/a"));
+        QVERIFY(db.contains(STORAGE1 "/c"));
+        QVERIFY(db.contains(nonAscii));
+    }
+    QVERIFY(QFile::remove(path + ".journal"));
+
+    // Databases of the earlier format are imported
+    QFile legacy(path);
+    QVERIFY(legacy.open(QIODevice::WriteOnly | QIODevice::Truncate));
+    MtpInt128 largest(5);
+    quint32 count = 1;
+    QByteArray name(STORAGE1 "/legacy");
+    quint32 length = name.size();
+    legacy.write(largest.val, sizeof largest.val);
+    legacy.write(reinterpret_cast<const char *>(&count), sizeof count);
+    legacy.write(reinterpret_cast<const char *>(&length), sizeof length);
+    legacy.write(name);
+    legacy.write(largest.val, sizeof largest.val);
+    legacy.close();
+    {
+        PuoidDb db;
+        db.open(path);
+        db.compact();
+    }
+    {
+        PuoidDb db;
+        db.open(path);
+        QVERIFY(db.find(STORAGE1 "/legacy", puoid));
+        QVERIFY(puoid == largest);
+        QVERIFY(!db.contains(STORAGE1 "/a"));
+    }
+    QVERIFY(QFile::remove(path));
+    QFile::remove(path + ".journal");
+}
+
 void FSStoragePlugin_test::testTruncateItem()
 {
     MTPResponseCode response;
-    response = m_storage->truncateItem(m_storage->m_pathNamesMap[STORAGE1 "/file3"], 0);
+    ObjHandle handle = handleForPath(STORAGE1 "/file3");
+
+    // Truncated in the middle of a write, later data follows the new end
+    QCOMPARE(m_storage->writeData(handle, "aaaaaa", 6, true, false), (MTPResponseCode) MTP_RESP_OK);
+    QCOMPARE(m_storage->truncateItem(handle, 2), (MTPResponseCode) MTP_RESP_OK);
+    QCOMPARE(m_storage->writeData(handle, "bb", 2, false, false), (MTPResponseCode) MTP_RESP_OK);
+    QCOMPARE(m_storage->writeData(handle, 0, 0, false, true), (MTPResponseCode) MTP_RESP_OK);
+    QFile written(STORAGE1 "/file3");
+    QVERIFY(written.open(QIODevice::ReadOnly));
+    QCOMPARE(written.readAll(), QByteArray("aabb"));
+    written.close();
+
+    // Finishing the write doesn't grow the file back
+    QCOMPARE(m_storage->writeData(handle, "cccc", 4, true, false), (MTPResponseCode) MTP_RESP_OK);
+    QCOMPARE(m_storage->truncateItem(handle, 0), (MTPResponseCode) MTP_RESP_OK);
+    QCOMPARE(m_storage->writeData(handle, 0, 0, false, true), (MTPResponseCode) MTP_RESP_OK);
+    QCOMPARE(written.size(), static_cast<qint64>(0));
+
+    response = m_storage->truncateItem(handleForPath(STORAGE1 "/file3"), 0);
     QCOMPARE(response, (MTPResponseCode) MTP_RESP_OK);
     QFile file(STORAGE1 "/file3");
     QCOMPARE(file.size(), static_cast<qint64>(0));
@@ -1121,7 +1756,7 @@ void FSStoragePlugin_test::testGetPath()
 {
     MTPResponseCode response;
     QString path;
-    response = m_storage->getPath(m_storage->m_pathNamesMap[STORAGE1 "/file3"], path);
+    response = m_storage->getPath(handleForPath(STORAGE1 "/file3"), path);
     QCOMPARE(response, (MTPResponseCode) MTP_RESP_OK);
     QCOMPARE(path, QString(STORAGE1 "/file3"));
 }
@@ -1130,7 +1765,7 @@ void FSStoragePlugin_test::testGetObjectPropertyValueFromStorage()
 {
     MTPResponseCode response;
     QVariant v;
-    ObjHandle handle = m_storage->m_pathNamesMap[STORAGE1 "/file3"];
+    ObjHandle handle = handleForPath(STORAGE1 "/file3");
     response
         = m_storage->getObjectPropertyValueFromStorage(handle, MTP_OBJ_PROP_Association_Desc, v, MTP_DATA_TYPE_UNDEF);
     QCOMPARE(response, (MTPResponseCode) MTP_RESP_OK);
@@ -1143,7 +1778,7 @@ void FSStoragePlugin_test::testGetObjectPropertyValueFromStorage()
 
     response = m_storage->getObjectPropertyValueFromStorage(handle, MTP_OBJ_PROP_Parent_Obj, v, MTP_DATA_TYPE_UNDEF);
     QCOMPARE(response, (MTPResponseCode) MTP_RESP_OK);
-    QCOMPARE(v.toUInt(), m_storage->m_pathNamesMap[STORAGE1]);
+    QCOMPARE(v.toUInt(), handleForPath(STORAGE1));
 
     response = m_storage->getObjectPropertyValueFromStorage(handle, MTP_OBJ_PROP_Obj_Size, v, MTP_DATA_TYPE_UNDEF);
     QCOMPARE(response, (MTPResponseCode) MTP_RESP_OK);
@@ -1232,7 +1867,7 @@ void FSStoragePlugin_test::testGetInvalidObjectPropertyValueFromStorage()
 {
     MTPResponseCode response;
     QVariant v;
-    ObjHandle handle = m_storage->m_pathNamesMap[STORAGE1 "/file3"];
+    ObjHandle handle = handleForPath(STORAGE1 "/file3");
     response = m_storage->getObjectPropertyValueFromStorage(handle, 0x0000, v, MTP_DATA_TYPE_UNDEF);
     QCOMPARE(response, (MTPResponseCode) MTP_RESP_ObjectProp_Not_Supported);
 }
@@ -1254,7 +1889,7 @@ void FSStoragePlugin_test::testInotifyCreate()
     while (loop.processEvents())
         ;
 
-    QVERIFY(m_storage->m_pathNamesMap.contains(STORAGE1 "/inotifydir/tmpfile"));
+    QVERIFY(m_storage->findStorageItemByPath(STORAGE1 "/inotifydir/tmpfile"));
 }
 
 void FSStoragePlugin_test::testInotifyModify()
@@ -1270,6 +1905,7 @@ void FSStoragePlugin_test::testInotifyModify()
 
     StorageItem *item = m_storage->findStorageItemByPath(STORAGE1 "/tmpfile");
     QVERIFY(item);
+    m_storage->populateObjectInfo(item);
     QCOMPARE(item->m_objectInfo->mtpObjectCompressedSize, static_cast<quint64>(0));
 
     const QString TEXT("some text to be written into the file");
@@ -1279,6 +1915,7 @@ void FSStoragePlugin_test::testInotifyModify()
 
     loop.processEvents();
 
+    m_storage->populateObjectInfo(item);
     QCOMPARE(item->m_objectInfo->mtpObjectCompressedSize, static_cast<quint64>(TEXT.size()));
 }
 
@@ -1296,11 +1933,11 @@ void FSStoragePlugin_test::testInotifyMove()
         ++getOutOfHere;
     }
     QCOMPARE(storageItem != 0, true);
-    //QCOMPARE( storageItem->m_parent->m_handle, m_storage->m_pathNamesMap[STORAGE1 "/tmpdir"] );
-    QCOMPARE(storageItem->m_parent->m_handle, m_storage->m_pathNamesMap[STORAGE1 "/subdir2"]);
+    //QCOMPARE( storageItem->m_parent->m_handle, handleForPath(STORAGE1 "/tmpdir") );
+    QCOMPARE(storageItem->m_parent->m_handle, handleForPath(STORAGE1 "/subdir2"));
     // Fetch the object info once
     const MTPObjectInfo *objInfo;
-    m_storage->getObjectInfo(m_storage->m_pathNamesMap[STORAGE1 "/subdir2/tmpfile"], objInfo);
+    m_storage->getObjectInfo(handleForPath(STORAGE1 "/subdir2/tmpfile"), objInfo);
 }
 
 void FSStoragePlugin_test::testInotifyDelete()
@@ -1321,6 +1958,114 @@ void FSStoragePlugin_test::testInotifyDelete()
     QCOMPARE(storageItem == 0, true);
 }
 
+void FSStoragePlugin_test::testInotifyBatch()
+{
+    QEventLoop loop;
+    while (loop.processEvents())
+        ;
+
+    StorageItem *dirItem = m_storage->findStorageItemByPath(STORAGE1 "/inotifydir");
+    QVERIFY(dirItem);
+    QVERIFY(dirItem->m_wd != -1);
+
+    // A file written and another one created and removed before the
+    // events got read
+    QVERIFY(makeTestFile(STORAGE1 "/inotifydir/batched", content_size_6));
+    QByteArray batch;
+    appendInotifyEvent(batch, dirItem->m_wd, IN_CREATE, "batched");
+    appendInotifyEvent(batch, dirItem->m_wd, IN_CLOSE_WRITE, "batched");
+    appendInotifyEvent(batch, dirItem->m_wd, IN_CREATE, "transient");
+    appendInotifyEvent(batch, dirItem->m_wd, IN_CLOSE_WRITE, "transient");
+    appendInotifyEvent(batch, dirItem->m_wd, IN_DELETE, "transient");
+
+    QSignalSpy spy(m_storage, SIGNAL(eventGenerated(MTPEventCode, const QVector<quint32> &)));
+    m_storage->inotifyEventsSlot(batch);
+
+    StorageItem *item = m_storage->findStorageItemByPath(STORAGE1 "/inotifydir/batched");
+    QVERIFY(item);
+    QCOMPARE(item->m_size, static_cast<quint64>(sizeof content_size_6 - 1));
+    QVERIFY(!m_storage->findStorageItemByPath(STORAGE1 "/inotifydir/transient"));
+
+    // Only the addition of the written file is reported
+    int added = 0;
+    foreach (const QList<QVariant> &arguments, spy) {
+        MTPEventCode code = arguments.at(0).value<MTPEventCode>();
+        QVERIFY(code != MTP_EV_ObjectInfoChanged);
+        QVERIFY(code != MTP_EV_ObjectRemoved);
+        if (code == MTP_EV_ObjectAdded) {
+            QCOMPARE(arguments.at(1).value<QVector<quint32>>().at(0), item->m_handle);
+            ++added;
+        }
+    }
+    QCOMPARE(added, 1);
+
+    // The real events of the file are redundant now
+    while (loop.processEvents())
+        ;
+    QCOMPARE(m_storage->findStorageItemByPath(STORAGE1 "/inotifydir/batched"), item);
+}
+
+void FSStoragePlugin_test::testInotifyOverflow()
+{
+    QEventLoop loop;
+    while (loop.processEvents())
+        ;
+
+    // Pretend the events of a file were lost
+    StorageItem *item = m_storage->findStorageItemByPath(STORAGE1 "/inotifydir/batched");
+    QVERIFY(item);
+    m_storage->removeFromStorage(item->m_handle);
+    QVERIFY(!m_storage->findStorageItemByPath(STORAGE1 "/inotifydir/batched"));
+
+    // The overflow makes the whole storage get scanned again
+    QByteArray batch;
+    appendInotifyEvent(batch, -1, IN_Q_OVERFLOW, "");
+    m_storage->inotifyEventsSlot(batch);
+    QVERIFY(m_storage->m_scanner);
+    QVERIFY(m_storage->m_validatingIndex);
+    QTRY_VERIFY(!m_storage->m_scanner);
+    QVERIFY(!m_storage->m_validatingIndex);
+    QVERIFY(m_storage->findStorageItemByPath(STORAGE1 "/inotifydir/batched"));
+}
+
+void FSStoragePlugin_test::testFanotify()
+{
+    FSFanotify fanotify(STORAGE1);
+    if (!fanotify.isValid()) {
+        QSKIP("fanotify is not available");
+    }
+    int wd = fanotify.addWatch(STORAGE1 "/inotifydir");
+    QVERIFY(wd != -1);
+    QCOMPARE(fanotify.addWatch(STORAGE1 "/inotifydir"), wd);
+
+    QSignalSpy spy(&fanotify, SIGNAL(inotifyEventsSignal(const QByteArray &)));
+    QVERIFY(makeTestFile(STORAGE1 "/inotifydir/fanotified", content_size_1));
+    QVERIFY(runCommand("mv " STORAGE1 "/inotifydir/fanotified " STORAGE1 "/inotifydir/renamed"));
+
+    // Collect the translated events until the rename shows up
+    QList<QPair<quint32, QByteArray>> events;
+    for (int tries = 0; tries < 10 && (events.isEmpty() || !(events.last().first & IN_MOVED_TO)); ++tries) {
+        if (spy.isEmpty() && !spy.wait(500)) {
+            continue;
+        }
+        QByteArray batch = spy.takeFirst().at(0).toByteArray();
+        for (int offset = 0; offset < batch.size();) {
+            const struct inotify_event *event = reinterpret_cast<const struct inotify_event *>(
+                batch.constData() + offset);
+            QCOMPARE(event->wd, wd);
+            events.append(qMakePair(event->mask, QByteArray(event->name)));
+            offset += sizeof *event + event->len;
+        }
+    }
+
+    QVERIFY(events.size() >= 3);
+    QCOMPARE(events.first(), qMakePair(quint32(IN_CREATE), QByteArray("fanotified")));
+    QCOMPARE(events.last(), qMakePair(quint32(IN_MOVED_TO), QByteArray("renamed")));
+    QCOMPARE(events.at(events.size() - 2), qMakePair(quint32(IN_MOVED_FROM), QByteArray("fanotified")));
+
+    QVERIFY(runCommand("rm " STORAGE1 "/inotifydir/renamed"));
+}
+
 void FSStoragePlugin_test::testThumbnailer()
 {
     // Create an image for the thumbnailer to work on
@@ -1342,7 +2087,7 @@ void FSStoragePlugin_test::testThumbnailer()
     int maxtries = 20;
     while (!handle && maxtries > 0) {
         loop.processEvents();
-        handle = m_storage->m_pathNamesMap[STORAGE1 "/testpic.png"];
+        handle = handleForPath(STORAGE1 "/testpic.png");
         --maxtries;
     }
     QVERIFY2(handle != 0, "testpic not registered in storage");
@@ -1400,11 +2145,28 @@ void FSStoragePlugin_test::testThumbnailer()
     QVERIFY(thumbnail.height() <= THUMBNAIL_HEIGHT);
 }
 
+ObjHandle FSStoragePlugin_test::handleForPath(const QString &path, FSStoragePlugin *storage)
+{
+    StorageItem *storageItem = (storage ? storage : m_storage)->findStorageItemByPath(path);
+    return storageItem ? storageItem->m_handle : 0;
+}
+
+int FSStoragePlugin_test::itemCount(const StorageItem *storageItem)
+{
+    int count = 1;
+    for (StorageItem *child = storageItem->m_firstChild; child; child = child->m_nextSibling) {
+        count += itemCount(child);
+    }
+    return count;
+}
+
 void FSStoragePlugin_test::setupPlugin(StoragePlugin *plugin)
 {
     QSignalSpy readySpy(plugin, SIGNAL(storagePluginReady(quint32)));
     plugin->enumerateStorage();
     QVERIFY(readySpy.wait());
+    // Ready may be signaled from the index snapshot before the scan is done
+    QTRY_VERIFY(!static_cast<FSStoragePlugin *>(plugin)->m_scanner);
 }
 
 void FSStoragePlugin_test::cleanupTestCase()
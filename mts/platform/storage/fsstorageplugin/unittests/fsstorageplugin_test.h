@@ -32,12 +32,14 @@
 #ifndef FSSTORAGEPLUGIN_TEST_H
 #define FSSTORAGEPLUGIN_TEST_H
 
+#include "mtptypes.h"
 #include <QtTest/QtTest>
 #include <QObject>
 
 namespace meegomtp1dot0 {
 class StoragePlugin;
 class FSStoragePlugin;
+class StorageItem;
 }
 
 namespace meegomtp1dot0 {
@@ -50,6 +52,11 @@ private slots:
     void cleanupTestCase();
 
     void testStorageCreation();
+    void testScannedObjectInfo();
+    void testIndexSnapshot();
+    void testScanOnDemand();
+    void testRelistBeforeWatch();
+    void testRenameWhileScanning();
     void testDeleteAll();
     void testObjectHandlesCountAfterCreation();
     void testObjectHandlesAfterCreation();
@@ -57,11 +64,14 @@ private slots:
     void testGetObjectHandleByFormat();
     void testObjectInfoAfterCreation();
     void testFindByPath();
+    void testStorageItemReuse();
     void testObjectHandle();
     void testStorageInfo();
     void testWriteData();
     void testReadData();
+    void testOpenObjectFd();
     void testAddFile();
+    void testReleaseReservedSpace();
     void testAddDir();
     void testObjectHandlesCountAfterAddition();
     void testObjectHandlesAfterAddition();
@@ -69,19 +79,23 @@ private slots:
     void testGetObjectPropertyValue();
     void testSetObjectPropertyValue();
     void testGetChildPropertyValues();
+    void testGetObjectPropertyValues();
     void testSetReferences();
     void testGetReferences();
     void testDeleteFile();
     void testDeleteDir();
     void testObjectHandlesCountAfterDeletion();
     void testObjectHandlesAfterDeletion();
+    void testHandleLists();
     void testFileCopy();
+    void testFileCopyData();
     void testDirCopy();
     void testFileMove();
     void testFileMoveAcrossStorage();
     void testDirMove();
     void testDirMoveAcrossStorage();
     void testGetLargestPuoid();
+    void testPuoidDb();
     void testTruncateItem();
     void testGetPath();
     void testGetObjectPropertyValueFromStorage();
@@ -90,12 +104,17 @@ private slots:
     void testInotifyModify();
     void testInotifyMove();
     void testInotifyDelete();
+    void testInotifyBatch();
+    void testInotifyOverflow();
+    void testFanotify();
     void testThumbnailer();
 
 private:
     FSStoragePlugin *m_storage;
 
     void setupPlugin(StoragePlugin *plugin);
+    ObjHandle handleForPath(const QString &path, FSStoragePlugin *storage = 0);
+    int itemCount(const StorageItem *storageItem);
     void setupTestData();
     void removeTestData();
 };
@@ -36,7 +36,12 @@ INCLUDEPATH += . \
 HEADERS += fsstorageplugin_test.h \
            ../../storageplugin.h \
            ../fsstorageplugin.h \
+           ../fswatcher.h \
            ../fsinotify.h \
+           ../fsfanotify.h \
+           ../fsdatawriter.h \
+           ../fsscanner.h \
+           ../puoiddb.h \
            ../thumbnailer.h \
            ../../storagefactory.h \
            ../storageitem.h \
@@ -61,6 +66,10 @@ HEADERS += fsstorageplugin_test.h \
 SOURCES += fsstorageplugin_test.cpp \
            ../fsstorageplugin.cpp \
            ../fsinotify.cpp \
+           ../fsfanotify.cpp \
+           ../fsdatawriter.cpp \
+           ../fsscanner.cpp \
+           ../puoiddb.cpp \
            ../storageitem.cpp \
            ../thumbnailer.cpp \
            ../../storagefactory.cpp \
@@ -31,6 +31,7 @@
 *
 */
 
+#include <algorithm>
 #include <dlfcn.h>
 
 #include <QDir>
@@ -43,15 +44,36 @@
 
 using namespace meegomtp1dot0;
 
+// Number of siblings whose properties are prefetched at first, and at most
+// once the initiator keeps walking through them
+static const int PREFETCH_MIN_WINDOW = 32;
+static const int PREFETCH_MAX_WINDOW = 1024;
+
+// Number of associations whose children are kept listed for prefetching
+static const int PREFETCH_MAX_ASSOCIATIONS = 64;
+
+// Sibling prefetch state of storage roots is keyed by the storage id with
+// this bit set, that of other associations by their handle
+static const quint64 PREFETCH_ROOT = Q_UINT64_C(1) << 32;
+
+// Size of the handle to storage table at which it is first swept for
+// objects that were removed without an event
+static const int MIN_HANDLE_SWEEP_SIZE = 4096;
+
 /*******************************************************
  * StorageFactory::StorageFactory
  ******************************************************/
 StorageFactory::StorageFactory()
     : m_storageId(0)
     , m_storagePluginsPath(pluginLocation)
+    , m_handleSweepSize(MIN_HANDLE_SWEEP_SIZE)
     , m_newObjectHandle(0)
     , m_newPuoid(0)
     , m_objectPropertyCache(new ObjectPropertyCache)
+    , m_propertyQueries(0)
+    , m_propertyQueryHits(0)
+    , m_prefetchedObjects(0)
+    , m_prefetchCount(0)
 {
     //TODO For now handle only the file system storage plug-in. As we have more storages
     // make this generic.
@@ -222,9 +244,14 @@ void StorageFactory::onStoragePluginReady(quint32 storageId)
 void StorageFactory::sessionOpenChanged(bool isOpen)
 {
     if (!isOpen) {
+        MTP_LOG_INFO(
+            "property queries:" << m_propertyQueries << "answered from cache:" << prefetchHitRate()
+                                << "objects prefetched:" << m_prefetchedObjects);
+
         /* Clear object changes need to be notified flags on session close */
         foreach (StoragePlugin *storage, m_allStorages) {
             storage->disableObjectEvents();
+            storage->sessionClosed();
         }
     }
 }
@@ -241,8 +268,18 @@ quint32 StorageFactory::assignStorageId(quint16 storageNo, quint16 partitionNo)
 
 StoragePlugin *StorageFactory::storageOfHandle(ObjHandle handle) const
 {
+    QHash<ObjHandle, StoragePlugin *>::iterator it = m_handleStorages.find(handle);
+    if (it != m_handleStorages.end()) {
+        if (it.value()->checkHandle(handle)) {
+            return it.value();
+        }
+        m_handleStorages.erase(it);
+    }
+
+    // Not handed out by us, or no longer in the storage it was handed out to
     foreach (StoragePlugin *storage, m_allStorages) {
         if (storage->checkHandle(handle)) {
+            recordHandleStorage(handle, storage);
             return storage;
         }
     }
@@ -250,6 +287,26 @@ StoragePlugin *StorageFactory::storageOfHandle(ObjHandle handle) const
     return 0;
 }
 
+void StorageFactory::recordHandleStorage(ObjHandle handle, StoragePlugin *storage) const
+{
+    m_handleStorages.insert(handle, storage);
+
+    // Handles are never reused, and the contents of a deleted association
+    // go without events, so entries of objects that are gone are dropped
+    // whenever the table has doubled since it was last swept
+    if (m_handleStorages.size() >= m_handleSweepSize) {
+        QHash<ObjHandle, StoragePlugin *>::iterator it = m_handleStorages.begin();
+        while (it != m_handleStorages.end()) {
+            if (it.value()->checkHandle(it.key())) {
+                ++it;
+            } else {
+                it = m_handleStorages.erase(it);
+            }
+        }
+        m_handleSweepSize = qMax(MIN_HANDLE_SWEEP_SIZE, 2 * m_handleStorages.size());
+    }
+}
+
 /*******************************************************
  * MTPResponseCode StorageFactory::addItem
  ******************************************************/
@@ -289,6 +346,9 @@ MTPResponseCode StorageFactory::deleteItem(const ObjHandle &handle, const MTPObj
     }
 
     m_objectPropertyCache->remove(handle);
+    if (MTP_RESP_OK == response) {
+        m_handleStorages.remove(handle);
+    }
 
     return response;
 }
@@ -312,7 +372,14 @@ MTPResponseCode StorageFactory::getObjectHandles(
             if (MTP_RESP_OK != response) {
                 break;
             }
-            objectHandles += handles;
+            // Each storage lists its handles in order, keep the whole list in order
+            if (objectHandles.isEmpty()) {
+                objectHandles = handles;
+            } else {
+                int middle = objectHandles.size();
+                objectHandles += handles;
+                std::inplace_merge(objectHandles.begin(), objectHandles.begin() + middle, objectHandles.end());
+            }
         }
     } else {
         //Get the no. of objects from the requested storage.
@@ -555,17 +622,56 @@ MTPResponseCode StorageFactory::readData(
     return MTP_RESP_InvalidObjectHandle;
 }
 
+/*******************************************************
+ * MTPResponseCode StorageFactory::openObjectFd
+ ******************************************************/
+MTPResponseCode StorageFactory::openObjectFd(const ObjHandle &handle, int &fd) const
+{
+    fd = -1;
+    StoragePlugin *storage = storageOfHandle(handle);
+    if (storage) {
+        return storage->openObjectFd(handle, fd);
+    }
+
+    return MTP_RESP_InvalidObjectHandle;
+}
+
+/*******************************************************
+ * void StorageFactory::releaseObjectData
+ ******************************************************/
+void StorageFactory::releaseObjectData(const ObjHandle &handle) const
+{
+    StoragePlugin *storage = storageOfHandle(handle);
+    if (storage) {
+        storage->releaseObjectData(handle);
+    }
+}
+
+/*******************************************************
+ * void StorageFactory::adviseSequentialRead
+ ******************************************************/
+void StorageFactory::adviseSequentialRead(const ObjHandle &handle, quint64 offsetNow, quint64 offsetEnd) const
+{
+    StoragePlugin *storage = storageOfHandle(handle);
+    if (storage) {
+        storage->adviseSequentialRead(handle, offsetNow, offsetEnd);
+    }
+}
+
 MTPResponseCode StorageFactory::getObjectPropertyValue(const ObjHandle &handle, QList<MTPObjPropDescVal> &propValList)
 {
     QList<MTPObjPropDescVal> notFoundList;
 
+    ++m_propertyQueries;
     if (propValList.count() == 1) {
         if (m_objectPropertyCache->get(handle, propValList[0])) {
+            ++m_propertyQueryHits;
             return MTP_RESP_OK;
         }
         notFoundList.swap(propValList);
     } else {
         if (m_objectPropertyCache->get(handle, propValList, notFoundList)) {
+            ++m_propertyQueryHits;
             return MTP_RESP_OK;
         }
     }
@@ -580,54 +686,181 @@ MTPResponseCode StorageFactory::getObjectPropertyValue(const ObjHandle &handle,
             return response;
         }
 
-        if (m_massQueriedAssociations.contains(info->mtpParentObject) || handle == 0) {
-            // We've done one mass query on this object's parent. For
-            // performance reasons revert now to querying individual objects, as
-            // repeated big queries would rather degrade the performance than
-            // improve it. Storage roots always go in this branch since they
-            // have no parent.
-
-            response = storage->getObjectPropertyValue(handle, notFoundList);
-            if (response == MTP_RESP_OK) {
-                m_objectPropertyCache->add(handle, notFoundList);
-                propValList += notFoundList;
-            }
-            return response;
-        } else {
-            // Speculatively load the property values for all sibling objects.
+        // Speculatively load the property values for the siblings following
+        // this object. Storage roots have no siblings.
+        if (handle != 0) {
             QList<const MtpObjPropDesc *> properties;
             foreach (const MTPObjPropDescVal &propVal, notFoundList) {
                 properties.append(propVal.propDesc);
             }
 
-            QMap<ObjHandle, QList<QVariant>> values;
-            response = storage->getChildPropertyValues(info->mtpParentObject, properties, values);
-            if (response != MTP_RESP_OK) {
-                return response;
+            if (prefetchSiblings(storage, handle, info, properties)) {
+                QList<MTPObjPropDescVal> stillNotFound;
+                bool found = m_objectPropertyCache->get(handle, notFoundList, stillNotFound);
+                propValList += notFoundList;
+                if (found) {
+                    return MTP_RESP_OK;
+                }
+                notFoundList.swap(stillNotFound);
             }
+        }
 
-            m_massQueriedAssociations.insert(info->mtpParentObject);
-
+        response = storage->getObjectPropertyValue(handle, notFoundList);
+        if (response == MTP_RESP_OK) {
+            if (handle != 0) {
+                m_objectPropertyCache->setAssociation(handle, info->mtpParentObject);
+            }
+            m_objectPropertyCache->add(handle, notFoundList);
             propValList += notFoundList;
+        }
+        return response;
+    }
 
-            // Feed the object property cache.
-            QMap<ObjHandle, QList<QVariant>>::iterator it;
-            for (it = values.begin(); it != values.end(); ++it) {
-                const ObjHandle &childHandle = it.key();
-                const QList<QVariant> &childValues = it.value();
+    return MTP_RESP_InvalidObjectHandle;
+}
 
-                for (int i = 0; i != properties.count(); ++i) {
-                    m_objectPropertyCache->add(childHandle, properties[i]->uPropCode, childValues[i]);
-                }
+bool StorageFactory::prefetchSiblings(
+    StoragePlugin *storage, ObjHandle handle, const MTPObjectInfo *info, const QList<const MtpObjPropDesc *> &properties)
+{
+    // Every storage has a root with the handle 0, so the roots go by storage
+    ObjHandle parent = info->mtpParentObject;
+    quint64 key = parent ? parent : (PREFETCH_ROOT | info->mtpStorageId);
+    if (!m_prefetches.contains(key) && m_prefetches.size() >= PREFETCH_MAX_ASSOCIATIONS) {
+        // Make room by forgetting the association gone through longest ago
+        QHash<quint64, SiblingPrefetch>::iterator oldest = m_prefetches.begin();
+        QHash<quint64, SiblingPrefetch>::iterator it;
+        for (it = m_prefetches.begin(); it != m_prefetches.end(); ++it) {
+            if (it->lastUse < oldest->lastUse) {
+                oldest = it;
             }
+        }
+        m_prefetches.erase(oldest);
+    }
+    SiblingPrefetch &prefetch = m_prefetches[key];
+    prefetch.lastUse = ++m_prefetchCount;
+
+    QVector<ObjHandle>::const_iterator child
+        = std::lower_bound(prefetch.children.constBegin(), prefetch.children.constEnd(), handle);
+    if (child == prefetch.children.constEnd() || *child != handle) {
+        // Not listed yet, or added since: handles only grow, so new objects
+        // are never in the list
+        prefetch.children.clear();
+        prefetch.windowEnd = -1;
+        if (storage->getObjectHandles(0, parent ? parent : 0xFFFFFFFF, prefetch.children)
+            != MTP_RESP_OK) {
+            m_prefetches.remove(key);
+            return false;
+        }
+        std::sort(prefetch.children.begin(), prefetch.children.end());
 
-            // We have everything in the cache now, so let's call this method
-            // again in order to retrieve the values.
-            return getObjectPropertyValue(handle, propValList);
+        child = std::lower_bound(prefetch.children.constBegin(), prefetch.children.constEnd(), handle);
+        if (child == prefetch.children.constEnd() || *child != handle) {
+            return false;
         }
     }
 
-    return MTP_RESP_InvalidObjectHandle;
+    // Widen the window while the initiator walks through the children, and
+    // start small again when it jumps elsewhere
+    int position = child - prefetch.children.constBegin();
+    if (position == prefetch.windowEnd) {
+        prefetch.window = qMin(prefetch.window * 2, PREFETCH_MAX_WINDOW);
+    } else {
+        prefetch.window = PREFETCH_MIN_WINDOW;
+    }
+    QVector<ObjHandle> window = prefetch.children.mid(position, prefetch.window);
+    prefetch.windowEnd = position + window.size();
+
+    QVector<QList<QVariant>> values;
+    if (storage->getObjectPropertyValues(window, properties, values) != MTP_RESP_OK) {
+        // Some of the children are gone, list them again next time
+        prefetch.children.clear();
+        return false;
+    }
+    m_prefetchedObjects += window.size();
+
+    // Feed the object property cache.
+    for (int i = 0; i != window.size(); ++i) {
+        const QList<QVariant> &childValues = values[i];
+        m_objectPropertyCache->setAssociation(window[i], parent);
+        for (int j = 0; j != properties.count(); ++j) {
+            m_objectPropertyCache->add(window[i], properties[j]->uPropCode, childValues[j]);
+        }
+    }
+    return true;
+}
+
+qreal StorageFactory::prefetchHitRate() const
+{
+    return m_propertyQueries ? qreal(m_propertyQueryHits) / m_propertyQueries : 0;
+}
+
+MTPResponseCode StorageFactory::getObjectPropertyValues(
+    const QVector<ObjHandle> &handles,
+    const QList<const MtpObjPropDesc *> &properties,
+    QVector<QList<QVariant>> &values)
+{
+    QHash<StoragePlugin *, QVector<int>> notFound;
+    int parentIndex = -1;
+    for (int i = 0; i < properties.count(); ++i) {
+        if (properties[i]->uPropCode == MTP_OBJ_PROP_Parent_Obj) {
+            parentIndex = i;
+        }
+    }
+
+    // Take whatever objects the cache has complete, and group the rest by
+    // storage so that each storage is queried just once.
+    values.resize(handles.size());
+    for (int i = 0; i < handles.size(); ++i) {
+        QList<QVariant> &objectValues = values[i];
+        objectValues.clear();
+        foreach (const MtpObjPropDesc *desc, properties) {
+            QVariant value;
+            if (!m_objectPropertyCache->get(handles[i], desc->uPropCode, value)) {
+                break;
+            }
+            objectValues.append(value);
+        }
+        if (objectValues.count() == properties.count()) {
+            continue;
+        }
+
+        StoragePlugin *storage = storageOfHandle(handles[i]);
+        if (!storage) {
+            return MTP_RESP_InvalidObjectHandle;
+        }
+        notFound[storage].append(i);
+    }
+
+    QHash<StoragePlugin *, QVector<int>>::const_iterator it;
+    for (it = notFound.constBegin(); it != notFound.constEnd(); ++it) {
+        const QVector<int> &indices = it.value();
+        QVector<ObjHandle> storageHandles;
+        storageHandles.reserve(indices.count());
+        foreach (int i, indices) {
+            storageHandles.append(handles[i]);
+        }
+
+        QVector<QList<QVariant>> storageValues;
+        MTPResponseCode response = it.key()->getObjectPropertyValues(storageHandles, properties, storageValues);
+        if (response != MTP_RESP_OK) {
+            return response;
+        }
+
+        // Feed the object property cache, keeping the objects of an
+        // association together if their parent is among the properties.
+        for (int j = 0; j != indices.count(); ++j) {
+            const QList<QVariant> &objectValues = storageValues[j];
+            if (parentIndex >= 0 && objectValues[parentIndex].isValid()) {
+                m_objectPropertyCache->setAssociation(storageHandles[j], objectValues[parentIndex].value<quint32>());
+            }
+            for (int k = 0; k != properties.count(); ++k) {
+                m_objectPropertyCache->add(storageHandles[j], properties[k]->uPropCode, objectValues[k]);
+            }
+            values[indices[j]] = objectValues;
+        }
+    }
+
+    return MTP_RESP_OK;
 }
 
 MTPResponseCode StorageFactory::setObjectPropertyValue(
@@ -662,17 +895,43 @@ void StorageFactory::onStorageEvent(MTPEventCode event, const QVector<quint32> &
         flushCachedObjectPropertyValues(params[0]);
         break;
     case MTP_EV_ObjectRemoved:
-        m_massQueriedAssociations.remove(params[0]);
         m_objectPropertyCache->remove(params[0]);
+        m_handleStorages.remove(params[0]);
+        forgetPrefetchedObject(params[0]);
         break;
     }
 }
 
+void StorageFactory::forgetPrefetchedObject(ObjHandle handle)
+{
+    m_prefetches.remove(handle);
+
+    // Drop the object from the list of its siblings, wherever it is
+    QHash<quint64, SiblingPrefetch>::iterator prefetch;
+    for (prefetch = m_prefetches.begin(); prefetch != m_prefetches.end(); ++prefetch) {
+        QVector<ObjHandle> &children = prefetch->children;
+        QVector<ObjHandle>::iterator it = std::lower_bound(children.begin(), children.end(), handle);
+        if (it != children.end() && *it == handle) {
+            if (it - children.begin() < prefetch->windowEnd) {
+                --prefetch->windowEnd;
+            }
+            children.erase(it);
+            break;
+        }
+    }
+}
+
 void StorageFactory::getObjectHandle(ObjHandle &handle)
 {
     //TODO : Handle the case when object handle surpasses 0xFFFFFFFF,
     //but the no. of objects doesn't.
     handle = ++m_newObjectHandle == 0xFFFFFFFF ? 1 : m_newObjectHandle;
+
+    // The handle belongs to the storage that asked for it
+    StoragePlugin *storage = qobject_cast<StoragePlugin *>(sender());
+    if (storage) {
+        recordHandleStorage(handle, storage);
+    }
 }
 
 void StorageFactory::getPuoid(MtpInt128 &puoid)
@@ -217,6 +217,21 @@ public:
     /// \param readOffset [in] The offset, in bytes, into the object to be read from
     MTPResponseCode readData(const ObjHandle &handle, char *readBuffer, quint32 readBufferLen, quint64 readOffset) const;
 
+    /// Opens a storage item for reading, see StoragePlugin::openObjectFd().
+    /// \param handle [in] the object handle.
+    /// \param fd [out] a file descriptor open for reading; to be closed by the caller.
+    MTPResponseCode openObjectFd(const ObjHandle &handle, int &fd) const;
+
+    /// Releases resources kept for reading an object, see StoragePlugin::releaseObjectData().
+    /// \param handle [in] the object handle.
+    void releaseObjectData(const ObjHandle &handle) const;
+
+    /// Passes a sequential access hint to the storage, see StoragePlugin::adviseSequentialRead().
+    /// \param handle [in] the object handle.
+    /// \param offsetNow [in] the offset of the next read.
+    /// \param offsetEnd [in] the offset where the transfer will end.
+    void adviseSequentialRead(const ObjHandle &handle, quint64 offsetNow, quint64 offsetEnd) const;
+
     /// Truncates an item to a certain size.
     /// \param handle [in] the object handle.
     /// \size [in] the size in bytes.
@@ -224,6 +239,19 @@ public:
 
     MTPResponseCode getObjectPropertyValue(const ObjHandle &handle, QList<MTPObjPropDescVal> &propValList);
 
+    /// Gets the values of the same object properties for many objects at once,
+    /// see StoragePlugin::getObjectPropertyValues(). The objects may be in
+    /// different storages.
+    /// \param handles [in] the object handles.
+    /// \param properties [in] descriptions of the properties to get.
+    /// \param values [out] the property values of each object, in the order of
+    ///               \c handles and \c properties.
+    /// \return MTP response.
+    MTPResponseCode getObjectPropertyValues(
+        const QVector<ObjHandle> &handles,
+        const QList<const MtpObjPropDesc *> &properties,
+        QVector<QList<QVariant>> &values);
+
     MTPResponseCode setObjectPropertyValue(
         const ObjHandle &handle, QList<MTPObjPropDescVal> &propValList, bool sendObjectPropList = false);
 
@@ -234,6 +262,10 @@ public:
     /// \return true iff all storage plugins have completed enumeration
     bool storageIsReady();
 
+    /// \return the share of getObjectPropertyValue() calls answered from the
+    /// object property cache, which prefetching siblings is to keep high
+    qreal prefetchHitRate() const;
+
 public Q_SLOTS:
     /// This slot will take care of providing an object handle which a storage plug-in can assign to an object.
     /// A storage plug-in will emit an objectCreated signal when it needs a handle.
@@ -288,16 +320,54 @@ private:
     /// \return the storage id.
     quint32 assignStorageId(quint16 storageNo, quint16 partitionNo = 0) const;
 
+    /// Finds the storage an object belongs to.
+    /// \param handle [in] the object handle.
+    /// \return the storage, or 0 if no storage has the object.
     StoragePlugin *storageOfHandle(ObjHandle handle) const;
 
+    /// Records which storage an object handle belongs to, see m_handleStorages.
+    void recordHandleStorage(ObjHandle handle, StoragePlugin *storage) const;
+
+    /// The storage each object handle was handed out to. It lets
+    /// storageOfHandle() route without asking every storage in turn. Entries
+    /// of removed objects are dropped once the removal is seen, or by the
+    /// sweep in recordHandleStorage().
+    mutable QHash<ObjHandle, StoragePlugin *> m_handleStorages;
+    mutable int m_handleSweepSize; ///< Table size at which m_handleStorages is next swept
+
     ObjHandle m_newObjectHandle;
     MtpInt128 m_newPuoid;
 
     QScopedPointer<ObjectPropertyCache> m_objectPropertyCache;
 
-    /// Improves performance by preventing repeat mass fills of object property
-    /// cache with StoragePlugin::getChildPropertyValues().
-    QSet<ObjHandle> m_massQueriedAssociations;
+    /// Where the sibling prefetch of getObjectPropertyValue() is in an association
+    struct SiblingPrefetch {
+        SiblingPrefetch() : window(0), windowEnd(-1), lastUse(0) {}
+
+        QVector<ObjHandle> children; ///< Children of the association in handle order
+        int window;                  ///< Number of children in the latest prefetch
+        int windowEnd;               ///< Position in children after the latest prefetch
+        quint64 lastUse;             ///< Value of m_prefetchCount at the latest prefetch
+    };
+
+    /// Loads the given properties of the object and of the siblings following
+    /// it into the object property cache. The more of the siblings the
+    /// initiator goes through in order, the more of them are loaded at once.
+    /// \return true if the object's values are in the cache now.
+    bool prefetchSiblings(
+        StoragePlugin *storage,
+        ObjHandle handle,
+        const MTPObjectInfo *info,
+        const QList<const MtpObjPropDesc *> &properties);
+
+    /// Drops a removed object from the sibling prefetch state.
+    void forgetPrefetchedObject(ObjHandle handle);
+
+    QHash<quint64, SiblingPrefetch> m_prefetches; ///< Sibling prefetch state, by association
+    quint64 m_propertyQueries;                    ///< Calls to getObjectPropertyValue()
+    quint64 m_propertyQueryHits;                  ///< Calls answered from the cache alone
+    quint64 m_prefetchedObjects;                  ///< Objects loaded by prefetching
+    quint64 m_prefetchCount;                      ///< Number of prefetches done
 
 private slots:
     /// This slot is called when some of the underlying storage plugins
@@ -53,14 +53,15 @@ MTPResponseCode StoragePlugin::copyData(
         return result;
     }
 
-    quint32 readOffset = 0;
-    quint32 remainingLen = sourceInfo->mtpObjectCompressedSize;
-    qint32 readLen = MAX_READ_LEN;
+    quint64 readOffset = 0;
+    quint64 remainingLen = sourceInfo->mtpObjectCompressedSize;
+    quint32 readLen = MAX_READ_LEN;
     char readBuffer[MAX_READ_LEN];
     bool txCancelled = false;
 
     while (remainingLen && result == MTP_RESP_OK) {
         readLen = remainingLen >= MAX_READ_LEN ? MAX_READ_LEN : remainingLen;
+        sourceStorage->adviseSequentialRead(source, readOffset, readOffset + remainingLen);
         result = sourceStorage->readData(source, readBuffer, readLen, readOffset);
 
         emit sourceStorage->checkTransportEvents(txCancelled);
@@ -80,5 +81,25 @@ MTPResponseCode StoragePlugin::copyData(
         }
     }
 
+    sourceStorage->releaseObjectData(source);
     return result;
 }
+
+MTPResponseCode StoragePlugin::openObjectFd(const ObjHandle & /*handle*/, int &fd)
+{
+    fd = -1;
+    return MTP_RESP_OperationNotSupported;
+}
+
+void StoragePlugin::releaseObjectData(const ObjHandle & /*handle*/)
+{
+}
+
+void StoragePlugin::sessionClosed()
+{
+}
+
+void StoragePlugin::adviseSequentialRead(
+    const ObjHandle & /*handle*/, quint64 /*offsetNow*/, quint64 /*offsetEnd*/)
+{
+}
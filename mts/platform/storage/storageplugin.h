@@ -69,6 +69,10 @@ public:
     /// Stop sending change events for all objects
     virtual void disableObjectEvents() = 0;
 
+    /// Tells the storage that the session was closed, so that state kept
+    /// for objects still waiting for their data can be dropped.
+    virtual void sessionClosed();
+
     /// Enumerate the storage.
     /// \return true or false depending on whether storage succeeded or failed.
     virtual bool enumerateStorage() = 0;
@@ -214,6 +218,28 @@ public:
     virtual MTPResponseCode readData(const ObjHandle &handle, char *readBuffer, quint32 readBufferLen, quint64 readOffset)
         = 0;
 
+    /// Opens a storage item for reading, so that its content can be passed
+    /// to the transport without copying it through an intermediate buffer.
+    /// \param handle [in] the object handle.
+    /// \param fd [out] a file descriptor open for reading; to be closed by
+    ///           the caller.
+    /// \return MTP_RESP_OperationNotSupported if the storage is not backed
+    ///         by files, in which case readData() must be used instead.
+    virtual MTPResponseCode openObjectFd(const ObjHandle &handle, int &fd);
+
+    /// Tells the storage that the initiator is done reading an object, so
+    /// that any resources kept for repeated readData() calls can be freed.
+    /// \param handle [in] the object handle.
+    virtual void releaseObjectData(const ObjHandle &handle);
+
+    /// Tells the storage that the initiator is reading an object
+    /// sequentially, so that the data can be fetched ahead of the reads.
+    /// Meant to be called before every segment of a transfer.
+    /// \param handle [in] the object handle.
+    /// \param offsetNow [in] the offset of the next read.
+    /// \param offsetEnd [in] the offset where the transfer will end.
+    virtual void adviseSequentialRead(const ObjHandle &handle, quint64 offsetNow, quint64 offsetEnd);
+
     /// Truncates an item to a certain size.
     /// \param handle [in] the object handle.
     /// \size [in] the size in bytes.
@@ -247,6 +273,21 @@ public:
         ObjHandle handle, const QList<const MtpObjPropDesc *> &properties, QMap<ObjHandle, QList<QVariant>> &values)
         = 0;
 
+    /// Retrieves the values of given object properties for a list of objects
+    /// in one pass.
+    ///
+    /// \param handles [in] handles of the objects, all in this storage.
+    /// \param properties [in] a list describing the properties to retrieve.
+    /// \param values [out] the method fills this structure with the query
+    ///               result, where each entry holds the properties of the
+    ///               object at the same index in \c handles, in the same
+    ///               order as the descriptions in the \c properties list have.
+    virtual MTPResponseCode getObjectPropertyValues(
+        const QVector<ObjHandle> &handles,
+        const QList<const MtpObjPropDesc *> &properties,
+        QVector<QList<QVariant>> &values)
+        = 0;
+
 signals:
     /// Emitted whenever the storage plugin generates an MTP event.
     ///
@@ -24,6 +24,9 @@
 #include "storagefactory_test.h"
 #include "storagefactory.h"
 #include "mtpresponder.h"
+#include "objectpropertycache.h"
+
+#include <algorithm>
 
 #include <QDir>
 #include <QFile>
@@ -146,7 +149,7 @@ void StorageFactory_test::testGetDevicePropValueAfterObjectInfoChanged()
     file.remove();
 }
 
-void StorageFactory_test::testMassObjectPropertyQueryThrottle()
+void StorageFactory_test::testSiblingPrefetch()
 {
     QString dirName(QStringLiteral("massDirectory"));
     QString dirPath(m_storageRoot + dirName);
@@ -164,23 +167,161 @@ void StorageFactory_test::testMassObjectPropertyQueryThrottle()
     ObjHandle massDirHandle = handleForFilename(0xFFFFFFFF, dirName);
     QVERIFY(massDirHandle != 0);
 
-    ObjHandle f1Handle = handleForFilename(massDirHandle, "f1");
-    QVERIFY(f1Handle != 0);
+    QVector<ObjHandle> handles;
+    foreach (const QString &file, QStringList() << "f1" << "f2" << "f3") {
+        handles.append(handleForFilename(massDirHandle, file));
+        QVERIFY(handles.last() != 0);
+    }
+    std::sort(handles.begin(), handles.end());
 
-    QVERIFY(!m_storageFactory->m_massQueriedAssociations.contains(massDirHandle));
+    QVERIFY(!m_storageFactory->m_prefetches.contains(massDirHandle));
 
+    // The first child brings in the ones following it
+    quint64 queries = m_storageFactory->m_propertyQueries;
+    quint64 hits = m_storageFactory->m_propertyQueryHits;
     QCOMPARE(
-        m_storageFactory->getObjectPropertyValue(f1Handle, m_queryForObjSize),
+        m_storageFactory->getObjectPropertyValue(handles[0], m_queryForObjSize),
         static_cast<MTPResponseCode>(MTP_RESP_OK));
+    QVERIFY(m_storageFactory->m_prefetches.contains(massDirHandle));
+    QCOMPARE(m_storageFactory->m_prefetches[massDirHandle].children, handles);
 
-    QVERIFY(m_storageFactory->m_massQueriedAssociations.contains(massDirHandle));
+    QCOMPARE(
+        m_storageFactory->getObjectPropertyValue(handles[2], m_queryForObjSize),
+        static_cast<MTPResponseCode>(MTP_RESP_OK));
+    QCOMPARE(m_storageFactory->m_propertyQueries, queries + 2);
+    QCOMPARE(m_storageFactory->m_propertyQueryHits, hits + 1);
+    QVERIFY(m_storageFactory->prefetchHitRate() > 0);
+
+    // Removed children leave the list, and so does the association itself
+    QVERIFY(QFile::remove(dirPath + "/f2"));
+    while (loop.processEvents())
+        ;
+    QVERIFY(!m_storageFactory->m_prefetches[massDirHandle].children.contains(handles[1]));
 
     dir.removeRecursively();
 
     while (loop.processEvents())
         ;
 
-    QVERIFY(!m_storageFactory->m_massQueriedAssociations.contains(massDirHandle));
+    QVERIFY(!m_storageFactory->m_prefetches.contains(massDirHandle));
+}
+
+void StorageFactory_test::testHandleRouting()
+{
+    MTPObjectInfo objInfo;
+    objInfo.mtpStorageId = STORAGE_ID;
+    objInfo.mtpObjectCompressedSize = 0;
+    objInfo.mtpObjectFormat = MTP_OBF_FORMAT_Undefined;
+    objInfo.mtpFileName = QStringLiteral("tmpRoutedFile");
+    objInfo.mtpParentObject = 0;
+
+    quint32 storage = STORAGE_ID;
+    ObjHandle handle;
+    ObjHandle parentHandle;
+    QCOMPARE(
+        m_storageFactory->addItem(storage, parentHandle, handle, &objInfo), static_cast<MTPResponseCode>(MTP_RESP_OK));
+
+    // The handle was recorded for its storage when it was handed out
+    StoragePlugin *plugin = m_storageFactory->m_allStorages.value(STORAGE_ID);
+    QVERIFY(plugin);
+    QCOMPARE(m_storageFactory->m_handleStorages.value(handle), plugin);
+    QCOMPARE(m_storageFactory->storageOfHandle(handle), plugin);
+
+    // The entry is forgotten along with the object
+    QCOMPARE(
+        m_storageFactory->deleteItem(handle, MTP_OBF_FORMAT_Undefined), static_cast<MTPResponseCode>(MTP_RESP_OK));
+    QVERIFY(!m_storageFactory->m_handleStorages.contains(handle));
+    QVERIFY(!m_storageFactory->storageOfHandle(handle));
+    QCOMPARE(m_storageFactory->checkHandle(handle), static_cast<MTPResponseCode>(MTP_RESP_InvalidObjectHandle));
+
+    // A stale entry does not route to a storage that no longer has the object
+    m_storageFactory->m_handleStorages.insert(handle, plugin);
+    QVERIFY(!m_storageFactory->storageOfHandle(handle));
+    QVERIFY(!m_storageFactory->m_handleStorages.contains(handle));
+}
+
+void StorageFactory_test::testObjectPropertyCache()
+{
+    ObjectPropertyCache cache;
+    QVariant value;
+
+    QVERIFY(!cache.get(1, MTP_OBJ_PROP_Obj_Format, value));
+    QCOMPARE(cache.misses(), static_cast<quint64>(1));
+
+    // Values come back with the type they were added with
+    cache.add(1, MTP_OBJ_PROP_Obj_Format, QVariant::fromValue(static_cast<quint16>(MTP_OBF_FORMAT_Text)));
+    cache.add(1, MTP_OBJ_PROP_Obj_File_Name, QVariant::fromValue(QStringLiteral("file")));
+    cache.add(1, MTP_OBJ_PROP_Genre, QVariant());
+    cache.add(1, MTP_OBJ_PROP_Persistent_Unique_ObjId, QVariant::fromValue(MtpInt128(7)));
+
+    QVERIFY(cache.get(1, MTP_OBJ_PROP_Obj_Format, value));
+    QCOMPARE(value.userType(), static_cast<int>(QMetaType::UShort));
+    QCOMPARE(value.value<quint16>(), static_cast<quint16>(MTP_OBF_FORMAT_Text));
+    QVERIFY(cache.get(1, MTP_OBJ_PROP_Obj_File_Name, value));
+    QCOMPARE(value.toString(), QStringLiteral("file"));
+    QVERIFY(cache.get(1, MTP_OBJ_PROP_Genre, value));
+    QVERIFY(!value.isValid());
+    QVERIFY(cache.get(1, MTP_OBJ_PROP_Persistent_Unique_ObjId, value));
+    QVERIFY(value.value<MtpInt128>() == MtpInt128(7));
+    QCOMPARE(cache.hits(), static_cast<quint64>(4));
+
+    // A value of another type does not disturb the ones already cached
+    cache.add(2, MTP_OBJ_PROP_Obj_Format, QVariant::fromValue(static_cast<quint32>(5)));
+    QVERIFY(cache.get(1, MTP_OBJ_PROP_Obj_Format, value));
+    QCOMPARE(value.userType(), static_cast<int>(QMetaType::UShort));
+    QCOMPARE(value.value<quint16>(), static_cast<quint16>(MTP_OBF_FORMAT_Text));
+    QVERIFY(cache.get(2, MTP_OBJ_PROP_Obj_Format, value));
+    QCOMPARE(value.value<quint32>(), static_cast<quint32>(5));
+
+    cache.remove(1, MTP_OBJ_PROP_Obj_Format);
+    QVERIFY(!cache.get(1, MTP_OBJ_PROP_Obj_Format, value));
+    QVERIFY(cache.get(1, MTP_OBJ_PROP_Obj_File_Name, value));
+    cache.remove(1);
+    QVERIFY(!cache.get(1, MTP_OBJ_PROP_Obj_File_Name, value));
+
+    cache.clear();
+    QCOMPARE(cache.memoryUsage(), static_cast<qint64>(0));
+
+    // Strings no cached value refers to anymore are dropped right away
+    cache.add(1, MTP_OBJ_PROP_Obj_File_Name, QVariant::fromValue(QString("first")));
+    qint64 usage = cache.memoryUsage();
+    cache.add(1, MTP_OBJ_PROP_Obj_File_Name, QVariant::fromValue(QString("longer")));
+    QCOMPARE(cache.memoryUsage(), usage + static_cast<qint64>(sizeof(QChar)));
+    usage = cache.memoryUsage();
+    cache.add(2, MTP_OBJ_PROP_Obj_File_Name, QVariant::fromValue(QString("longer")));
+    cache.remove(2);
+    QCOMPARE(cache.memoryUsage(), usage);
+    cache.remove(1, MTP_OBJ_PROP_Obj_File_Name);
+    QCOMPARE(cache.memoryUsage(), static_cast<qint64>(0));
+}
+
+void StorageFactory_test::testObjectPropertyCacheEviction()
+{
+    // Room for about two associations of ten objects
+    ObjectPropertyCache cache(2200);
+    QVariant value;
+
+    for (ObjHandle association = 100; association <= 300; association += 100) {
+        for (ObjHandle handle = association + 1; handle <= association + 10; ++handle) {
+            cache.setAssociation(handle, association);
+            cache.add(handle, MTP_OBJ_PROP_Obj_File_Name, QVariant::fromValue(QString("object%1").arg(handle)));
+            cache.add(handle, MTP_OBJ_PROP_Obj_Size, QVariant::fromValue(static_cast<quint64>(handle)));
+        }
+        if (association == 200) {
+            // Makes the second association the least recently used one
+            QVERIFY(cache.get(101, MTP_OBJ_PROP_Obj_Size, value));
+        }
+    }
+
+    QVERIFY(cache.memoryUsage() <= 2200);
+    QCOMPARE(cache.evictions(), static_cast<quint64>(10));
+    for (ObjHandle handle = 201; handle <= 210; ++handle) {
+        QVERIFY(!cache.get(handle, MTP_OBJ_PROP_Obj_Size, value));
+    }
+    QVERIFY(cache.get(105, MTP_OBJ_PROP_Obj_File_Name, value));
+    QCOMPARE(value.toString(), QStringLiteral("object105"));
+    QVERIFY(cache.get(310, MTP_OBJ_PROP_Obj_Size, value));
+    QCOMPARE(value.value<quint64>(), static_cast<quint64>(310));
 }
 
 void StorageFactory_test::cleanupTestCase()
@@ -41,7 +41,10 @@ private slots:
     void testStorageIds();
     void testGetObjectHandles();
     void testGetDevicePropValueAfterObjectInfoChanged();
-    void testMassObjectPropertyQueryThrottle();
+    void testSiblingPrefetch();
+    void testHandleRouting();
+    void testObjectPropertyCache();
+    void testObjectPropertyCacheEviction();
 
 private:
     ObjHandle handleForFilename(ObjHandle parent, const QString &name) const;
@@ -37,6 +37,9 @@
 #include <QtAlgorithms>
 #include <qglobal.h>
 
+#include <unistd.h>
+#include <algorithm>
+
 #include "mtpresponder.h"
 #include "mtpcontainerwrapper.h"
 #include "mtptxcontainer.h"
@@ -67,9 +70,13 @@ using namespace meegomtp1dot0;
  */
 #define DEFER_TRANSPORTER_ACTIVATION 1
 
-// BUFFER_MAX_LEN is based on the max request size in ci13xxx_udc.c,
-// which is four pages of 4k each
-static const quint32 BUFFER_MAX_LEN = 4 * 4096;
+// Buffers for object data are sized by MTPTransporter::dataChunkSize().
+// When object data is sent straight from file, the transport splits it
+// into chunk sized writes -> larger segments just mean fewer round trips
+// between responder and transport.
+static const quint32 FILE_SEGMENT_MAX_LEN = 1024 * 1024;
+// Number of objects whose properties GetObjectPropList fetches at a time
+static const int PROPLIST_BATCH_SIZE = 256;
 MTPResponder *MTPResponder::m_instance = 0;
 
 MTPResponder *MTPResponder::instance()
@@ -1103,8 +1110,11 @@ void MTPResponder::getObjectHandlesReq()
     if (MTP_RESP_OK == code) {
         // At least one PTP client (iPhoto) only shows all pictures if
         // the handles are sorted. It's probably related to having parent
-        // folders listed before the objects they contain.
-        std::sort(handles.begin(), handles.end());
+        // folders listed before the objects they contain. Storages keep
+        // their lists sorted, checking does not copy a shared list.
+        if (!std::is_sorted(handles.constBegin(), handles.constEnd())) {
+            std::sort(handles.begin(), handles.end());
+        }
         MTP_LOG_INFO("handle count:" << handles.size());
         // DATA PHASE
         payloadLength = (handles.size() + 1) * sizeof(quint32);
@@ -1948,11 +1958,7 @@ void MTPResponder::getObjectPropListReq()
             QVector<ObjHandle> objHandles;
             quint32 numHandles = 0;
             quint32 numElements = 0;
-            MTPObjFormatCode objFormat;
-            MTPObjectFormatCategory category;
             quint32 storageID = 0xFFFFFFFF;
-            const MTPObjectInfo *objInfo;
-            ObjHandle currentObj = 0;
 
             if (0 == depth) {
                 // The properties for this object are requested
@@ -1971,65 +1977,60 @@ void MTPResponder::getObjectPropListReq()
             }
 
             if (MTP_RESP_OK == resp) {
-                // TODO: The buffer max len needs to be decided
-                quint32 maxPayloadLen = BUFFER_MAX_LEN - MTP_HEADER_SIZE;
+                quint32 chunkSize = m_transporter->dataChunkSize();
                 MTPTxContainer dataContainer(
-                    MTP_CONTAINER_TYPE_DATA, reqContainer->code(), reqContainer->transactionId(), maxPayloadLen);
+                    MTP_CONTAINER_TYPE_DATA, reqContainer->code(), reqContainer->transactionId(),
+                    chunkSize - MTP_HEADER_SIZE);
+                // Sizes of the serialized objects, for streaming the dataset if it outgrows one chunk
+                QVector<quint32> objSizes;
+                quint64 payloadLength = sizeof(quint32);
+                bool streamed = false;
 
                 // if there are no handles found an empty dataset will be sent
                 numHandles = objHandles.size();
                 MTP_LOG_TRACE(numHandles);
                 dataContainer << numHandles; // Write the numHandles here for now, to advance the serializer's pointer
                 // go through the list of found ObjectHandles
+                QVector<QList<MTPObjPropDescVal>> propValLists;
                 for (quint32 i = 0; (i < numHandles && (MTP_RESP_OK == resp)); i++) {
-                    currentObj = objHandles[i];
-
-                    resp = m_storageServer->getObjectInfo(currentObj, objInfo);
+                    if (0 == i % PROPLIST_BATCH_SIZE) {
+                        resp = getObjectPropLists(objHandles.mid(i, PROPLIST_BATCH_SIZE), propCode, propValLists);
+                    }
                     if (MTP_RESP_OK == resp) {
-                        // find the format and the category of the object
-                        objFormat = static_cast<MTPObjFormatCode>(objInfo->mtpObjectFormat);
-                        category = static_cast<MTPObjectFormatCategory>(
-                            m_devInfoProvider->getFormatCodeCategory(objFormat));
-
-                        // FIXME: Investigate if the below force assignment to common format is really needed
-                        if (category == MTP_UNSUPPORTED_FORMAT) {
-                            category = MTP_COMMON_FORMAT;
-                        }
+                        QList<MTPObjPropDescVal> &propValList = propValLists[i % PROPLIST_BATCH_SIZE];
+                        quint32 objSize = 0;
 
-                        QList<MTPObjPropDescVal> propValList;
-                        // check whether all or a certain ObjectProperty of the referenced Object is requested
-                        if (0xFFFF == propCode) {
-                            const MtpObjPropDesc *propDesc = 0;
-                            QVector<MTPObjPropertyCode> propsSupported;
-
-                            resp = m_propertyPod->getObjectPropsSupportedByType(category, propsSupported);
-                            for (int i = 0; ((i < propsSupported.size()) && (MTP_RESP_OK == resp)); i++) {
-                                resp = m_propertyPod->getObjectPropDesc(category, propsSupported[i], propDesc);
-                                if (MTP_OBJ_PROP_Rep_Sample_Data != propDesc->uPropCode) {
-                                    propValList.append(MTPObjPropDescVal(propDesc));
-                                }
-                            }
+                        // The element count goes in front of the elements, so a dataset that does not fit
+                        // in one chunk is only measured here and serialized while it is being sent
+                        if (streamed) {
+                            numElements += measurePropList(propValList, objSize);
                         } else {
-                            const MtpObjPropDesc *propDesc = 0;
-                            resp = m_propertyPod->getObjectPropDesc(category, propCode, propDesc);
-                            propValList.append(MTPObjPropDescVal(propDesc));
-                        }
-                        if (MTP_RESP_OK == resp) {
-                            resp = m_storageServer->getObjectPropertyValue(currentObj, propValList);
-                            if (resp == MTP_RESP_OK) {
-                                numElements += serializePropList(currentObj, propValList, dataContainer);
+                            quint32 offset = dataContainer.bufferSize();
+                            numElements += serializePropList(objHandles[i], propValList, dataContainer);
+                            objSize = dataContainer.bufferSize() - offset;
+                            if (dataContainer.bufferSize() > chunkSize) {
+                                streamed = true;
+                                dataContainer.discardPayload(dataContainer.bufferSize() - MTP_HEADER_SIZE);
                             }
                         }
+                        objSizes.append(objSize);
+                        payloadLength += objSize;
                     }
                 }
                 if (MTP_RESP_OK == resp) {
                     MTP_LOG_INFO("element count:" << numElements);
-                    // KLUDGE: We have to manually insert the number of elements at
-                    // the start of the container payload. Is there a better way?
-                    dataContainer.putl32(dataContainer.payload(), numElements);
-                    sent = sendContainer(dataContainer);
-                    if (!sent) {
-                        MTP_LOG_CRITICAL("Could not send data");
+                    if (streamed) {
+                        sent = sendObjectPropListStreamed(
+                            dataContainer, objHandles, propCode, propValLists, objSizes, payloadLength, numElements,
+                            resp);
+                    } else {
+                        // KLUDGE: We have to manually insert the number of elements at
+                        // the start of the container payload. Is there a better way?
+                        dataContainer.putl32(dataContainer.payload(), numElements);
+                        sent = sendContainer(dataContainer);
+                        if (!sent) {
+                            MTP_LOG_CRITICAL("Could not send data");
+                        }
                     }
                 }
             } else { //FIXME Is this needed?
@@ -2345,8 +2346,11 @@ void MTPResponder::sendObjectData(quint8 *data, quint32 dataLen, bool isFirstPac
             }
             m_storageServer->setObjectPropertyValue(handle, propValList, true);
         }
-        // Trigger close file in the storage server... ignore return here
-        m_storageServer->writeData(handle, 0, 0, false, true);
+        // Trigger close file in the storage server. Data may be written
+        // in background, so failures can surface only at this point.
+        MTPResponseCode closeCode = m_storageServer->writeData(handle, 0, 0, false, true);
+        if (MTP_RESP_OK == code)
+            code = closeCode;
         // create and send container for response
         sendResponse(code);
         // This is moved here intentionally : in case a cancel tx is received before sending the response above
@@ -2888,6 +2892,234 @@ quint32 MTPResponder::serializePropList(
     return serializedCount;
 }
 
+quint32 MTPResponder::measurePropList(const QList<MTPObjPropDescVal> &propValList, quint32 &length)
+{
+    quint32 count = 0;
+
+    length = 0;
+    for (QList<MTPObjPropDescVal>::const_iterator i = propValList.constBegin(); i != propValList.constEnd(); ++i) {
+        if (!i->propVal.isValid()) {
+            continue;
+        }
+
+        const MtpObjPropDesc *propDesc = i->propDesc;
+        length += sizeof(ObjHandle) + sizeof(propDesc->uPropCode) + sizeof(propDesc->uDataType);
+        length += MTPTxContainer::variantLength(propDesc->uDataType, i->propVal);
+
+        ++count;
+    }
+
+    return count;
+}
+
+MTPResponseCode MTPResponder::getObjectCategory(ObjHandle handle, MTPObjectFormatCategory &category)
+{
+    const MTPObjectInfo *objInfo;
+    MTPResponseCode resp = m_storageServer->getObjectInfo(handle, objInfo);
+    if (MTP_RESP_OK != resp) {
+        return resp;
+    }
+
+    // find the format and the category of the object
+    MTPObjFormatCode objFormat = static_cast<MTPObjFormatCode>(objInfo->mtpObjectFormat);
+    category = static_cast<MTPObjectFormatCategory>(m_devInfoProvider->getFormatCodeCategory(objFormat));
+
+    // FIXME: Investigate if the below force assignment to common format is really needed
+    if (category == MTP_UNSUPPORTED_FORMAT) {
+        category = MTP_COMMON_FORMAT;
+    }
+    return MTP_RESP_OK;
+}
+
+MTPResponseCode MTPResponder::getObjectPropDescs(
+    MTPObjectFormatCategory category, MTPObjPropertyCode propCode, QList<const MtpObjPropDesc *> &propDescs)
+{
+    MTPResponseCode resp = MTP_RESP_OK;
+
+    // check whether all or a certain ObjectProperty of the referenced Object is requested
+    if (0xFFFF == propCode) {
+        const MtpObjPropDesc *propDesc = 0;
+        QVector<MTPObjPropertyCode> propsSupported;
+
+        resp = m_propertyPod->getObjectPropsSupportedByType(category, propsSupported);
+        for (int i = 0; ((i < propsSupported.size()) && (MTP_RESP_OK == resp)); i++) {
+            resp = m_propertyPod->getObjectPropDesc(category, propsSupported[i], propDesc);
+            if (MTP_OBJ_PROP_Rep_Sample_Data != propDesc->uPropCode) {
+                propDescs.append(propDesc);
+            }
+        }
+    } else {
+        const MtpObjPropDesc *propDesc = 0;
+        resp = m_propertyPod->getObjectPropDesc(category, propCode, propDesc);
+        propDescs.append(propDesc);
+    }
+    return resp;
+}
+
+MTPResponseCode MTPResponder::getObjectPropLists(
+    const QVector<ObjHandle> &handles, MTPObjPropertyCode propCode, QVector<QList<MTPObjPropDescVal>> &propValLists)
+{
+    MTPResponseCode resp = MTP_RESP_OK;
+    QHash<int, QList<const MtpObjPropDesc *>> propDescs;
+    QHash<int, QVector<int>> objectsOfCategory;
+
+    propValLists.resize(handles.size());
+    for (int i = 0; i < handles.size(); i++) {
+        MTPObjectFormatCategory category;
+        resp = getObjectCategory(handles[i], category);
+        if (MTP_RESP_OK != resp) {
+            return resp;
+        }
+        if (!propDescs.contains(category)) {
+            resp = getObjectPropDescs(category, propCode, propDescs[category]);
+            if (MTP_RESP_OK != resp) {
+                return resp;
+            }
+        }
+        objectsOfCategory[category].append(i);
+    }
+
+    // A lone object is queried the way GetObjectPropValue does, which lets
+    // the storage server prefetch its siblings
+    if (1 == handles.size()) {
+        QList<MTPObjPropDescVal> &propValList = propValLists[0];
+        propValList.clear();
+        foreach (const MtpObjPropDesc *propDesc, propDescs.begin().value()) {
+            propValList.append(MTPObjPropDescVal(propDesc));
+        }
+        return m_storageServer->getObjectPropertyValue(handles[0], propValList);
+    }
+
+    // Objects of the same category share the property set, so each category
+    // is fetched in one call
+    QHash<int, QVector<int>>::const_iterator it;
+    for (it = objectsOfCategory.constBegin(); it != objectsOfCategory.constEnd(); ++it) {
+        const QList<const MtpObjPropDesc *> &descs = propDescs[it.key()];
+        const QVector<int> &indices = it.value();
+        QVector<ObjHandle> categoryHandles;
+        categoryHandles.reserve(indices.size());
+        foreach (int i, indices) {
+            categoryHandles.append(handles[i]);
+        }
+
+        QVector<QList<QVariant>> values;
+        resp = m_storageServer->getObjectPropertyValues(categoryHandles, descs, values);
+        if (MTP_RESP_OK != resp) {
+            return resp;
+        }
+        for (int j = 0; j < indices.size(); j++) {
+            QList<MTPObjPropDescVal> &propValList = propValLists[indices[j]];
+            propValList.clear();
+            for (int k = 0; k < descs.size(); k++) {
+                propValList.append(MTPObjPropDescVal(descs[k], values[j][k]));
+            }
+        }
+    }
+    return MTP_RESP_OK;
+}
+
+bool MTPResponder::sendObjectPropListStreamed(
+    MTPTxContainer &dataContainer,
+    const QVector<ObjHandle> &objHandles,
+    MTPObjPropertyCode propCode,
+    QVector<QList<MTPObjPropDescVal>> &propValLists,
+    const QVector<quint32> &objSizes,
+    quint64 payloadLength,
+    quint32 numElements,
+    MTPResponseCode &resp)
+{
+    MTP_FUNC_TRACE();
+
+    bool headerSent = false;
+    bool sendFailed = false;
+
+    dataContainer.discardPayload(dataContainer.bufferSize() - MTP_HEADER_SIZE);
+    dataContainer << numElements;
+    dataContainer.setContainerLength(
+        payloadLength > MTP_MAX_CONTENT_SIZE ? 0xFFFFFFFF : quint32(MTP_HEADER_SIZE + payloadLength));
+
+    // The values of a single batch are still at hand from measuring, larger
+    // datasets are fetched again one batch at a time to keep memory bounded
+    bool refetch = objHandles.size() > PROPLIST_BATCH_SIZE;
+    for (int i = 0; i < objHandles.size(); i++) {
+        if (refetch && 0 == i % PROPLIST_BATCH_SIZE) {
+            resp = getObjectPropLists(objHandles.mid(i, PROPLIST_BATCH_SIZE), propCode, propValLists);
+            if (MTP_RESP_OK != resp) {
+                break;
+            }
+        }
+        QList<MTPObjPropDescVal> &propValList = propValLists[i % PROPLIST_BATCH_SIZE];
+
+        // The container length and element count are already fixed, so a
+        // refetched object must serialize to the length it was measured at
+        quint32 offset = dataContainer.bufferSize();
+        serializePropList(objHandles[i], propValList, dataContainer);
+        if (dataContainer.bufferSize() - offset != objSizes[i]) {
+            MTP_LOG_WARNING("Object" << objHandles[i] << "changed while its properties were being sent");
+            resp = MTP_RESP_GeneralError;
+            break;
+        }
+
+        if (!sendDataChunks(dataContainer, headerSent, i == objHandles.size() - 1)) {
+            sendFailed = true;
+            break;
+        }
+    }
+
+    // See sendObjectSegmented(): once a part of the data container has been
+    // sent, neither a data nor a response container can follow it anymore
+    if (headerSent && (sendFailed || MTP_RESP_OK != resp)) {
+        MTP_LOG_CRITICAL("Could not finish data phase");
+        return false;
+    }
+    if (sendFailed) {
+        MTP_LOG_CRITICAL("Could not send data");
+        return false;
+    }
+    return true;
+}
+
+bool MTPResponder::sendDataChunks(MTPTxContainer &dataContainer, bool &headerSent, bool isLastPacket)
+{
+    quint32 chunkSize = m_transporter->dataChunkSize();
+
+    if (!headerSent) {
+        if (!isLastPacket && dataContainer.bufferSize() <= chunkSize) {
+            return true;
+        }
+
+        // Send the header and the first chunk's worth of payload as a container of its own
+        quint32 excess = isLastPacket ? 0 : dataContainer.bufferSize() - chunkSize;
+        dataContainer.seek(-qint32(excess));
+        quint32 sentLength = dataContainer.bufferSize() - MTP_HEADER_SIZE;
+        bool sent = sendContainer(dataContainer, isLastPacket);
+        dataContainer.seek(excess);
+        if (!sent) {
+            return false;
+        }
+        headerSent = true;
+        dataContainer.discardPayload(sentLength);
+    }
+
+    // Only whole chunks can go out before the last one, and something is
+    // always kept back so that the last packet has data to terminate with
+    quint32 length = dataContainer.bufferSize() - MTP_HEADER_SIZE;
+    if (!isLastPacket) {
+        length = length ? ((length - 1) / chunkSize) * chunkSize : 0;
+    }
+    if (0 == length) {
+        return true;
+    }
+    if (RESPONDER_TX_CANCEL == getResponderState()) {
+        return false;
+    }
+    if (!m_transporter->sendData(dataContainer.payload(), length, isLastPacket)) {
+        return false;
+    }
+    dataContainer.discardPayload(length);
+    return true;
+}
+
 void MTPResponder::sendObjectSegmented()
 {
     MTP_FUNC_TRACE();
@@ -2899,13 +3131,14 @@ void MTPResponder::sendObjectSegmented()
     bool contentSent = false;
     quint64 bytesSent = 0;
     quint8 *buffer = nullptr;
+    quint32 chunkSize = m_transporter->dataChunkSize();
 
     quint64 remainingLength = m_segmentedSender.offsetEnd - m_segmentedSender.offsetNow;
 
     // Send ptp header + initial part of file content
     if (respCode == MTP_RESP_OK && !headerSent) {
         // Calculate amount of data to send in initial frame
-        quint32 contentLength = BUFFER_MAX_LEN - MTP_HEADER_SIZE;
+        quint32 contentLength = chunkSize - MTP_HEADER_SIZE;
         if (remainingLength < contentLength)
             contentLength = quint32(remainingLength);
 
@@ -2915,6 +3148,8 @@ void MTPResponder::sendObjectSegmented()
             remainingLength > MTP_MAX_CONTENT_SIZE ? 0xFFFFFFFF : quint32(MTP_HEADER_SIZE + remainingLength));
 
         // Read file content
+        m_storageServer->adviseSequentialRead(
+            m_segmentedSender.objHandle, m_segmentedSender.offsetNow, m_segmentedSender.offsetEnd);
         respCode = m_storageServer->readData(
             m_segmentedSender.objHandle,
             reinterpret_cast<char *>(dataContainer.payload()),
@@ -2935,17 +3170,48 @@ void MTPResponder::sendObjectSegmented()
         }
     }
 
-    while (respCode == MTP_RESP_OK && headerSent && !contentSent) {
+    // Send the rest of file content without copying it, if possible
+    int fd = -1;
+    bool sentFromFile = false;
+    if (respCode == MTP_RESP_OK && headerSent && !contentSent && m_transporter->canSendFileData()
+        && m_storageServer->openObjectFd(m_segmentedSender.objHandle, fd) == MTP_RESP_OK) {
+        sentFromFile = true;
+        while (!contentSent) {
+            // Calculate amount of data to send in continuation frame
+            quint32 contentLength = FILE_SEGMENT_MAX_LEN;
+            if (remainingLength < contentLength)
+                contentLength = quint32(remainingLength);
+
+            m_storageServer->adviseSequentialRead(
+                m_segmentedSender.objHandle, m_segmentedSender.offsetNow, m_segmentedSender.offsetEnd);
+            if (!m_transporter->sendFileData(
+                    fd, m_segmentedSender.offsetNow, contentLength, (contentLength == remainingLength))) {
+                MTP_LOG_CRITICAL("Could not send content");
+                break;
+            }
+            bytesSent += contentLength;
+            remainingLength -= contentLength;
+            m_segmentedSender.offsetNow += contentLength;
+            contentSent = (remainingLength == 0);
+        }
+        close(fd);
+        fd = -1;
+    }
+
+    // A failure to send from file is not retried from buffers
+    while (respCode == MTP_RESP_OK && headerSent && !contentSent && !sentFromFile) {
         // Allocate buffer
         if (!buffer)
-            buffer = new quint8[BUFFER_MAX_LEN];
+            buffer = new quint8[chunkSize];
 
         // Calculate amount of data to send in continuation frame
-        quint32 contentLength = BUFFER_MAX_LEN;
+        quint32 contentLength = chunkSize;
         if (remainingLength < contentLength)
             contentLength = quint32(remainingLength);
 
         // Read file content
+        m_storageServer->adviseSequentialRead(
+            m_segmentedSender.objHandle, m_segmentedSender.offsetNow, m_segmentedSender.offsetEnd);
         respCode
             = m_storageServer
                   ->readData(m_segmentedSender.objHandle, (char *) buffer, contentLength, m_segmentedSender.offsetNow);
@@ -2987,6 +3253,7 @@ void MTPResponder::sendObjectSegmented()
             break;
         }
     }
+    m_storageServer->releaseObjectData(m_segmentedSender.objHandle);
     delete[] buffer;
 }
 
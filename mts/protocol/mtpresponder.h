@@ -473,6 +473,66 @@ private:
     /// QVariants.
     quint32 serializePropList(ObjHandle handle, QList<MTPObjPropDescVal> &propValList, MTPTxContainer &dataContainer);
 
+    /// Computes the serialized length of a property list without serializing
+    /// it, skipping invalid QVariants the way serializePropList() does.
+    ///
+    /// \param length [out] the number of bytes the properties take
+    ///
+    /// \return the number of properties that would be serialized.
+    quint32 measurePropList(const QList<MTPObjPropDescVal> &propValList, quint32 &length);
+
+    /// Finds out the format category of an object.
+    MTPResponseCode getObjectCategory(ObjHandle handle, MTPObjectFormatCategory &category);
+
+    /// Lists the descriptions of one or all object properties of a format
+    /// category, as GetObjectPropList reports them.
+    MTPResponseCode getObjectPropDescs(
+        MTPObjectFormatCategory category, MTPObjPropertyCode propCode, QList<const MtpObjPropDesc *> &propDescs);
+
+    /// Fetches the values of one or all object properties of a number of
+    /// objects, as GetObjectPropList reports them. The values are queried
+    /// from the storage server in one call per format category.
+    ///
+    /// \param propValLists [out] the properties of each object, in the order
+    /// of \c handles
+    MTPResponseCode getObjectPropLists(
+        const QVector<ObjHandle> &handles,
+        MTPObjPropertyCode propCode,
+        QVector<QList<MTPObjPropDescVal>> &propValLists);
+
+    /// Sends a GetObjectPropList dataset that does not fit in one chunk. The
+    /// objects are serialized one by one and sent in whole chunks, so the
+    /// dataset is never held in memory in full.
+    ///
+    /// \param propValLists [in,out] The last batch of properties fetched
+    /// while measuring, reused if it covers all of \c objHandles
+    /// \param objSizes [in] The serialized size of each object, as measured
+    /// before sending
+    /// \param payloadLength [in] The length of the whole dataset
+    /// \param resp [out] The response code for the operation
+    ///
+    /// \return false if no response must be sent, i.e. the data could not be
+    /// sent or was sent only in part.
+    bool sendObjectPropListStreamed(
+        MTPTxContainer &dataContainer,
+        const QVector<ObjHandle> &objHandles,
+        MTPObjPropertyCode propCode,
+        QVector<QList<MTPObjPropDescVal>> &propValLists,
+        const QVector<quint32> &objSizes,
+        quint64 payloadLength,
+        quint32 numElements,
+        MTPResponseCode &resp);
+
+    /// Sends what has been serialized into a data container so far in whole
+    /// transport chunks, and drops the sent part from the container. The
+    /// container header goes out with the first chunk.
+    ///
+    /// \param headerSent [in,out] Whether the container header has been sent
+    /// \param isLastPacket [in] If true, all of the remaining data is sent
+    ///
+    /// \return true on success
+    bool sendDataChunks(MTPTxContainer &dataContainer, bool &headerSent, bool isLastPacket);
+
     /// Sends a large data packet in segments of max data packet size
     void sendObjectSegmented();
 
@@ -70,6 +70,16 @@ void MTPTxContainer::resetContainerLength()
     m_computeContainerLength = true;
 }
 
+void MTPTxContainer::discardPayload(quint32 len)
+{
+    quint32 payloadLength = m_offset - MTP_HEADER_SIZE;
+    if (len > payloadLength) {
+        len = payloadLength;
+    }
+    memmove(m_buffer + MTP_HEADER_SIZE, m_buffer + MTP_HEADER_SIZE + len, payloadLength - len);
+    m_offset -= len;
+}
+
 const quint8 *MTPTxContainer::buffer()
 {
     // Populate the container length
@@ -217,13 +227,12 @@ MTPTxContainer &MTPTxContainer::operator<<(const QVector<MtpInt128> &d)
     return *this;
 }
 
-MTPTxContainer &MTPTxContainer::operator<<(const QString &d)
+// Shortens a string to what fits in an MTP string, and returns its UTF-16
+// data in \a str and its encoded length, without the NULL terminator
+static const quint16 *truncateString(const QString &d, QString &str, int &len)
 {
-    QString str;
-
     const quint16 *dta = 0;
     const quint16 *end = 0;
-    int len = 0;
 
     // Maximum possible string length is 255 (one character for the NULL terminator)
     // Due to UTF16 encoding, content size can be greater than string length
@@ -238,6 +247,14 @@ MTPTxContainer &MTPTxContainer::operator<<(const QString &d)
         if (len <= 254)
             break;
     }
+    return dta;
+}
+
+MTPTxContainer &MTPTxContainer::operator<<(const QString &d)
+{
+    QString str;
+    int len = 0;
+    const quint16 *dta = truncateString(d, str, len);
 
     MTP_LOG_TRACE("string:" << str);
 
@@ -375,6 +392,54 @@ void MTPTxContainer::serializeVariantByType(MTPDataType type, const QVariant &d)
     }
 }
 
+quint32 MTPTxContainer::variantLength(MTPDataType type, const QVariant &d)
+{
+    switch (type) {
+    case MTP_DATA_TYPE_INT8:
+    case MTP_DATA_TYPE_UINT8:
+        return sizeof(quint8);
+    case MTP_DATA_TYPE_INT16:
+    case MTP_DATA_TYPE_UINT16:
+        return sizeof(quint16);
+    case MTP_DATA_TYPE_INT32:
+    case MTP_DATA_TYPE_UINT32:
+        return sizeof(quint32);
+    case MTP_DATA_TYPE_INT64:
+    case MTP_DATA_TYPE_UINT64:
+        return sizeof(quint64);
+    case MTP_DATA_TYPE_INT128:
+    case MTP_DATA_TYPE_UINT128:
+        return sizeof(MtpInt128);
+    case MTP_DATA_TYPE_AINT8:
+        return sizeof(quint32) + d.value< QVector<qint8> >().size() * sizeof(qint8);
+    case MTP_DATA_TYPE_AUINT8:
+        return sizeof(quint32) + d.value< QVector<quint8> >().size() * sizeof(quint8);
+    case MTP_DATA_TYPE_AINT16:
+        return sizeof(quint32) + d.value< QVector<qint16> >().size() * sizeof(qint16);
+    case MTP_DATA_TYPE_AUINT16:
+        return sizeof(quint32) + d.value< QVector<quint16> >().size() * sizeof(quint16);
+    case MTP_DATA_TYPE_AINT32:
+        return sizeof(quint32) + d.value< QVector<qint32> >().size() * sizeof(qint32);
+    case MTP_DATA_TYPE_AUINT32:
+        return sizeof(quint32) + d.value< QVector<quint32> >().size() * sizeof(quint32);
+    case MTP_DATA_TYPE_AINT64:
+        return sizeof(quint32) + d.value< QVector<qint64> >().size() * sizeof(qint64);
+    case MTP_DATA_TYPE_AUINT64:
+        return sizeof(quint32) + d.value< QVector<quint64> >().size() * sizeof(quint64);
+    case MTP_DATA_TYPE_AINT128:
+    case MTP_DATA_TYPE_AUINT128:
+        return sizeof(quint32) + d.value< QVector<MtpInt128> >().size() * sizeof(MtpInt128);
+    case MTP_DATA_TYPE_STR: {
+        QString str;
+        int len = 0;
+        truncateString(d.value<QString>(), str, len);
+        return sizeof(quint8) + ((len > 0) ? (len + 1) * sizeof(quint16) : 0);
+    }
+    default:
+        return 0;
+    }
+}
+
 void MTPTxContainer::serialize(const void *source, quint32 elementSize, quint32 numberOfElements)
 {
     // Expand buffer if needed
@@ -156,10 +156,20 @@ public:
     /// \param type [in] The MTP type of the value to be serialized
     /// \param d [in] The value to serialize
     void serializeVariantByType(MTPDataType type, const QVariant &d);
+    /// Computes the number of bytes serializeVariantByType() writes for a
+    /// value, without serializing it
+    /// \param type [in] The MTP type of the value
+    /// \param d [in] The value to measure
+    /// \return The serialized length of the value
+    static quint32 variantLength(MTPDataType type, const QVariant &d);
     ///< Provide a container length and prevent MTPTxContainer from determining the same
     void setContainerLength(quint32 containerLength);
     ///< Allow MTPTxContainer to determine container length ( the default )
     void resetContainerLength();
+    /// Drops bytes from the start of the payload, moving the rest of the payload up. Useful when a data
+    /// container is sent in pieces and the part that has already gone out is no longer needed.
+    /// \param len [in] The number of payload bytes to drop
+    void discardPayload(quint32 len);
 
 private:
     ///< Serializes into the internal buffer, elements of the given size and
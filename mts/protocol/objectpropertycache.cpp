@@ -34,13 +34,145 @@
 
 using namespace meegomtp1dot0;
 
+// Rough per row and per cell costs of the cache structures, in bytes
+static const qint64 ROW_SIZE = 64;
+static const qint64 CELL_SIZE = 8;
+
+// Groups of objects without a known association are keyed by the object
+// handle, those of associations by the association handle with this bit set
+static const quint64 ASSOCIATION_GROUP = Q_UINT64_C(1) << 32;
+
+static bool numberOf(const QVariant &value, quint64 &number)
+{
+    switch (value.userType()) {
+    case QMetaType::Bool:
+        number = value.value<bool>();
+        return true;
+    case QMetaType::SChar:
+        number = value.value<qint8>();
+        return true;
+    case QMetaType::UChar:
+        number = value.value<quint8>();
+        return true;
+    case QMetaType::Short:
+        number = value.value<qint16>();
+        return true;
+    case QMetaType::UShort:
+        number = value.value<quint16>();
+        return true;
+    case QMetaType::Int:
+        number = value.value<qint32>();
+        return true;
+    case QMetaType::UInt:
+        number = value.value<quint32>();
+        return true;
+    case QMetaType::LongLong:
+        number = value.value<qint64>();
+        return true;
+    case QMetaType::ULongLong:
+        number = value.value<quint64>();
+        return true;
+    default:
+        return false;
+    }
+}
+
+static QVariant numberVariant(int type, quint64 number)
+{
+    switch (type) {
+    case QMetaType::Bool:
+        return QVariant::fromValue(number != 0);
+    case QMetaType::SChar:
+        return QVariant::fromValue(qint8(number));
+    case QMetaType::UChar:
+        return QVariant::fromValue(quint8(number));
+    case QMetaType::Short:
+        return QVariant::fromValue(qint16(number));
+    case QMetaType::UShort:
+        return QVariant::fromValue(quint16(number));
+    case QMetaType::Int:
+        return QVariant::fromValue(qint32(number));
+    case QMetaType::UInt:
+        return QVariant::fromValue(quint32(number));
+    case QMetaType::LongLong:
+        return QVariant::fromValue(qint64(number));
+    default:
+        return QVariant::fromValue(number);
+    }
+}
+
+ObjectPropertyCache::ObjectPropertyCache(qint64 memoryBudget)
+    : m_useCount(0)
+    , m_payloadSize(0)
+    , m_memoryBudget(memoryBudget)
+    , m_hits(0)
+    , m_misses(0)
+    , m_evictions(0)
+{
+}
+
 void ObjectPropertyCache::add(ObjHandle handle, MTPObjPropertyCode propertyCode, const QVariant &value)
 {
     MTP_FUNC_TRACE();
 
-    //MTP_LOG_WARNING("Property code " << propertyCode << " with value " << value.toString()
-    // << " added/updated to cache for object handle " << handle);
-    m_propertyMap[handle].insert(propertyCode, value);
+    int row = rowOf(handle, true);
+    Column &column = m_columns[propertyCode];
+    if (column.present.size() <= row) {
+        int size = m_rows.size();
+        column.present.resize(size);
+        column.valid.resize(size);
+    }
+
+    if (column.present.testBit(row)) {
+        clearValue(column, row);
+    } else {
+        column.present.setBit(row);
+        ++m_rows[row].valueCount;
+    }
+
+    if (value.isValid()) {
+        quint64 number = 0;
+        bool isNumber = numberOf(value, number);
+        bool isString = !isNumber && value.userType() == QMetaType::QString;
+
+        if (column.kind == EmptyColumn) {
+            column.kind = isNumber ? NumberColumn : isString ? StringColumn : VariantColumn;
+            column.numberType = isNumber ? value.userType() : int(QMetaType::UnknownType);
+        } else if (
+            (column.kind == NumberColumn && (!isNumber || value.userType() != column.numberType))
+            || (column.kind == StringColumn && !isString)) {
+            // Not the kind of values seen so far for the property
+            convertToVariants(column);
+        }
+
+        switch (column.kind) {
+        case NumberColumn:
+            if (column.numbers.size() <= row) {
+                column.numbers.resize(m_rows.size());
+            }
+            column.numbers[row] = number;
+            break;
+        case StringColumn:
+            if (column.strings.size() <= row) {
+                column.strings.resize(m_rows.size());
+            }
+            column.strings[row] = intern(value.toString());
+            break;
+        default:
+            if (column.variants.size() <= row) {
+                column.variants.resize(m_rows.size());
+            }
+            column.variants[row] = value;
+            m_payloadSize += payloadSize(value);
+            break;
+        }
+        column.valid.setBit(row);
+    }
+
+    touch(m_rows[row].group);
+    if (memoryUsage() > m_memoryBudget) {
+        evict();
+    }
 }
 
 void ObjectPropertyCache::add(ObjHandle handle, const MTPObjPropDescVal &propDescVal)
@@ -60,14 +192,32 @@ void ObjectPropertyCache::add(ObjHandle handle, QList<MTPObjPropDescVal> propDes
     }
 }
 
+void ObjectPropertyCache::setAssociation(ObjHandle handle, ObjHandle association)
+{
+    MTP_FUNC_TRACE();
+
+    moveToGroup(rowOf(handle, true), ASSOCIATION_GROUP | association);
+}
+
 void ObjectPropertyCache::remove(ObjHandle handle, MTPObjPropertyCode propertyCode)
 {
     MTP_FUNC_TRACE();
 
-    //MTP_LOG_WARNING("Property code " << propertyCode << " removed from cache for object handle " << handle);
-    m_propertyMap[handle].remove(propertyCode);
-    if (m_propertyMap[handle].empty() || 0x0000 == propertyCode) {
-        m_propertyMap.remove(handle);
+    int row = rowOf(handle, false);
+    if (row < 0) {
+        return;
+    }
+
+    if (0x0000 != propertyCode) {
+        QHash<MTPObjPropertyCode, Column>::iterator column = m_columns.find(propertyCode);
+        if (column != m_columns.end() && row < column->present.size() && column->present.testBit(row)) {
+            clearValue(*column, row);
+            column->present.clearBit(row);
+            --m_rows[row].valueCount;
+        }
+    }
+    if (0x0000 == propertyCode || 0 == m_rows[row].valueCount) {
+        removeRow(row);
     }
 }
 
@@ -92,16 +242,18 @@ bool ObjectPropertyCache::get(ObjHandle handle, MTPObjPropertyCode propertyCode,
 {
     MTP_FUNC_TRACE();
 
-    bool found = false;
-    if (m_propertyMap.contains(handle) && m_propertyMap[handle].contains(propertyCode)) {
-        value = m_propertyMap[handle].value(propertyCode);
-        //MTP_LOG_WARNING("Property code " << propertyCode << " with value " << value.toString()
-        // << " fetched from cache for object handle " << handle);
-        found = true;
-    } else {
-        //MTP_LOG_WARNING("Property code " << propertyCode << " not found in cache " << " for object handle " << handle);
+    int row = rowOf(handle, false);
+    if (row >= 0) {
+        QHash<MTPObjPropertyCode, Column>::const_iterator column = m_columns.constFind(propertyCode);
+        if (column != m_columns.constEnd() && row < column->present.size() && column->present.testBit(row)) {
+            value = this->value(*column, row);
+            touch(m_rows[row].group);
+            ++m_hits;
+            return true;
+        }
     }
-    return found;
+    ++m_misses;
+    return false;
 }
 
 bool ObjectPropertyCache::get(ObjHandle handle, MTPObjPropDescVal &propDescVal)
@@ -131,7 +283,257 @@ void ObjectPropertyCache::clear()
 {
     MTP_FUNC_TRACE();
 
-    m_propertyMap.clear();
+    MTP_LOG_INFO(
+        "objects:" << m_rowOfHandle.size() << "memory:" << memoryUsage() << "hits:" << m_hits << "misses:" << m_misses
+                   << "evictions:" << m_evictions);
+
+    m_rowOfHandle.clear();
+    m_rows.clear();
+    m_freeRows.clear();
+    m_columns.clear();
+    m_internedStrings.clear();
+    m_groups.clear();
+    m_lru.clear();
+    m_payloadSize = 0;
+}
+
+void ObjectPropertyCache::setMemoryBudget(qint64 memoryBudget)
+{
+    m_memoryBudget = memoryBudget;
+    if (memoryUsage() > m_memoryBudget) {
+        evict();
+    }
+}
+
+qint64 ObjectPropertyCache::memoryUsage() const
+{
+    // The columns are dense, so every row takes a cell in each of them
+    qint64 rowSize = ROW_SIZE + m_columns.size() * CELL_SIZE;
+    return m_rowOfHandle.size() * rowSize + m_payloadSize;
+}
+
+quint64 ObjectPropertyCache::hits() const
+{
+    return m_hits;
+}
+
+quint64 ObjectPropertyCache::misses() const
+{
+    return m_misses;
+}
+
+quint64 ObjectPropertyCache::evictions() const
+{
+    return m_evictions;
 }
 
 ObjectPropertyCache::~ObjectPropertyCache() {}
+
+int ObjectPropertyCache::rowOf(ObjHandle handle, bool create)
+{
+    QHash<ObjHandle, int>::const_iterator it = m_rowOfHandle.constFind(handle);
+    if (it != m_rowOfHandle.constEnd()) {
+        return it.value();
+    }
+    if (!create) {
+        return -1;
+    }
+
+    int row;
+    if (!m_freeRows.isEmpty()) {
+        row = m_freeRows.takeLast();
+    } else {
+        row = m_rows.size();
+        m_rows.append(Row());
+    }
+    Row &newRow = m_rows[row];
+    newRow.handle = handle;
+    newRow.group = handle;
+    newRow.valueCount = 0;
+    m_rowOfHandle.insert(handle, row);
+
+    Group &group = m_groups[newRow.group];
+    if (group.rows.isEmpty()) {
+        group.lastUse = ++m_useCount;
+        m_lru.insert(group.lastUse, newRow.group);
+    }
+    group.rows.insert(row);
+    return row;
+}
+
+void ObjectPropertyCache::removeRow(int row)
+{
+    QHash<MTPObjPropertyCode, Column>::iterator column;
+    for (column = m_columns.begin(); column != m_columns.end(); ++column) {
+        if (row < column->present.size() && column->present.testBit(row)) {
+            clearValue(*column, row);
+            column->present.clearBit(row);
+        }
+    }
+
+    Row &oldRow = m_rows[row];
+    QHash<quint64, Group>::iterator group = m_groups.find(oldRow.group);
+    group->rows.remove(row);
+    if (group->rows.isEmpty()) {
+        m_lru.remove(group->lastUse);
+        m_groups.erase(group);
+    }
+
+    m_rowOfHandle.remove(oldRow.handle);
+    oldRow.valueCount = 0;
+    m_freeRows.append(row);
+}
+
+void ObjectPropertyCache::clearValue(Column &column, int row)
+{
+    if (!column.valid.testBit(row)) {
+        return;
+    }
+    column.valid.clearBit(row);
+    if (column.kind == StringColumn) {
+        release(column.strings[row]);
+    } else if (column.kind == VariantColumn) {
+        m_payloadSize -= payloadSize(column.variants[row]);
+        if (column.variants[row].userType() == QMetaType::QString) {
+            // May still share an interned string from a former StringColumn
+            QString string = column.variants[row].toString();
+            column.variants[row] = QVariant();
+            release(string);
+        } else {
+            column.variants[row] = QVariant();
+        }
+    }
+}
+
+void ObjectPropertyCache::convertToVariants(Column &column)
+{
+    // Variants are accounted for each, interned strings only once
+    QVector<QVariant> variants(m_rows.size());
+    for (int row = 0; row < column.valid.size(); ++row) {
+        if (column.valid.testBit(row)) {
+            variants[row] = value(column, row);
+            m_payloadSize += payloadSize(variants[row]);
+        }
+    }
+    column.kind = VariantColumn;
+    column.numberType = QMetaType::UnknownType;
+    column.numbers.clear();
+    column.strings.clear();
+    column.variants.swap(variants);
+}
+
+QVariant ObjectPropertyCache::value(const Column &column, int row) const
+{
+    if (!column.valid.testBit(row)) {
+        return QVariant();
+    }
+    switch (column.kind) {
+    case NumberColumn:
+        return numberVariant(column.numberType, column.numbers.at(row));
+    case StringColumn:
+        return QVariant::fromValue(column.strings.at(row));
+    default:
+        return column.variants.at(row);
+    }
+}
+
+QString ObjectPropertyCache::intern(const QString &string)
+{
+    QSet<QString>::const_iterator it = m_internedStrings.constFind(string);
+    if (it != m_internedStrings.constEnd()) {
+        return *it;
+    }
+    m_internedStrings.insert(string);
+    m_payloadSize += string.size() * sizeof(QChar);
+    return string;
+}
+
+void ObjectPropertyCache::release(QString &string)
+{
+    // The interned copy goes too once no cached value refers to it
+    QSet<QString>::iterator it = m_internedStrings.find(string);
+    string = QString();
+    if (it != m_internedStrings.end() && it->isDetached()) {
+        m_payloadSize -= it->size() * sizeof(QChar);
+        m_internedStrings.erase(it);
+    }
+}
+
+void ObjectPropertyCache::pruneInternedStrings()
+{
+    // Strings the caller still shared when their last value was released
+    QSet<QString>::iterator it = m_internedStrings.begin();
+    while (it != m_internedStrings.end()) {
+        if (it->isDetached()) {
+            m_payloadSize -= it->size() * sizeof(QChar);
+            it = m_internedStrings.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void ObjectPropertyCache::moveToGroup(int row, quint64 key)
+{
+    Row &movedRow = m_rows[row];
+    if (movedRow.group == key) {
+        return;
+    }
+
+    QHash<quint64, Group>::iterator group = m_groups.find(movedRow.group);
+    group->rows.remove(row);
+    if (group->rows.isEmpty()) {
+        m_lru.remove(group->lastUse);
+        m_groups.erase(group);
+    }
+
+    movedRow.group = key;
+    Group &newGroup = m_groups[key];
+    if (newGroup.rows.isEmpty()) {
+        newGroup.lastUse = ++m_useCount;
+        m_lru.insert(newGroup.lastUse, key);
+    }
+    newGroup.rows.insert(row);
+    touch(key);
+}
+
+void ObjectPropertyCache::touch(quint64 key)
+{
+    Group &group = m_groups[key];
+    if (group.lastUse == m_useCount) {
+        // Already the most recently used one
+        return;
+    }
+    m_lru.remove(group.lastUse);
+    group.lastUse = ++m_useCount;
+    m_lru.insert(group.lastUse, key);
+}
+
+void ObjectPropertyCache::evict()
+{
+    // Leave some room so that eviction does not run again on the next add,
+    // but never drop the group that is in use right now
+    qint64 target = m_memoryBudget - m_memoryBudget / 4;
+    while (memoryUsage() > target && m_lru.size() > 1) {
+        QHash<quint64, Group>::iterator group = m_groups.find(m_lru.first());
+        QList<int> rows = group->rows.values();
+        m_evictions += rows.size();
+        foreach (int row, rows) {
+            removeRow(row);
+        }
+    }
+    pruneInternedStrings();
+}
+
+qint64 ObjectPropertyCache::payloadSize(const QVariant &value)
+{
+    int type = value.userType();
+    if (type == QMetaType::QString) {
+        return value.toString().size() * sizeof(QChar);
+    } else if (type == qMetaTypeId<QVector<quint8>>()) {
+        return value.value<QVector<quint8>>().size();
+    } else if (type == qMetaTypeId<QVector<qint16>>()) {
+        return value.value<QVector<qint16>>().size() * sizeof(qint16);
+    }
+    return 0;
+}
@@ -32,9 +32,14 @@
 #ifndef OBJECTPROPERTYCACHE_H
 #define OBJECTPROPERTYCACHE_H
 
+#include <QtCore/QBitArray>
+#include <QtCore/QHash>
 #include <QtCore/QList>
 #include <QtCore/QMap>
+#include <QtCore/QSet>
+#include <QtCore/QString>
 #include <QtCore/QVariant>
+#include <QtCore/QVector>
 
 #include "mtptypes.h"
 
@@ -47,11 +52,22 @@
 /// values per object. Values are cached first either when a setObjectPropList/Value is called or a getObjectPropList/Value
 /// is called for an object already on the responder. Future access to these properties fetches the values from cache. The
 /// cache is updated when a property's value is modified. This class is a singleton.
+///
+/// Each cached object gets a row, and the values of each property are kept in
+/// a column of their own: integers as plain numbers, strings shared through an
+/// intern table and anything else as QVariants. Objects are grouped by the
+/// association they are in, and when the cache grows over its memory budget,
+/// the least recently used groups are dropped.
 namespace meegomtp1dot0 {
 class ObjectPropertyCache
 {
 public:
-    ObjectPropertyCache() {}
+    /// Default memory budget of the cache, in bytes
+    static const qint64 DEFAULT_MEMORY_BUDGET = 4 * 1024 * 1024;
+
+    /// Constructor
+    /// \param memoryBudget [in] roughly how much memory the cached values may take, in bytes
+    explicit ObjectPropertyCache(qint64 memoryBudget = DEFAULT_MEMORY_BUDGET);
 
     /// Add/Modify a property-value pair for an object to the cache.
     /// \param handle [in] the object handle which needs to be added/modified
@@ -69,6 +85,13 @@ public:
     /// \propDescValList [in] list of propDescVal structures
     void add(ObjHandle handle, QList<MTPObjPropDescVal> propDescValList);
 
+    /// Tells which association an object is in. The objects of an association
+    /// are evicted together; objects with no association given are evicted on
+    /// their own.
+    /// \param handle [in] the object handle
+    /// \param association [in] the handle of the association containing the object
+    void setAssociation(ObjHandle handle, ObjHandle association);
+
     /// Remove a property-value pair for an object from the cache.
     /// If there's no code specified then the object itself is removed
     /// If this was the last property in the cache then the object itself is removed
@@ -122,11 +145,81 @@ public:
     /// clear everything in the cache
     void clear();
 
+    /// Changes the memory budget, evicting objects right away if needed.
+    /// \param memoryBudget [in] roughly how much memory the cached values may take, in bytes
+    void setMemoryBudget(qint64 memoryBudget);
+
+    /// \return an estimate of the memory the cached values take, in bytes
+    qint64 memoryUsage() const;
+
+    /// \return the number of property lookups answered from the cache
+    quint64 hits() const;
+
+    /// \return the number of property lookups the cache could not answer
+    quint64 misses() const;
+
+    /// \return the number of objects evicted to stay within the memory budget
+    quint64 evictions() const;
+
     ~ObjectPropertyCache();
 
 private:
-    /// The cache!
-    QHash<ObjHandle, QHash<MTPObjPropertyCode, QVariant> > m_propertyMap;
+    /// How the values of a column are stored
+    enum ColumnKind { EmptyColumn, NumberColumn, StringColumn, VariantColumn };
+
+    /// The cached values of one property, indexed by row
+    struct Column {
+        Column() : kind(EmptyColumn), numberType(QMetaType::UnknownType) {}
+
+        ColumnKind kind;
+        int numberType;             ///< The type of the values in numbers
+        QBitArray present;          ///< A value is cached for the row
+        QBitArray valid;            ///< The cached value is not a null QVariant
+        QVector<quint64> numbers;   ///< The values of a NumberColumn
+        QVector<QString> strings;   ///< The values of a StringColumn
+        QVector<QVariant> variants; ///< The values of a VariantColumn
+    };
+
+    /// A cached object
+    struct Row {
+        ObjHandle handle;
+        quint64 group;  ///< Key of the group the object is evicted with
+        int valueCount; ///< Number of properties cached for the object
+    };
+
+    /// Objects evicted together
+    struct Group {
+        quint64 lastUse; ///< Key of the group in m_lru
+        QSet<int> rows;
+    };
+
+    int rowOf(ObjHandle handle, bool create);
+    void removeRow(int row);
+    void clearValue(Column &column, int row);
+    void convertToVariants(Column &column);
+    QVariant value(const Column &column, int row) const;
+    QString intern(const QString &string);
+    void release(QString &string);
+    void pruneInternedStrings();
+    void moveToGroup(int row, quint64 group);
+    void touch(quint64 group);
+    void evict();
+
+    static qint64 payloadSize(const QVariant &value);
+
+    QHash<ObjHandle, int> m_rowOfHandle;            ///< Row of each cached object
+    QVector<Row> m_rows;                            ///< Cached objects, by row
+    QVector<int> m_freeRows;                        ///< Rows of evicted or removed objects, for reuse
+    QHash<MTPObjPropertyCode, Column> m_columns;    ///< Cached values, by property
+    QSet<QString> m_internedStrings;                ///< Shared copies of the cached strings
+    QHash<quint64, Group> m_groups;                 ///< Groups of objects, by key
+    QMap<quint64, quint64> m_lru;                   ///< Keys of the groups, least recently used first
+    quint64 m_useCount;                             ///< Source for the keys of m_lru
+    qint64 m_payloadSize;                           ///< Memory taken by interned strings and variant contents
+    qint64 m_memoryBudget;
+    quint64 m_hits;
+    quint64 m_misses;
+    quint64 m_evictions;
 };
 }
 #endif
@@ -77,6 +77,32 @@ static void cleanDirs()
     QVERIFY(QDir(QDir::homePath() + "/.local/mtp").removeRecursively());
 }
 
+// Checks that a GetObjectPropList data container is as long as its header
+// says and holds exactly as many elements as its element count says
+static void checkPropListContainer(const QByteArray &data, quint32 &numElements)
+{
+    QVERIFY((quint32) data.size() > MTP_HEADER_SIZE);
+    QCOMPARE(MTPContainer::getl32(data.constData()), (quint32) data.size());
+
+    MTPRxContainer container(reinterpret_cast<const quint8 *>(data.constData()), data.size());
+    MTPTxContainer elements(MTP_CONTAINER_TYPE_DATA, container.code(), container.transactionId(), data.size());
+    container >> numElements;
+    elements << numElements;
+    for (quint32 i = 0; i < numElements; i++) {
+        ObjHandle handle;
+        MTPObjPropertyCode propCode;
+        MTPDataType dataType;
+        QVariant value;
+        container >> handle >> propCode >> dataType;
+        container.deserializeVariantByType(dataType, value);
+        elements << handle << propCode << dataType;
+        elements.serializeVariantByType(dataType, value);
+    }
+    QCOMPARE(
+        QByteArray(reinterpret_cast<const char *>(elements.payload()), elements.bufferSize() - MTP_HEADER_SIZE),
+        data.mid(MTP_HEADER_SIZE));
+}
+
 void MTPResponder_test::copyAndSendContainer(MTPTxContainer *container)
 {
     quint8 *buffer = new quint8[container->bufferSize()];
@@ -343,6 +369,77 @@ void MTPResponder_test::testGetObjectPropList()
     QCOMPARE(m_responseCode, (MTPResponseCode) MTP_RESP_OK);
 }
 
+void MTPResponder_test::testGetObjectPropListAll()
+{
+    // All properties of all objects; this is likely to outgrow one transport
+    // chunk and to be sent in pieces
+    MTPTxContainer *reqContainer = new MTPTxContainer(
+        MTP_CONTAINER_TYPE_COMMAND, MTP_OP_GetObjectPropList, nextTransactionId(), 5 * sizeof(quint32));
+    *reqContainer << (quint32) 0xFFFFFFFF << (quint32) 0x00000000 << (quint32) 0xFFFFFFFF << (quint32) 0x00000000
+                  << (quint32) 0xFFFFFFFF;
+    copyAndSendContainer(reqContainer);
+    QCOMPARE(m_responseCode, (MTPResponseCode) MTP_RESP_OK);
+}
+
+void MTPResponder_test::testGetObjectPropListStreamed()
+{
+    MTPTransporterDummy *transport = static_cast<MTPTransporterDummy *>(m_responder->m_transporter);
+    MTPTxContainer *reqContainer = 0;
+    quint32 numElements = 0;
+    quint32 numStreamed = 0;
+
+    // All properties of one object fit in one chunk of the default size
+    m_responseCode = (MTPResponseCode) MTP_RESP_Undefined;
+    reqContainer = new MTPTxContainer(
+        MTP_CONTAINER_TYPE_COMMAND, MTP_OP_GetObjectPropList, nextTransactionId(), 5 * sizeof(quint32));
+    *reqContainer << (quint32) m_objectHandle << (quint32) 0x00000000 << (quint32) 0xFFFFFFFF << (quint32) 0x00000000
+                  << (quint32) 0x00000000;
+    copyAndSendContainer(reqContainer);
+    QCOMPARE(m_responseCode, (MTPResponseCode) MTP_RESP_OK);
+    QByteArray whole = transport->lastDataContainer();
+    checkPropListContainer(whole, numElements);
+    QVERIFY(numElements > 0);
+
+    // With small chunks the same dataset has to be streamed
+    transport->setDataChunkSize(64);
+    QVERIFY(whole.size() > 64);
+    m_responseCode = (MTPResponseCode) MTP_RESP_Undefined;
+    reqContainer = new MTPTxContainer(
+        MTP_CONTAINER_TYPE_COMMAND, MTP_OP_GetObjectPropList, nextTransactionId(), 5 * sizeof(quint32));
+    *reqContainer << (quint32) m_objectHandle << (quint32) 0x00000000 << (quint32) 0xFFFFFFFF << (quint32) 0x00000000
+                  << (quint32) 0x00000000;
+    copyAndSendContainer(reqContainer);
+    QCOMPARE(m_responseCode, (MTPResponseCode) MTP_RESP_OK);
+    QByteArray streamed = transport->lastDataContainer();
+    checkPropListContainer(streamed, numStreamed);
+    QCOMPARE(numStreamed, numElements);
+    QCOMPARE(streamed.mid(MTP_HEADER_SIZE), whole.mid(MTP_HEADER_SIZE));
+
+    // All properties of all objects, streamed in small and in default chunks
+    m_responseCode = (MTPResponseCode) MTP_RESP_Undefined;
+    reqContainer = new MTPTxContainer(
+        MTP_CONTAINER_TYPE_COMMAND, MTP_OP_GetObjectPropList, nextTransactionId(), 5 * sizeof(quint32));
+    *reqContainer << (quint32) 0xFFFFFFFF << (quint32) 0x00000000 << (quint32) 0xFFFFFFFF << (quint32) 0x00000000
+                  << (quint32) 0xFFFFFFFF;
+    copyAndSendContainer(reqContainer);
+    QCOMPARE(m_responseCode, (MTPResponseCode) MTP_RESP_OK);
+    streamed = transport->lastDataContainer();
+    checkPropListContainer(streamed, numStreamed);
+
+    transport->setDataChunkSize(0);
+    m_responseCode = (MTPResponseCode) MTP_RESP_Undefined;
+    reqContainer = new MTPTxContainer(
+        MTP_CONTAINER_TYPE_COMMAND, MTP_OP_GetObjectPropList, nextTransactionId(), 5 * sizeof(quint32));
+    *reqContainer << (quint32) 0xFFFFFFFF << (quint32) 0x00000000 << (quint32) 0xFFFFFFFF << (quint32) 0x00000000
+                  << (quint32) 0xFFFFFFFF;
+    copyAndSendContainer(reqContainer);
+    QCOMPARE(m_responseCode, (MTPResponseCode) MTP_RESP_OK);
+    whole = transport->lastDataContainer();
+    checkPropListContainer(whole, numElements);
+    QCOMPARE(numStreamed, numElements);
+    QCOMPARE(streamed.mid(MTP_HEADER_SIZE), whole.mid(MTP_HEADER_SIZE));
+}
+
 void MTPResponder_test::testGetObject()
 {
     MTPTxContainer *reqContainer
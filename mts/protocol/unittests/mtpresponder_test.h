@@ -68,6 +68,8 @@ private slots:
     void testGetObjectHandles();
     void testGetObjectInfo();
     void testGetObjectPropList();
+    void testGetObjectPropListAll();
+    void testGetObjectPropListStreamed();
     void testGetObject();
     void testGetObjectPropDesc();
     void testGetDevicePropDesc();
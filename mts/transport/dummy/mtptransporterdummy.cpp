@@ -37,9 +37,8 @@ using namespace meegomtp1dot0;
 MTPTransporterDummy::MTPTransporterDummy()
     : m_currentTransactionPhase(eMTP_CONTAINER_TYPE_UNDEFINED)
     , m_isNextChunkData(false)
-    , m_noOfDataChunksExpected(0)
-    , m_noOfDataChunksReceived(0)
-    , m_noOfDataChunksToFollow(0)
+    , m_dataBytesToFollow(0)
+    , m_dataChunkSize(0)
     , m_transactionId(0xFFFFFFFF)
 {}
 
@@ -72,6 +71,16 @@ bool MTPTransporterDummy::sendEvent(const quint8 * /*data*/, quint32 /*len*/, bo
     return true;
 }
 
+quint32 MTPTransporterDummy::dataChunkSize() const
+{
+    return m_dataChunkSize ? m_dataChunkSize : MTPTransporter::dataChunkSize();
+}
+
+void MTPTransporterDummy::setDataChunkSize(quint32 chunkSize)
+{
+    m_dataChunkSize = chunkSize;
+}
+
 bool MTPTransporterDummy::checkHeader(MTPContainerWrapper *mtpHeader, quint32 len)
 {
     //Check length
@@ -95,26 +104,22 @@ bool MTPTransporterDummy::checkData(const quint8 *data, quint32 len)
     // The first packet for data which also has header
     if (eMTP_CONTAINER_TYPE_DATA == m_currentTransactionPhase && !m_isNextChunkData) {
         MTPContainerWrapper mtpHeader(const_cast<quint8 *>(data));
-        // Determine total data length
-        quint32 dataLength = mtpHeader.containerLength() - MTP_HEADER_SIZE;
-        // Check how many bytes of data are present in the current packet
-        quint32 currLength = len - MTP_HEADER_SIZE;
-        // Determine how many chunks will follow; data may be segmented
-        m_noOfDataChunksToFollow = (dataLength / currLength + dataLength % currLength ? 1 : 0) - 1;
-        m_noOfDataChunksExpected = m_noOfDataChunksToFollow;
-        m_isNextChunkData = m_noOfDataChunksExpected ? true : false;
+        // Determine total data length; data may be segmented
+        quint32 containerLength = mtpHeader.containerLength();
+        if (len < MTP_HEADER_SIZE || len > containerLength) {
+            return false;
+        }
+        m_dataContainer = QByteArray(reinterpret_cast<const char *>(data), len);
+        m_dataBytesToFollow = containerLength - len;
+        m_isNextChunkData = m_dataBytesToFollow ? true : false;
         return true;
     } else if (m_isNextChunkData) {
-        if (m_noOfDataChunksToFollow) {
-            --m_noOfDataChunksToFollow;
-            ++m_noOfDataChunksReceived;
-        }
-        if (!m_noOfDataChunksToFollow) {
-            m_isNextChunkData = false;
-            if (m_noOfDataChunksReceived != m_noOfDataChunksExpected) {
-                return false;
-            }
+        if (len > m_dataBytesToFollow) {
+            return false;
         }
+        m_dataContainer.append(reinterpret_cast<const char *>(data), len);
+        m_dataBytesToFollow -= len;
+        m_isNextChunkData = m_dataBytesToFollow ? true : false;
         return true;
     }
     return false;
@@ -34,6 +34,7 @@
 
 #include "mtptransporter.h"
 #include "mtptypes.h"
+#include <QByteArray>
 
 namespace meegomtp1dot0 {
 class MTPContainerWrapper;
@@ -58,6 +59,19 @@ public:
     /// Checks if event data is good, if so returns true
     bool sendEvent(const quint8 *data, quint32 len, bool sendZeroPacket = true);
 
+    /// Returns the chunk size set with setDataChunkSize(), or the default one.
+    quint32 dataChunkSize() const;
+
+    /// Makes the protocol layer split its data phases into chunks of the given size.
+    /// \param chunkSize [in] The chunk size in bytes, 0 restores the default.
+    void setDataChunkSize(quint32 chunkSize);
+
+    /// Returns the last data container sent, header included.
+    const QByteArray &lastDataContainer() const
+    {
+        return m_dataContainer;
+    }
+
     bool activate()
     {
         return true;
@@ -92,9 +106,9 @@ private:
     };
     transactionPhase m_currentTransactionPhase; ///< The MTP phase we are currently in ( when sendData/Event is called ).
     bool m_isNextChunkData; ///< When set to true, we expect raw data in sendEvent.
-    quint32 m_noOfDataChunksExpected; ///< The no. of data chunks that we expect to receive when a data phase begins.
-    quint32 m_noOfDataChunksReceived; ///< The no. of data chunks that are finally received.
-    quint32 m_noOfDataChunksToFollow; ///< The no. of data chunks that are yet to be received.
+    quint32 m_dataBytesToFollow; ///< The no. of data bytes that are yet to be received in the current data phase.
+    quint32 m_dataChunkSize; ///< The chunk size set for the protocol layer, 0 for the default.
+    QByteArray m_dataContainer; ///< The data container of the current or the last data phase.
     quint32 m_transactionId; ///< The transaction id of the current MTP transaction ( read from the mtp packet revecied in sendData ).
 
 Q_SIGNALS:
@@ -63,6 +63,38 @@ public:
     /// \return Must return true if send was a success, else false.
     virtual bool sendData(const quint8 *data, quint32 len, bool sendZeroPacket = true) = 0;
 
+    /// Tells how much data the transport prefers to get per sendData() call. The protocol layer sizes
+    /// its read buffers and data segments by this.
+    /// \return The chunk size in bytes.
+    virtual quint32 dataChunkSize() const
+    {
+        // Max request size of the ci13xxx UDC, four pages
+        return 4 * 4096;
+    }
+
+    /// Tells whether the transport can send object data straight from a file, see sendFileData().
+    /// \return true if sendFileData() is implemented.
+    virtual bool canSendFileData() const
+    {
+        return false;
+    }
+
+    /// Sends data (a part of an MTP data container) read from a file, without the caller having to
+    /// copy it into a buffer first. Apart from where the data comes from, this behaves like sendData().
+    /// \param fd [in] A file descriptor open for reading; it stays owned by the caller.
+    /// \param offset [in] The offset, in bytes, of the data in the file.
+    /// \param len [in] The number of bytes to send.
+    /// \param isLastPacket [in] If true, this concludes the data container.
+    /// \return Must return true if send was a success, else false.
+    virtual bool sendFileData(int fd, quint64 offset, quint32 len, bool isLastPacket = true)
+    {
+        Q_UNUSED(fd);
+        Q_UNUSED(offset);
+        Q_UNUSED(len);
+        Q_UNUSED(isLastPacket);
+        return false;
+    }
+
     /// Sends data (an MTP event container) to the initiator. The function must be synchronous.
     /// \param data [in] The buffer of data to be sent. The buffer is assumed to be allocated by the caller, and will not be modified.
     /// \param len [in] The length of the data buffer in bytes.
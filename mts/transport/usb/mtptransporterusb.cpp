@@ -50,6 +50,20 @@
 
 using namespace meegomtp1dot0;
 
+/* Bulk IN writes can be done either with blocking write() calls from
+ * the writer thread (default) or by keeping several native AIO requests
+ * queued on the endpoint. Select via BUTEO_MTP_BULK_IO=thread|aio. */
+static bool useAsyncBulkIO()
+{
+    QByteArray envData = qgetenv("BUTEO_MTP_BULK_IO");
+    QString envValue = QString::fromUtf8(envData.data()).toLower();
+    if (envValue == "aio")
+        return true;
+    if (!envValue.isEmpty() && envValue != "thread")
+        MTP_LOG_WARNING("unknown bulk io backend:" << envValue);
+    return false;
+}
+
 MTPTransporterUSB::MTPTransporterUSB()
     : m_ioState(SUSPENDED)
     , m_containerReadLen(0)
@@ -82,9 +96,13 @@ MTPTransporterUSB::MTPTransporterUSB()
     QObject::connect(&m_bulkRead, SIGNAL(dataReady()),
                      this, SLOT(handleDataReady()), Qt::QueuedConnection);
 
+    // bulk write backend
+    if (useAsyncBulkIO() && !m_bulkWrite.setAsyncIO(true))
+        MTP_LOG_WARNING("native AIO not available - using blocking bulk writes");
+
     // bulk write data
-    QObject::connect(&m_bulkWrite, &QThread::finished,
-                     this, &MTPTransporterUSB::handleWriterExit,
+    QObject::connect(&m_bulkWrite, &BulkWriterThread::dataWritten,
+                     this, &MTPTransporterUSB::handleDataWritten,
                      Qt::QueuedConnection);
 
     // event write control
@@ -219,8 +237,11 @@ void MTPTransporterUSB::reset()
     m_ioState = ACTIVE;
     m_containerReadLen = 0;
     m_bulkRead.resetData();
+    m_bulkWrite.flushData();
+    m_bulkWrite.takeResult();
     m_resetCount++;
 
+    m_bulkWrite.start();
     m_intrWrite.start();
     startRead();
 
@@ -266,6 +287,26 @@ void MTPTransporterUSB::setEventsBusy(int state)
 }
 
 bool MTPTransporterUSB::sendData(const quint8 *data, quint32 dataLen, bool isLastPacket)
+{
+    return sendBulk(data, -1, 0, dataLen, isLastPacket);
+}
+
+quint32 MTPTransporterUSB::dataChunkSize() const
+{
+    return BulkTransferSize::chunkSize();
+}
+
+bool MTPTransporterUSB::canSendFileData() const
+{
+    return true;
+}
+
+bool MTPTransporterUSB::sendFileData(int fd, quint64 offset, quint32 dataLen, bool isLastPacket)
+{
+    return sendBulk(0, fd, offset, dataLen, isLastPacket);
+}
+
+bool MTPTransporterUSB::sendBulk(const quint8 *data, int fd, quint64 offset, quint32 dataLen, bool isLastPacket)
 {
     // TODO: can't handle re-entrant calls with the current design.
 
@@ -294,29 +335,64 @@ bool MTPTransporterUSB::sendData(const quint8 *data, quint32 dataLen, bool isLas
         MTP_LOG_INFO("intr writer is idle - continue");
     }
 
-    // Unlike the other IO threads, the bulk writer is only alive
-    // while processing one buffer and then finishes. It all happens
-    // during this call. The reason for the extra thread is to
-    // remain responsive to events while the data is being written.
-    // That's done by calling processEvents while waiting.
+    // The bulk writer is a long lived thread that works through a short
+    // queue of buffers. Intermediate buffers of a data phase are just
+    // queued, so that the caller can prepare the next one while this
+    // one is being written. The last buffer of a container is waited
+    // for so that the result can be reported and the host sees the
+    // whole transfer before we move on. While waiting, events are
+    // processed to remain responsive.
+
+    bool r = m_bulkWrite.isRunning();
+    if (!r) {
+        MTP_LOG_CRITICAL("bulk writer is not running");
+    } else {
+        // Queued buffers are kept within the request size the UDC can
+        // take, so that each of them can be written as one request.
+        quint32 chunkSize = BulkTransferSize::chunkSize();
 
-    m_bulkWrite.setData(data, dataLen, isLastPacket);
-    m_bulkWrite.start();
+        do {
+            quint32 queueLen = (dataLen < chunkSize) ? dataLen : chunkSize;
 
-    // The bulk writer will make sure that processEvents is woken up
-    // when the result is ready.
-    while (!m_bulkWrite.resultReady()) {
-        QCoreApplication::sendPostedEvents();
+            // The bulk writer will make sure that processEvents is woken up
+            // whenever a buffer has been written.
+            while (!m_bulkWrite.canAddData()) {
+                QCoreApplication::sendPostedEvents();
 
-        if (m_bulkWrite.resultReady())
-            break;
+                if (m_bulkWrite.canAddData())
+                    break;
 
-        QCoreApplication::processEvents(QEventLoop::WaitForMoreEvents);
-    }
+                QCoreApplication::processEvents(QEventLoop::WaitForMoreEvents);
+            }
 
-    bool r = m_bulkWrite.getResult();
+            // Do not queue more data after a failed write
+            r = m_bulkWrite.takeResult();
+            if (!r)
+                break;
 
-    m_bulkWrite.wait();
+            bool terminate = isLastPacket && queueLen == dataLen;
+            if (fd != -1) {
+                m_bulkWrite.addFile(fd, offset, queueLen, terminate);
+                offset += queueLen;
+            } else {
+                m_bulkWrite.addData(data, queueLen, terminate);
+                data += queueLen;
+            }
+            dataLen -= queueLen;
+        } while (dataLen);
+
+        if (r && isLastPacket) {
+            while (!m_bulkWrite.isIdle()) {
+                QCoreApplication::sendPostedEvents();
+
+                if (m_bulkWrite.isIdle())
+                    break;
+
+                QCoreApplication::processEvents(QEventLoop::WaitForMoreEvents);
+            }
+            r = m_bulkWrite.takeResult();
+        }
+    }
 
     m_writer_busy = false;
     MTP_LOG_TRACE("m_writer_busy:" << m_writer_busy);
@@ -359,7 +435,7 @@ void MTPTransporterUSB::sendQueuedEvent()
     if (!m_inSession)
         return;
 
-    if (m_writer_busy)
+    if (!m_bulkWrite.isIdle())
         return;
 
     if (m_events_busy == INTERRUPT_WRITER_DISABLED)
@@ -479,11 +555,13 @@ void MTPTransporterUSB::eventCompleted(int result)
     }
 }
 
-void MTPTransporterUSB::handleWriterExit()
+void MTPTransporterUSB::handleDataWritten()
 {
-    /* Nothing to do here. This is just a handler for
-     * dummy signal to get sendData() out of wait loop. */
-    MTP_LOG_TRACE("writer exit");
+    /* Getting here is enough to get sendData() out of wait loop.
+     * If the last queued buffer went out after sendData() already
+     * returned, events held back by bulk writes can be sent now. */
+    MTP_LOG_TRACE("writer progress");
+    sendQueuedEvent();
 }
 
 void MTPTransporterUSB::handleDataReady()
@@ -593,6 +671,7 @@ void MTPTransporterUSB::openDevices()
         MTP_LOG_CRITICAL("Couldn't open IN endpoint file " << MTP_EP_PATH_IN);
     } else {
         m_bulkWrite.setFd(m_inFd);
+        m_bulkWrite.start();
     }
 
     m_outFd = open(MTP_EP_PATH_OUT, O_RDWR);
@@ -622,6 +701,8 @@ void MTPTransporterUSB::closeDevices()
     m_intrWrite.exitThread();
 
     stopRead();
+    m_bulkWrite.flushData();
+    m_bulkWrite.takeResult();
     m_intrWrite.reset();
 
     if (m_outFd != -1) {
@@ -656,6 +737,9 @@ void MTPTransporterUSB::rethinkRead()
 void MTPTransporterUSB::startRead()
 {
     MTP_LOG_TRACE("reader enabled");
+    // The packet size depends on the speed of the connection
+    if (m_inFd != -1)
+        BulkTransferSize::updatePacketSize(m_inFd);
     m_readerEnabled = true;
     rethinkRead();
 }
@@ -52,14 +52,25 @@ public:
     /// The MTPTransporterUSB destructor
     ~MTPTransporterUSB();
 
-    /// Sends data (an MTP data container) to the initiator. The function must be synchronous.
+    /// Sends data (an MTP data container) to the initiator. Intermediate packets are queued to the bulk
+    /// writer and the call returns as soon as the data has been copied; the last packet is waited for.
     /// \param data [in] The buffer of data to be sent. The buffer is assumed to be allocated by the caller, and will not be modified.
     /// \param len [in] The length of the data buffer in bytes.
     /// \param sendZeroPacket [in] If true, the transport layer must send a zero length MTP packet (in case where the data length was a multiple
     /// to the transport's max packet size).
-    /// \return Returns true if write to the USB FD was a success, else false.
+    /// \return Returns false if write to the USB FD failed for this or a previously queued packet, else true.
     bool sendData(const quint8 *data, quint32 len, bool isLastPacket = true);
 
+    /// Size of bulk requests, as configured and supported by the UDC.
+    quint32 dataChunkSize() const;
+
+    /// Bulk writes can take file ranges directly.
+    bool canSendFileData() const;
+
+    /// Sends a file range as (a part of) an MTP data container, see sendData().
+    /// The data is moved from the file to the endpoint without copying it via user space.
+    bool sendFileData(int fd, quint64 offset, quint32 len, bool isLastPacket = true);
+
     /// Sends data (an MTP event container) to the initiator. The function must be synchronous.
     /// \param data [in] The buffer of data to be sent. The buffer is assumed to be allocated by the caller, and will not be modified.
     /// \param len [in] The length of the data buffer in bytes.
@@ -107,6 +118,7 @@ private:
     bool writeMtpDescriptors();  // configure the USB endpoints for functionfs
     bool writeMtpStrings();      // step 2 of functionfs configuration
     void sendQueuedEvent();      // Buffering happens at sendEvent()
+    bool sendBulk(const quint8 *data, int fd, quint64 offset, quint32 len, bool isLastPacket);
 
     enum IOState {
         ACTIVE,
@@ -182,8 +194,8 @@ private Q_SLOTS:
     // Handle incoming data from m_bulkRead
     void handleDataReady();
 
-    // Handle outgoing data from m_bulkWrite
-    void handleWriterExit();
+    // Handle outgoing data progress from m_bulkWrite
+    void handleDataWritten();
 
     /// Handle high priority requests from the underlying transport driver.
     void handleHighPriorityData();
@@ -7,7 +7,15 @@
 #include <pthread.h>
 #include <signal.h>
 #include <endian.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 
 #include "threadio.h"
 #include "trace.h"
@@ -47,7 +55,18 @@
     errno = saved, rc;\
 })
 
-const int MAX_DATA_IN_SIZE = 16 * 1024;  // Matches USB transfer size
+// Bulk request sizes, see BulkTransferSize. Modern UDCs handle large
+// requests fine, older ones like ci13xxx_udc are limited to four pages
+// and get detected at runtime. Sizes are kept powers of two so that
+// they are always multiples of the packet size.
+const quint32 DEFAULT_CHUNK_SIZE = 64 * 1024;
+const quint32 MIN_CHUNK_SIZE = 4 * 1024;
+const quint32 MAX_CHUNK_SIZE = 1024 * 1024;
+
+// Number of requests in a row the UDC has to take before a chunk size
+// lowered after an error is raised again
+const int CHUNK_SIZE_RESTORE_COUNT = 256;
+
 const int MAX_CONTROL_IN_SIZE = 64;
 
 /* Maximum number of events to queue for sending via the interrupt
@@ -62,7 +81,160 @@ const int MAX_EVENTS_STORED = 512;
 // Give BulkReaderThread some space to acquire chunks while the main
 // thread is working, but still small enough for the main thread to
 // process as one event.
-const int READER_BUFFER_SIZE = MAX_DATA_IN_SIZE * 16;
+const int READER_BUFFER_CHUNKS = 16;
+const int READER_BUFFER_MAX_SIZE = 4 * 1024 * 1024;
+
+// Number of buffers sendData() can have in flight before it needs to
+// wait for the bulk writer: enough to keep the endpoint busy while the
+// next chunk is being read from storage, without hoarding memory.
+const int MAX_BULK_BUFFERS_QUEUED = 4;
+
+// With native AIO queued buffers are submitted in pieces of the chunk
+// size, with room for the zero length packet terminating a transfer.
+const int MAX_BULK_AIO_REQUESTS = MAX_BULK_BUFFERS_QUEUED + 1;
+
+/* Thin wrappers for the native AIO syscalls - glibc does not provide
+ * these and libaio is not needed for the little that is used here. */
+static inline int sys_io_setup(unsigned nr, aio_context_t *ctx)
+{
+    return syscall(__NR_io_setup, nr, ctx);
+}
+
+static inline int sys_io_destroy(aio_context_t ctx)
+{
+    return syscall(__NR_io_destroy, ctx);
+}
+
+static inline int sys_io_submit(aio_context_t ctx, long nr, struct iocb **iocbpp)
+{
+    return syscall(__NR_io_submit, ctx, nr, iocbpp);
+}
+
+static inline int sys_io_cancel(aio_context_t ctx, struct iocb *iocb, struct io_event *result)
+{
+    return syscall(__NR_io_cancel, ctx, iocb, result);
+}
+
+static inline int sys_io_getevents(aio_context_t ctx, long min_nr, long nr, struct io_event *events,
+                                   struct timespec *timeout)
+{
+    return syscall(__NR_io_getevents, ctx, min_nr, nr, events, timeout);
+}
+
+/* File ranges are sent with sendfile() only when asked for with
+ * BUTEO_MTP_SENDFILE=1. Before Linux 5.10 splicing into a FunctionFS
+ * endpoint splits the transfer into page sized writes, which is much
+ * slower than writing whole chunks from an mmap()ed view. */
+static bool useSendfile()
+{
+    QByteArray envData = qgetenv("BUTEO_MTP_SENDFILE");
+    bool enabled = envData == "1";
+    if (!envData.isEmpty() && !enabled && envData != "0")
+        MTP_LOG_WARNING("unknown sendfile setting:" << envData);
+    return enabled;
+}
+
+/* 0 = not limited at runtime / not known, see the accessors */
+QAtomicInt BulkTransferSize::s_chunkSize(0);
+QAtomicInt BulkTransferSize::s_chunkSuccesses(0);
+QAtomicInt BulkTransferSize::s_packetSize(0);
+
+static quint32 configuredChunkSize()
+{
+    QByteArray envData = qgetenv("BUTEO_MTP_CHUNK_SIZE").trimmed().toLower();
+    if (envData.isEmpty())
+        return DEFAULT_CHUNK_SIZE;
+
+    quint64 scale = 1;
+    if (envData.endsWith('k')) {
+        scale = 1024;
+        envData.chop(1);
+    } else if (envData.endsWith('m')) {
+        scale = 1024 * 1024;
+        envData.chop(1);
+    }
+
+    bool ok = false;
+    quint64 value = envData.toULongLong(&ok) * scale;
+    if (!ok || !value) {
+        MTP_LOG_WARNING("invalid chunk size:" << envData);
+        return DEFAULT_CHUNK_SIZE;
+    }
+
+    quint32 size = MIN_CHUNK_SIZE;
+    while (size < MAX_CHUNK_SIZE && 2 * quint64(size) <= value)
+        size *= 2;
+    if (size != value)
+        MTP_LOG_WARNING("chunk size" << value << "adjusted to" << size);
+    return size;
+}
+
+quint32 BulkTransferSize::maxChunkSize()
+{
+    static const quint32 size = configuredChunkSize();
+    return size;
+}
+
+quint32 BulkTransferSize::chunkSize()
+{
+    quint32 size = s_chunkSize.loadAcquire();
+    return size ?: maxChunkSize();
+}
+
+bool BulkTransferSize::reduceChunkSize(quint32 failedSize)
+{
+    // The reader and the writer can both get here, and the failed
+    // request may have been smaller than a chunk to begin with.
+    quint32 limit = qMin(chunkSize(), failedSize) / 2;
+    quint32 size = MIN_CHUNK_SIZE;
+    if (limit < size)
+        return false;
+    while (2 * size <= limit)
+        size *= 2;
+
+    s_chunkSize.storeRelease(size);
+    s_chunkSuccesses.storeRelease(0);
+    MTP_LOG_WARNING("limit bulk requests to:" << size);
+    return true;
+}
+
+void BulkTransferSize::chunkSucceeded()
+{
+    quint32 size = s_chunkSize.loadAcquire();
+    if (!size)
+        return;
+    if (s_chunkSuccesses.fetchAndAddOrdered(1) + 1 < CHUNK_SIZE_RESTORE_COUNT)
+        return;
+
+    s_chunkSuccesses.storeRelease(0);
+    quint32 raised = 2 * size < maxChunkSize() ? 2 * size : 0;
+    if (s_chunkSize.testAndSetOrdered(size, raised))
+        MTP_LOG_INFO("raise bulk requests to:" << (raised ?: maxChunkSize()));
+}
+
+quint32 BulkTransferSize::packetSize()
+{
+    quint32 size = s_packetSize.loadAcquire();
+    return size ?: PTP_HS_DATA_PKT_SIZE;
+}
+
+void BulkTransferSize::updatePacketSize(int fd)
+{
+    quint32 size = 0;
+#ifdef FUNCTIONFS_ENDPOINT_DESC
+    struct usb_endpoint_descriptor desc;
+    if (ioctl(fd, FUNCTIONFS_ENDPOINT_DESC, &desc) == -1)
+        MTP_LOG_INFO("can't get endpoint descriptor:" << strerror(errno));
+    else
+        size = le16toh(desc.wMaxPacketSize) & 0x7ff;
+#else
+    Q_UNUSED(fd);
+#endif
+    if (size) {
+        MTP_LOG_INFO("bulk packet size:" << size);
+        s_packetSize.storeRelease(size);
+    }
+}
 
 const struct ptp_device_status_data status_data[] = {
     /* OK     */ {
@@ -310,7 +482,8 @@ void ControlReaderThread::setupRequest(void *data)
 BulkReaderThread::BulkReaderThread(QObject *parent)
     : IOThread(parent)
 {
-    m_buffer = new char[READER_BUFFER_SIZE];
+    m_bufferSize = qMin(READER_BUFFER_CHUNKS * BulkTransferSize::maxChunkSize(), quint32(READER_BUFFER_MAX_SIZE));
+    m_buffer = new char[m_bufferSize];
     resetData();
 }
 
@@ -327,14 +500,14 @@ void BulkReaderThread::resetData()
     m_dataSize2 = 0;
 }
 
-// Find a usable place in m_buffer to read MAX_DATA_IN_SIZE bytes.
+// Find a usable place in m_buffer to read readSize bytes.
 // Return -1 if there's no space.
-int BulkReaderThread::_getOffset_locked()
+int BulkReaderThread::_getOffset_locked(int readSize)
 {
     // See the class definition for the story of how m_buffer is handled.
-    if (READER_BUFFER_SIZE - (m_dataStart + m_dataSize1) >= MAX_DATA_IN_SIZE)
+    if (m_bufferSize - (m_dataStart + m_dataSize1) >= readSize)
         return m_dataStart + m_dataSize1;
-    if (m_dataStart - m_dataSize2 >= MAX_DATA_IN_SIZE)
+    if (m_dataStart - m_dataSize2 >= readSize)
         return m_dataSize2;
     return -1;
 }
@@ -362,10 +535,11 @@ void BulkReaderThread::execute()
 
     while (!m_shouldExit) {
         int offset;
+        int chunkSize = BulkTransferSize::chunkSize();
 
         /* Wait for read offset in locked state */
         m_bufferLock.lock();
-        offset = _getOffset_locked();
+        offset = _getOffset_locked(chunkSize);
         while (!m_shouldExit && offset < 0) {
             /* Expectation: Waiting should not be required except when
              * transferring large files and file system writes can't
@@ -373,7 +547,7 @@ void BulkReaderThread::execute()
             MTP_LOG_INFO("waiting ...");
             m_wait.wait(&m_bufferLock);
             MTP_LOG_INFO("woke up");
-            offset = _getOffset_locked();
+            offset = _getOffset_locked(chunkSize);
         }
         m_bufferLock.unlock();
 
@@ -382,7 +556,7 @@ void BulkReaderThread::execute()
             break;
 
         /* Do a blocking read */
-        readSize = MTP_READ(m_fd, m_buffer + offset, MAX_DATA_IN_SIZE, false);
+        readSize = MTP_READ(m_fd, m_buffer + offset, chunkSize, false);
 
         /* Check if thread exit has been requested */
         if (m_shouldExit)
@@ -401,11 +575,18 @@ void BulkReaderThread::execute()
                 continue;
             }
 
+            /* The UDC may not take requests this large */
+            if ((errno == EIO || errno == EMSGSIZE) && BulkTransferSize::reduceChunkSize(chunkSize)) {
+                continue;
+            }
+
             /* Abandon thread - this should not happen */
             MTP_LOG_CRITICAL("exit thread due to unhandled error");
             break;
         }
 
+        BulkTransferSize::chunkSucceeded();
+
         /* Update data availability in locked state */
         if (!_markNewData(offset, readSize)) {
             MTP_LOG_CRITICAL("exit thread due to bad offset:" << offset
@@ -469,35 +650,219 @@ void BulkReaderThread::interrupt() // Executed in main thread
 
 BulkWriterThread::BulkWriterThread(QObject *parent)
     : IOThread(parent)
+    , m_writing(false)
+    , m_result(true)
+    , m_aioContext(0)
+    , m_aioEventFd(-1)
+    , m_wakeFd(-1)
+    , m_haveCurrent(false)
+    , m_currentOffset(0)
+    , m_currentSerial(0)
+{
+}
+
+BulkWriterThread::~BulkWriterThread()
+{
+    flushData();
+    releaseAsyncIO();
+}
+
+bool BulkWriterThread::setAsyncIO(bool enabled)
+{
+    // This runs in the main thread while the writer is not running.
+    if (enabled == asyncIO())
+        return true;
+
+    if (!enabled) {
+        releaseAsyncIO();
+        return true;
+    }
+
+    if (sys_io_setup(MAX_BULK_AIO_REQUESTS, &m_aioContext) == -1) {
+        MTP_LOG_WARNING("io_setup failed:" << strerror(errno));
+        m_aioContext = 0;
+    } else if ((m_aioEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1
+               || (m_wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+        MTP_LOG_WARNING("eventfd failed:" << strerror(errno));
+    } else {
+        MTP_LOG_INFO("bulk writer uses native AIO");
+        return true;
+    }
+
+    releaseAsyncIO();
+    return false;
+}
+
+bool BulkWriterThread::asyncIO() const
 {
-    // Connect the finished signal (emitted from the writer thread) to
-    // a do-nothing slot (received in the transporter's thread) in order to
-    // make sure that sendData() in the transporter is woken up after the
-    // result is ready. This way sendData doesn't have to poll.
-    connect(this, SIGNAL(finished()), SLOT(quit()), Qt::QueuedConnection);
+    return m_aioContext != 0;
 }
 
-void BulkWriterThread::setData(const quint8 *buffer, quint32 dataLen, bool terminateTransfer)
+void BulkWriterThread::releaseAsyncIO()
 {
-    // This runs in the main thread. The caller makes sure that the
-    // writer thread is not running yet.
+    if (m_aioContext) {
+        // Waits for the requests the kernel still has, after which the
+        // abandoned ones can be let go of
+        sys_io_destroy(m_aioContext);
+        m_aioContext = 0;
+    }
+    for (AioRequest *request : m_abandoned)
+        freeRequest(request);
+    m_abandoned.clear();
+    if (m_aioEventFd != -1) {
+        close(m_aioEventFd);
+        m_aioEventFd = -1;
+    }
+    if (m_wakeFd != -1) {
+        close(m_wakeFd);
+        m_wakeFd = -1;
+    }
+}
 
-    m_buffer = buffer;
-    m_dataLen = dataLen;
-    m_terminateTransfer = terminateTransfer;
-    m_result = false;
-    m_result_ready.store(0);
+void BulkWriterThread::wakeUp()
+{
+    m_wait.wakeAll(); // wake up the thread if it's in m_wait.wait()
+    if (m_wakeFd != -1)
+        eventfd_write(m_wakeFd, 1); // wake up the thread if it's in poll()
 }
 
-void BulkWriterThread::execute()
+bool BulkWriterThread::canAddData()
 {
-    // Maximum length of individual writes
-    static quint32 writeMax = 16 << 10;
+    QMutexLocker locker(&m_lock);
+    return m_buffers.count() < MAX_BULK_BUFFERS_QUEUED;
+}
 
-    // Call setData before starting the thread.
+bool BulkWriterThread::isIdle()
+{
+    QMutexLocker locker(&m_lock);
+    return m_buffers.isEmpty() && !m_writing;
+}
+
+bool BulkWriterThread::takeResult()
+{
+    QMutexLocker locker(&m_lock);
+    bool result = m_result;
+    m_result = true;
+    return result;
+}
+
+void BulkWriterThread::addData(const quint8 *buffer, quint32 dataLen, bool terminateTransfer)
+{
+    // This runs in the main thread. The caller owns the buffer and may
+    // reuse it as soon as we return -> queue a private copy.
+    BulkBuffer item = BulkBuffer();
+    item.data = (quint8 *) malloc(dataLen ?: 1);
+    item.dataLen = dataLen;
+    item.terminateTransfer = terminateTransfer;
+    item.fd = -1;
+
+    if (item.data == NULL) {
+        MTP_LOG_CRITICAL("Couldn't allocate memory for bulk data");
+        QMutexLocker locker(&m_lock);
+        m_result = false;
+        return;
+    }
+    memcpy(item.data, buffer, dataLen);
+
+    queueBuffer(item);
+}
+
+void BulkWriterThread::addFile(int fd, quint64 offset, quint32 dataLen, bool terminateTransfer)
+{
+    // This runs in the main thread. The caller may close its descriptor
+    // as soon as we return -> queue a private duplicate.
+    BulkBuffer item = BulkBuffer();
+    item.dataLen = dataLen;
+    item.terminateTransfer = terminateTransfer;
+    item.offset = offset;
+    item.fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+
+    if (item.fd == -1) {
+        MTP_LOG_CRITICAL("Couldn't duplicate file descriptor:" << strerror(errno));
+        QMutexLocker locker(&m_lock);
+        m_result = false;
+        return;
+    }
+
+    queueBuffer(item);
+}
+
+void BulkWriterThread::queueBuffer(const BulkBuffer &buffer)
+{
+    QMutexLocker locker(&m_lock);
+    m_buffers.append(buffer);
+    wakeUp();
+}
+
+bool BulkWriterThread::mapBuffer(BulkBuffer &buffer)
+{
+    if (buffer.data || !buffer.dataLen)
+        return true;
+
+    // Touching a mapped page past the end of the file raises SIGBUS,
+    // don't map ranges of a file that got truncated after being queued
+    struct stat st;
+    if (fstat(buffer.fd, &st) == -1) {
+        MTP_LOG_CRITICAL("fstat(" << buffer.fd << ") -> err:" << strerror(errno));
+        return false;
+    }
+    if (buffer.offset + buffer.dataLen > quint64(st.st_size)) {
+        MTP_LOG_CRITICAL("file shorter than data to send:" << st.st_size << buffer.offset << buffer.dataLen);
+        return false;
+    }
+
+    static const quint64 pageMask = sysconf(_SC_PAGESIZE) - 1;
+    quint64 mapOffset = buffer.offset & ~pageMask;
+    size_t delta = buffer.offset - mapOffset;
+
+    buffer.mapLen = delta + buffer.dataLen;
+    buffer.map = mmap(NULL, buffer.mapLen, PROT_READ, MAP_SHARED, buffer.fd, mapOffset);
+    if (buffer.map == MAP_FAILED) {
+        MTP_LOG_CRITICAL("mmap(" << buffer.fd << buffer.offset << buffer.dataLen << ") -> err:" << strerror(errno));
+        buffer.map = 0;
+        return false;
+    }
+    madvise(buffer.map, buffer.mapLen, MADV_SEQUENTIAL);
+    buffer.data = (quint8 *) buffer.map + delta;
+    return true;
+}
+
+void BulkWriterThread::releaseBuffer(BulkBuffer &buffer)
+{
+    if (buffer.map)
+        munmap(buffer.map, buffer.mapLen);
+    else
+        free(buffer.data);
+    if (buffer.fd != -1)
+        close(buffer.fd);
+    buffer = BulkBuffer();
+    buffer.fd = -1;
+}
+
+void BulkWriterThread::flushData()
+{
+    QMutexLocker locker(&m_lock);
+    flushData_locked();
+}
+
+void BulkWriterThread::flushData_locked()
+{
+    while (!m_buffers.isEmpty()) {
+        BulkBuffer buffer = m_buffers.takeFirst();
+        releaseBuffer(buffer);
+    }
+}
+
+bool BulkWriterThread::writeBuffer(BulkBuffer &buffer)
+{
+    // FunctionFS endpoints do not implement splice_write on all kernels;
+    // in that case file ranges are written from an mmap()ed view instead.
+    static bool sendfileWorks = useSendfile();
 
     int bytesWritten = 0;
-    char *dataptr = (char *) m_buffer;
+    char *dataptr = (char *) buffer.data;
+    quint32 dataLen = buffer.dataLen;
+    off_t fileOffset = buffer.offset;
     // PTP compatibility requires that a transfer is terminated by a
     // "short packet" (a packet of less than maximum length). This
     // happens naturally for most transfers, but if the transfer size
@@ -506,16 +871,36 @@ void BulkWriterThread::execute()
     // buffers for the current transfer were also multiples of the
     // packet size, which is generally not a problem because powers
     // of two are used.
-    // TODO: Get the real packet size from the kernel
-    bool zeropacket = m_terminateTransfer && m_dataLen % PTP_HS_DATA_PKT_SIZE == 0;
+    bool zeropacket = buffer.terminateTransfer && dataLen % BulkTransferSize::packetSize() == 0;
 
-    while ((m_dataLen || zeropacket) && !m_shouldExit) {
-        quint32 writeNow = (m_dataLen < writeMax) ? m_dataLen : writeMax;
-        bytesWritten = MTP_WRITE(m_fd, dataptr, writeNow, false);
+    if (!dataptr && !sendfileWorks) {
+        if (!mapBuffer(buffer))
+            return false;
+        dataptr = (char *) buffer.data;
+    }
+
+    while ((dataLen || zeropacket) && !m_shouldExit) {
+        quint32 writeMax = BulkTransferSize::chunkSize();
+        quint32 writeNow = (dataLen < writeMax) ? dataLen : writeMax;
+        if (dataptr || !writeNow)
+            bytesWritten = MTP_WRITE(m_fd, dataptr, writeNow, false);
+        else
+            bytesWritten = sendfile(m_fd, buffer.fd, &fileOffset, writeNow);
+        if (bytesWritten == 0 && writeNow) {
+            // sendfile() hits the end of a file truncated while being sent
+            MTP_LOG_CRITICAL("BulkWriterThread nothing written," << dataLen << "bytes left");
+            break;
+        }
         if (bytesWritten == -1) {
-            if (errno == EIO && writeMax > PTP_HS_DATA_PKT_SIZE) {
-                writeMax >>= 1;
-                MTP_LOG_WARNING("BulkWriterThread limit writes to: " << writeMax);
+            if (!dataptr && writeNow && (errno == EINVAL || errno == ENOSYS)) {
+                MTP_LOG_WARNING("BulkWriterThread sendfile not supported, using mmap");
+                sendfileWorks = false;
+                if (!mapBuffer(buffer))
+                    break;
+                dataptr = (char *) buffer.data + (buffer.dataLen - dataLen);
+                continue;
+            }
+            if ((errno == EIO || errno == EMSGSIZE) && BulkTransferSize::reduceChunkSize(writeNow)) {
                 continue;
             }
             if (errno == EINTR)
@@ -528,31 +913,385 @@ void BulkWriterThread::execute()
             if (errno == ESHUTDOWN) {
                 // After a shutdown, the host won't expect this data anymore,
                 // so drop it and report failure.
-                MTP_LOG_WARNING("BulkWriterThread exiting (endpoint shutdown)");
+                MTP_LOG_WARNING("BulkWriterThread dropping data (endpoint shutdown)");
                 break;
             }
-            MTP_LOG_CRITICAL("BulkWriterThread exiting: errno " << errno);
+            MTP_LOG_CRITICAL("BulkWriterThread write failed: errno " << errno);
             break;
         }
-        if (m_dataLen == 0)
+        if (writeNow == writeMax)
+            BulkTransferSize::chunkSucceeded();
+        if (dataLen == 0)
             zeropacket = false;
-        dataptr += bytesWritten;
-        m_dataLen -= bytesWritten;
+        if (dataptr)
+            dataptr += bytesWritten;
+        dataLen -= bytesWritten;
     }
 
-    m_result = m_dataLen == 0;
-    m_result_ready.storeRelease(1);
+    return dataLen == 0 && !zeropacket;
 }
 
-bool BulkWriterThread::resultReady()
+void BulkWriterThread::execute()
 {
-    return m_result_ready.load() != 0;
+    if (asyncIO())
+        executeAsync();
+    else
+        executeBlocking();
 }
 
-bool BulkWriterThread::getResult()
+void BulkWriterThread::executeBlocking()
 {
-    // Check resultReady() before calling getResult()
-    return m_result;
+    /* Lock on entry */
+    m_lock.lock();
+
+    while (!m_shouldExit) {
+        if (m_buffers.isEmpty()) {
+            /* Waiting happens in locked state, but the lock is
+             * released for the duration of the wait itself. */
+            m_wait.wait(&m_lock);
+            continue;
+        }
+
+        BulkBuffer buffer = m_buffers.takeFirst();
+        m_writing = true;
+
+        /* Do IO in unlocked state */
+        m_lock.unlock();
+        bool success = writeBuffer(buffer);
+        releaseBuffer(buffer);
+        m_lock.lock();
+
+        m_writing = false;
+        if (!success) {
+            /* The rest of the transfer is useless to the host,
+             * drop it and let sendData() report the failure. */
+            m_result = false;
+            flushData_locked();
+        }
+
+        /* Wake up sendData() waiting for queue space / idle writer */
+        emit dataWritten();
+    }
+
+    /* Unlock before leaving */
+    m_lock.unlock();
+}
+
+bool BulkWriterThread::takeBuffer_locked()
+{
+    m_current = m_buffers.takeFirst();
+    m_currentOffset = 0;
+    ++m_currentSerial;
+    m_writing = true;
+
+    // File ranges are submitted from an mmap()ed view
+    if (!mapBuffer(m_current)) {
+        releaseBuffer(m_current);
+        return false;
+    }
+    m_haveCurrent = true;
+    return true;
+}
+
+void BulkWriterThread::dropCurrent_locked()
+{
+    if (!m_haveCurrent)
+        return;
+    m_haveCurrent = false;
+
+    // Requests still in flight point into the buffer, the last of them
+    // releases it once it completes
+    for (int i = m_requests.count() - 1; i >= 0; --i) {
+        if (m_requests[i]->serial == m_currentSerial) {
+            m_requests[i]->buffer = m_current;
+            m_requests[i]->ownsBuffer = true;
+            return;
+        }
+    }
+    releaseBuffer(m_current);
+}
+
+bool BulkWriterThread::submitNext_locked()
+{
+    // Requests are kept to the chunk size, just like the writes in
+    // writeBuffer(), so that the UDC limit applies to them as well
+    quint32 left = m_current.dataLen - m_currentOffset;
+    quint32 len = qMin(left, BulkTransferSize::chunkSize());
+    bool last = len == left;
+    quint8 *data = m_current.data ? m_current.data + m_currentOffset : 0;
+
+    if (!submitRequest_locked(data, len, last))
+        return false;
+    m_currentOffset += len;
+    if (!last)
+        return true;
+
+    // The buffer now belongs to the request carrying its last piece.
+    // See writeBuffer() for why the zero length packet is needed.
+    m_haveCurrent = false;
+    if (m_current.dataLen && m_current.terminateTransfer && m_current.dataLen % BulkTransferSize::packetSize() == 0)
+        return submitRequest_locked(0, 0, false);
+    return true;
+}
+
+bool BulkWriterThread::submitRequest_locked(quint8 *data, quint32 dataLen, bool ownsBuffer)
+{
+    AioRequest *request = new AioRequest;
+    request->buffer = BulkBuffer();
+    request->buffer.fd = -1;
+    if (ownsBuffer)
+        request->buffer = m_current;
+    request->serial = m_currentSerial;
+    request->data = data;
+    request->dataLen = dataLen;
+    request->ownsBuffer = ownsBuffer;
+    request->completed = false;
+    request->result = 0;
+
+    memset(&request->cb, 0, sizeof request->cb);
+    request->cb.aio_data = (quintptr) request;
+    request->cb.aio_lio_opcode = IOCB_CMD_PWRITE;
+    request->cb.aio_fildes = m_fd;
+    request->cb.aio_buf = (quintptr) data;
+    request->cb.aio_nbytes = dataLen;
+    request->cb.aio_flags = IOCB_FLAG_RESFD;
+    request->cb.aio_resfd = m_aioEventFd;
+
+    struct iocb *cbs[1] = { &request->cb };
+    int rc;
+    while ((rc = sys_io_submit(m_aioContext, 1, cbs)) == -1 && errno == EINTR) {
+    }
+    if (rc != 1) {
+        MTP_LOG_CRITICAL("io_submit(" << m_fd << dataLen << ") -> err:" << strerror(errno));
+        delete request;
+        return false;
+    }
+
+    m_requests.append(request);
+    return true;
+}
+
+void BulkWriterThread::cancelRequest_locked(AioRequest *request)
+{
+    struct io_event event;
+    if (!request->completed && sys_io_cancel(m_aioContext, &request->cb, &event) == 0) {
+        // Older kernels hand the completion back right away
+        request->completed = true;
+        request->result = (qint64) event.res;
+    }
+}
+
+void BulkWriterThread::freeRequest(AioRequest *request)
+{
+    if (request->ownsBuffer)
+        releaseBuffer(request->buffer);
+    delete request;
+}
+
+int BulkWriterThread::collectEvents_locked(bool wait)
+{
+    struct io_event events[MAX_BULK_AIO_REQUESTS];
+    struct timespec timeout = { wait ? 1 : 0, 0 };
+    int count;
+
+    while ((count = sys_io_getevents(m_aioContext, wait ? 1 : 0, MAX_BULK_AIO_REQUESTS, events, &timeout)) == -1
+           && errno == EINTR) {
+    }
+    for (int i = 0; i < count; ++i) {
+        AioRequest *request = (AioRequest *) (quintptr) events[i].data;
+        request->completed = true;
+        request->result = (qint64) events[i].res;
+    }
+    return count;
+}
+
+bool BulkWriterThread::requestsCompleted_locked(int from) const
+{
+    for (int i = from; i < m_requests.count(); ++i) {
+        if (!m_requests[i]->completed)
+            return false;
+    }
+    return true;
+}
+
+void BulkWriterThread::reapRequests_locked(bool drain)
+{
+    if (drain) {
+        while (!requestsCompleted_locked(0) && collectEvents_locked(true) > 0) {
+        }
+    } else {
+        collectEvents_locked(false);
+    }
+
+    // Cancelled requests can complete out of order, but buffers are only
+    // released by the last request pointing into them -> let go of the
+    // requests in the order they were submitted
+    while (!m_abandoned.isEmpty() && m_abandoned.first()->completed)
+        freeRequest(m_abandoned.takeFirst());
+
+    while (!m_requests.isEmpty() && m_requests.first()->completed) {
+        AioRequest *request = m_requests.first();
+
+        if (request->result != (qint64) request->dataLen) {
+            if ((request->result == -EIO || request->result == -EMSGSIZE) && request->dataLen && m_result
+                && !m_shouldExit && retryRequests_locked())
+                continue;
+
+            if (request->result < 0)
+                MTP_LOG_WARNING("bulk aio write(" << m_fd << request->dataLen << ") -> err:"
+                                << strerror(-request->result));
+            else
+                MTP_LOG_WARNING("bulk aio write(" << m_fd << request->dataLen << ") -> short:" << request->result);
+            m_result = false;
+        } else if (request->dataLen == BulkTransferSize::chunkSize()) {
+            BulkTransferSize::chunkSucceeded();
+        }
+
+        m_requests.removeFirst();
+        freeRequest(request);
+    }
+}
+
+bool BulkWriterThread::retryRequests_locked()
+{
+    AioRequest *failed = m_requests.first();
+    if (!BulkTransferSize::reduceChunkSize(failed->dataLen))
+        return false;
+
+    // The requests after the failed one are already queued on the
+    // endpoint. They can only be sent again in smaller pieces if none of
+    // them went out in the meantime.
+    for (int i = 1; i < m_requests.count(); ++i)
+        cancelRequest_locked(m_requests[i]);
+    while (!requestsCompleted_locked(1) && collectEvents_locked(true) > 0) {
+    }
+    if (!requestsCompleted_locked(1))
+        return false;
+    for (int i = 1; i < m_requests.count(); ++i) {
+        if (m_requests[i]->result >= 0)
+            return false;
+    }
+
+    // Take the buffers back from the requests and resume with the piece
+    // that failed. Buffers that were queued later go back to the queue.
+    quint32 serial = failed->serial;
+    quint8 *resumeAt = failed->data;
+    QList<BulkBuffer> later;
+    BulkBuffer first = BulkBuffer();
+    for (AioRequest *request : m_requests) {
+        if (request->ownsBuffer) {
+            if (request->serial == serial)
+                first = request->buffer;
+            else
+                later.append(request->buffer);
+        }
+        delete request;
+    }
+    m_requests.clear();
+    if (m_haveCurrent) {
+        if (m_currentSerial == serial)
+            first = m_current;
+        else
+            later.append(m_current);
+    }
+    while (!later.isEmpty())
+        m_buffers.prepend(later.takeLast());
+
+    m_current = first;
+    m_currentOffset = resumeAt - first.data;
+    m_currentSerial = serial;
+    m_haveCurrent = true;
+    return true;
+}
+
+void BulkWriterThread::executeAsync()
+{
+    /* Lock on entry */
+    m_lock.lock();
+
+    while (!m_shouldExit) {
+        /* Keep the endpoint busy: submit as much as there is room for,
+         * leaving a slot for the zero length packet */
+        while (m_requests.count() + m_abandoned.count() < MAX_BULK_AIO_REQUESTS - 1) {
+            if (!m_haveCurrent) {
+                if (m_buffers.isEmpty())
+                    break;
+                if (!takeBuffer_locked()) {
+                    m_result = false;
+                    break;
+                }
+            }
+            if (!submitNext_locked()) {
+                m_result = false;
+                break;
+            }
+        }
+
+        if (!m_result) {
+            /* The rest of the transfer is useless to the host */
+            dropCurrent_locked();
+            flushData_locked();
+        }
+
+        if (m_requests.isEmpty() && !m_haveCurrent && m_writing) {
+            m_writing = false;
+            emit dataWritten();
+        }
+        if (m_requests.isEmpty() && m_abandoned.isEmpty()) {
+            if (m_buffers.isEmpty() && !m_haveCurrent)
+                m_wait.wait(&m_lock);
+            continue;
+        }
+
+        /* Wait for completions / new data in unlocked state */
+        m_lock.unlock();
+        struct pollfd fds[2] = {
+            { m_aioEventFd, POLLIN, 0 },
+            { m_wakeFd, POLLIN, 0 },
+        };
+        if (poll(fds, 2, -1) == -1 && errno != EINTR)
+            MTP_LOG_WARNING("poll failed:" << strerror(errno));
+        eventfd_t dummy;
+        eventfd_read(m_aioEventFd, &dummy);
+        eventfd_read(m_wakeFd, &dummy);
+        m_lock.lock();
+
+        int pending = m_requests.count();
+        reapRequests_locked(false);
+        if (!m_result) {
+            dropCurrent_locked();
+            flushData_locked();
+        }
+
+        /* Wake up sendData() waiting for queue space / idle writer */
+        if (m_requests.count() != pending)
+            emit dataWritten();
+    }
+
+    /* Whatever is still on the endpoint is not going to be needed */
+    dropCurrent_locked();
+    for (AioRequest *request : m_requests)
+        cancelRequest_locked(request);
+    reapRequests_locked(true);
+
+    /* Requests the kernel has not given back yet may still be written
+     * from. They are kept until their completions turn up on a later
+     * run, or until the context is destroyed in releaseAsyncIO(). */
+    if (!m_requests.isEmpty()) {
+        MTP_LOG_WARNING("abandoning" << m_requests.count() << "bulk aio requests");
+        m_abandoned.append(m_requests);
+        m_requests.clear();
+    }
+    m_writing = false;
+
+    /* Unlock before leaving */
+    m_lock.unlock();
+}
+
+void BulkWriterThread::interrupt()
+{
+    IOThread::interrupt();  // wake up the thread if it's in write()
+    wakeUp();
 }
 
 InterruptWriterThread::InterruptWriterThread(QObject *parent)
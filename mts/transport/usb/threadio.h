@@ -4,17 +4,58 @@
 #include "ptp.h"
 
 #include <QThread>
+#include <QAtomicInt>
 #include <QMutex>
 #include <QPair>
 #include <QList>
 #include <QWaitCondition>
 
+#include <linux/aio_abi.h>
+
 enum mtpfs_status {
     MTPFS_STATUS_OK,
     MTPFS_STATUS_BUSY,
     MTPFS_STATUS_TXCANCEL
 };
 
+/// Sizing of bulk transfers, shared by the endpoint threads and, via
+/// the transporter, by the protocol layer.
+///
+/// The chunk size is the size of individual read and write requests on
+/// the bulk endpoints. It is configured with BUTEO_MTP_CHUNK_SIZE (bytes,
+/// optionally with a k/M suffix) and lowered at runtime if the UDC turns
+/// out not to handle requests that large. The packet size is taken from
+/// the endpoint descriptor of the active connection.
+class BulkTransferSize
+{
+public:
+    /// Current size of individual bulk requests.
+    static quint32 chunkSize();
+
+    /// Chunk size as configured, i.e. the upper limit of chunkSize().
+    static quint32 maxChunkSize();
+
+    /// Halves the chunk size after the UDC rejected a request.
+    /// \return false if the chunk size can't be lowered any further.
+    static bool reduceChunkSize(quint32 failedSize);
+
+    /// Counts a request of the current chunk size that the UDC took. After
+    /// enough of them in a row a lowered chunk size is doubled again, so a
+    /// transient error does not slow down the rest of the connection.
+    static void chunkSucceeded();
+
+    /// Max packet size of the bulk endpoints.
+    static quint32 packetSize();
+
+    /// Queries the max packet size of the connection from an enabled endpoint.
+    static void updatePacketSize(int fd);
+
+private:
+    static QAtomicInt s_chunkSize;
+    static QAtomicInt s_chunkSuccesses;
+    static QAtomicInt s_packetSize;
+};
+
 class IOThread : public QThread
 {
 public:
@@ -131,11 +172,12 @@ private:
     // it was smaller than the minimum read size.
     //
     char *m_buffer;
+    int m_bufferSize;
     int m_dataStart; // protected by m_bufferLock
     int m_dataSize1; // protected by m_bufferLock
     int m_dataSize2; // protected by m_bufferLock
 
-    int _getOffset_locked();
+    int _getOffset_locked(int readSize);
     bool _markNewData(int offset, int size);
 signals:
     void dataReady();
@@ -146,20 +188,91 @@ class BulkWriterThread : public IOThread
     Q_OBJECT
 public:
     explicit BulkWriterThread(QObject *parent = 0);
+    ~BulkWriterThread();
 
-    void setData(const quint8 *buffer, quint32 dataLen, bool terminateTransfer = false);
-    bool resultReady();
-    bool getResult();
+    // Switch between blocking write() and native AIO submission;
+    // call only while the thread is not running
+    bool setAsyncIO(bool enabled);
+    bool asyncIO() const;
+
+    // Queue a copy of the buffer for writing; check canAddData() first
+    void addData(const quint8 *buffer, quint32 dataLen, bool terminateTransfer = false);
+    // Queue a file range for writing without copying it via user space
+    void addFile(int fd, quint64 offset, quint32 dataLen, bool terminateTransfer = false);
+    bool canAddData(); // false while the queue is full
+    bool isIdle(); // nothing queued and no write in progress
+    bool takeResult(); // false if a write failed since the last call
+    void flushData();
+    virtual void interrupt();
+
+signals:
+    void dataWritten();
 
 protected:
     virtual void execute();
 
 private:
-    const quint8 *m_buffer;
-    quint32 m_dataLen;
-    QAtomicInt m_result_ready;
+    struct BulkBuffer {
+        quint8 *data;
+        quint32 dataLen;
+        bool terminateTransfer;
+        int fd;          // file to send from instead of data, or -1
+        quint64 offset;  // position of the data in fd
+        void *map;       // mmap()ed view of fd while data points into it
+        size_t mapLen;
+    };
+
+    struct AioRequest {
+        BulkBuffer buffer; // released with the request if ownsBuffer
+        quint32 serial;    // tells which buffer the data points into
+        quint8 *data;
+        quint32 dataLen;
+        bool ownsBuffer;
+        bool completed;
+        qint64 result;
+        struct iocb cb;
+    };
+
+    bool writeBuffer(BulkBuffer &buffer);
+    void flushData_locked();
+    void queueBuffer(const BulkBuffer &buffer);
+    static bool mapBuffer(BulkBuffer &buffer);
+    static void releaseBuffer(BulkBuffer &buffer);
+    void wakeUp();
+
+    void executeBlocking();
+    void executeAsync();
+    bool takeBuffer_locked();
+    void dropCurrent_locked();
+    bool submitNext_locked();
+    bool submitRequest_locked(quint8 *data, quint32 dataLen, bool ownsBuffer);
+    void cancelRequest_locked(AioRequest *request);
+    static void freeRequest(AioRequest *request);
+    int collectEvents_locked(bool wait);
+    bool requestsCompleted_locked(int from) const;
+    void reapRequests_locked(bool drain);
+    bool retryRequests_locked();
+    void releaseAsyncIO();
+
+    QMutex m_lock; // protects the members below and used with m_wait
+    QWaitCondition m_wait;
+
+    QList<BulkBuffer> m_buffers;
+    bool m_writing;
     bool m_result;
-    bool m_terminateTransfer;
+
+    // Native AIO: several buffers are queued on the endpoint at once and
+    // completions are signaled via m_aioEventFd. New data and exit
+    // requests poke m_wakeFd instead of relying on SIGUSR1.
+    aio_context_t m_aioContext;
+    int m_aioEventFd;
+    int m_wakeFd;
+    BulkBuffer m_current; // buffer being submitted, if m_haveCurrent
+    bool m_haveCurrent;
+    quint32 m_currentOffset; // how much of m_current has been submitted
+    quint32 m_currentSerial;
+    QList<AioRequest *> m_requests; // submitted, in order, not yet let go of
+    QList<AioRequest *> m_abandoned; // left in flight by an earlier run
 };
 
 enum InterruptWriterResult {